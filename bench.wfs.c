@@ -0,0 +1,769 @@
+#define _POSIX_C_SOURCE 200809L
+#include <dirent.h>   // for opendir, readdir
+#include <errno.h>    // for errno, EEXIST
+#include <fcntl.h>    // for open
+#include <limits.h>   // for PATH_MAX
+#include <pthread.h>  // for pthread_create, pthread_barrier_wait
+#include <stdio.h>    // for printf
+#include <stdlib.h>   // for exit, malloc, qsort
+#include <string.h>   // for memcmp, memset
+#include <sys/resource.h> // for getrusage
+#include <sys/stat.h> // for mkdir, stat
+#include <time.h>     // for clock_gettime
+#include <unistd.h>   // for close, fsync, pread, pwrite, unlink
+#include "libwfs.h"
+
+#define DEFAULT_THREADS 8       // most threads to scale up to
+#define DEFAULT_FILES 200       // files each thread creates per run
+#define DEFAULT_WRITE 4096      // bytes of each small write, and of each file the threads write
+#define DEFAULT_MAX_FILES 10000 // largest directory the metadata runs build
+#define FIRST_FILES 100         // smallest directory the metadata runs build
+#define DEFAULT_FILE_SIZE (4 * 1024 * 1024) // bytes written and read sequentially
+#define DEFAULT_BLOCK (64 * 1024)           // bytes per sequential write or read
+#define DEFAULT_RANDOM 4096     // small writes at random offsets
+#define DUP_EDIT 16             // bytes each copy of the duplicate runs overwrites
+#define DUP_INSERT 100          // bytes each copy of the duplicate runs inserts
+#define READDIR_PASSES 10       // listings of each directory
+
+/*
+ * Where the benchmark runs: a directory, normally a wfs mount point, reached
+ * through system calls, or an image driven in-process through libwfs. A
+ * directory is known by its path to the first and by its inode number to
+ * the second, and so is an open file by its descriptor or inode number.
+ */
+struct dir_ref {
+    char path[PATH_MAX];
+    uint32_t inode;
+};
+struct file_ref {
+    int fd;
+    uint32_t inode;
+};
+struct backend {
+    const char *name;
+    int (*make_dir)(const char *name, struct dir_ref *dir); // in the root; an existing one is reused
+    int (*create)(const struct dir_ref *dir, const char *name, struct file_ref *file); // and opens it
+    int (*open)(const struct dir_ref *dir, const char *name, struct file_ref *file);
+    void (*close)(struct file_ref *file);
+    int (*stat)(const struct dir_ref *dir, const char *name, struct stat *stat_info);
+    long (*list)(const struct dir_ref *dir); // returns the number of entries
+    int (*unlink)(const struct dir_ref *dir, const char *name);
+    ssize_t (*write)(struct file_ref *file, const void *buf, size_t size, off_t offset);
+    ssize_t (*read)(struct file_ref *file, void *buf, size_t size, off_t offset);
+    int (*sync)(struct file_ref *file);
+};
+
+/*
+ * One worker of a run: creates its files in its own directory, then stats
+ * and reads each of them back.
+ */
+struct worker {
+    pthread_t thread;
+    int run;            // thread count of the run, which names its directories
+    int index;          // which of the run's threads this is
+    unsigned long ops;  // operations completed
+    double start, end;  // when its timed work began and finished
+    int failed;
+};
+
+static const char *root;              // directory or image to run in
+static const struct backend *target;  // how to reach it
+static struct libwfs *engine;         // the image, when driven in-process
+static int files = DEFAULT_FILES;
+static size_t write_size = DEFAULT_WRITE;
+static int sync_files;                // fsync each file the workers write
+static pthread_barrier_t start_line;  // lets every worker of a run start at once
+
+/**
+ * Stops the benchmark after an operation failed.
+ */
+static void fail(const char *what, const char *name) {
+    fprintf(stderr, "%s %s failed\n", what, name);
+    exit(-1);
+}
+
+/**
+ * Builds the path of an entry of a directory.
+ */
+static void entry_path(char *path, const struct dir_ref *dir, const char *name) {
+    if (snprintf(path, PATH_MAX, "%s/%s", dir->path, name) >= PATH_MAX) {
+        fail("path of", name);
+    }
+}
+
+static int posix_make_dir(const char *name, struct dir_ref *dir) {
+    if (snprintf(dir->path, PATH_MAX, "%s/%s", root, name) >= PATH_MAX) {
+        fail("path of", name);
+    }
+    return mkdir(dir->path, 0755) == -1 && errno != EEXIST ? -1 : 0; // wfs has no rmdir, so reruns reuse them
+}
+
+static int posix_create(const struct dir_ref *dir, const char *name, struct file_ref *file) {
+    char path[PATH_MAX];
+    entry_path(path, dir, name);
+    file->fd = open(path, O_CREAT | O_EXCL | O_RDWR, 0644);
+    return file->fd == -1 ? -1 : 0;
+}
+
+static int posix_open(const struct dir_ref *dir, const char *name, struct file_ref *file) {
+    char path[PATH_MAX];
+    entry_path(path, dir, name);
+    file->fd = open(path, O_RDWR);
+    return file->fd == -1 ? -1 : 0;
+}
+
+static void posix_close(struct file_ref *file) {
+    close(file->fd);
+}
+
+static int posix_stat(const struct dir_ref *dir, const char *name, struct stat *stat_info) {
+    char path[PATH_MAX];
+    entry_path(path, dir, name);
+    return stat(path, stat_info);
+}
+
+static long posix_list(const struct dir_ref *dir) {
+    DIR *stream = opendir(dir->path);
+    if (stream == NULL) {
+        return -1;
+    }
+    long count = 0;
+    while (readdir(stream) != NULL) {
+        count++;
+    }
+    closedir(stream);
+    return count - 2; // . and ..
+}
+
+static int posix_unlink(const struct dir_ref *dir, const char *name) {
+    char path[PATH_MAX];
+    entry_path(path, dir, name);
+    return unlink(path);
+}
+
+static ssize_t posix_write(struct file_ref *file, const void *buf, size_t size, off_t offset) {
+    return pwrite(file->fd, buf, size, offset);
+}
+
+static ssize_t posix_read(struct file_ref *file, void *buf, size_t size, off_t offset) {
+    return pread(file->fd, buf, size, offset);
+}
+
+static int posix_sync(struct file_ref *file) {
+    return fsync(file->fd);
+}
+
+static const struct backend posix_backend = {
+    .name = "mounted", .make_dir = posix_make_dir, .create = posix_create, .open = posix_open,
+    .close = posix_close, .stat = posix_stat, .list = posix_list, .unlink = posix_unlink,
+    .write = posix_write, .read = posix_read, .sync = posix_sync,
+};
+
+static int engine_make_dir(const char *name, struct dir_ref *dir) {
+    int ret = libwfs_create(engine, LIBWFS_ROOT, name, S_IFDIR | 0755, &dir->inode);
+    if (ret == -EEXIST) {
+        ret = libwfs_lookup(engine, LIBWFS_ROOT, name, &dir->inode);
+    }
+    return ret;
+}
+
+static int engine_create(const struct dir_ref *dir, const char *name, struct file_ref *file) {
+    return libwfs_create(engine, dir->inode, name, S_IFREG | 0644, &file->inode);
+}
+
+static int engine_open(const struct dir_ref *dir, const char *name, struct file_ref *file) {
+    return libwfs_lookup(engine, dir->inode, name, &file->inode);
+}
+
+static void engine_close(struct file_ref *file) {
+}
+
+static int engine_stat(const struct dir_ref *dir, const char *name, struct stat *stat_info) {
+    uint32_t inode;
+    int ret = libwfs_lookup(engine, dir->inode, name, &inode);
+    return ret != 0 ? ret : libwfs_getattr(engine, inode, stat_info);
+}
+
+static int count_entry(void *context, const char *name, uint32_t inode, uint64_t next) {
+    (*(long*)context)++;
+    return 0;
+}
+
+static long engine_list(const struct dir_ref *dir) {
+    long count = 0;
+    return libwfs_readdir(engine, dir->inode, 0, count_entry, &count) != 0 ? -1 : count;
+}
+
+static int engine_unlink(const struct dir_ref *dir, const char *name) {
+    return libwfs_unlink(engine, dir->inode, name);
+}
+
+static ssize_t engine_write(struct file_ref *file, const void *buf, size_t size, off_t offset) {
+    return libwfs_write(engine, file->inode, buf, size, offset);
+}
+
+static ssize_t engine_read(struct file_ref *file, void *buf, size_t size, off_t offset) {
+    return libwfs_read(engine, file->inode, buf, size, offset);
+}
+
+static int engine_sync(struct file_ref *file) {
+    return libwfs_fsync(engine, file->inode);
+}
+
+static const struct backend engine_backend = {
+    .name = "engine", .make_dir = engine_make_dir, .create = engine_create, .open = engine_open,
+    .close = engine_close, .stat = engine_stat, .list = engine_list, .unlink = engine_unlink,
+    .write = engine_write, .read = engine_read, .sync = engine_sync,
+};
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+/**
+ * Returns the CPU time this process has used, user and system, in seconds.
+ */
+static double cpu_seconds() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Prints one row of results from the latencies of a phase's operations,
+ * which are sorted in the process.
+ *
+ * @param phase     The name of the phase.
+ * @param count     The size of the phase, in files, entries or operations.
+ * @param ops       The number of operations, and of entries in latency.
+ * @param units     The number of units the rate counts, such as entries listed.
+ * @param bytes     Bytes moved, or 0 for metadata.
+ * @param seconds   How long the phase took.
+ * @param latency   How long each operation took, in seconds.
+ */
+static void report(const char *phase, long count, long ops, long units, double bytes, double seconds, double *latency) {
+    qsort(latency, ops, sizeof(double), compare_doubles);
+    char rate[16] = "-";
+    if (bytes > 0) {
+        snprintf(rate, sizeof(rate), "%.1f", bytes / (1024 * 1024) / seconds);
+    }
+    printf("%-10s %8ld %12.0f %9s %9.1f %9.1f\n", phase, count, units / seconds, rate,
+           latency[ops / 2] * 1e6, latency[ops * 99 / 100] * 1e6);
+}
+
+/**
+ * Builds a directory of the given size and times creating, stating, listing
+ * and removing its files, one operation at a time. The cost of a create and
+ * an unlink grows with the directory, so comparing sizes shows how they scale.
+ *
+ * @param count The number of files.
+ */
+static void metadata_run(long count) {
+    char name[PATH_MAX];
+    struct dir_ref dir;
+    snprintf(name, sizeof(name), "m%ld", count);
+    if (target->make_dir(name, &dir) != 0) {
+        fail("mkdir", name);
+    }
+    double *latency = malloc(count * READDIR_PASSES * sizeof(double));
+    if (latency == NULL) {
+        perror("Error allocating latencies");
+        exit(-1);
+    }
+
+    double start = now();
+    for (long i = 0; i < count; i++) {
+        struct file_ref file;
+        snprintf(name, sizeof(name), "f%ld", i);
+        double before = now();
+        if (target->create(&dir, name, &file) != 0) {
+            fail("create", name);
+        }
+        target->close(&file);
+        latency[i] = now() - before;
+    }
+    report("create", count, count, count, 0, now() - start, latency);
+
+    start = now();
+    for (long i = 0; i < count; i++) {
+        struct stat stat_info;
+        snprintf(name, sizeof(name), "f%ld", i);
+        double before = now();
+        if (target->stat(&dir, name, &stat_info) != 0) {
+            fail("stat", name);
+        }
+        latency[i] = now() - before;
+    }
+    report("stat", count, count, count, 0, now() - start, latency);
+
+    start = now();
+    for (int i = 0; i < READDIR_PASSES; i++) {
+        double before = now();
+        if (target->list(&dir) != count) {
+            fail("readdir", dir.path);
+        }
+        latency[i] = now() - before;
+    }
+    report("readdir", count, READDIR_PASSES, count * READDIR_PASSES, 0, now() - start, latency);
+
+    start = now();
+    for (long i = 0; i < count; i++) {
+        snprintf(name, sizeof(name), "f%ld", i);
+        double before = now();
+        if (target->unlink(&dir, name) != 0) {
+            fail("unlink", name);
+        }
+        latency[i] = now() - before;
+    }
+    report("unlink", count, count, count, 0, now() - start, latency);
+    free(latency);
+}
+
+/**
+ * Writes a file sequentially, reads it back and checks it, then overwrites
+ * small pieces of it at random offsets. The file is removed afterwards.
+ *
+ * @param file_size The size of the file.
+ * @param block     Bytes per sequential write or read.
+ * @param random    The number of small writes, each write_size bytes.
+ */
+static void data_run(size_t file_size, size_t block, long random) {
+    struct dir_ref dir;
+    struct file_ref file;
+    if (target->make_dir("data", &dir) != 0) {
+        fail("mkdir", "data");
+    }
+    if (target->create(&dir, "seq", &file) != 0) {
+        fail("create", "seq");
+    }
+    long blocks = (file_size + block - 1) / block;
+    long most = blocks > random ? blocks : random;
+    double *latency = malloc(most * sizeof(double));
+    char *data = malloc(block > write_size ? block : write_size);
+    char *check = malloc(block);
+    if (latency == NULL || data == NULL || check == NULL) {
+        perror("Error allocating buffers");
+        exit(-1);
+    }
+
+    double start = now();
+    for (long i = 0; i < blocks; i++) {
+        size_t size = file_size - i * block < block ? file_size - i * block : block;
+        memset(data, 'a' + i % 26, size);
+        double before = now();
+        if (target->write(&file, data, size, i * block) != (ssize_t)size) {
+            fail("write", "seq");
+        }
+        latency[i] = now() - before;
+    }
+    report("seq write", file_size, blocks, blocks, file_size, now() - start, latency);
+
+    start = now();
+    for (long i = 0; i < blocks; i++) {
+        size_t size = file_size - i * block < block ? file_size - i * block : block;
+        double before = now();
+        if (target->read(&file, check, size, i * block) != (ssize_t)size) {
+            fail("read", "seq");
+        }
+        latency[i] = now() - before;
+        memset(data, 'a' + i % 26, size);
+        if (memcmp(data, check, size) != 0) {
+            fail("read back", "seq");
+        }
+    }
+    report("seq read", file_size, blocks, blocks, file_size, now() - start, latency);
+
+    if (random > 0 && file_size >= write_size) {
+        unsigned int seed = 1;
+        memset(data, 'z', write_size);
+        start = now();
+        for (long i = 0; i < random; i++) {
+            off_t offset = rand_r(&seed) % (file_size - write_size + 1);
+            double before = now();
+            if (target->write(&file, data, write_size, offset) != (ssize_t)write_size) {
+                fail("write", "seq");
+            }
+            latency[i] = now() - before;
+        }
+        report("rand write", random, random, random, (double)random * write_size, now() - start, latency);
+    }
+
+    target->close(&file);
+    if (target->unlink(&dir, "seq") != 0) {
+        fail("unlink", "seq");
+    }
+    free(latency);
+    free(data);
+    free(check);
+}
+
+/**
+ * Writes near-identical copies of a file of random bytes, as backups or
+ * build trees would: each copy after the first overwrites a few bytes and
+ * inserts a few more, shifting everything after them. Reports the write
+ * rate and the CPU time spent per MB written, and for an image driven
+ * in-process, how much of the data deduplication found already written.
+ * The CPU time is this process's, so it only covers the filesystem's work
+ * with -e. The last copy is read back and checked, and the copies removed.
+ *
+ * @param file_size The size of the file copied.
+ * @param block     Bytes per write.
+ * @param copies    The number of copies.
+ */
+static void dup_run(size_t file_size, size_t block, long copies) {
+    struct dir_ref dir;
+    if (target->make_dir("dup", &dir) != 0) {
+        fail("mkdir", "dup");
+    }
+    size_t most = file_size + DUP_INSERT;
+    long blocks = (most + block - 1) / block;
+    double *latency = malloc(copies * blocks * sizeof(double));
+    char *base = malloc(file_size);
+    char *copy = malloc(most);
+    char *check = malloc(block);
+    if (latency == NULL || base == NULL || copy == NULL || check == NULL) {
+        perror("Error allocating buffers");
+        exit(-1);
+    }
+    unsigned int seed = 2;
+    for (size_t i = 0; i < file_size; i++) {
+        base[i] = rand_r(&seed);
+    }
+
+    char name[PATH_MAX];
+    size_t size = 0;
+    long ops = 0;
+    double bytes = 0;
+    double cpu = cpu_seconds();
+    double start = now();
+    for (long c = 0; c < copies; c++) {
+        memcpy(copy, base, file_size);
+        size = file_size;
+        if (c > 0 && file_size >= DUP_EDIT) {
+            memset(copy + rand_r(&seed) % (file_size - DUP_EDIT + 1), 'a' + c % 26, DUP_EDIT);
+            size_t at = rand_r(&seed) % (file_size + 1);
+            memmove(copy + at + DUP_INSERT, copy + at, file_size - at);
+            memset(copy + at, 'A' + c % 26, DUP_INSERT);
+            size += DUP_INSERT;
+        }
+        struct file_ref file;
+        snprintf(name, sizeof(name), "d%ld", c);
+        if (target->create(&dir, name, &file) != 0) {
+            fail("create", name);
+        }
+        for (size_t done = 0; done < size; done += block) {
+            size_t piece = size - done < block ? size - done : block;
+            double before = now();
+            if (target->write(&file, copy + done, piece, done) != (ssize_t)piece) {
+                fail("write", name);
+            }
+            latency[ops++] = now() - before;
+        }
+        target->close(&file);
+        bytes += size;
+    }
+    double seconds = now() - start;
+    cpu = cpu_seconds() - cpu;
+    report("dup write", copies, ops, ops, bytes, seconds, latency);
+
+    struct file_ref file;
+    if (target->open(&dir, name, &file) != 0) {
+        fail("open", name);
+    }
+    for (size_t done = 0; done < size; done += block) {
+        size_t piece = size - done < block ? size - done : block;
+        if (target->read(&file, check, piece, done) != (ssize_t)piece || memcmp(copy + done, check, piece) != 0) {
+            fail("read back", name);
+        }
+    }
+    target->close(&file);
+    printf("%-10s %.2f ms CPU per MB written\n", "dup cpu", bytes > 0 ? cpu * 1e3 / (bytes / (1024 * 1024)) : 0.0);
+    if (engine != NULL) {
+        char stats[4096];
+        libwfs_stats(engine, stats, sizeof(stats));
+        for (char *line = strtok(stats, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+            if (strstr(line, "chunk") != NULL) {
+                printf("%-10s %s\n", "dup", line);
+            }
+        }
+    }
+
+    for (long c = 0; c < copies; c++) {
+        snprintf(name, sizeof(name), "d%ld", c);
+        if (target->unlink(&dir, name) != 0) {
+            fail("unlink", name);
+        }
+    }
+    free(latency);
+    free(base);
+    free(copy);
+    free(check);
+}
+
+/**
+ * Names one of a worker's files, or its directory when file is negative.
+ * Names stay short enough for a wfs dentry.
+ */
+static void worker_name(char *name, const struct worker *worker, int file) {
+    if (file < 0) {
+        snprintf(name, PATH_MAX, "s%d_%d", worker->run, worker->index);
+    } else {
+        snprintf(name, PATH_MAX, "f%d", file);
+    }
+}
+
+/**
+ * Body of a worker thread. Every file costs four operations: create, write,
+ * stat and read. With -y, each file is also fsynced once written, as part
+ * of the write. The bytes read back are checked against those written.
+ *
+ * @param arg The worker.
+ * @return    NULL.
+ */
+static void *worker_main(void *arg) {
+    struct worker *worker = arg;
+    char name[PATH_MAX];
+    struct dir_ref dir;
+    char *data = malloc(write_size);
+    char *check = malloc(write_size);
+    if (data == NULL || check == NULL) {
+        perror("Error allocating buffers");
+        exit(-1);
+    }
+    memset(data, 'a' + worker->index % 26, write_size);
+    worker_name(name, worker, -1);
+    if (target->make_dir(name, &dir) != 0) {
+        fail("mkdir", name);
+    }
+
+    pthread_barrier_wait(&start_line);
+    worker->start = now();
+    for (int i = 0; i < files && !worker->failed; i++) {
+        struct file_ref file;
+        worker_name(name, worker, i);
+        if (target->create(&dir, name, &file) != 0) {
+            fail("create", name);
+        }
+        if (target->write(&file, data, write_size, 0) != (ssize_t)write_size) {
+            fprintf(stderr, "%s: write failed\n", name);
+            worker->failed = 1;
+        }
+        if (sync_files && target->sync(&file) != 0) {
+            fprintf(stderr, "%s: fsync failed\n", name);
+            worker->failed = 1;
+        }
+        target->close(&file);
+        worker->ops += 2;
+    }
+    for (int i = 0; i < files && !worker->failed; i++) {
+        struct stat stat_info;
+        struct file_ref file;
+        worker_name(name, worker, i);
+        if (target->stat(&dir, name, &stat_info) != 0 || target->open(&dir, name, &file) != 0) {
+            fail("open", name);
+        }
+        if (target->read(&file, check, write_size, 0) != (ssize_t)write_size || memcmp(data, check, write_size) != 0) {
+            fprintf(stderr, "%s: read back wrong contents\n", name);
+            worker->failed = 1;
+        }
+        target->close(&file);
+        worker->ops += 2;
+    }
+
+    worker->end = now();
+
+    // Removed outside the timing, once every worker is done
+    pthread_barrier_wait(&start_line);
+    for (int i = 0; i < files; i++) {
+        worker_name(name, worker, i);
+        target->unlink(&dir, name);
+    }
+    free(data);
+    free(check);
+    return NULL;
+}
+
+/**
+ * Runs the workload with the given number of threads and prints one row of
+ * the results. The files are removed afterwards, outside the timing.
+ *
+ * @param threads  The number of threads.
+ * @param baseline Operations per second of the single-threaded run, or 0 if this is it.
+ * @return         Operations per second, or -1 if a worker failed.
+ */
+static double run(int threads, double baseline) {
+    struct worker *workers = calloc(threads, sizeof(struct worker));
+    if (workers == NULL) {
+        perror("Error allocating workers");
+        exit(-1);
+    }
+    for (int i = 0; i < threads; i++) {
+        workers[i].run = threads;
+        workers[i].index = i;
+    }
+
+    pthread_barrier_init(&start_line, NULL, threads + 1);
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+            perror("Error starting worker");
+            exit(-1);
+        }
+    }
+    pthread_barrier_wait(&start_line);
+    pthread_barrier_wait(&start_line);
+    unsigned long ops = 0;
+    int failed = 0;
+    double start = workers[0].start, end = workers[0].end;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        ops += workers[i].ops;
+        failed |= workers[i].failed;
+        start = workers[i].start < start ? workers[i].start : start;
+        end = workers[i].end > end ? workers[i].end : end;
+    }
+    double seconds = end - start; // Timed by the workers, which the main thread may not see start
+    pthread_barrier_destroy(&start_line);
+    free(workers);
+    if (failed) {
+        return -1;
+    }
+
+    double rate = ops / seconds;
+    double megabytes = 2.0 * threads * files * write_size / (1024 * 1024);
+    printf("%7d %9.3f %12.0f %9.1f %8.2fx\n", threads, seconds, rate, megabytes / seconds,
+           baseline > 0 ? rate / baseline : 1.0);
+    return rate;
+}
+
+/**
+ * Benchmarks a mounted filesystem, or with -e an image driven in-process
+ * through libwfs, in the style of mdtest and fio:
+ *
+ *  - create, stat, readdir and unlink in directories of FIRST_FILES files,
+ *    ten times as many, and so on up to max_files;
+ *  - sequential writes and reads of a file_size file in block_size pieces,
+ *    then random_writes writes of small_write_size bytes within it;
+ *  - with -d, writes of copies near-identical files of file_size random
+ *    bytes, for what deduplication saves and what it costs in CPU time;
+ *  - how throughput scales as the thread count doubles up to max_threads,
+ *    each thread creating, writing, stating and reading files_per_thread
+ *    files of small_write_size bytes in a directory of its own, and with -y
+ *    fsyncing each, as a database committing would.
+ *
+ * Throughput counts operations, except for readdir, which counts entries
+ * listed. Latencies are per operation, and per listing for readdir.
+ *
+ * Usage: bench.wfs [-e] [-y] [-t max_threads] [-n max_files] [-p files_per_thread]
+ *                  [-f file_size] [-b block_size] [-r random_writes] [-d copies]
+ *                  [-s small_write_size] directory|image
+ */
+int main(int argc, char *argv[]) {
+    int max_threads = DEFAULT_THREADS;
+    long max_files = DEFAULT_MAX_FILES;
+    size_t file_size = DEFAULT_FILE_SIZE;
+    size_t block = DEFAULT_BLOCK;
+    long random = DEFAULT_RANDOM;
+    long copies = 0;
+    int bad_usage = 0;
+    int opt;
+    target = &posix_backend;
+    while ((opt = getopt(argc, argv, "eyt:n:p:f:b:r:d:s:")) != -1) {
+        switch (opt) {
+        case 'e':
+            target = &engine_backend;
+            break;
+        case 'y':
+            sync_files = 1;
+            break;
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 'n':
+            max_files = atol(optarg);
+            break;
+        case 'p':
+            files = atoi(optarg);
+            break;
+        case 'f':
+            file_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            block = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            random = atol(optarg);
+            break;
+        case 'd':
+            copies = atol(optarg);
+            break;
+        case 's':
+            write_size = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            bad_usage = 1;
+        }
+    }
+    if (bad_usage || optind != argc - 1 || max_threads < 1 || max_files < 0 || files < 1 ||
+        block == 0 || random < 0 || copies < 0 || write_size == 0) {
+        fprintf(stderr, "Usage: bench.wfs [-e] [-y] [-t max_threads] [-n max_files] [-p files_per_thread]\n"
+                        "                 [-f file_size] [-b block_size] [-r random_writes] [-d copies]\n"
+                        "                 [-s small_write_size] directory|image\n");
+        exit(-1);
+    }
+    root = argv[optind];
+    if (target == &engine_backend) {
+        int error;
+        engine = libwfs_open(root, NULL, &error);
+        if (engine == NULL) {
+            fprintf(stderr, "%s: cannot open image: %s\n", root, strerror(-error));
+            exit(-1);
+        }
+        libwfs_start(engine);
+    }
+
+    printf("%s: %s\n", target->name, root);
+    printf("phase         count        ops/s      MB/s    p50 us    p99 us\n");
+    for (long count = FIRST_FILES; count <= max_files; count *= 10) {
+        metadata_run(count);
+    }
+    if (file_size > 0) {
+        data_run(file_size, block, random);
+    }
+    if (copies > 0 && file_size > 0) {
+        dup_run(file_size, block, copies);
+    }
+
+    printf("\n%d files of %zu bytes per thread%s\n", files, write_size, sync_files ? ", each fsynced" : "");
+    printf("threads   seconds        ops/s      MB/s  speedup\n");
+    double baseline = 0;
+    for (int threads = 1;; threads *= 2) {
+        if (threads > max_threads) {
+            threads = max_threads;
+        }
+        double rate = run(threads, baseline);
+        if (rate < 0) {
+            fprintf(stderr, "Run with %d threads failed\n", threads);
+            exit(-1);
+        }
+        if (baseline == 0) {
+            baseline = rate;
+        }
+        if (threads == max_threads) {
+            break;
+        }
+    }
+
+    if (engine != NULL && libwfs_close(engine) != 0) {
+        fprintf(stderr, "%s: final checkpoint failed\n", root);
+        exit(-1);
+    }
+    return 0;
+}
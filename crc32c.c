@@ -0,0 +1,224 @@
+#include <string.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78  // the Castagnoli polynomial, bit-reflected
+#define LONG_BLOCK 8192         // bytes per stream when three are run side by side; a power of two
+#define SHORT_BLOCK 256         // the same, for what is left after the long blocks
+
+static uint32_t table[8][256];          // table[k][b]: b followed by k zero bytes
+static uint32_t long_shift[4][256];     // moves a CRC past LONG_BLOCK zero bytes, one byte of it at a time
+static uint32_t short_shift[4][256];    // the same for SHORT_BLOCK zero bytes
+static int hardware;                    // 1 if the CPU has CRC-32C instructions
+
+/**
+ * Multiplies a vector by a 32x32 matrix over GF(2), the matrix given as its
+ * columns.
+ */
+static uint32_t gf2_times(const uint32_t *matrix, uint32_t vector) {
+    uint32_t sum = 0;
+    for (; vector != 0; vector >>= 1, matrix++) {
+        if (vector & 1) {
+            sum ^= *matrix;
+        }
+    }
+    return sum;
+}
+
+static void gf2_square(uint32_t *square, const uint32_t *matrix) {
+    for (int n = 0; n < 32; n++) {
+        square[n] = gf2_times(matrix, matrix[n]);
+    }
+}
+
+/**
+ * Builds tables that advance a CRC register over len zero bytes, so CRCs
+ * computed apart can be joined: the CRC of a then b is the CRC of a shifted
+ * past b's length, xored with the CRC of b started from 0.
+ *
+ * @param shift the tables to fill in
+ * @param len the number of zero bytes; a power of two
+ */
+static void build_shift(uint32_t shift[4][256], size_t len) {
+    uint32_t even[32];
+    uint32_t odd[32];
+
+    odd[0] = CRC32C_POLY;  // the operator for one zero bit
+    for (int n = 1; n < 32; n++) {
+        odd[n] = 1u << (n - 1);
+    }
+    gf2_square(even, odd);  // two zero bits
+    gf2_square(odd, even);  // four zero bits
+
+    // Each squaring doubles the zero bytes, starting from one
+    uint32_t *op = odd;
+    for (int turn = 0; len != 0; len >>= 1, turn++) {
+        op = turn % 2 == 0 ? even : odd;
+        gf2_square(op, op == even ? odd : even);
+    }
+
+    for (int b = 0; b < 256; b++) {
+        for (int k = 0; k < 4; k++) {
+            shift[k][b] = gf2_times(op, (uint32_t)b << (8 * k));
+        }
+    }
+}
+
+static uint32_t shift_crc(uint32_t shift[4][256], uint32_t crc) {
+    return shift[0][crc & 0xff] ^ shift[1][(crc >> 8) & 0xff] ^
+           shift[2][(crc >> 16) & 0xff] ^ shift[3][crc >> 24];
+}
+
+/**
+ * Fills in the tables and looks for CRC instructions. Runs before main, so
+ * crc32c() never has to check whether it has been done.
+ */
+__attribute__((constructor))
+static void crc32c_init() {
+    for (int b = 0; b < 256; b++) {
+        uint32_t crc = b;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+        }
+        table[0][b] = crc;
+    }
+    for (int b = 0; b < 256; b++) {
+        for (int k = 1; k < 8; k++) {
+            table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xff];
+        }
+    }
+
+    build_shift(long_shift, LONG_BLOCK);
+    build_shift(short_shift, SHORT_BLOCK);
+
+#if defined(__x86_64__)
+    hardware = __builtin_cpu_supports("sse4.2");
+#elif defined(__aarch64__)
+    hardware = (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#endif
+}
+
+/**
+ * Slicing-by-8: eight bytes per step, one table lookup for each of them.
+ *
+ * @param crc the CRC so far, not inverted
+ * @return the CRC after buf, not inverted
+ */
+static uint32_t crc32c_table(uint32_t crc, const unsigned char *buf, size_t len) {
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, buf, 8);
+        word ^= crc;  // assumes a little-endian CPU, like the image format does
+        crc = table[7][word & 0xff] ^ table[6][(word >> 8) & 0xff] ^
+              table[5][(word >> 16) & 0xff] ^ table[4][(word >> 24) & 0xff] ^
+              table[3][(word >> 32) & 0xff] ^ table[2][(word >> 40) & 0xff] ^
+              table[1][(word >> 48) & 0xff] ^ table[0][word >> 56];
+        buf += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        crc = (crc >> 8) ^ table[0][(crc ^ *buf++) & 0xff];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+#define HARDWARE_TARGET __attribute__((target("sse4.2")))
+HARDWARE_TARGET static inline uint32_t crc_word(uint32_t crc, uint64_t word) {
+    return _mm_crc32_u64(crc, word);
+}
+HARDWARE_TARGET static inline uint32_t crc_byte(uint32_t crc, unsigned char byte) {
+    return _mm_crc32_u8(crc, byte);
+}
+#elif defined(__aarch64__)
+#define HARDWARE_TARGET __attribute__((target("+crc")))
+HARDWARE_TARGET static inline uint32_t crc_word(uint32_t crc, uint64_t word) {
+    return __crc32cd(crc, word);
+}
+HARDWARE_TARGET static inline uint32_t crc_byte(uint32_t crc, unsigned char byte) {
+    return __crc32cb(crc, byte);
+}
+#endif
+
+#ifdef HARDWARE_TARGET
+/**
+ * Runs the CRC instruction over three blocks of block bytes at a time, each
+ * with its own register, then joins the three. One stream would wait on the
+ * latency of every instruction; three keep the unit busy.
+ *
+ * @param crc the CRC so far, not inverted
+ * @param buf the bytes to add; moved past those added
+ * @param len the number of bytes at buf; less than 3 * block on return
+ * @param block bytes per stream
+ * @param shift the tables for block zero bytes
+ * @return the CRC after the bytes added, not inverted
+ */
+HARDWARE_TARGET static uint32_t crc_blocks(uint32_t crc, const unsigned char **buf, size_t *len,
+                                           size_t block, uint32_t shift[4][256]) {
+    const unsigned char *next = *buf;
+    while (*len >= 3 * block) {
+        uint32_t crc1 = 0;
+        uint32_t crc2 = 0;
+        for (const unsigned char *end = next + block; next < end; next += 8) {
+            uint64_t words[3];
+            memcpy(&words[0], next, 8);
+            memcpy(&words[1], next + block, 8);
+            memcpy(&words[2], next + 2 * block, 8);
+            crc = crc_word(crc, words[0]);
+            crc1 = crc_word(crc1, words[1]);
+            crc2 = crc_word(crc2, words[2]);
+        }
+        crc = shift_crc(shift, crc) ^ crc1;
+        crc = shift_crc(shift, crc) ^ crc2;
+        next += 2 * block;
+        *len -= 3 * block;
+    }
+    *buf = next;
+    return crc;
+}
+
+HARDWARE_TARGET static uint32_t crc32c_hardware(uint32_t crc, const unsigned char *buf, size_t len) {
+    crc = crc_blocks(crc, &buf, &len, LONG_BLOCK, long_shift);
+    crc = crc_blocks(crc, &buf, &len, SHORT_BLOCK, short_shift);
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, buf, 8);
+        crc = crc_word(crc, word);
+        buf += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        crc = crc_byte(crc, *buf++);
+    }
+    return crc;
+}
+#else
+static uint32_t crc32c_hardware(uint32_t crc, const unsigned char *buf, size_t len) {
+    return crc32c_table(crc, buf, len);
+}
+#endif
+
+/**
+ * Extends a CRC-32C over more bytes. Passing the result of one call as crc
+ * to the next gives the CRC of the bytes of both; start with 0.
+ *
+ * @param crc the CRC of the bytes before buf, or 0
+ * @param buf the bytes to add
+ * @param len the number of bytes in buf
+ * @return the CRC of everything so far
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    crc = ~crc;
+    if (hardware) {
+        crc = crc32c_hardware(crc, buf, len);
+    } else {
+        crc = crc32c_table(crc, buf, len);
+    }
+    return ~crc;
+}
@@ -0,0 +1,15 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef CRC32C_H_
+#define CRC32C_H_
+
+/*
+ * CRC-32C (Castagnoli), as used to check the records of a WFS image. It is
+ * computed with the CRC instructions of SSE4.2 or ARMv8 where the CPU has
+ * them, and with tables otherwise.
+ */
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif
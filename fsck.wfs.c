@@ -1,72 +1,1264 @@
-int main(int argc, char *argv[]) {
+#define _POSIX_C_SOURCE 200809L
+#include "wfs.h"
+#include "crc32c.h"
+#include "lz4.h"
+#include <stddef.h>   // for offsetof
+#include <fcntl.h>    // for open
+#include <unistd.h>   // for close, ftruncate
+#include <stdio.h>    // for printf
+#include <stdlib.h>   // for exit, malloc
+#include <string.h>   // for memcpy, memset
+#include <sys/mman.h> // for mmap, msync
+#include <sys/stat.h> // for fstat, S_ISDIR
+#include <time.h>     // for clock_gettime
+
+#define LEGACY_LOG_START (2 * sizeof(uint32_t)) // format 1 images from before segments had a two-field superblock
+#define SEGMENT_ROOM (WFS_SEGMENT_SIZE - sizeof(struct wfs_sb) - sizeof(struct wfs_segment))
+#define MAX_ENTRY_SIZE (SEGMENT_ROOM - sizeof(struct wfs_record))
+#define MAX_RUN (MAX_ENTRY_SIZE - sizeof(struct wfs_data_run))
+
+/*
+ * A stretch of the input image holding log entries back to back.
+ */
+struct log_range {
+    uint64_t start;
+    uint64_t end;
+    uint64_t sequence;
+    uint32_t frame;     // bytes in front of each entry: a wfs_record, or none in older segments
+};
+
+/*
+ * A log entry of the input image, in the terms of the current format
+ * whichever format it was written in.
+ */
+struct entry_view {
+    struct wfs_inode inode; // size is the size of the inode, as in format 2
+    const char *data;       // the entry's data after its delta, or all of it for WFS_LOG_INODE
+    uint32_t length;        // bytes at data
+    uint64_t prev;          // offset of the previous entry of the inode, unless WFS_LOG_INODE
+    uint32_t data_offset;   // for WFS_LOG_DATA, where in the file the bytes at data go
+};
+
+/*
+ * A directory entry of the input image, in either format.
+ */
+struct dentry_view {
+    uint32_t inode_number;
+    const char *name;       // not null-terminated
+    size_t len;
+};
+
+/*
+ * A file's extents, sorted by offset and never overlapping.
+ */
+struct extent_map {
+    struct wfs_extent *extents;
+    size_t count;
+    size_t capacity;
+};
+
+/*
+ * A whole run of the input image that a deduplicated image may map into
+ * several files, and where it was copied to in the compacted image.
+ */
+struct shared_run {
+    uint64_t in;  // location of its bytes in the input image, 0 for an empty slot
+    uint64_t out; // location of their copy
+};
+
+/*
+ * Liveness of one inode number: the offset of its newest log entry, or 0 if
+ * the inode was never written or has been deleted.
+ */
+struct inode_state {
+    uint64_t latest;
+};
+
+static char *disk;               // mapped image being compacted
+static size_t disk_size;         // bytes mapped at disk
+static int in_format;            // on-disk format of the input image, 1 or WFS_VERSION
+static uint32_t in_sb_size;      // bytes of its superblock
+static uint64_t in_head;         // end of its log as of the newest commit or checkpoint
+static uint32_t in_segments;     // segments of the input image
+static struct log_range *ranges; // the input log, oldest first
+static uint32_t range_count;
+static struct inode_state *inodes;
+static unsigned long inode_count; // slots in inodes
+static unsigned long data_bytes;  // bytes of data runs in the input image
+static uint64_t last_sequence;    // highest sequence number in the input image
+static int packed;                // set if the input image compresses file data, and so the compacted one does too
+static int deduplicated;          // set if the input image shares runs between files, and so the compacted one does too
+static struct shared_run *shared_runs; // runs copied so far that extents may share, open addressing
+static size_t shared_run_slots;
+static size_t shared_run_count;
+
+static char *out;                // compacted image being built
+static uint64_t out_head;        // end of the log in out
+static uint32_t out_segments;    // segments available in out
+static uint32_t out_segment;     // segment out_head points into
+static uint64_t out_data_head;   // end of the file data in out, 0 before the first run
+static uint32_t out_data_segment; // segment out_data_head points into
+static uint32_t out_used;        // segments of out taken so far, from the start
+static unsigned long out_bytes;  // bytes of log entries and data runs written to out
+
+/**
+ * Returns the offset of the first log entry of a segment of the compacted image.
+ */
+static uint64_t segment_start(uint32_t segment) {
+    return (uint64_t)segment * WFS_SEGMENT_SIZE + (segment == 0 ? sizeof(struct wfs_sb) : 0) + sizeof(struct wfs_segment);
+}
+
+/**
+ * Returns the offset of the first log entry of a segment of the input image,
+ * whose superblock may be shorter.
+ */
+static uint64_t in_segment_start(uint32_t segment) {
+    return (uint64_t)segment * WFS_SEGMENT_SIZE + (segment == 0 ? in_sb_size : 0) + sizeof(struct wfs_segment);
+}
+
+/**
+ * Returns the header of a segment of the input image.
+ */
+static struct wfs_segment *in_header(uint32_t segment) {
+    return (struct wfs_segment*)(disk + in_segment_start(segment) - sizeof(struct wfs_segment));
+}
+
+/**
+ * Returns whether a location in the input image lies in a packed data
+ * segment, where it is that of a whole packed run's bytes.
+ */
+static int in_packed(uint64_t location) {
+    return in_format != 1 && in_header(location / WFS_SEGMENT_SIZE)->magic == WFS_PACKED_DATA_MAGIC;
+}
+
+/**
+ * Returns the size of the inode at the start of every log entry of a format.
+ */
+static uint32_t inode_header_size(int format) {
+    return format == 1 ? sizeof(struct wfs_inode_v1) : sizeof(struct wfs_inode);
+}
+
+/**
+ * Returns the size of the delta at the start of the input image's log
+ * entries other than WFS_LOG_INODE.
+ */
+static size_t in_delta_size() {
+    return in_format == 1 ? sizeof(struct wfs_delta_v1) : sizeof(struct wfs_delta);
+}
+
+/**
+ * Computes the CRC of a record, taking the deleted field of a log entry as 0.
+ *
+ * @param sequence The sequence number of the segment holding the record.
+ * @param record   The record's frame, with type and length set; its bytes follow it.
+ * @param format   The format of the log entry in the record, 1 or WFS_VERSION.
+ */
+static uint32_t record_crc(uint64_t sequence, const struct wfs_record *record, int format) {
+    uint32_t crc = crc32c(0, &sequence, sizeof(sequence));
+    crc = crc32c(crc, record, offsetof(struct wfs_record, crc));
+    const char *bytes = (const char*)(record + 1);
+    uint32_t header = inode_header_size(format);
+    if (record->type == WFS_RECORD_ENTRY && record->length >= header) {
+        char inode[sizeof(struct wfs_inode) > sizeof(struct wfs_inode_v1) ? sizeof(struct wfs_inode) : sizeof(struct wfs_inode_v1)];
+        memcpy(inode, bytes, header);
+        if (format == 1) {
+            memset(inode + offsetof(struct wfs_inode_v1, deleted), 0, sizeof(((struct wfs_inode_v1*)0)->deleted));
+        } else {
+            memset(inode + offsetof(struct wfs_inode, deleted), 0, sizeof(((struct wfs_inode*)0)->deleted));
+        }
+        crc = crc32c(crc, inode, header);
+        return crc32c(crc, bytes + header, record->length - header);
+    }
+    return crc32c(crc, bytes, record->length);
+}
+
+/**
+ * Decodes a log entry of the input image. Format 1 keeps the size of the
+ * inode in the delta of every entry but a WFS_LOG_INODE one, and its times
+ * in seconds.
+ *
+ * @param offset The offset of the entry's inode.
+ * @param view   Where to store the decoded entry.
+ */
+static void read_entry(uint64_t offset, struct entry_view *view) {
+    memset(view, 0, sizeof(*view));
+    if (in_format != 1) {
+        const struct wfs_log_entry *entry = (const struct wfs_log_entry*)(disk + offset);
+        view->inode = entry->inode;
+        view->data = entry->data;
+        view->length = ((const struct wfs_record*)entry - 1)->length - sizeof(struct wfs_inode);
+        if (entry->inode.flags != WFS_LOG_INODE) {
+            view->prev = ((const struct wfs_delta*)entry->data)->prev;
+            view->data += in_delta_size();
+            view->length -= in_delta_size();
+        }
+        return;
+    }
+
+    const struct wfs_inode_v1 *inode = (const struct wfs_inode_v1*)(disk + offset);
+    view->inode = (struct wfs_inode){
+        .inode_number = inode->inode_number,
+        .flags = inode->flags,
+        .deleted = inode->deleted,
+        .mode = inode->mode,
+        .uid = inode->uid,
+        .gid = inode->gid,
+        .links = inode->links,
+        .size = inode->size,
+        .atime = inode->atime * 1000000000ll,
+        .mtime = inode->mtime * 1000000000ll,
+        .ctime = inode->ctime * 1000000000ll,
+    };
+    view->data = (const char*)(inode + 1);
+    view->length = inode->size;
+    if (inode->flags != WFS_LOG_INODE) {
+        const struct wfs_delta_v1 *delta = (const struct wfs_delta_v1*)view->data;
+        view->inode.size = delta->size;
+        view->prev = delta->prev;
+        view->data_offset = delta->offset;
+        view->data += in_delta_size();
+        view->length -= in_delta_size();
+    }
+}
+
+/**
+ * Returns the size of the extents in the input image's log entries.
+ */
+static size_t in_extent_size() {
+    return in_format == 1 ? sizeof(struct wfs_extent_v1) : sizeof(struct wfs_extent);
+}
+
+/**
+ * Decodes one extent of the input image.
+ */
+static struct wfs_extent read_extent(const char *bytes) {
+    struct wfs_extent extent;
+    if (in_format == 1) {
+        struct wfs_extent_v1 old;
+        memcpy(&old, bytes, sizeof(old));
+        return (struct wfs_extent){ .offset = old.offset, .length = old.length, .location = old.location };
+    }
+    memcpy(&extent, bytes, sizeof(extent));
+    return extent;
+}
+
+/**
+ * Decodes the next directory entry of the input image.
+ *
+ * @param bytes  Where the entry starts.
+ * @param end    The end of the entries.
+ * @param dentry Where to store the entry.
+ * @return       The bytes the entry takes, or 0 if no whole entry is left.
+ */
+static size_t read_dentry(const char *bytes, const char *end, struct dentry_view *dentry) {
+    if (in_format == 1) {
+        if (end - bytes < (ptrdiff_t)sizeof(struct wfs_dentry_v1)) {
+            return 0;
+        }
+        const struct wfs_dentry_v1 *old = (const struct wfs_dentry_v1*)bytes;
+        dentry->inode_number = old->inode_number;
+        dentry->name = old->name;
+        dentry->len = strnlen(old->name, MAX_FILE_NAME_LEN_V1);
+        return sizeof(struct wfs_dentry_v1);
+    }
+    struct wfs_dentry packed;
+    if (end - bytes < (ptrdiff_t)offsetof(struct wfs_dentry, name)) {
+        return 0;
+    }
+    memcpy(&packed, bytes, offsetof(struct wfs_dentry, name)); // Packed, so not aligned
+    if (end - bytes < (ptrdiff_t)WFS_DENTRY_SIZE(packed.name_len)) {
+        return 0;
+    }
+    dentry->inode_number = packed.inode_number;
+    dentry->name = bytes + offsetof(struct wfs_dentry, name);
+    dentry->len = packed.name_len;
+    return WFS_DENTRY_SIZE(packed.name_len);
+}
+
+/**
+ * Checks a record of the input image: its type, that its length fits before
+ * end and agrees with the header inside it, and its CRC. A packed run also
+ * has to name a known codec and a size it may have.
+ *
+ * @param offset   The offset of the frame.
+ * @param end      The end of the bytes it may take up.
+ * @param sequence The sequence number of its segment.
+ * @param type     WFS_RECORD_ENTRY, WFS_RECORD_RUN or WFS_RECORD_PACKED_RUN.
+ * @return         1 if the record checks out, 0 otherwise.
+ */
+static int record_valid(uint64_t offset, uint64_t end, uint64_t sequence, uint32_t type) {
+    if (offset >= end || end - offset < sizeof(struct wfs_record)) {
+        return 0;
+    }
+    const struct wfs_record *record = (const struct wfs_record*)(disk + offset);
+    if (record->type != type || record->length > end - offset - sizeof(struct wfs_record)) {
+        return 0;
+    }
+    uint32_t header_size = type == WFS_RECORD_ENTRY ? inode_header_size(in_format)
+                         : type == WFS_RECORD_RUN ? sizeof(struct wfs_data_run) : sizeof(struct wfs_packed_run);
+    if (record->length < header_size) {
+        return 0;
+    }
+    // Format 2 takes the length of an entry's data from its record alone
+    if (type == WFS_RECORD_PACKED_RUN) {
+        const struct wfs_packed_run *run = (const struct wfs_packed_run*)(record + 1);
+        if (run->length != record->length - header_size || run->size == 0 || run->size > WFS_PACKED_RUN_SIZE ||
+            (run->codec != WFS_CODEC_LZ4 && (run->codec != WFS_CODEC_NONE || run->length != run->size))) {
+            return 0;
+        }
+    } else if (type == WFS_RECORD_RUN || in_format == 1) {
+        uint32_t size = type == WFS_RECORD_ENTRY ? ((const struct wfs_inode_v1*)(record + 1))->size
+                                                 : ((const struct wfs_data_run*)(record + 1))->length;
+        if (size != record->length - header_size) {
+            return 0;
+        }
+    }
+    return record->crc == record_crc(sequence, record, in_format);
+}
+
+/**
+ * Returns whether a log record comes after the end of the log as of the
+ * newest commit or checkpoint. Only the runs of WFS_LOG_MAP entries past it
+ * may not have reached the disk; those of older entries may since have been
+ * cleaned.
+ *
+ * @param sequence The sequence number of the record's segment.
+ * @param offset   The offset of the record.
+ */
+static int after_commit(uint64_t sequence, uint64_t offset) {
+    uint64_t committed = (in_head - 1) / WFS_SEGMENT_SIZE; // head may sit right at the end of its segment
+    if (in_head == 0 || committed >= in_segments ||
+        (in_header(committed)->magic != WFS_FRAMED_SEGMENT_MAGIC && in_header(committed)->magic != WFS_SEGMENT_MAGIC)) {
+        return 1;
+    }
+    uint64_t committed_sequence = in_header(committed)->sequence;
+    return sequence > committed_sequence || (sequence == committed_sequence && offset >= in_head);
+}
+
+/**
+ * Checks the runs a WFS_LOG_MAP entry maps in, where their data segments
+ * have frames.
+ *
+ * @return 1 if every run checks out, 0 otherwise.
+ */
+static int map_runs_valid(const struct entry_view *entry) {
+    size_t count = entry->length / in_extent_size();
+    for (size_t i = 0; i < count; i++) {
+        struct wfs_extent extent = read_extent(entry->data + i * in_extent_size());
+        uint64_t segment = extent.location / WFS_SEGMENT_SIZE;
+        if (segment >= in_segments) {
+            return 0;
+        }
+        struct wfs_segment *header = in_header(segment);
+        if (header->magic == WFS_DATA_MAGIC) {
+            continue;
+        }
+        if (header->magic == WFS_PACKED_DATA_MAGIC) {
+            uint64_t start = extent.location - sizeof(struct wfs_packed_run) - sizeof(struct wfs_record);
+            const struct wfs_packed_run *run = (const struct wfs_packed_run*)(disk + extent.location) - 1;
+            if (extent.location < in_segment_start(segment) + sizeof(struct wfs_record) + sizeof(struct wfs_packed_run) ||
+                !record_valid(start, segment * WFS_SEGMENT_SIZE + header->used, header->sequence, WFS_RECORD_PACKED_RUN) ||
+                extent.offset < run->offset || extent.offset - run->offset > run->size ||
+                extent.length > run->size - (extent.offset - run->offset)) {
+                return 0;
+            }
+            continue;
+        }
+        uint64_t start = extent.location - sizeof(struct wfs_data_run) - sizeof(struct wfs_record);
+        if (header->magic != WFS_FRAMED_DATA_MAGIC ||
+            extent.location < in_segment_start(segment) + sizeof(struct wfs_record) + sizeof(struct wfs_data_run) ||
+            !record_valid(start, segment * WFS_SEGMENT_SIZE + header->used, header->sequence, WFS_RECORD_RUN) ||
+            extent.length > ((struct wfs_data_run*)(disk + start + sizeof(struct wfs_record)))->length) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Orders log ranges by sequence number.
+ */
+static int compare_ranges(const void *a, const void *b) {
+    uint64_t sequence_a = ((const struct log_range*)a)->sequence;
+    uint64_t sequence_b = ((const struct log_range*)b)->sequence;
+    return (sequence_a > sequence_b) - (sequence_a < sequence_b);
+}
+
+/**
+ * Works out which format the input image is in and where its log lives: the
+ * segments in use, in sequence order, or for an image from before segments,
+ * everything from the superblock to its head. Data segments are only
+ * counted; their runs are reached through the extents of the files.
+ *
+ * @return 0 on success, -1 if the image is not a wfs image, or -2 if it is
+ *         in a format newer than this build can read.
+ */
+static int find_log_ranges() {
+    struct wfs_sb *sb = (struct wfs_sb*)disk;
+    struct wfs_sb_v1 *sb_v1 = (struct wfs_sb_v1*)disk;
+    uint32_t segment_size;
+    if (sb->magic == WFS_MAGIC_V1) {
+        in_format = 1;
+        in_sb_size = sizeof(struct wfs_sb_v1);
+        in_head = sb_v1->head;
+        in_segments = sb_v1->segments;
+        segment_size = sb_v1->segment_size;
+    } else if (sb->magic == WFS_MAGIC && disk_size >= sizeof(struct wfs_sb)) {
+        if (sb->version != WFS_VERSION || (sb->features & ~WFS_FEATURES) != 0) {
+            return -2;
+        }
+        in_format = sb->version;
+        in_sb_size = sizeof(struct wfs_sb);
+        in_head = sb->head;
+        in_segments = sb->segments;
+        segment_size = sb->segment_size;
+        packed = (sb->features & WFS_FEATURE_COMPRESSION) != 0;
+        deduplicated = (sb->features & WFS_FEATURE_DEDUP) != 0;
+    } else {
+        return -1;
+    }
+    if (segment_size != WFS_SEGMENT_SIZE) {
+        if (in_format != 1) {
+            return -1;
+        }
+        if (in_head < LEGACY_LOG_START || in_head > disk_size) {
+            return -1;
+        }
+        ranges = malloc(sizeof(struct log_range));
+        if (ranges == NULL) {
+            return -1;
+        }
+        ranges[0] = (struct log_range){ .start = LEGACY_LOG_START, .end = in_head };
+        range_count = 1;
+        return 0;
+    }
+
+    if (in_segments == 0 || (uint64_t)in_segments * WFS_SEGMENT_SIZE > disk_size) {
+        return -1;
+    }
+    ranges = malloc(in_segments * sizeof(struct log_range));
+    if (ranges == NULL) {
+        return -1;
+    }
+    for (uint32_t segment = 0; segment < in_segments; segment++) {
+        struct wfs_segment *header = in_header(segment);
+        int data = header->magic == WFS_FRAMED_DATA_MAGIC || (in_format == 1 && header->magic == WFS_DATA_MAGIC) ||
+                   (in_format != 1 && header->magic == WFS_PACKED_DATA_MAGIC);
+        if (header->magic != WFS_FRAMED_SEGMENT_MAGIC && !(in_format == 1 && header->magic == WFS_SEGMENT_MAGIC) && !data) {
+            continue;
+        }
+        if (header->used < in_segment_start(segment) - (uint64_t)segment * WFS_SEGMENT_SIZE || header->used > WFS_SEGMENT_SIZE) {
+            fprintf(stderr, "Corrupt header in segment %u\n", segment);
+            return -1;
+        }
+        if (header->sequence > last_sequence) {
+            last_sequence = header->sequence;
+        }
+        if (data) {
+            data_bytes += header->used - (in_segment_start(segment) - (uint64_t)segment * WFS_SEGMENT_SIZE);
+            continue;
+        }
+        ranges[range_count++] = (struct log_range){
+            .start = in_segment_start(segment),
+            .end = (uint64_t)segment * WFS_SEGMENT_SIZE + header->used,
+            .sequence = header->sequence,
+            .frame = header->magic == WFS_FRAMED_SEGMENT_MAGIC ? sizeof(struct wfs_record) : 0,
+        };
+    }
+    qsort(ranges, range_count, sizeof(struct log_range), compare_ranges);
+    return 0;
+}
+
+/**
+ * Walks the log once and records the newest entry of every inode number.
+ * Deleted entries mark the inode as dead. The log ends at the first record
+ * that does not check out, as mounting would have it: whatever comes after
+ * is dropped.
+ *
+ * @param entries Set to the number of entries in the log.
+ * @param bytes   Set to the number of bytes of entries in the log.
+ * @return        0 on success, -1 if the log is corrupt.
+ */
+static int find_live_inodes(unsigned long *entries, unsigned long *bytes) {
+    *entries = 0;
+    *bytes = 0;
+    for (uint32_t i = 0; i < range_count; i++) {
+        uint64_t offset = ranges[i].start;
+        uint64_t end = ranges[i].end;
+
+        while (offset < end) {
+            uint32_t frame = ranges[i].frame;
+            uint32_t header = inode_header_size(in_format);
+            if (frame != 0 && !record_valid(offset, end, ranges[i].sequence, WFS_RECORD_ENTRY)) {
+                printf("Torn log record at offset %lu; dropping the log from there\n", (unsigned long)offset);
+                ranges[i].end = offset;
+                range_count = i + 1;
+                break;
+            }
+            // Only format 1 has entries without records, whose data length is in the inode
+            uint32_t entry_size = frame != 0 ? ((struct wfs_record*)(disk + offset))->length
+                                             : header + ((struct wfs_inode_v1*)(disk + offset))->size;
+            uint32_t flags = in_format == 1 ? ((struct wfs_inode_v1*)(disk + offset + frame))->flags
+                                            : ((struct wfs_inode*)(disk + offset + frame))->flags;
+            if (offset + frame + header > end || entry_size > end - offset - frame ||
+                (flags != WFS_LOG_INODE && entry_size < header + in_delta_size())) {
+                fprintf(stderr, "Corrupt log entry at offset %lu\n", (unsigned long)offset);
+                return -1;
+            }
+            struct entry_view entry;
+            read_entry(offset + frame, &entry);
+            if (frame != 0 && !S_ISDIR(entry.inode.mode) && entry.inode.flags == WFS_LOG_MAP &&
+                after_commit(ranges[i].sequence, offset) && !map_runs_valid(&entry)) {
+                printf("Torn log record at offset %lu; dropping the log from there\n", (unsigned long)offset);
+                ranges[i].end = offset;
+                range_count = i + 1;
+                break;
+            }
+
+            unsigned long number = entry.inode.inode_number;
+            if (number >= inode_count) {
+                unsigned long new_count = inode_count ? inode_count : 64;
+                while (new_count <= number) {
+                    new_count *= 2;
+                }
+                struct inode_state *new_inodes = realloc(inodes, new_count * sizeof(struct inode_state));
+                if (new_inodes == NULL) {
+                    perror("Error allocating inode table");
+                    return -1;
+                }
+                memset(new_inodes + inode_count, 0, (new_count - inode_count) * sizeof(struct inode_state));
+                inodes = new_inodes;
+                inode_count = new_count;
+            }
+            inodes[number].latest = entry.inode.deleted ? 0 : offset + frame;
+
+            offset += frame + entry_size;
+            (*entries)++;
+        }
+        *bytes += ranges[i].end - ranges[i].start;
+    }
     return 0;
 }
 
+/**
+ * Collects the entries needed to rebuild an inode by following prev links back
+ * to its last full entry.
+ *
+ * @param offset The offset of the inode's newest entry.
+ * @param length Set to the number of entries collected.
+ * @return       The offsets, newest first, or NULL on failure. The caller must free it.
+ */
+static uint64_t *read_chain(uint64_t offset, size_t *length) {
+    uint64_t *chain = NULL;
+    size_t capacity = 0;
+    *length = 0;
+    while (1) {
+        if (*length == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            uint64_t *new_chain = realloc(chain, capacity * sizeof(uint64_t));
+            if (new_chain == NULL) {
+                free(chain);
+                return NULL;
+            }
+            chain = new_chain;
+        }
+        chain[(*length)++] = offset;
+        struct entry_view entry;
+        read_entry(offset, &entry);
+        if (entry.inode.flags == WFS_LOG_INODE || entry.inode.flags == WFS_LOG_EXTENTS) {
+            return chain;
+        }
+        offset = entry.prev;
+        if (offset < LEGACY_LOG_START || offset >= disk_size) {
+            fprintf(stderr, "Broken chain in inode %u\n", entry.inode.inode_number);
+            free(chain);
+            return NULL;
+        }
+    }
+}
+
+/**
+ * Returns the header of a segment of the compacted image.
+ */
+static struct wfs_segment *out_header(uint32_t segment) {
+    return (struct wfs_segment*)(out + segment_start(segment) - sizeof(struct wfs_segment));
+}
+
+/**
+ * Takes the next unused segment of the compacted image for the log or for
+ * file data. Sequence numbers go on from the highest in the input image, so
+ * records it left behind cannot pass for those of the compacted one.
+ *
+ * @param magic WFS_FRAMED_SEGMENT_MAGIC, WFS_FRAMED_DATA_MAGIC or WFS_PACKED_DATA_MAGIC.
+ * @return      The segment number, or -1 if the image is full.
+ */
+static int take_segment(uint32_t magic) {
+    if (out_used >= out_segments) {
+        fprintf(stderr, "Compacted log does not fit in the image\n");
+        return -1;
+    }
+    uint32_t segment = out_used++;
+    out_header(segment)->magic = magic;
+    out_header(segment)->sequence = last_sequence + out_used;
+    out_header(segment)->used = segment_start(segment) - (uint64_t)segment * WFS_SEGMENT_SIZE;
+    return segment;
+}
+
+/**
+ * Reserves room for one entry at the end of the compacted log, moving on to
+ * the next free segment if the entry does not fit in the current one. Its
+ * record is framed here and sealed by seal_log() once the log is complete.
+ *
+ * @param inode The newest inode of the entry.
+ * @param flags The kind of entry, one of the WFS_LOG_* values.
+ * @param size The size of the inode as of the entry.
+ * @param data_size The number of data bytes that follow the inode.
+ * @return A pointer to the entry, or NULL if the compacted log is full.
+ */
+static struct wfs_log_entry *emit_entry(const struct wfs_inode *inode, uint32_t flags, uint64_t size, uint32_t data_size) {
+    uint32_t entry_size = sizeof(struct wfs_inode) + data_size;
+    uint32_t record_size = sizeof(struct wfs_record) + entry_size;
+    if (out_head + record_size > (uint64_t)(out_segment + 1) * WFS_SEGMENT_SIZE) {
+        int segment = take_segment(WFS_FRAMED_SEGMENT_MAGIC);
+        if (segment < 0) {
+            return NULL;
+        }
+        out_segment = segment;
+        out_head = segment_start(out_segment);
+    }
+    struct wfs_record *record = (struct wfs_record*)(out + out_head);
+    record->type = WFS_RECORD_ENTRY;
+    record->length = entry_size;
+    struct wfs_log_entry *entry = (struct wfs_log_entry*)(record + 1);
+    entry->inode = *inode;
+    entry->inode.flags = flags;
+    entry->inode.deleted = 0;
+    entry->inode.size = size;
+    out_head += record_size;
+    out_bytes += record_size;
+    out_header(out_segment)->used = out_head - (uint64_t)out_segment * WFS_SEGMENT_SIZE;
+    return entry;
+}
+
+/**
+ * Copies file bytes to the end of the compacted file data as one run.
+ *
+ * @param inode_number The file the bytes belong to.
+ * @param bytes        The bytes.
+ * @param length       The number of bytes, at most MAX_RUN.
+ * @return             The offset of the copy in the image, or 0 if the image is full.
+ */
+static uint64_t emit_run(uint32_t inode_number, const char *bytes, uint32_t length) {
+    uint32_t run_size = sizeof(struct wfs_record) + sizeof(struct wfs_data_run) + length;
+    if (out_data_head == 0 || out_data_head + run_size > (uint64_t)(out_data_segment + 1) * WFS_SEGMENT_SIZE) {
+        int segment = take_segment(WFS_FRAMED_DATA_MAGIC);
+        if (segment < 0) {
+            return 0;
+        }
+        out_data_segment = segment;
+        out_data_head = segment_start(out_data_segment);
+    }
+    struct wfs_record *record = (struct wfs_record*)(out + out_data_head);
+    struct wfs_data_run *run = (struct wfs_data_run*)(record + 1);
+    run->inode_number = inode_number;
+    run->length = length;
+    memcpy(run + 1, bytes, length);
+    record->type = WFS_RECORD_RUN;
+    record->length = sizeof(struct wfs_data_run) + length;
+    record->crc = record_crc(out_header(out_data_segment)->sequence, record, WFS_VERSION);
+    out_data_head += run_size;
+    out_bytes += run_size;
+    out_header(out_data_segment)->used = out_data_head - (uint64_t)out_data_segment * WFS_SEGMENT_SIZE;
+    return out_data_head - length;
+}
+
+/**
+ * Copies file bytes to the end of the compacted file data as one packed run,
+ * compressed unless that would not make it any smaller.
+ *
+ * @param inode_number The file the bytes belong to.
+ * @param bytes        The bytes.
+ * @param length       The number of bytes, at most WFS_PACKED_RUN_SIZE.
+ * @param offset       Where in the file the bytes go.
+ * @return             The offset of the run's bytes in the image, or 0 if the image is full.
+ */
+static uint64_t emit_packed_run(uint32_t inode_number, const char *bytes, uint32_t length, uint64_t offset) {
+    char compressed[WFS_PACKED_RUN_SIZE];
+    uint32_t stored = lz4_compress(bytes, length, compressed, length - 1);
+    uint32_t codec = stored != 0 ? WFS_CODEC_LZ4 : WFS_CODEC_NONE;
+    stored = stored != 0 ? stored : length;
+
+    uint32_t run_size = sizeof(struct wfs_record) + sizeof(struct wfs_packed_run) + stored;
+    if (out_data_head == 0 || out_data_head + run_size > (uint64_t)(out_data_segment + 1) * WFS_SEGMENT_SIZE) {
+        int segment = take_segment(WFS_PACKED_DATA_MAGIC);
+        if (segment < 0) {
+            return 0;
+        }
+        out_data_segment = segment;
+        out_data_head = segment_start(out_data_segment);
+    }
+    struct wfs_record *record = (struct wfs_record*)(out + out_data_head);
+    struct wfs_packed_run *run = (struct wfs_packed_run*)(record + 1);
+    *run = (struct wfs_packed_run){ .inode_number = inode_number, .length = stored, .offset = offset, .size = length, .codec = codec };
+    memcpy(run + 1, codec == WFS_CODEC_LZ4 ? compressed : bytes, stored);
+    record->type = WFS_RECORD_PACKED_RUN;
+    record->length = sizeof(struct wfs_packed_run) + stored;
+    record->crc = record_crc(out_header(out_data_segment)->sequence, record, WFS_VERSION);
+    out_data_head += run_size;
+    out_bytes += run_size;
+    out_header(out_data_segment)->used = out_data_head - (uint64_t)out_data_segment * WFS_SEGMENT_SIZE;
+    return out_data_head - stored;
+}
+
+/**
+ * Fills in the CRC of every record of the compacted log, now that the
+ * callers of emit_entry() have filled in their data.
+ */
+static void seal_log() {
+    for (uint32_t segment = 0; segment < out_used; segment++) {
+        struct wfs_segment *header = out_header(segment);
+        if (header->magic != WFS_FRAMED_SEGMENT_MAGIC) {
+            continue;
+        }
+        uint64_t offset = segment_start(segment);
+        while (offset < (uint64_t)segment * WFS_SEGMENT_SIZE + header->used) {
+            struct wfs_record *record = (struct wfs_record*)(out + offset);
+            record->crc = record_crc(header->sequence, record, WFS_VERSION);
+            offset += sizeof(struct wfs_record) + record->length;
+        }
+    }
+}
+
+/**
+ * Writes a directory as few entries as possible, keeping only entries that
+ * point at live inodes. A directory too large for one entry is written as a
+ * full entry followed by entries that add the rest of its dentries.
+ *
+ * @return The number of dangling entries dropped, or -1 on failure.
+ */
+static int compact_dir(uint64_t *chain, size_t length) {
+    struct dentry_view *dentries = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+
+    // Replay the chain oldest first
+    for (size_t i = length; i-- > 0;) {
+        struct entry_view entry;
+        read_entry(chain[i], &entry);
+        const char *end = entry.data + entry.length;
+        struct dentry_view changed;
+        for (const char *next = entry.data; next < end;) {
+            size_t bytes = read_dentry(next, end, &changed);
+            if (bytes == 0) {
+                break;
+            }
+            next += bytes;
+            if (entry.inode.flags == WFS_LOG_DENTRY_DEL) {
+                for (size_t k = 0; k < count; k++) {
+                    if (dentries[k].inode_number == changed.inode_number) {
+                        dentries[k] = dentries[--count];
+                        break;
+                    }
+                }
+                continue;
+            }
+            if (count == capacity) {
+                capacity = capacity ? capacity * 2 : 64;
+                struct dentry_view *new_dentries = realloc(dentries, capacity * sizeof(struct dentry_view));
+                if (new_dentries == NULL) {
+                    free(dentries);
+                    return -1;
+                }
+                dentries = new_dentries;
+            }
+            dentries[count++] = changed;
+        }
+    }
+
+    int dropped = 0;
+    for (size_t k = 0; k < count;) {
+        unsigned long target = dentries[k].inode_number;
+        if (target >= inode_count || inodes[target].latest == 0 || dentries[k].len == 0) {
+            dentries[k] = dentries[--count];
+            dropped++;
+        } else {
+            k++;
+        }
+    }
+
+    // Pack the entries into as few log entries as they fit in
+    struct entry_view newest;
+    read_entry(chain[0], &newest);
+    size_t room = MAX_ENTRY_SIZE - sizeof(struct wfs_inode) - sizeof(struct wfs_delta);
+    size_t done = 0;
+    uint64_t size = 0;
+    uint64_t prev = 0;
+    do {
+        size_t piece = 0;
+        size_t piece_size = 0;
+        while (done + piece < count && piece_size + WFS_DENTRY_SIZE(dentries[done + piece].len) <= room) {
+            piece_size += WFS_DENTRY_SIZE(dentries[done + piece].len);
+            piece++;
+        }
+        size += piece_size;
+        size_t header = done == 0 ? 0 : sizeof(struct wfs_delta);
+        struct wfs_log_entry *entry = emit_entry(&newest.inode, done == 0 ? WFS_LOG_INODE : WFS_LOG_DENTRY_ADD,
+                                                 size, header + piece_size);
+        if (entry == NULL) {
+            free(dentries);
+            return -1;
+        }
+        if (done != 0) {
+            struct wfs_delta delta = { .prev = prev };
+            memcpy(entry->data, &delta, sizeof(delta));
+        }
+        char *packed = entry->data + header;
+        for (size_t k = done; k < done + piece; k++) {
+            struct wfs_dentry dentry = { .inode_number = dentries[k].inode_number, .name_len = dentries[k].len };
+            memcpy(packed, &dentry, offsetof(struct wfs_dentry, name));
+            memcpy(packed + offsetof(struct wfs_dentry, name), dentries[k].name, dentries[k].len);
+            packed += WFS_DENTRY_SIZE(dentries[k].len);
+        }
+        prev = (char*)entry - out;
+        done += piece;
+    } while (done < count);
+
+    free(dentries);
+    return dropped;
+}
+
+/**
+ * Maps a range of a file to bytes in the input image, replacing whatever the
+ * range mapped to before.
+ *
+ * @return 0 on success, or -1 if memory ran out.
+ */
+static int map_range(struct extent_map *map, uint64_t offset, uint32_t length, uint64_t location) {
+    if (length == 0) {
+        return 0;
+    }
+    uint64_t end = offset + length;
+
+    // Find the run of extents that overlap [offset, end)
+    size_t first = 0;
+    while (first < map->count && map->extents[first].offset + map->extents[first].length <= offset) {
+        first++;
+    }
+    size_t last = first;
+    while (last < map->count && map->extents[last].offset < end) {
+        last++;
+    }
+
+    // Parts of the first and last overlapping extents that stick out survive
+    struct wfs_extent before = { 0 };
+    struct wfs_extent after = { 0 };
+    if (first < last && map->extents[first].offset < offset) {
+        before = map->extents[first];
+        before.length = offset - before.offset;
+    }
+    if (first < last) {
+        struct wfs_extent *tail = &map->extents[last - 1];
+        if (tail->offset + tail->length > end) {
+            after.offset = end;
+            after.length = tail->offset + tail->length - end;
+            // Extents into a packed run all point at its start
+            after.location = in_packed(tail->location) ? tail->location : tail->location + (end - tail->offset);
+        }
+    }
 
-// Main function
-    // Check if disk path argument is provided
-//    If not enough arguments provided
-//        Print error message and exit
+    size_t replacement = 1 + (before.length != 0) + (after.length != 0);
+    size_t new_count = map->count - (last - first) + replacement;
+    if (new_count > map->capacity) {
+        size_t new_capacity = map->capacity ? map->capacity * 2 : 8;
+        while (new_capacity < new_count) {
+            new_capacity *= 2;
+        }
+        struct wfs_extent *new_extents = realloc(map->extents, new_capacity * sizeof(struct wfs_extent));
+        if (new_extents == NULL) {
+            return -1;
+        }
+        map->extents = new_extents;
+        map->capacity = new_capacity;
+    }
+    memmove(&map->extents[first + replacement], &map->extents[last], (map->count - last) * sizeof(struct wfs_extent));
+
+    size_t i = first;
+    if (before.length != 0) {
+        map->extents[i++] = before;
+    }
+    map->extents[i++] = (struct wfs_extent){ .offset = offset, .length = length, .location = location };
+    if (after.length != 0) {
+        map->extents[i++] = after;
+    }
+    map->count = new_count;
+    return 0;
+}
+
+/**
+ * Finds the bytes an extent of the input image maps: in the image, or for a
+ * compressed packed run, decompressed as far as the extent reaches.
+ *
+ * @param extent   The extent.
+ * @param unpacked Room for WFS_PACKED_RUN_SIZE decompressed bytes.
+ * @return         A pointer to the extent's first byte, or NULL if its packed run is damaged.
+ */
+static const char *extent_bytes(const struct wfs_extent *extent, char *unpacked) {
+    if (!in_packed(extent->location)) {
+        return disk + extent->location;
+    }
+    const struct wfs_packed_run *run = (const struct wfs_packed_run*)(disk + extent->location) - 1;
+    uint64_t skip = extent->offset - run->offset;
+    if (extent->location < sizeof(struct wfs_packed_run) || run->length > disk_size - extent->location ||
+        extent->offset < run->offset || run->size > WFS_PACKED_RUN_SIZE || extent->length > run->size ||
+        skip > run->size - extent->length) {
+        return NULL;
+    }
+    if (run->codec == WFS_CODEC_NONE) {
+        return (const char*)(run + 1) + skip;
+    }
+    if (run->codec != WFS_CODEC_LZ4 || lz4_decompress(run + 1, run->length, unpacked, skip + extent->length) != 0) {
+        return NULL;
+    }
+    return unpacked + skip;
+}
 
-//    disk_path = get disk path from arguments
+/**
+ * Returns whether an extent of the input image maps the whole of a run
+ * that a deduplicated image may share between files: one of at least
+ * WFS_MIN_SHARED_RUN bytes in a framed data segment, that checks out.
+ */
+static int whole_shared_run(const struct wfs_extent *extent) {
+    uint64_t segment = extent->location / WFS_SEGMENT_SIZE;
+    uint32_t frame = sizeof(struct wfs_record) + sizeof(struct wfs_data_run);
+    if (!deduplicated || extent->length < WFS_MIN_SHARED_RUN || extent->length > MAX_RUN ||
+        segment >= in_segments) {
+        return 0;
+    }
+    struct wfs_segment *header = in_header(segment);
+    uint64_t start = extent->location - frame;
+    return header->magic == WFS_FRAMED_DATA_MAGIC && extent->location >= in_segment_start(segment) + frame &&
+           record_valid(start, (uint64_t)segment * WFS_SEGMENT_SIZE + header->used, header->sequence, WFS_RECORD_RUN) &&
+           ((const struct wfs_data_run*)(disk + start + sizeof(struct wfs_record)))->length == extent->length;
+}
 
-    // Open the disk file
-//    file_descriptor = open disk file (disk_path)
+/**
+ * Finds the slot of a whole run of the input image among those copied so
+ * far, or the empty slot it goes in, first making the table bigger if it
+ * is half full.
+ *
+ * @param location The location of the run's bytes in the input image.
+ * @return         The slot, or NULL if memory ran out.
+ */
+static struct shared_run *find_shared_run(uint64_t location) {
+    if ((shared_run_count + 1) * 2 > shared_run_slots) {
+        size_t new_slots = shared_run_slots ? shared_run_slots * 2 : 1024;
+        struct shared_run *new_runs = calloc(new_slots, sizeof(struct shared_run));
+        if (new_runs == NULL) {
+            return NULL;
+        }
+        for (size_t i = 0; i < shared_run_slots; i++) {
+            if (shared_runs[i].in != 0) {
+                size_t slot = (shared_runs[i].in * 2654435761u) & (new_slots - 1);
+                while (new_runs[slot].in != 0) {
+                    slot = (slot + 1) & (new_slots - 1);
+                }
+                new_runs[slot] = shared_runs[i];
+            }
+        }
+        free(shared_runs);
+        shared_runs = new_runs;
+        shared_run_slots = new_slots;
+    }
+    size_t slot = (location * 2654435761u) & (shared_run_slots - 1);
+    while (shared_runs[slot].in != 0 && shared_runs[slot].in != location) {
+        slot = (slot + 1) & (shared_run_slots - 1);
+    }
+    return &shared_runs[slot];
+}
 
-//    If file_descriptor is invalid
-//        Print error message and exit
+/**
+ * Writes a file's contents to data segments and its extent map as a full
+ * entry, followed by map entries for whatever extents do not fit in one.
+ * Holes stay holes, so a sparse file takes only the room of its data.
+ *
+ * @return 0 on success, or -1 on failure.
+ */
+static int compact_file(uint64_t *chain, size_t length) {
+    struct entry_view newest;
+    read_entry(chain[0], &newest);
+    uint64_t size = newest.inode.size;
+    struct extent_map map = { 0 };
 
-    // Get file information for mmap
-//    stat_info = get file information (file_descriptor)
+    // Replay the chain oldest first, so newer bytes replace older ones
+    int ret = 0;
+    for (size_t i = length; i-- > 0 && ret == 0;) {
+        struct entry_view entry;
+        read_entry(chain[i], &entry);
+        uint64_t location = entry.data - disk;
+        if (entry.inode.flags == WFS_LOG_INODE) { // Format 1 kept the first bytes inline
+            ret = map_range(&map, 0, entry.length, location);
+        } else if (entry.inode.flags == WFS_LOG_EXTENTS || entry.inode.flags == WFS_LOG_MAP) {
+            size_t count = entry.length / in_extent_size();
+            for (size_t j = 0; j < count && ret == 0; j++) {
+                struct wfs_extent extent = read_extent(entry.data + j * in_extent_size());
+                if (extent.location <= disk_size && extent.length <= disk_size - extent.location) {
+                    ret = map_range(&map, extent.offset, extent.length, extent.location);
+                }
+            }
+        } else if (entry.inode.flags == WFS_LOG_DATA) {
+            ret = map_range(&map, entry.data_offset, entry.length, location);
+        }
+    }
 
-    // Memory map the disk
-//    mapped_disk = memory map the disk (file_descriptor, size from stat_info)
+    // Copy what lies within the file's size, in runs of at most MAX_RUN, or
+    // packed runs of at most WFS_PACKED_RUN_SIZE. A run a deduplicated image
+    // shares between files stays shared.
+    struct extent_map runs = { 0 };
+    uint32_t limit = packed ? WFS_PACKED_RUN_SIZE : MAX_RUN;
+    char unpacked[WFS_PACKED_RUN_SIZE];
+    for (size_t i = 0; i < map.count && ret == 0 && map.extents[i].offset < size; i++) {
+        struct wfs_extent extent = map.extents[i];
+        if (extent.length > size - extent.offset) {
+            extent.length = size - extent.offset;
+        }
+        if (whole_shared_run(&extent)) { // Copied once, however many files map it
+            struct shared_run *run = find_shared_run(extent.location);
+            if (run == NULL) {
+                fprintf(stderr, "Error allocating shared run table\n");
+                ret = -1;
+            } else if (run->in == 0 && (run->out = emit_run(newest.inode.inode_number, disk + extent.location, extent.length)) == 0) {
+                ret = -1;
+            } else {
+                shared_run_count += run->in == 0;
+                run->in = extent.location;
+                ret = map_range(&runs, extent.offset, extent.length, run->out);
+            }
+            continue;
+        }
+        const char *bytes = extent_bytes(&extent, unpacked);
+        if (bytes == NULL) {
+            fprintf(stderr, "Packed run at offset %lu of inode %u is damaged\n", (unsigned long)extent.location, newest.inode.inode_number);
+            ret = -1;
+        }
+        for (uint32_t done = 0; done < extent.length && ret == 0;) {
+            uint32_t piece = extent.length - done < limit ? extent.length - done : limit;
+            uint64_t location = packed ? emit_packed_run(newest.inode.inode_number, bytes + done, piece, extent.offset + done)
+                                       : emit_run(newest.inode.inode_number, bytes + done, piece);
+            ret = location == 0 ? -1 : map_range(&runs, extent.offset + done, piece, location);
+            done += piece;
+        }
+    }
+    free(map.extents);
+    if (ret != 0) {
+        free(runs.extents);
+        return -1;
+    }
 
-    // Close the file descriptor as it's no longer needed
-//    close file_descriptor
+    size_t per_entry = (MAX_ENTRY_SIZE - sizeof(struct wfs_inode) - sizeof(struct wfs_delta)) / sizeof(struct wfs_extent);
+    size_t done = 0;
+    uint64_t prev = 0;
+    do {
+        size_t piece = runs.count - done < per_entry ? runs.count - done : per_entry;
+        struct wfs_log_entry *entry = emit_entry(&newest.inode, done == 0 ? WFS_LOG_EXTENTS : WFS_LOG_MAP, size,
+                                                 sizeof(struct wfs_delta) + piece * sizeof(struct wfs_extent));
+        if (entry == NULL) {
+            free(runs.extents);
+            return -1;
+        }
+        struct wfs_delta delta = { .prev = prev };
+        memcpy(entry->data, &delta, sizeof(delta));
+        if (piece > 0) {
+            memcpy(entry->data + sizeof(delta), runs.extents + done, piece * sizeof(struct wfs_extent));
+        }
+        prev = (char*)entry - out;
+        done += piece;
+    } while (done < runs.count);
 
-    // Perform file system check and log compaction
-//    PerformFsck(mapped_disk)
+    free(runs.extents);
+    return 0;
+}
 
-    // Unmap the memory-mapped disk
-//    unmap memory (mapped_disk)
+/**
+ * Copies the newest version of every live inode into a new log, rebuilding
+ * directories and files from their chains so each takes as few entries as
+ * possible. The new log fills segments from the start of the image.
+ *
+ * @param dangling Set to the number of directory entries dropped because they
+ *                 pointed at dead inodes.
+ * @return         0 on success, -1 on failure.
+ */
+static int compact_log(unsigned long *dangling) {
+    struct wfs_sb *sb = (struct wfs_sb*)out;
+    sb->magic = WFS_MAGIC;
+    sb->segment_size = WFS_SEGMENT_SIZE;
+    sb->segments = out_segments;
+    sb->checkpoint = WFS_NO_CHECKPOINT; // mount.wfs replays the compacted log once and checkpoints it
+    sb->version = WFS_VERSION;
+    sb->features = (packed ? WFS_FEATURE_COMPRESSION : 0) | (deduplicated ? WFS_FEATURE_DEDUP : 0);
+    out_segment = take_segment(WFS_FRAMED_SEGMENT_MAGIC);
+    out_head = segment_start(0);
+    *dangling = 0;
 
-//    return success
+    for (unsigned long number = 0; number < inode_count; number++) {
+        if (inodes[number].latest == 0) {
+            continue;
+        }
+        size_t length;
+        uint64_t *chain = read_chain(inodes[number].latest, &length);
+        if (chain == NULL) {
+            return -1;
+        }
 
+        struct entry_view newest;
+        read_entry(chain[0], &newest);
+        int ret;
+        if (S_ISDIR(newest.inode.mode)) {
+            ret = compact_dir(chain, length);
+            if (ret > 0) {
+                *dangling += ret;
+            }
+        } else {
+            ret = compact_file(chain, length);
+        }
+        free(chain);
+        if (ret < 0) {
+            return -1;
+        }
+    }
 
-// Function to perform file system check and log compaction
-//Function PerformFsck(mapped_disk)
-    // Initialize necessary variables and structures
-//    Initialize variables for traversal, inode tracking, etc.
+    seal_log();
+    sb->head = out_head;
+    return 0;
+}
 
-    // Iterate over the log entries in the disk
-//    For each log entry in mapped_disk
-        // Check for inconsistencies or errors in the log entry
-//        If log entry is inconsistent or erroneous
-//            Handle or report the inconsistency
+/**
+ * Writes the compacted log to a new image of the given size.
+ */
+static int write_image(const char *path, off_t size) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("Error opening output image");
+        return -1;
+    }
+    size_t bytes = (size_t)out_used * WFS_SEGMENT_SIZE;
+    if (ftruncate(fd, size) == -1 || pwrite(fd, out, bytes, 0) != (ssize_t)bytes) {
+        perror("Error writing output image");
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
 
-        // Check for redundancy
-//        If current log entry is redundant (e.g., older version of an inode)
-//            Mark for compaction or removal
+int main(int argc, char *argv[]) {
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: fsck.wfs disk_path [output_disk_path]\n"
+                        "Compacts the image; one in an older on-disk format is upgraded to format %d.\n", WFS_VERSION);
+        exit(-1);
+    }
+    const char *disk_path = argv[1];
+    const char *output_path = argc == 3 ? argv[2] : NULL;
 
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    // Compact the log by removing marked redundant entries
-//    CompactLog(mapped_disk)
+    int fd = open(disk_path, output_path ? O_RDONLY : O_RDWR);
+    if (fd == -1) {
+        perror("Error opening file");
+        exit(-1);
+    }
+    struct stat stat_info;
+    if (fstat(fd, &stat_info) == -1) {
+        perror("Error getting file size");
+        close(fd);
+        exit(-1);
+    }
+    if ((size_t)stat_info.st_size < sizeof(struct wfs_sb_v1)) {
+        fprintf(stderr, "Image is too small\n");
+        close(fd);
+        exit(-1);
+    }
+    disk = mmap(NULL, stat_info.st_size, output_path ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (disk == MAP_FAILED) {
+        perror("Error mapping file into memory");
+        exit(-1);
+    }
 
+    disk_size = stat_info.st_size;
+    int ret = find_log_ranges();
+    if (ret != 0) {
+        fprintf(stderr, ret == -2 ? "Image uses a newer on-disk format than this fsck.wfs understands\n"
+                                     : "Not a wfs image\n");
+        exit(-1);
+    }
 
+    unsigned long entries;
+    unsigned long log_bytes;
+    if (find_live_inodes(&entries, &log_bytes) == -1) {
+        exit(-1);
+    }
 
-// Function to compact the log
-//Function CompactLog(mapped_disk)
-    // Initialize variables for log compaction
-//    Initialize variables for new log, tracking, etc.
+    // Images from before segments are converted; they need room for at least one
+    out_segments = disk_size / WFS_SEGMENT_SIZE < WFS_MAX_SEGMENTS ? disk_size / WFS_SEGMENT_SIZE : WFS_MAX_SEGMENTS;
+    if (out_segments == 0) {
+        fprintf(stderr, "Image is too small to hold a segment\n");
+        exit(-1);
+    }
+    out = calloc(out_segments, WFS_SEGMENT_SIZE);
+    if (out == NULL) {
+        perror("Error allocating compacted log");
+        exit(-1);
+    }
+    unsigned long dangling;
+    if (compact_log(&dangling) == -1) {
+        fprintf(stderr, "Compaction failed; image left unchanged\n");
+        exit(-1);
+    }
 
-    // Iterate over the log entries
-//    For each log entry in mapped_disk
-        // If the entry is not marked for removal
-//        If log entry is not marked for compaction
-//            Copy entry to new log
+    if (output_path) {
+        if (write_image(output_path, stat_info.st_size) == -1) {
+            exit(-1);
+        }
+    } else {
+        // Everything we still need has been copied out, so overwrite in place
+        // and mark the segments past the new log free
+        memcpy(disk, out, (size_t)out_used * WFS_SEGMENT_SIZE);
+        for (uint32_t segment = out_used; segment < out_segments; segment++) {
+            memset(disk + (uint64_t)segment * WFS_SEGMENT_SIZE, 0, sizeof(struct wfs_segment));
+        }
+        if (msync(disk, stat_info.st_size, MS_SYNC) == -1) {
+            perror("Error syncing image");
+            exit(-1);
+        }
+    }
+    munmap(disk, stat_info.st_size);
 
+    unsigned long live = 0;
+    for (unsigned long number = 0; number < inode_count; number++) {
+        live += inodes[number].latest != 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    long before = log_bytes + data_bytes;
+    long after = out_bytes;
+    long reclaimed = before > after ? before - after : 0;
 
-    // Update the log head pointer to the new compacted log
-//    UpdateLogHead(mapped_disk)
+    if (in_format != WFS_VERSION) {
+        printf("Upgraded the image from format %d to format %d\n", in_format, WFS_VERSION);
+    }
+    printf("%lu entries, %lu live inodes\n", entries, live);
+    if (dangling) {
+        printf("Dropped %lu directory entries pointing at deleted inodes\n", dangling);
+    }
+    printf("Log %ld -> %ld bytes, %ld bytes reclaimed\n", before, after, reclaimed);
+    printf("Live/dead ratio %ld:%ld (%.1f%% live)\n", before - reclaimed, reclaimed,
+           before ? 100.0 * (before - reclaimed) / before : 100.0);
+    printf("Compacted in %.3f s\n", seconds);
 
+    free(out);
+    free(ranges);
+    free(inodes);
+    free(shared_runs);
+    return 0;
+}
@@ -0,0 +1,4936 @@
+#define _GNU_SOURCE // for mremap
+#include <errno.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <stdarg.h>
+#include "wfs.h"
+#include "libwfs.h"
+#include "crc32c.h"
+#include "lz4.h"
+#include "assert.h"
+
+#define SEGMENT_ROOM (WFS_SEGMENT_SIZE - sizeof(struct wfs_sb) - sizeof(struct wfs_segment)) // fits in any segment
+#define MAX_ENTRY_SIZE (SEGMENT_ROOM - sizeof(struct wfs_record)) // fits in any segment with its frame
+#define SEGMENT_NONE ((uint32_t)-1)
+#define MAX_RUN (MAX_ENTRY_SIZE - sizeof(struct wfs_data_run)) // file bytes in one run of a data segment
+#define MAP_EXTENTS 64                  // runs mapped in by one WFS_LOG_MAP entry
+#define CLEANER_RESERVE 3               // free segments only the cleaner may write to
+#define CHECKPOINT_SEGMENTS 16          // segments written after which the background thread checkpoints
+#define DCACHE_SIZE 4096                // number of cached lookups; must be a power of two
+#define DCACHE_NEGATIVE ((uint32_t)-1)  // cached child for a name known not to exist
+#define DCACHE_LOCKS 64                 // dentry cache slots are locked in this many stripes
+#define INODE_LOCKS 1024                // inodes are locked in this many stripes
+#define LATENCY_BUCKETS 32              // power-of-two latency buckets, from 1 ns up to about 4 s
+#define MAX_IMAGE_SEGMENTS WFS_MAX_SEGMENTS // segments an image may grow to
+#define GROW_UTILIZATION 0.75           // share of the image that is live before growing beats cleaning
+#define STALLED_ROUNDS 2                // rounds of cleaning that gain no room before make_room() grows the image or gives up
+#define DIR_BLOCK_ENTRIES 64            // dentries per block of an in-memory directory
+#define DCACHE_NAME_LEN 32              // names this long or longer are not cached
+#define MAX_FILE_SIZE ((uint64_t)INT64_MAX) // the largest offset an off_t can hold
+#define CHUNK_MIN (2 * 1024)            // bytes a chunk of file data holds at least, unless the write ends first
+#define CHUNK_MAX (32 * 1024)           // bytes a chunk holds at most
+#define CHUNK_MASK (0x1fffull << 51)    // bits of the rolling hash that end a chunk when all clear, about every 8 KiB
+#define CHUNK_TABLE_MIN 1024            // slots the chunk table starts with; must be a power of two
+#define CHUNK_EMPTY 0                   // location of a chunk table slot never used
+#define CHUNK_DELETED 1                 // location of a chunk table slot whose chunk was taken out
+
+/**
+ * One cached directory lookup: the child found under (parent, name), or
+ * DCACHE_NEGATIVE if the name does not exist in that directory.
+ */
+struct dcache_entry {
+    int valid;
+    uint32_t parent;
+    uint32_t child;
+    char name[DCACHE_NAME_LEN];
+};
+
+/**
+ * An entry of an in-memory directory.
+ */
+struct dir_entry {
+    uint32_t inode_number;
+    char *name; // null-terminated, and freed with the entry
+};
+
+/**
+ * A run of a directory's entries, in the directory's order.
+ */
+struct dir_block {
+    size_t count;
+    uint64_t cookies[DIR_BLOCK_ENTRIES]; // dentry_cookie() of each name
+    struct dir_entry entries[DIR_BLOCK_ENTRIES];
+};
+
+/**
+ * Entries of a directory, rebuilt from its chain of log entries. They are
+ * kept in order of their readdir cookies, a hash of the name, then of name,
+ * in blocks that split when full and go away when empty. Finding a name is
+ * a binary search over the blocks and then within one, and a listing can
+ * pick up again at any cookie however the directory changed in between.
+ */
+struct wfs_dir {
+    struct dir_block **blocks;
+    size_t block_count;
+    size_t block_capacity;
+    size_t count;        // entries in all blocks
+    uint64_t bytes;      // what the entries take packed as wfs_dentries, which is the directory's size
+    unsigned int deltas; // delta entries written since the directory was last written in full
+};
+
+/**
+ * Extent map of a file, rebuilt from its chain of log entries.
+ */
+struct wfs_file {
+    struct wfs_extent *extents;
+    size_t count;
+    size_t capacity;
+    unsigned int deltas; // data entries written since the extent map was last written in full
+};
+
+/**
+ * In-memory state of one inode number.
+ */
+struct inode_map_entry {
+    uint64_t offset;       // latest log entry of the inode, 0 if the inode does not exist
+    uint64_t tombstone;    // WFS_LOG_TOMBSTONE entry of a deleted inode, while older entries may be left; 0 otherwise
+    uint32_t generation;   // times the inode number was freed since the image was opened
+    uint32_t holds;        // libwfs_hold() calls not yet undone; a removed inode's number is not reused while held
+    struct wfs_dir *dir;   // entries of a directory, built on first use
+    struct wfs_file *file; // extent map of a file, built on first use
+};
+
+/**
+ * The chunks of a data segment, sorted by location, and files other than
+ * the ones their runs were written to that may map some of them in.
+ */
+struct segment_chunks {
+    struct wfs_chunk *chunks;
+    uint32_t count;
+    uint32_t capacity;
+    int hidden;              // set while the chunks are out of the chunk table, so nothing new maps them
+    uint32_t *sharers;       // inode numbers, some of which may no longer map anything here
+    uint32_t sharer_count;
+    uint32_t sharer_capacity;
+};
+
+/**
+ * A slot of the chunk table, which finds the runs holding given bytes.
+ */
+struct chunk_slot {
+    uint32_t crc;      // CRC-32C of the run's bytes
+    uint32_t length;   // bytes in the run
+    uint64_t location; // the run's, CHUNK_EMPTY or CHUNK_DELETED
+};
+
+/**
+ * A packed run decompressed as far as a read has needed it, kept while the
+ * read goes on so the next extent into the same run need not start over.
+ */
+struct unpacked_run {
+    uint64_t location; // the location of the run's bytes, 0 if none are held
+    uint32_t length;   // bytes of it decompressed
+    char bytes[WFS_PACKED_RUN_SIZE];
+};
+
+static const char *disk_path;
+static void *mapped_disk; // starting of the superblock
+static int currFd; // file descriptor of the image, kept open so it can grow
+static _Atomic uint64_t log_tail; // active segment in the high half, where the next entry goes within it in the low half
+static _Atomic uint64_t data_tail = (uint64_t)SEGMENT_NONE << 32 | WFS_SEGMENT_SIZE; // the same for the data segment being filled
+static _Atomic int inode_number;  // highest inode number handed out
+static uint32_t *free_inodes;     // stack of inode numbers up to inode_number free for reuse
+static uint32_t free_inode_count; // entries in free_inodes
+static uint32_t free_inode_capacity; // slots allocated in free_inodes
+static size_t length; // bytes of the image mapped
+static struct inode_map_entry *inode_map; // indexed by inode number
+static unsigned long inode_map_size;      // number of slots allocated in inode_map
+static struct dcache_entry dcache[DCACHE_SIZE]; // direct-mapped (parent inode, name) -> child inode cache
+
+static uint32_t segment_count;    // segments in the image
+static uint64_t last_sequence;    // sequence number of the active segment
+static _Atomic long *segment_live; // bytes in each segment still needed by some inode
+static uint64_t *segment_sequence; // sequence number of each segment holding log entries, 0 otherwise
+static uint32_t *free_segments;   // stack of free segment numbers
+static uint32_t free_count;       // entries in free_segments
+static uint32_t *pending_segments; // segments cleaned since the last checkpoint, which may still need them
+static uint32_t pending_count;    // entries in pending_segments
+static uint32_t *checkpoint_segments; // segments holding the newest checkpoint
+static uint32_t checkpoint_count; // entries in checkpoint_segments
+static uint32_t segments_since_checkpoint; // segments opened since the newest checkpoint
+static int cleaning;              // set while the cleaner is relocating; lets it use the reserve
+static int log_torn;              // set when mounting cut the log short at a record that did not check out
+static int compress_data;         // set if the image has WFS_FEATURE_COMPRESSION, so new file data goes to packed runs
+static int dedup_data;            // set if the image has WFS_FEATURE_DEDUP, so new file data is cut into chunks
+static uint64_t chunk_gear[256];  // what each byte adds to the rolling hash that cuts chunks
+static struct segment_chunks *segment_chunks; // chunks of each segment
+static _Atomic size_t chunk_count; // chunks in all segments
+static struct chunk_slot *chunk_table; // open addressing by CRC and length, over the chunks not hidden
+static size_t chunk_table_size;   // slots in chunk_table, a power of two
+static size_t chunk_table_used;   // slots not empty, deleted ones included
+static _Atomic size_t reserved_bytes; // log room promised to operations still running
+
+/*
+ * Locking. Every operation holds fs_lock shared; whatever may move or drop
+ * any inode (the cleaner, checkpoints, unlink, growing the inode map) holds
+ * it exclusively. Under the shared lock, an inode's slot in the inode map
+ * and its in-memory entries or extents are guarded by its stripe of
+ * inode_locks, and a thread holds at most one of those at a time. Appends
+ * claim their place in the log with a fetch-add on log_tail, or on data_tail
+ * for file data; log_lock is only taken to open a new segment or to promise
+ * log room. Inode numbers are handed out and given back under
+ * inode_alloc_lock. The chunk index, the chunks' references and the sharers
+ * are guarded by chunk_lock, and nothing else is locked while it is held.
+ */
+static pthread_rwlock_t fs_lock;
+static pthread_rwlock_t inode_locks[INODE_LOCKS];
+static pthread_mutex_t dcache_locks[DCACHE_LOCKS];
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t inode_alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local int thread_exclusive;       // set while this thread holds fs_lock exclusively
+static _Thread_local size_t thread_reserved;     // the part of reserved_bytes promised to this thread
+static _Thread_local size_t thread_shortfall;    // log room the last failed reserve_log() asked for
+static _Thread_local unsigned long thread_map_needed; // inode number the inode map has to grow to hold
+
+static pthread_mutex_t cleaner_lock = PTHREAD_MUTEX_INITIALIZER; // guards cleaner_stop
+static pthread_cond_t cleaner_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_t cleaner_thread;
+static int cleaner_running;
+static int cleaner_stop;
+
+/*
+ * Commits. A commit makes the log and the file data appended so far durable
+ * without writing a checkpoint: it flushes what was appended since the last
+ * commit or checkpoint, then the headers of the segments it went to, which
+ * say how far each is filled, and only then the superblock. Under strict
+ * durability, each fsync takes a ticket and waits for a commit that started
+ * after it; those that come in while one runs are all served by the next.
+ */
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER; // guards the tickets and commit_stop
+static pthread_cond_t commit_wakeup = PTHREAD_COND_INITIALIZER; // wakes the commit thread
+static pthread_cond_t commit_done = PTHREAD_COND_INITIALIZER;   // wakes fsyncs once a commit finishes
+static pthread_t commit_thread;
+static int commit_running;
+static int commit_stop;
+static uint64_t commit_requested; // tickets handed out
+static uint64_t commit_finished;  // tickets served by finished commits
+static int commit_error;          // what the newest commit returned
+static uint64_t committed_sequence; // newest segment opened before the last commit or checkpoint
+static uint64_t committed_log;      // end of the log as of the last commit or checkpoint
+static uint64_t committed_data;     // end of the file data then, or 0 if there was no data segment
+
+static struct wfs_options options = LIBWFS_DEFAULT_OPTIONS; // those of the open image
+
+/*
+ * Statistics. Every counter is bumped with a relaxed atomic add and read
+ * without a lock, so the numbers in one report need not quite agree.
+ */
+enum wfs_op { OP_RESOLVE, OP_LOOKUP, OP_GETATTR, OP_CREATE, OP_READ, OP_WRITE, OP_READDIR, OP_UNLINK, OP_SYNC, OP_FSYNC, OP_COUNT };
+static const char *op_names[OP_COUNT] = { "resolve", "lookup", "getattr", "create", "read", "write", "readdir", "unlink", "sync", "fsync" };
+
+/**
+ * Counters of one kind of operation. Bucket i counts the calls that took
+ * from 2^i up to 2^(i+1) nanoseconds.
+ */
+struct op_stats {
+    _Atomic unsigned long calls;
+    _Atomic unsigned long errors;
+    _Atomic unsigned long nanoseconds;
+    _Atomic unsigned long buckets[LATENCY_BUCKETS];
+};
+static struct op_stats op_stats[OP_COUNT];
+static _Atomic unsigned long log_bytes;        // bytes of log entries and data runs appended
+static _Atomic unsigned long data_bytes;       // the part of log_bytes that went to data segments
+static _Atomic unsigned long cleaner_bytes;    // the part of log_bytes the cleaner moved
+static _Atomic unsigned long packed_bytes;     // file bytes written to packed runs
+static _Atomic unsigned long packed_stored;    // what they took there once compressed
+static _Atomic unsigned long chunks_written;   // chunks written to runs of their own
+static _Atomic unsigned long chunks_shared;    // chunks mapped to runs that already held their bytes
+static _Atomic unsigned long shared_bytes;     // the bytes of those, which were not written again
+static _Atomic unsigned long chunk_nanoseconds; // time spent cutting chunks and looking them up
+static _Atomic unsigned long checkpoint_bytes; // bytes of checkpoints written
+static _Atomic unsigned long checkpoints;      // checkpoints written
+static _Atomic unsigned long commits;          // commits run
+static _Atomic unsigned long commit_bytes;     // bytes commits flushed
+static _Atomic unsigned long segments_cleaned;
+static _Atomic unsigned long images_grown;     // times the image has grown
+static _Atomic unsigned long dcache_hits;
+static _Atomic unsigned long dcache_misses;
+
+static const char zero_block[WFS_SEGMENT_SIZE]; // what holes in files read as, for map_file()
+
+static struct wfs_log_entry *find_last_matching_inode(unsigned long inode_number);
+static int clean_segment(uint32_t segment);
+static uint32_t pick_victim();
+static int write_checkpoint();
+static void free_dir(struct wfs_dir *dir);
+static void account_tombstone(unsigned long inode_number, int sign);
+static uint64_t op_clock();
+
+/**
+ * Hashes a (parent inode, name) pair to its slot in the dentry cache.
+ *
+ * @param parent The inode number of the directory.
+ * @param name   The name to look up; need not be null-terminated.
+ * @param len    The length of the name.
+ * @return       A pointer to the cache slot for the pair.
+ */
+static struct dcache_entry *dcache_slot(uint32_t parent, const char *name, size_t len) {
+    uint32_t hash = 2166136261u ^ parent; // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return &dcache[hash & (DCACHE_SIZE - 1)];
+}
+
+/**
+ * Returns the lock guarding a slot of the dentry cache.
+ */
+static pthread_mutex_t *dcache_lock(const struct dcache_entry *slot) {
+    return &dcache_locks[(slot - dcache) % DCACHE_LOCKS];
+}
+
+/**
+ * Looks up a (parent inode, name) pair in the dentry cache.
+ *
+ * @param parent The inode number of the directory.
+ * @param name   The name to look up; need not be null-terminated.
+ * @param len    The length of the name; names of DCACHE_NAME_LEN or more always miss.
+ * @param child  Set to the cached child inode number, or DCACHE_NEGATIVE, on a hit.
+ * @return       1 on a hit, 0 on a miss.
+ */
+static int dcache_lookup(uint32_t parent, const char *name, size_t len, uint32_t *child) {
+    if (len >= DCACHE_NAME_LEN) {
+        atomic_fetch_add_explicit(&dcache_misses, 1, memory_order_relaxed);
+        return 0;
+    }
+    struct dcache_entry *slot = dcache_slot(parent, name, len);
+    pthread_mutex_lock(dcache_lock(slot));
+    int hit = slot->valid && slot->parent == parent && strncmp(slot->name, name, len) == 0 && slot->name[len] == '\0';
+    if (hit) {
+        *child = slot->child;
+    }
+    pthread_mutex_unlock(dcache_lock(slot));
+    atomic_fetch_add_explicit(hit ? &dcache_hits : &dcache_misses, 1, memory_order_relaxed);
+    return hit;
+}
+
+/**
+ * Caches the result of a lookup, evicting whatever shared its slot.
+ * Operations that change a directory also use this to overwrite a stale result.
+ * The caller holds the parent's lock, so a lookup that raced with a change of
+ * the directory cannot cache a result from before it.
+ *
+ * @param parent The inode number of the directory.
+ * @param name   The name; need not be null-terminated.
+ * @param len    The length of the name; names of DCACHE_NAME_LEN or more are not cached.
+ * @param child  The child inode number, or DCACHE_NEGATIVE if the name does not exist.
+ */
+static void dcache_insert(uint32_t parent, const char *name, size_t len, uint32_t child) {
+    if (len >= DCACHE_NAME_LEN) {
+        return; // Long names are rare; caching them would make every slot that much bigger
+    }
+    struct dcache_entry *slot = dcache_slot(parent, name, len);
+    pthread_mutex_lock(dcache_lock(slot));
+    slot->valid = 1;
+    slot->parent = parent;
+    slot->child = child;
+    memcpy(slot->name, name, len);
+    slot->name[len] = '\0';
+    pthread_mutex_unlock(dcache_lock(slot));
+}
+
+/**
+ * Returns the in-memory state of an inode number, growing the inode map if
+ * the number does not fit yet. Growing moves the map, so only a thread that
+ * holds fs_lock exclusively, or runs before FUSE starts, may ask for a number
+ * that does not fit.
+ *
+ * @param inode_number The inode number to look up.
+ * @return             A pointer to the inode's slot in the inode map.
+ */
+static struct inode_map_entry *inode_map_slot(unsigned long inode_number) {
+    if (inode_number >= inode_map_size) {
+        unsigned long new_size = inode_map_size ? inode_map_size : 64;
+        while (new_size <= inode_number) {
+            new_size *= 2;
+        }
+        struct inode_map_entry *new_map = realloc(inode_map, new_size * sizeof(struct inode_map_entry));
+        if (new_map == NULL) {
+            printf("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        memset(new_map + inode_map_size, 0, (new_size - inode_map_size) * sizeof(struct inode_map_entry));
+        inode_map = new_map;
+        inode_map_size = new_size;
+    }
+    return &inode_map[inode_number];
+}
+
+/**
+ * Returns the lock guarding an inode's slot in the inode map and its
+ * in-memory entries or extents. Inode numbers share locks in stripes.
+ */
+static pthread_rwlock_t *inode_lock(unsigned long inode_number) {
+    return &inode_locks[inode_number % INODE_LOCKS];
+}
+
+/**
+ * Records the given offset as the latest log entry for an inode number.
+ *
+ * @param inode_number The inode number to update.
+ * @param offset       Offset of the log entry from the start of the disk, or 0 to drop the inode.
+ */
+static void inode_map_set(unsigned long inode_number, uint64_t offset) {
+    struct inode_map_entry *slot = inode_map_slot(inode_number);
+    slot->offset = offset;
+    if (offset == 0 && slot->dir != NULL) {
+        free_dir(slot->dir);
+        slot->dir = NULL;
+    }
+    if (offset == 0 && slot->file != NULL) {
+        free(slot->file->extents);
+        free(slot->file);
+        slot->file = NULL;
+    }
+}
+
+/**
+ * Returns the header of a segment.
+ *
+ * @param segment The segment number.
+ * @return        A pointer to the segment's header, which in segment 0 follows the superblock.
+ */
+static struct wfs_segment *segment_header(uint32_t segment) {
+    uint64_t offset = (uint64_t)segment * WFS_SEGMENT_SIZE + (segment == 0 ? sizeof(struct wfs_sb) : 0);
+    return (struct wfs_segment*)((char*)mapped_disk + offset);
+}
+
+/**
+ * Returns the offset of the first log entry of a segment.
+ */
+static uint64_t segment_first_entry(uint32_t segment) {
+    return (char*)segment_header(segment) + sizeof(struct wfs_segment) - (char*)mapped_disk;
+}
+
+/**
+ * Returns the segment number an offset falls into.
+ */
+static uint32_t segment_of(uint64_t offset) {
+    return offset / WFS_SEGMENT_SIZE;
+}
+
+/**
+ * Returns whether a segment holds log entries.
+ */
+static int is_log_segment(uint32_t segment) {
+    return segment_header(segment)->magic == WFS_FRAMED_SEGMENT_MAGIC;
+}
+
+/**
+ * Returns whether a segment holds file data.
+ */
+static int is_data_segment(uint32_t segment) {
+    uint32_t magic = segment_header(segment)->magic;
+    return magic == WFS_FRAMED_DATA_MAGIC || magic == WFS_PACKED_DATA_MAGIC;
+}
+
+/**
+ * Returns whether a segment holds file data in packed runs.
+ */
+static int is_packed_segment(uint32_t segment) {
+    return segment_header(segment)->magic == WFS_PACKED_DATA_MAGIC;
+}
+
+/**
+ * Returns the header of the packed run an extent in a packed data segment
+ * maps part of.
+ *
+ * @param location The extent's location, which is that of the run's bytes.
+ */
+static const struct wfs_packed_run *packed_run(uint64_t location) {
+    return (const struct wfs_packed_run*)((char*)mapped_disk + location) - 1;
+}
+
+/**
+ * Returns the most file bytes a new run holds. Packed runs hold fewer, so
+ * reading a few bytes never has to decompress many.
+ */
+static uint32_t run_limit() {
+    return compress_data ? WFS_PACKED_RUN_SIZE : MAX_RUN;
+}
+
+/**
+ * Returns how many bytes of its segment part of an extent keeps live: the
+ * bytes themselves, or in a packed run, their share of the bytes stored.
+ * Shares are rounded so that those of the parts of a range add up to the
+ * share of the whole, however the range is split.
+ *
+ * @param extent The extent.
+ * @param from   The file offset the part starts at.
+ * @param to     The file offset the part ends at.
+ * @return       The number of bytes.
+ */
+static long extent_live(const struct wfs_extent *extent, uint64_t from, uint64_t to) {
+    if (!is_packed_segment(segment_of(extent->location))) {
+        return to - from;
+    }
+    const struct wfs_packed_run *run = packed_run(extent->location);
+    return (to - run->offset) * run->length / run->size - (from - run->offset) * run->length / run->size;
+}
+
+/**
+ * Returns the number of bytes of data that follow a log entry's inode, which
+ * the entry's frame keeps track of.
+ */
+static uint32_t entry_data_size(const struct wfs_log_entry *entry) {
+    return ((const struct wfs_record*)entry - 1)->length - sizeof(struct wfs_inode);
+}
+
+/**
+ * Computes the CRC of a record. The deleted field of a log entry is set in
+ * place long after the entry is written, so it is taken as 0.
+ *
+ * @param sequence The sequence number of the segment holding the record.
+ * @param record   The record's frame, with type and length set; its bytes follow it.
+ * @return         The value for record->crc.
+ */
+static uint32_t record_crc(uint64_t sequence, const struct wfs_record *record) {
+    uint32_t crc = crc32c(0, &sequence, sizeof(sequence));
+    crc = crc32c(crc, record, offsetof(struct wfs_record, crc));
+    const char *bytes = (const char*)(record + 1);
+    if (record->type == WFS_RECORD_ENTRY && record->length >= sizeof(struct wfs_inode)) {
+        struct wfs_inode inode = *(const struct wfs_inode*)bytes;
+        inode.deleted = 0;
+        crc = crc32c(crc, &inode, sizeof(inode));
+        return crc32c(crc, bytes + sizeof(inode), record->length - sizeof(inode));
+    }
+    return crc32c(crc, bytes, record->length);
+}
+
+/**
+ * Frames a record written at some offset: fills in the wfs_record in front
+ * of its bytes, which have to be in place already.
+ *
+ * @param offset The offset of the frame from the start of the disk.
+ * @param type   One of WFS_RECORD_*.
+ * @param length The bytes of the record after the frame.
+ */
+static void seal_record(uint64_t offset, uint32_t type, uint32_t length) {
+    struct wfs_record *record = (struct wfs_record*)((char*)mapped_disk + offset);
+    record->type = type;
+    record->length = length;
+    record->crc = record_crc(segment_header(segment_of(offset))->sequence, record);
+}
+
+/**
+ * Checks a record: its frame has the expected type, its length fits before
+ * end and leaves room for the header inside it, agreeing with it for a run,
+ * and its CRC matches. A packed run also has to name a known codec and a
+ * size it may have.
+ *
+ * @param offset The offset of the frame from the start of the disk.
+ * @param end    The end of the segment's used bytes.
+ * @param type   One of WFS_RECORD_*.
+ * @return       1 if the record checks out, 0 otherwise.
+ */
+static int record_valid(uint64_t offset, uint64_t end, uint32_t type) {
+    if (offset >= end || end - offset < sizeof(struct wfs_record)) {
+        return 0;
+    }
+    const struct wfs_record *record = (const struct wfs_record*)((char*)mapped_disk + offset);
+    if (record->type != type || record->length > end - offset - sizeof(struct wfs_record)) {
+        return 0;
+    }
+    if (type == WFS_RECORD_ENTRY) {
+        if (record->length < sizeof(struct wfs_inode)) {
+            return 0;
+        }
+    } else if (type == WFS_RECORD_RUN) {
+        const struct wfs_data_run *run = (const struct wfs_data_run*)(record + 1);
+        if (record->length < sizeof(struct wfs_data_run) || run->length != record->length - sizeof(struct wfs_data_run)) {
+            return 0;
+        }
+    } else {
+        const struct wfs_packed_run *run = (const struct wfs_packed_run*)(record + 1);
+        if (record->length < sizeof(struct wfs_packed_run) || run->length != record->length - sizeof(struct wfs_packed_run) ||
+            run->size == 0 || run->size > WFS_PACKED_RUN_SIZE ||
+            (run->codec != WFS_CODEC_LZ4 && (run->codec != WFS_CODEC_NONE || run->length != run->size))) {
+            return 0;
+        }
+    }
+    return record->crc == record_crc(segment_header(segment_of(offset))->sequence, record);
+}
+
+/**
+ * Returns the segment the log is being appended to.
+ */
+static uint32_t log_segment() {
+    return log_tail >> 32;
+}
+
+/**
+ * Returns the data segment file bytes are being appended to, or SEGMENT_NONE.
+ */
+static uint32_t data_segment() {
+    return data_tail >> 32;
+}
+
+/**
+ * Returns the room left in the segment a tail points into, which is none
+ * once appends have run past its end.
+ */
+static size_t tail_room(uint64_t tail) {
+    uint32_t used = (uint32_t)tail;
+    return (tail >> 32) != SEGMENT_NONE && used < WFS_SEGMENT_SIZE ? WFS_SEGMENT_SIZE - used : 0;
+}
+
+/**
+ * Returns the offset the next log entry goes to, which is the end of the
+ * active segment once appends have run past it.
+ */
+static uint64_t log_head() {
+    return (uint64_t)(log_segment() + 1) * WFS_SEGMENT_SIZE - tail_room(log_tail);
+}
+
+/**
+ * Moves the head of the log.
+ *
+ * @param segment The segment to append to from now on.
+ * @param head    The offset the next log entry goes to, within that segment or right at its end.
+ */
+static void set_log_head(uint32_t segment, uint64_t head) {
+    log_tail = (uint64_t)segment << 32 | (head - (uint64_t)segment * WFS_SEGMENT_SIZE);
+
+}
+
+/**
+ * Moves the head of the file data to where a data segment's header says it
+ * ends, or to no segment at all, so that the next run opens one.
+ *
+ * @param segment The data segment to append to from now on, or SEGMENT_NONE.
+ */
+static void set_data_head(uint32_t segment) {
+    data_tail = (uint64_t)segment << 32 | (segment == SEGMENT_NONE ? WFS_SEGMENT_SIZE : segment_header(segment)->used);
+}
+
+/**
+ * Extends the part of a segment its header marks as used. Appends finish
+ * out of order, so this only ever moves the mark forward.
+ *
+ * @param segment The segment number.
+ * @param used    The end of an entry just written, from the start of the segment.
+ */
+static void mark_used(uint32_t segment, uint32_t used) {
+    uint32_t *mark = &segment_header(segment)->used;
+    uint32_t seen = __atomic_load_n(mark, __ATOMIC_RELAXED);
+    while (seen < used && !__atomic_compare_exchange_n(mark, &seen, used, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+}
+
+/**
+ * Orders segment numbers by the sequence number in their headers.
+ */
+static int compare_segments(const void *a, const void *b) {
+    uint64_t sequence_a = segment_header(*(const uint32_t*)a)->sequence;
+    uint64_t sequence_b = segment_header(*(const uint32_t*)b)->sequence;
+    return (sequence_a > sequence_b) - (sequence_a < sequence_b);
+}
+
+/**
+ * Returns the bytes of a log entry that stay live for as long as the entry is
+ * part of its inode's chain.
+ *
+ * @param entry The log entry, in place in its frame.
+ * @return      The number of bytes.
+ */
+static uint32_t entry_chain_bytes(const struct wfs_log_entry *entry) {
+    return sizeof(struct wfs_inode) + entry_data_size(entry);
+}
+
+/**
+ * Sets up the locks. fs_lock prefers writers, so the cleaner and unlink are
+ * not starved by a steady stream of reads.
+ */
+static void init_locks() {
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&fs_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    for (int i = 0; i < INODE_LOCKS; i++) {
+        pthread_rwlock_init(&inode_locks[i], NULL);
+    }
+    for (int i = 0; i < DCACHE_LOCKS; i++) {
+        pthread_mutex_init(&dcache_locks[i], NULL);
+    }
+}
+
+/**
+ * Resizes the per-segment tables for an image with more segments. Entries
+ * for the new segments start out empty.
+ *
+ * @param old_count The segments the tables hold now, 0 if not yet allocated.
+ * @param new_count The segments they have to hold.
+ * @return          0 on success, or -ENOMEM. Tables already resized stay so.
+ */
+static int resize_segment_tables(uint32_t old_count, uint32_t new_count) {
+    uint32_t **stacks[] = { &free_segments, &pending_segments, &checkpoint_segments };
+    for (size_t i = 0; i < sizeof(stacks) / sizeof(stacks[0]); i++) {
+        uint32_t *stack = realloc(*stacks[i], new_count * sizeof(uint32_t));
+        if (stack == NULL) {
+            return -ENOMEM;
+        }
+        *stacks[i] = stack;
+    }
+    _Atomic long *live = realloc((void*)segment_live, new_count * sizeof(long));
+    if (live == NULL) {
+        return -ENOMEM;
+    }
+    segment_live = live;
+    uint64_t *sequence = realloc(segment_sequence, new_count * sizeof(uint64_t));
+    if (sequence == NULL) {
+        return -ENOMEM;
+    }
+    segment_sequence = sequence;
+    struct segment_chunks *chunks = realloc(segment_chunks, new_count * sizeof(struct segment_chunks));
+    if (chunks == NULL) {
+        return -ENOMEM;
+    }
+    segment_chunks = chunks;
+    for (uint32_t segment = old_count; segment < new_count; segment++) {
+        segment_live[segment] = 0;
+        segment_sequence[segment] = 0;
+        segment_chunks[segment] = (struct segment_chunks){ 0 };
+    }
+    return 0;
+}
+
+/**
+ * Allocates the per-segment tables, which hold every segment at most once.
+ */
+static void alloc_segment_tables() {
+    if (resize_segment_tables(0, segment_count) != 0) {
+        printf("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Returns whether a log record comes after the end of the log as of the
+ * newest commit or checkpoint, in which case a crash may have left the runs
+ * it maps in only partly on disk.
+ *
+ * @param segment The log segment holding the record.
+ * @param offset  The offset of the record from the start of the disk.
+ */
+static int after_commit(uint32_t segment, uint64_t offset) {
+    uint64_t head = ((struct wfs_sb*)mapped_disk)->head;
+    uint32_t committed = segment_of(head - 1); // head may sit right at the end of its segment
+    if (head == 0 || committed >= segment_count || !is_log_segment(committed)) {
+        return 1;
+    }
+    uint64_t sequence = segment_header(segment)->sequence;
+    uint64_t committed_sequence = segment_header(committed)->sequence;
+    return sequence > committed_sequence || (sequence == committed_sequence && offset >= head);
+}
+
+/**
+ * Checks the runs a WFS_LOG_MAP entry maps in: each has to be a whole run
+ * in a data segment in use, and check out. The extent of a packed run has
+ * to lie within the bytes written to it. Those that check out are marked
+ * used in their segment, whose header may have missed the flush.
+ *
+ * @param entry The entry, in place in its frame.
+ * @return      1 if every run checks out, 0 otherwise.
+ */
+static int map_runs_valid(const struct wfs_log_entry *entry) {
+    if (entry_data_size(entry) < sizeof(struct wfs_delta)) {
+        return 0;
+    }
+    const struct wfs_extent *extents = (const struct wfs_extent*)(entry->data + sizeof(struct wfs_delta));
+    size_t count = (entry_data_size(entry) - sizeof(struct wfs_delta)) / sizeof(struct wfs_extent);
+    for (size_t i = 0; i < count; i++) {
+        uint32_t segment = segment_of(extents[i].location);
+        if (segment >= segment_count || segment_sequence[segment] == 0 || !is_data_segment(segment)) {
+            return 0;
+        }
+        uint32_t frame = sizeof(struct wfs_record);
+        if (is_packed_segment(segment)) {
+            uint64_t start = extents[i].location - sizeof(struct wfs_packed_run) - frame;
+            const struct wfs_packed_run *run = packed_run(extents[i].location);
+            if (extents[i].location < segment_first_entry(segment) + frame + sizeof(struct wfs_packed_run) ||
+                !record_valid(start, (uint64_t)(segment + 1) * WFS_SEGMENT_SIZE, WFS_RECORD_PACKED_RUN) ||
+                extents[i].offset < run->offset || extents[i].offset - run->offset > run->size ||
+                extents[i].length > run->size - (extents[i].offset - run->offset)) {
+                return 0;
+            }
+            mark_used(segment, extents[i].location % WFS_SEGMENT_SIZE + run->length);
+            continue;
+        }
+        uint64_t start = extents[i].location - sizeof(struct wfs_data_run) - frame;
+        const struct wfs_data_run *run = (const struct wfs_data_run*)((char*)mapped_disk + start + frame);
+        if (extents[i].location < segment_first_entry(segment) + frame + sizeof(struct wfs_data_run) ||
+            !record_valid(start, (uint64_t)(segment + 1) * WFS_SEGMENT_SIZE, WFS_RECORD_RUN) || extents[i].length > run->length) {
+            return 0;
+        }
+        mark_used(segment, extents[i].location % WFS_SEGMENT_SIZE + run->length);
+    }
+    return 1;
+}
+
+/**
+ * Finds where the log entries of a segment end, and cuts the log short there
+ * if a crash tore it.
+ *
+ * Records are followed for as long as they check out, up to the end of the
+ * segment rather than to where its header says it is used, as the header may
+ * have missed the last commit's flush. The log is torn if a record after the
+ * last one that checks out does, or if the header claims more: a record only
+ * partly on disk, bytes claimed by an append that never finished, or a
+ * WFS_LOG_MAP entry past the last commit whose runs did not all make it. The
+ * rest of the segment is then zeroed, so records left beyond the cut can
+ * never line up with new ones and pass for part of the log again.
+ *
+ * @param segment The log segment.
+ * @param start   The offset of the first record to look at.
+ * @return        The offset just past the last record that checks out.
+ */
+static uint64_t recover_segment(uint32_t segment, uint64_t start) {
+    struct wfs_segment *header = segment_header(segment);
+    uint64_t base = (uint64_t)segment * WFS_SEGMENT_SIZE;
+    uint64_t used_end = base + header->used;
+    uint64_t segment_end = base + WFS_SEGMENT_SIZE;
+    uint64_t end = start;
+    int torn = 0;
+    while (!torn && end < segment_end && record_valid(end, segment_end, WFS_RECORD_ENTRY)) {
+        struct wfs_log_entry *entry = (struct wfs_log_entry*)((char*)mapped_disk + end + sizeof(struct wfs_record));
+        if (!S_ISDIR(entry->inode.mode) && entry->inode.flags == WFS_LOG_MAP &&
+            after_commit(segment, end) && !map_runs_valid(entry)) {
+            torn = 1;
+        } else {
+            end += sizeof(struct wfs_record) + sizeof(struct wfs_inode) + entry_data_size(entry);
+        }
+    }
+
+    torn = torn || end < used_end;
+    for (uint64_t offset = end + 1; !torn && offset < segment_end; offset++) {
+        torn = record_valid(offset, segment_end, WFS_RECORD_ENTRY);
+    }
+    if (torn) {
+        printf("Error: the log is torn at offset %lu; dropping the rest of it\n", (unsigned long)end);
+        memset((char*)mapped_disk + end, 0, segment_end - end);
+        log_torn = 1;
+    }
+    if (header->used != end - base) {
+        header->used = end - base;
+    }
+    return end;
+}
+
+/**
+ * Frees a log segment written after the log was torn. Its sequence number
+ * is never handed out again, so its records cannot check out once it is
+ * reused.
+ *
+ * @param segment The log segment.
+ */
+static void drop_log_segment(uint32_t segment) {
+    struct wfs_segment *header = segment_header(segment);
+    printf("Error: dropping log segment %u, written after the log was torn\n", segment);
+    header->magic = 0;
+    header->used = 0;
+    header->sequence = 0;
+    segment_sequence[segment] = 0;
+    free_segments[free_count++] = segment;
+}
+
+/**
+ * Builds the inode map and the list of free segments with a single pass over the log.
+ *
+ * The log segments in use are replayed in sequence order. Later entries
+ * overwrite earlier ones, so each slot ends up pointing at the newest record
+ * of that inode. A tombstone drops the inode, as do entries marked deleted
+ * in place by older builds. Data segments are
+ * only noted as in use; nothing in them needs replaying. The log ends at the
+ * first record that does not check out, and later log segments are dropped.
+ * This is only needed when the image has no usable checkpoint.
+ *
+ * @return 0 on success, or -1 if the image has no log to replay.
+ */
+static int build_inode_map() {
+    uint32_t *in_use = malloc(segment_count * sizeof(uint32_t));
+    if (in_use == NULL) {
+        printf("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // Free segments are pushed highest first so the lowest are reused first
+    uint32_t used_count = 0;
+    for (uint32_t segment = segment_count; segment-- > 0;) {
+        if (is_log_segment(segment) || is_data_segment(segment)) {
+            in_use[used_count++] = segment;
+            segment_sequence[segment] = segment_header(segment)->sequence;
+        } else {
+            free_segments[free_count++] = segment;
+        }
+    }
+    qsort(in_use, used_count, sizeof(uint32_t), compare_segments);
+    if (used_count > 0) {
+        last_sequence = segment_sequence[in_use[used_count - 1]]; // Segments dropped below included
+    }
+
+    uint32_t active = SEGMENT_NONE;
+    uint32_t active_data = SEGMENT_NONE;
+    for (uint32_t i = 0; i < used_count; i++) {
+        uint32_t segment = in_use[i];
+        if (is_data_segment(segment)) {
+            active_data = segment;
+            continue;
+        }
+        if (log_torn) {
+            drop_log_segment(segment);
+            continue;
+        }
+        active = segment;
+        uint32_t frame = sizeof(struct wfs_record);
+        uint64_t offset = segment_first_entry(segment);
+        uint64_t end = recover_segment(segment, offset);
+
+        while (offset < end) {
+            struct wfs_log_entry *curr_log_entry = (struct wfs_log_entry*)((char*)mapped_disk + offset + frame);
+            inode_map_set(curr_log_entry->inode.inode_number, curr_log_entry->inode.deleted ? 0 : offset + frame);
+            inode_map[curr_log_entry->inode.inode_number].tombstone =
+                curr_log_entry->inode.flags == WFS_LOG_TOMBSTONE ? offset + frame : 0;
+            if ((int)curr_log_entry->inode.inode_number > inode_number) {
+                inode_number = curr_log_entry->inode.inode_number;
+            }
+            offset += frame + sizeof(struct wfs_inode) + entry_data_size(curr_log_entry);
+        }
+    }
+
+    if (active == SEGMENT_NONE) {
+        printf("Error: the image has no log\n");
+        free(in_use);
+        return -1;
+    }
+
+    // The log and the file data go on at the end of the newest segment of each
+    set_log_head(active, (uint64_t)active * WFS_SEGMENT_SIZE + segment_header(active)->used);
+    set_data_head(active_data);
+    free(in_use);
+    return 0;
+}
+
+/**
+ * Returns how many segments a checkpoint of the current state takes, which
+ * is also how many free segments are held back so one can always be written.
+ */
+static uint32_t checkpoint_parts() {
+    size_t bytes = sizeof(struct wfs_checkpoint) + (inode_number + 1) * sizeof(uint64_t) + sizeof(uint32_t) +
+                   segment_count * (sizeof(struct wfs_segment_usage) + sizeof(uint32_t)) +
+                   (dedup_data ? sizeof(uint32_t) + chunk_count * sizeof(struct wfs_chunk) : 0);
+    uint32_t parts = 1;
+    while (parts * SEGMENT_ROOM < bytes + parts * sizeof(uint32_t)) {
+        parts++;
+    }
+    return parts;
+}
+
+/**
+ * Starts writing to a free segment once the active one is full, either the
+ * log's or the file data's.
+ *
+ * The free segments needed for the next checkpoint are always off limits.
+ * Outside the cleaner, so are the CLEANER_RESERVE segments after them, so
+ * the cleaner always has somewhere to move live entries to.
+ *
+ * The caller holds log_lock. Appends still running in the old segment keep
+ * their place; any that find it full try again in the new one.
+ *
+ * @param tail &log_tail or &data_tail.
+ * @return     0 on success, or -ENOSPC if no segment may be used.
+ */
+static int open_segment(_Atomic uint64_t *tail) {
+    if (free_count <= (cleaning ? 0 : CLEANER_RESERVE) + checkpoint_parts()) {
+        return -ENOSPC;
+    }
+    uint32_t segment = free_segments[--free_count];
+    struct wfs_segment *header = segment_header(segment);
+    header->sequence = ++last_sequence;
+    header->used = segment_first_entry(segment) % WFS_SEGMENT_SIZE;
+    if (tail == &data_tail) {
+        header->magic = compress_data ? WFS_PACKED_DATA_MAGIC : WFS_FRAMED_DATA_MAGIC;
+    } else {
+        header->magic = WFS_FRAMED_SEGMENT_MAGIC;
+    }
+    segment_sequence[segment] = last_sequence;
+    segments_since_checkpoint++;
+
+    if (tail == &data_tail) {
+        set_data_head(segment);
+        return 0;
+    }
+    set_log_head(segment, segment_first_entry(segment));
+    return 0;
+}
+
+/**
+ * Returns how many bytes of log entries and file data can still be written,
+ * assuming no space is lost at the end of segments.
+ *
+ * The log and the file data fill their active segments separately, so
+ * either may have to open a segment while the other still has room. Only the
+ * room both active segments have counts, and one usable free segment is held
+ * back for whichever runs out first.
+ */
+static size_t log_room() {
+    size_t room = tail_room(log_tail) < tail_room(data_tail) ? tail_room(log_tail) : tail_room(data_tail);
+    uint32_t reserved = (cleaning ? 0 : CLEANER_RESERVE) + checkpoint_parts() + 1;
+    uint32_t usable = free_count > reserved ? free_count - reserved : 0;
+    return room + usable * (WFS_SEGMENT_SIZE - sizeof(struct wfs_segment));
+}
+
+/**
+ * Returns whether so much of the image is live that cleaning would move a lot
+ * to free little, so growing the image is the better way to make room.
+ */
+static int mostly_live() {
+    long live = 0;
+    for (uint32_t segment = 0; segment < segment_count; segment++) {
+        live += segment_live[segment];
+    }
+    return live >= GROW_UTILIZATION * segment_count * (WFS_SEGMENT_SIZE - sizeof(struct wfs_segment));
+}
+
+/**
+ * Adds options.grow_size MiB of free segments to the end of the image, or as
+ * many as options.max_size still allows.
+ *
+ * The file is extended with posix_fallocate(), so a host filesystem that is
+ * full fails here rather than on a later store into the mapping, and the
+ * mapping is then grown with mremap(), which may move it. The caller holds
+ * fs_lock exclusively and must not hold pointers into the image across the
+ * call. A checkpoint is written right away so its free stack includes the
+ * new segments; until then, the changed segment count in the superblock
+ * makes a mount ignore the older checkpoint.
+ *
+ * @return 0 on success, or -ENOSPC if the image may not or cannot grow.
+ */
+static int grow_image() {
+    uint32_t max_segments = MAX_IMAGE_SEGMENTS;
+    if (options.max_size > 0 && options.max_size < (uint64_t)max_segments * WFS_SEGMENT_SIZE >> 20) {
+        max_segments = ((uint64_t)options.max_size << 20) / WFS_SEGMENT_SIZE;
+    }
+    uint64_t target = segment_count + ((uint64_t)options.grow_size << 20) / WFS_SEGMENT_SIZE;
+    if (target > max_segments) {
+        target = max_segments;
+    }
+    if (target <= segment_count) {
+        return -ENOSPC;
+    }
+
+    size_t new_length = target * WFS_SEGMENT_SIZE;
+    if (new_length > length) {
+        int err = posix_fallocate(currFd, length, new_length - length);
+        if (err != 0) {
+            printf("Error: Failed to grow %s: %s\n", disk_path, strerror(err));
+            return -ENOSPC;
+        }
+        void *moved = mremap(mapped_disk, length, new_length, MREMAP_MAYMOVE);
+        if (moved == MAP_FAILED) {
+            printf("Error: Failed to map the grown image\n");
+            return -ENOSPC;
+        }
+        mapped_disk = moved;
+        length = new_length;
+    }
+    if (resize_segment_tables(segment_count, target) != 0) {
+        printf("Error: Memory allocation failed\n");
+        return -ENOSPC;
+    }
+
+    // Highest first, so the new segments are used from the front
+    for (uint32_t segment = target; segment-- > segment_count;) {
+        free_segments[free_count++] = segment;
+    }
+    segment_count = target;
+    ((struct wfs_sb*)mapped_disk)->segments = segment_count;
+    images_grown++;
+    if (write_checkpoint() != 0) {
+        printf("Error: Failed to write a checkpoint after growing the image\n");
+    }
+    return 0;
+}
+
+/**
+ * Cleans segments until there is room for the given number of bytes. Each
+ * round writes a checkpoint to release the segments cleaned earlier, then
+ * if that is not enough cleans one more segment and releases it too. Once
+ * the image is mostly live, or STALLED_ROUNDS rounds in a row leave no more
+ * room than the most there has been, the image grows instead. The caller holds fs_lock exclusively.
+ *
+ * @param needed The room needed, in bytes.
+ * @return       0 once there is room, or -ENOSPC.
+ */
+static int make_room(size_t needed) {
+    size_t best = log_room();
+    int stalled = 0;
+    while (log_room() < needed) {
+        if (cleaning) {
+            return -ENOSPC;
+        }
+        if (pending_count > 0) {
+            write_checkpoint();
+        }
+        if (log_room() < needed && (!mostly_live() || grow_image() != 0)) {
+            uint32_t victim = pick_victim();
+            if (victim != SEGMENT_NONE && clean_segment(victim) == 0 && pending_count > 0) {
+                write_checkpoint();
+            }
+        }
+        // Cleaning moves live bytes as well as freeing dead ones, and the
+        // first checkpoint with no older one to free takes up the segment
+        // cleaned, so a round may gain nothing; once STALLED_ROUNDS in a row
+        // have, growing is the only way on
+        if (log_room() > best) {
+            best = log_room();
+            stalled = 0;
+        } else if (++stalled >= STALLED_ROUNDS) {
+            if (grow_image() != 0) {
+                return -ENOSPC;
+            }
+            stalled = 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Makes sure a series of log entries can be appended without running out of
+ * space part way.
+ *
+ * Under the exclusive lock, segments are cleaned in the foreground if that is
+ * what it takes. Under the shared lock, the room is promised to this thread
+ * until release_log(), so operations running alongside cannot use it up; if
+ * there is not enough, the operation has to back out and make_progress()
+ * cleans. Room already promised to this thread counts towards the request.
+ *
+ * Call this before building the entries: cleaning may rewrite any inode.
+ *
+ * @param bytes   The total size of the entries.
+ * @param largest The size of the largest entry or data run, which bounds
+ *                what is lost at the end of each segment.
+ * @return        0 if the entries fit, -EAGAIN if they may fit once
+ *                segments are cleaned, or -ENOSPC.
+ */
+static int reserve_log(size_t bytes, size_t largest) {
+    size_t needed = bytes + (bytes / (WFS_SEGMENT_SIZE - sizeof(struct wfs_segment)) + 2) * largest; // One more for each active segment
+    if (thread_exclusive) {
+        return make_room(needed);
+    }
+    if (needed <= thread_reserved) {
+        return 0;
+    }
+
+    int ret = 0;
+    pthread_mutex_lock(&log_lock);
+    if (log_room() >= reserved_bytes + (needed - thread_reserved)) {
+        reserved_bytes += needed - thread_reserved;
+        thread_reserved = needed;
+    } else {
+        thread_shortfall = needed;
+        ret = -EAGAIN;
+    }
+    pthread_mutex_unlock(&log_lock);
+    return ret;
+}
+
+/**
+ * Gives back whatever log room is still promised to this thread, once its
+ * operation is done.
+ */
+static void release_log() {
+    reserved_bytes -= thread_reserved;
+    thread_reserved = 0;
+}
+
+/**
+ * Starts an operation that runs alongside others.
+ */
+static void begin_shared() {
+    pthread_rwlock_rdlock(&fs_lock);
+}
+
+/**
+ * Ends an operation started with begin_shared().
+ */
+static void end_shared() {
+    release_log();
+    pthread_rwlock_unlock(&fs_lock);
+}
+
+/**
+ * Starts an operation that has the filesystem to itself.
+ */
+static void begin_exclusive() {
+    pthread_rwlock_wrlock(&fs_lock);
+    thread_exclusive = 1;
+}
+
+/**
+ * Ends an operation started with begin_exclusive().
+ */
+static void end_exclusive() {
+    thread_exclusive = 0;
+    pthread_rwlock_unlock(&fs_lock);
+}
+
+/**
+ * Does what a shared operation backed out with -EAGAIN for: grows the inode
+ * map or cleans segments, both of which need the exclusive lock. The
+ * operation is then tried again from the start.
+ *
+ * @return 0 if the operation may be tried again, or -ENOSPC.
+ */
+static int make_progress() {
+    begin_exclusive();
+    if (thread_map_needed >= inode_map_size) {
+        inode_map_slot(thread_map_needed);
+    }
+    int ret = thread_shortfall > 0 ? make_room(thread_shortfall) : 0;
+    thread_map_needed = 0;
+    thread_shortfall = 0;
+    end_exclusive();
+    return ret;
+}
+
+/**
+ * Claims room at the end of the log or of the file data, moving on to a new
+ * segment if the active one is full.
+ *
+ * The place is claimed with a single fetch-add on the tail, so appends copy
+ * their bytes in parallel. Once they are in place, the caller finishes with
+ * finish_append().
+ *
+ * @param tail  &log_tail or &data_tail.
+ * @param size  The number of bytes to claim, at most SEGMENT_ROOM.
+ * @param error Where to store -ENOSPC if no segment may be opened.
+ * @return      The offset of the room from the start of the disk, or 0 on failure.
+ */
+static uint64_t claim_room(_Atomic uint64_t *tail, uint32_t size, int *error) {
+    if (size > SEGMENT_ROOM) {
+        *error = -ENOSPC;
+        return 0;
+    }
+    while (1) {
+        uint64_t claimed = atomic_fetch_add(tail, size);
+        uint32_t segment = claimed >> 32;
+        uint32_t used = (uint32_t)claimed;
+        if (segment != SEGMENT_NONE && used + size <= WFS_SEGMENT_SIZE) {
+            return (uint64_t)segment * WFS_SEGMENT_SIZE + used;
+        }
+        // The segment is full; whoever gets the lock first moves on
+        pthread_mutex_lock(&log_lock);
+        int ret = *tail >> 32 == segment ? open_segment(tail) : 0;
+        pthread_mutex_unlock(&log_lock);
+        if (ret != 0) {
+            *error = ret;
+            return 0;
+        }
+    }
+}
+
+/**
+ * Marks bytes written at room from claim_room() as part of their segment and
+ * takes them off the log room promised to this thread.
+ *
+ * @param offset The offset of the bytes from the start of the disk.
+ * @param size   The number of bytes.
+ */
+static void finish_append(uint64_t offset, uint32_t size) {
+
+    mark_used(segment_of(offset), offset % WFS_SEGMENT_SIZE + size);
+    atomic_fetch_add_explicit(&log_bytes, size, memory_order_relaxed);
+    if (cleaning) {
+        atomic_fetch_add_explicit(&cleaner_bytes, size, memory_order_relaxed);
+    }
+    size_t consumed = size < thread_reserved ? size : thread_reserved;
+    thread_reserved -= consumed;
+    reserved_bytes -= consumed;
+}
+
+/**
+ * Appends a log entry at the head of the log, in a record of its own, and
+ * points the inode map at it, or for a tombstone, notes it as the inode's.
+ * The caller holds the inode's lock for writing.
+ *
+ * @param entry     The entry to append.
+ * @param data_size The number of bytes of data that follow its inode.
+ * @return          A pointer to the appended entry on disk, or NULL if the log is full.
+ */
+static struct wfs_log_entry *append_log_entry(const struct wfs_log_entry *entry, uint32_t data_size) {
+    uint32_t entry_size = sizeof(struct wfs_inode) + data_size;
+    int error;
+    uint64_t offset = claim_room(&log_tail, sizeof(struct wfs_record) + entry_size, &error);
+    if (offset == 0) {
+        return NULL;
+    }
+    struct wfs_log_entry *new_log_entry = (struct wfs_log_entry*)((char*)mapped_disk + offset + sizeof(struct wfs_record));
+    memcpy(new_log_entry, entry, entry_size);
+    seal_record(offset, WFS_RECORD_ENTRY, entry_size);
+    struct inode_map_entry *slot = inode_map_slot(entry->inode.inode_number);
+    if (entry->inode.flags == WFS_LOG_TOMBSTONE) {
+        slot->tombstone = offset + sizeof(struct wfs_record);
+    } else {
+        slot->offset = offset + sizeof(struct wfs_record);
+    }
+    if (entry->inode.flags == WFS_LOG_INODE && slot->tombstone != 0) {
+        // A new inode under a reused number overrides the old one's entries as well
+        account_tombstone(entry->inode.inode_number, -1);
+        slot->tombstone = 0;
+    }
+    segment_live[segment_of(offset)] += entry_chain_bytes(new_log_entry);
+    finish_append(offset, sizeof(struct wfs_record) + entry_size);
+    return new_log_entry;
+}
+
+/**
+ * Appends a run of file bytes to the file data as a packed run, compressed
+ * unless that would not make it any smaller. The source fills a buffer
+ * first, so unlike a plain run, nothing is appended if it fails.
+ *
+ * @param inode_number The file the bytes are written to.
+ * @param source       Produces the bytes.
+ * @param context      Passed on to the source.
+ * @param size         The number of bytes, 1 to WFS_PACKED_RUN_SIZE.
+ * @param offset       Where in the file the bytes go.
+ * @param location     Where to store the offset of the run's bytes from the start of the disk.
+ * @return             0 on success, -ENOSPC, or the source's error.
+ */
+static int append_packed_run(unsigned long inode_number, libwfs_source_t source, void *context, uint32_t size, uint64_t offset, uint64_t *location) {
+    char bytes[WFS_PACKED_RUN_SIZE];
+    char packed[WFS_PACKED_RUN_SIZE];
+    int ret = source(context, bytes, size);
+    if (ret != 0) {
+        return ret;
+    }
+    uint32_t stored = lz4_compress(bytes, size, packed, size - 1);
+    uint32_t codec = stored != 0 ? WFS_CODEC_LZ4 : WFS_CODEC_NONE;
+    stored = stored != 0 ? stored : size;
+
+    uint32_t run_size = sizeof(struct wfs_record) + sizeof(struct wfs_packed_run) + stored;
+    uint64_t at = claim_room(&data_tail, run_size, &ret);
+    if (at == 0) {
+        return ret;
+    }
+    struct wfs_packed_run *run = (struct wfs_packed_run*)((char*)mapped_disk + at + sizeof(struct wfs_record));
+    *run = (struct wfs_packed_run){ .inode_number = inode_number, .length = stored, .offset = offset, .size = size, .codec = codec };
+    memcpy(run + 1, codec == WFS_CODEC_LZ4 ? packed : bytes, stored);
+    seal_record(at, WFS_RECORD_PACKED_RUN, sizeof(struct wfs_packed_run) + stored);
+    finish_append(at, run_size);
+    atomic_fetch_add_explicit(&data_bytes, run_size, memory_order_relaxed);
+    atomic_fetch_add_explicit(&packed_bytes, size, memory_order_relaxed);
+    atomic_fetch_add_explicit(&packed_stored, stored, memory_order_relaxed);
+    *location = (char*)(run + 1) - (char*)mapped_disk;
+    return 0;
+}
+
+/**
+ * Appends a run of file bytes to the file data. The bytes are copied by the
+ * source straight into their place in the image, so large writes are copied
+ * once. They count as live only once a WFS_LOG_MAP entry maps them in, so if
+ * the source fails, the run is appended all the same and simply never used.
+ * With compression on, the run is a packed one instead.
+ *
+ * @param inode_number The file the bytes are written to.
+ * @param source       Produces the bytes.
+ * @param context      Passed on to the source.
+ * @param size         The number of bytes, at most run_limit().
+ * @param offset       Where in the file the bytes go.
+ * @param location     Where to store the offset of the bytes from the start of the disk.
+ * @return             0 on success, -ENOSPC, or the source's error.
+ */
+static int append_data_run(unsigned long inode_number, libwfs_source_t source, void *context, uint32_t size, uint64_t offset, uint64_t *location) {
+    if (compress_data) {
+        return append_packed_run(inode_number, source, context, size, offset, location);
+    }
+    uint32_t run_size = sizeof(struct wfs_record) + sizeof(struct wfs_data_run) + size;
+    int ret;
+    uint64_t at = claim_room(&data_tail, run_size, &ret);
+    if (at == 0) {
+        return ret;
+    }
+    struct wfs_data_run *run = (struct wfs_data_run*)((char*)mapped_disk + at + sizeof(struct wfs_record));
+    run->inode_number = inode_number;
+    run->length = size;
+    ret = source(context, (char*)(run + 1), size);
+    seal_record(at, WFS_RECORD_RUN, sizeof(struct wfs_data_run) + size);
+    finish_append(at, run_size);
+    atomic_fetch_add_explicit(&data_bytes, run_size, memory_order_relaxed);
+    *location = (char*)(run + 1) - (char*)mapped_disk;
+    return ret;
+}
+
+/**
+ * A source for append_data_run() that copies from memory. The context
+ * points at a pointer to the next bytes, which is moved past those copied.
+ *
+ * @return 0, as copying from memory cannot fail.
+ */
+static int copy_from_memory(void *context, char *dst, size_t size) {
+    const char **next = context;
+    memcpy(dst, *next, size);
+    *next += size;
+    return 0;
+}
+
+/**
+ * Sets up an empty chunk index, and fills the table of what each byte adds
+ * to the rolling hash that cuts chunks. The values are the same in every
+ * build, so the same bytes are cut the same way whenever they are written.
+ */
+static void init_chunks() {
+    chunk_table = calloc(CHUNK_TABLE_MIN, sizeof(struct chunk_slot));
+    if (chunk_table == NULL) {
+        printf("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    chunk_table_size = CHUNK_TABLE_MIN;
+    uint64_t state = 0x5746535f43484e4bull; // splitmix64
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        chunk_gear[i] = z ^ (z >> 31);
+    }
+}
+
+/**
+ * Finds where the first chunk of some bytes ends. A gear hash rolls over
+ * the bytes from CHUNK_MIN on, and the chunk ends after the first byte that
+ * clears its CHUNK_MASK bits, which depend only on the bytes just before.
+ * Cuts thus follow the content: bytes inserted or removed early on shift
+ * the chunks after them rather than change them.
+ *
+ * @param bytes The bytes, which are all there is or at least CHUNK_MAX of them.
+ * @param size  The number of bytes.
+ * @return      The length of the chunk, at most CHUNK_MAX.
+ */
+static uint32_t chunk_cut(const unsigned char *bytes, uint32_t size) {
+    uint32_t end = size < CHUNK_MAX ? size : CHUNK_MAX;
+    uint64_t hash = 0;
+    for (uint32_t i = CHUNK_MIN; i < end; i++) {
+        hash = (hash << 1) + chunk_gear[bytes[i]];
+        if ((hash & CHUNK_MASK) == 0) {
+            return i + 1;
+        }
+    }
+    return end;
+}
+
+/**
+ * Finds the chunk a location falls in. The caller holds chunk_lock, or
+ * fs_lock exclusively.
+ *
+ * @param location An offset from the start of the disk, in a segment of the image.
+ * @return         The chunk, or NULL if the location is in none.
+ */
+static struct wfs_chunk *chunk_at(uint64_t location) {
+    struct segment_chunks *list = &segment_chunks[segment_of(location)];
+    uint32_t low = 0; // Binary search for the first chunk starting after location
+    uint32_t high = list->count;
+    while (low < high) {
+        uint32_t mid = (low + high) / 2;
+        if (list->chunks[mid].location <= location) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == 0 || location - list->chunks[low - 1].location >= list->chunks[low - 1].length) {
+        return NULL;
+    }
+    return &list->chunks[low - 1];
+}
+
+/**
+ * Returns the file a chunk's run was written to.
+ *
+ * @param location The location of the run's bytes.
+ */
+static uint32_t chunk_owner(uint64_t location) {
+    return ((const struct wfs_data_run*)((char*)mapped_disk + location) - 1)->inode_number;
+}
+
+/**
+ * Returns the slot of the chunk table where looking for bytes starts.
+ */
+static size_t chunk_home(uint32_t crc, uint32_t length) {
+    return (crc ^ length * 2654435761u) & (chunk_table_size - 1);
+}
+
+/**
+ * Puts a chunk in the chunk table, first making the table bigger if it is
+ * half full, deleted slots included.
+ *
+ * @param chunk The chunk.
+ */
+static void chunk_table_insert(const struct wfs_chunk *chunk) {
+    if ((chunk_table_used + 1) * 2 > chunk_table_size) {
+        size_t live = 0;
+        for (size_t i = 0; i < chunk_table_size; i++) {
+            live += chunk_table[i].location > CHUNK_DELETED;
+        }
+        size_t new_size = CHUNK_TABLE_MIN;
+        while (new_size < (live + 1) * 4) {
+            new_size *= 2;
+        }
+        struct chunk_slot *old_table = chunk_table;
+        size_t old_size = chunk_table_size;
+        chunk_table = calloc(new_size, sizeof(struct chunk_slot));
+        if (chunk_table == NULL) {
+            printf("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        chunk_table_size = new_size;
+        chunk_table_used = 0;
+        for (size_t i = 0; i < old_size; i++) {
+            if (old_table[i].location > CHUNK_DELETED) {
+                struct wfs_chunk moved = { .location = old_table[i].location, .length = old_table[i].length, .crc = old_table[i].crc };
+                chunk_table_insert(&moved);
+            }
+        }
+        free(old_table);
+    }
+    size_t slot = chunk_home(chunk->crc, chunk->length);
+    while (chunk_table[slot].location > CHUNK_DELETED) {
+        slot = (slot + 1) & (chunk_table_size - 1);
+    }
+    chunk_table_used += chunk_table[slot].location == CHUNK_EMPTY;
+    chunk_table[slot] = (struct chunk_slot){ .crc = chunk->crc, .length = chunk->length, .location = chunk->location };
+}
+
+/**
+ * Takes a chunk out of the chunk table.
+ *
+ * @param chunk The chunk, which is in the table.
+ */
+static void chunk_table_remove(const struct wfs_chunk *chunk) {
+    for (size_t slot = chunk_home(chunk->crc, chunk->length); chunk_table[slot].location != CHUNK_EMPTY;
+         slot = (slot + 1) & (chunk_table_size - 1)) {
+        if (chunk_table[slot].location == chunk->location) {
+            chunk_table[slot].location = CHUNK_DELETED;
+            return;
+        }
+    }
+}
+
+/**
+ * Adds a run to the chunks of its segment, and unless they are hidden, to
+ * the chunk table. The caller holds chunk_lock, or fs_lock exclusively.
+ *
+ * @param chunk The run's chunk.
+ */
+static void add_chunk(const struct wfs_chunk *chunk) {
+    struct segment_chunks *list = &segment_chunks[segment_of(chunk->location)];
+    if (list->count == list->capacity) {
+        uint32_t capacity = list->capacity ? list->capacity * 2 : 16;
+        struct wfs_chunk *grown = realloc(list->chunks, capacity * sizeof(struct wfs_chunk));
+        if (grown == NULL) {
+            printf("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        list->chunks = grown;
+        list->capacity = capacity;
+    }
+    uint32_t i = list->count; // Runs are appended, so this is nearly always the end
+    while (i > 0 && list->chunks[i - 1].location > chunk->location) {
+        i--;
+    }
+    memmove(list->chunks + i + 1, list->chunks + i, (list->count - i) * sizeof(struct wfs_chunk));
+    list->chunks[i] = *chunk;
+    list->count++;
+    chunk_count++;
+    if (!list->hidden) {
+        chunk_table_insert(chunk);
+    }
+}
+
+/**
+ * Notes that a file may map in chunks of a segment whose runs were written
+ * to another file, so cleaning the segment moves them for it as well.
+ * The caller holds chunk_lock, or fs_lock exclusively.
+ *
+ * @param segment      The segment.
+ * @param inode_number The file.
+ */
+static void add_sharer(uint32_t segment, uint32_t inode_number) {
+    struct segment_chunks *list = &segment_chunks[segment];
+    for (uint32_t i = list->sharer_count; i-- > 0 && i + 8 >= list->sharer_count;) {
+        if (list->sharers[i] == inode_number) {
+            return; // Chunks shared with one file mostly come one after another
+        }
+    }
+    if (list->sharer_count == list->sharer_capacity) {
+        uint32_t capacity = list->sharer_capacity ? list->sharer_capacity * 2 : 8;
+        uint32_t *grown = realloc(list->sharers, capacity * sizeof(uint32_t));
+        if (grown == NULL) {
+            printf("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        list->sharers = grown;
+        list->sharer_capacity = capacity;
+    }
+    list->sharers[list->sharer_count++] = inode_number;
+}
+
+/**
+ * Stores a chunk of bytes written to a file: finds a run that already holds
+ * the same bytes, or appends one. The chunk table finds runs by the CRC and
+ * length of their bytes, and a run found is only used once its bytes have
+ * been compared, so CRCs that collide cost no more than a missed match.
+ * Chunks too short to be worth indexing are always appended.
+ *
+ * @param inode_number The file the bytes are written to.
+ * @param bytes        The bytes.
+ * @param length       The number of bytes, at most MAX_RUN.
+ * @param offset       Where in the file the bytes go.
+ * @param location     Where to store the location of the run's bytes.
+ * @return             0 on success, or -ENOSPC.
+ */
+static int store_chunk(unsigned long inode_number, const char *bytes, uint32_t length, uint64_t offset, uint64_t *location) {
+    const char *next = bytes;
+    if (length < WFS_MIN_SHARED_RUN) {
+        return append_data_run(inode_number, copy_from_memory, &next, length, offset, location);
+    }
+    uint64_t started = op_clock();
+    uint32_t crc = crc32c(0, bytes, length);
+    *location = 0;
+    pthread_mutex_lock(&chunk_lock);
+    for (size_t slot = chunk_home(crc, length); chunk_table[slot].location != CHUNK_EMPTY; slot = (slot + 1) & (chunk_table_size - 1)) {
+        const struct chunk_slot *found = &chunk_table[slot];
+        if (found->location > CHUNK_DELETED && found->crc == crc && found->length == length &&
+            memcmp((char*)mapped_disk + found->location, bytes, length) == 0) {
+            *location = found->location;
+            if (chunk_owner(*location) != inode_number) {
+                add_sharer(segment_of(*location), inode_number);
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&chunk_lock);
+    atomic_fetch_add_explicit(&chunk_nanoseconds, op_clock() - started, memory_order_relaxed);
+    if (*location != 0) {
+        atomic_fetch_add_explicit(&chunks_shared, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&shared_bytes, length, memory_order_relaxed);
+        return 0;
+    }
+
+    int ret = append_data_run(inode_number, copy_from_memory, &next, length, offset, location);
+    if (ret != 0) {
+        return ret;
+    }
+    struct wfs_chunk chunk = { .location = *location, .length = length, .crc = crc };
+    pthread_mutex_lock(&chunk_lock);
+    add_chunk(&chunk);
+    pthread_mutex_unlock(&chunk_lock);
+    atomic_fetch_add_explicit(&chunks_written, 1, memory_order_relaxed);
+    return 0;
+}
+
+/**
+ * Returns whether any extent maps part of a chunk of a segment.
+ */
+static int chunks_mapped(uint32_t segment) {
+    const struct segment_chunks *list = &segment_chunks[segment];
+    for (uint32_t i = 0; i < list->count; i++) {
+        if (list->chunks[i].refs > 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Hides the chunks of a segment, taking them out of the chunk table so no
+ * new extent maps them. Their references are still counted. The caller
+ * holds fs_lock exclusively.
+ *
+ * @param segment The segment.
+ */
+static void hide_chunks(uint32_t segment) {
+    struct segment_chunks *list = &segment_chunks[segment];
+    if (!list->hidden) {
+        for (uint32_t i = 0; i < list->count; i++) {
+            chunk_table_remove(&list->chunks[i]);
+        }
+        list->hidden = 1;
+    }
+}
+
+/**
+ * Forgets the chunks and sharers of a segment that no longer holds them.
+ * The caller holds fs_lock exclusively.
+ *
+ * @param segment The segment.
+ */
+static void drop_chunks(uint32_t segment) {
+    struct segment_chunks *list = &segment_chunks[segment];
+    hide_chunks(segment);
+    chunk_count -= list->count;
+    free(list->chunks);
+    free(list->sharers);
+    *list = (struct segment_chunks){ 0 };
+}
+
+/**
+ * Adds the runs of a data segment that are not chunks yet to its chunks,
+ * with no references, while the image is loaded. Runs a crash tore are
+ * stepped over a byte at a time, as the cleaner does.
+ *
+ * @param segment The data segment.
+ */
+static void index_data_segment(uint32_t segment) {
+    uint32_t frame = sizeof(struct wfs_record);
+    uint64_t offset = segment_first_entry(segment);
+    uint64_t end = (uint64_t)segment * WFS_SEGMENT_SIZE + segment_header(segment)->used;
+    while (offset < end) {
+        if (!record_valid(offset, end, WFS_RECORD_RUN)) {
+            offset++;
+            continue;
+        }
+        const struct wfs_record *record = (const struct wfs_record*)((char*)mapped_disk + offset);
+        const struct wfs_data_run *run = (const struct wfs_data_run*)(record + 1);
+        uint64_t location = offset + frame + sizeof(struct wfs_data_run);
+        if (run->length >= WFS_MIN_SHARED_RUN && chunk_at(location) == NULL) {
+            struct wfs_chunk chunk = { .location = location, .length = run->length, .crc = crc32c(0, run + 1, run->length) };
+            add_chunk(&chunk);
+        }
+        offset += frame + record->length;
+    }
+}
+
+/**
+ * Finds the last log entry with the specified inode number.
+ *
+ * This is a constant-time lookup in the inode map, which always points at the
+ * newest log entry of each live inode.
+ *
+ * @param inode_number The inode number to search for.
+ * @return A pointer to the last log entry with the specified inode number,
+ *         or NULL if no matching inode is found.
+ */
+static struct wfs_log_entry *find_last_matching_inode(unsigned long inode_number){
+    if (inode_number >= inode_map_size || inode_map[inode_number].offset == 0){
+        return NULL; // ENOENT
+    }
+    return (struct wfs_log_entry*)((char*)mapped_disk + inode_map[inode_number].offset);
+}
+
+/**
+ * Returns the time of day, in nanoseconds since the epoch, as inodes keep it.
+ */
+static int64_t wall_clock() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec * 1000000000ll + now.tv_nsec;
+}
+
+/**
+ * Returns the readdir cookie of a name: a hash of it, which decides where the
+ * name goes in its directory. Cookies fall in [LIBWFS_COOKIE_FIRST,
+ * LIBWFS_COOKIE_END).
+ *
+ * @param name The name; need not be null-terminated.
+ * @param len  The length of the name.
+ * @return     The cookie.
+ */
+static uint64_t dentry_cookie(const char *name, size_t len) {
+    uint64_t hash = 14695981039346656037ull; // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 1099511628211ull;
+    }
+    return LIBWFS_COOKIE_FIRST + hash % (LIBWFS_COOKIE_END - LIBWFS_COOKIE_FIRST);
+}
+
+/**
+ * Compares a (cookie, name) key with an entry of a directory block.
+ *
+ * @return Less than, equal to or greater than 0 as the key sorts before, at or after the entry.
+ */
+static int dentry_compare(uint64_t cookie, const char *name, size_t len, const struct dir_block *block, size_t i) {
+    if (cookie != block->cookies[i]) {
+        return cookie < block->cookies[i] ? -1 : 1;
+    }
+    int ret = strncmp(name, block->entries[i].name, len);
+    return ret != 0 ? ret : block->entries[i].name[len] == '\0' ? 0 : -1;
+}
+
+/**
+ * Finds where a key is, or would go, in a directory.
+ *
+ * @param dir    The directory.
+ * @param cookie The cookie of the name.
+ * @param name   The name; need not be null-terminated.
+ * @param len    The length of the name.
+ * @param block  Set to the block holding the first entry at or after the key, or block_count if none.
+ * @param index  Set to that entry's position within the block.
+ * @return       1 if that entry is the key itself, 0 otherwise.
+ */
+static int dir_position(const struct wfs_dir *dir, uint64_t cookie, const char *name, size_t len, size_t *block, size_t *index) {
+    size_t low = 0; // Binary search for the first block whose last entry is not before the key
+    size_t high = dir->block_count;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        const struct dir_block *candidate = dir->blocks[mid];
+        if (dentry_compare(cookie, name, len, candidate, candidate->count - 1) > 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    *block = low;
+    *index = 0;
+    if (low == dir->block_count) {
+        return 0;
+    }
+
+    const struct dir_block *found = dir->blocks[low];
+    high = found->count;
+    while (*index < high) {
+        size_t mid = (*index + high) / 2;
+        if (dentry_compare(cookie, name, len, found, mid) > 0) {
+            *index = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return dentry_compare(cookie, name, len, found, *index) == 0;
+}
+
+/**
+ * Adds an entry to an in-memory directory, splitting its block if it is full.
+ *
+ * @param dir          The directory.
+ * @param inode_number The inode the entry points at.
+ * @param name         The name, which must not be in the directory yet; need not be null-terminated.
+ * @param len          The length of the name.
+ */
+static void dir_insert(struct wfs_dir *dir, uint32_t inode_number, const char *name, size_t len) {
+    char *copy = strndup(name, len);
+    if (copy == NULL) {
+        printf("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t cookie = dentry_cookie(name, len);
+    size_t b, i;
+    dir_position(dir, cookie, name, len, &b, &i);
+    if (b == dir->block_count && b > 0) {
+        i = dir->blocks[--b]->count; // After everything: the end of the last block
+    }
+
+    if (b == dir->block_count || dir->blocks[b]->count == DIR_BLOCK_ENTRIES) {
+        if (dir->block_count == dir->block_capacity) {
+            size_t new_capacity = dir->block_capacity ? dir->block_capacity * 2 : 4;
+            struct dir_block **new_blocks = realloc(dir->blocks, new_capacity * sizeof(struct dir_block*));
+            if (new_blocks == NULL) {
+                printf("Memory allocation failed");
+                exit(EXIT_FAILURE);
+            }
+            dir->blocks = new_blocks;
+            dir->block_capacity = new_capacity;
+        }
+        struct dir_block *added = calloc(1, sizeof(struct dir_block));
+        if (added == NULL) {
+            printf("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        if (b == dir->block_count) { // The directory is empty
+            dir->blocks[b] = added;
+        } else { // Split the full block, moving its upper half to the new one after it
+            struct dir_block *full = dir->blocks[b];
+            size_t keep = i == DIR_BLOCK_ENTRIES ? DIR_BLOCK_ENTRIES : DIR_BLOCK_ENTRIES / 2; // Appending leaves it full
+            added->count = full->count - keep;
+            memcpy(added->cookies, full->cookies + keep, added->count * sizeof(uint64_t));
+            memcpy(added->entries, full->entries + keep, added->count * sizeof(struct dir_entry));
+            full->count = keep;
+            memmove(dir->blocks + b + 2, dir->blocks + b + 1, (dir->block_count - b - 1) * sizeof(struct dir_block*));
+            dir->blocks[b + 1] = added;
+            if (i > keep || keep == DIR_BLOCK_ENTRIES) {
+                b++;
+                i -= keep;
+            }
+        }
+        dir->block_count++;
+    }
+
+    struct dir_block *block = dir->blocks[b];
+    memmove(block->cookies + i + 1, block->cookies + i, (block->count - i) * sizeof(uint64_t));
+    memmove(block->entries + i + 1, block->entries + i, (block->count - i) * sizeof(struct dir_entry));
+    block->cookies[i] = cookie;
+    block->entries[i] = (struct dir_entry){ .inode_number = inode_number, .name = copy };
+    block->count++;
+    dir->count++;
+    dir->bytes += WFS_DENTRY_SIZE(len);
+}
+
+/**
+ * Removes an entry from an in-memory directory, dropping its block if that
+ * leaves it empty.
+ *
+ * @param dir  The directory.
+ * @param name The name of the entry, which need not be null-terminated; nothing happens if there is none.
+ * @param len  The length of the name.
+ */
+static void dir_remove(struct wfs_dir *dir, const char *name, size_t len) {
+    size_t b, i;
+    if (!dir_position(dir, dentry_cookie(name, len), name, len, &b, &i)) {
+        return;
+    }
+    struct dir_block *block = dir->blocks[b];
+    free(block->entries[i].name);
+    block->count--;
+    memmove(block->cookies + i, block->cookies + i + 1, (block->count - i) * sizeof(uint64_t));
+    memmove(block->entries + i, block->entries + i + 1, (block->count - i) * sizeof(struct dir_entry));
+    dir->count--;
+    dir->bytes -= WFS_DENTRY_SIZE(len);
+    if (block->count == 0) {
+        free(block);
+        dir->block_count--;
+        memmove(dir->blocks + b, dir->blocks + b + 1, (dir->block_count - b) * sizeof(struct dir_block*));
+    }
+}
+
+/**
+ * Frees an in-memory directory.
+ */
+static void free_dir(struct wfs_dir *dir) {
+    for (size_t b = 0; b < dir->block_count; b++) {
+        for (size_t i = 0; i < dir->blocks[b]->count; i++) {
+            free(dir->blocks[b]->entries[i].name);
+        }
+        free(dir->blocks[b]);
+    }
+    free(dir->blocks);
+    free(dir);
+}
+
+/**
+ * Adds entries to or removes entries from an in-memory directory.
+ *
+ * @param dir      The directory to update.
+ * @param kind     WFS_LOG_DENTRY_ADD or WFS_LOG_DENTRY_DEL.
+ * @param dentries The packed entries to add, or the entries to remove (matched by name).
+ * @param bytes    The number of bytes at dentries.
+ */
+static void dir_apply(struct wfs_dir *dir, unsigned int kind, const char *dentries, size_t bytes) {
+    const char *end = dentries + bytes;
+    while (dentries < end) {
+        struct wfs_dentry dentry;
+        memcpy(&dentry, dentries, offsetof(struct wfs_dentry, name)); // Packed, so not aligned
+        const char *name = dentries + offsetof(struct wfs_dentry, name);
+        if (kind == WFS_LOG_DENTRY_ADD) {
+            dir_insert(dir, dentry.inode_number, name, dentry.name_len);
+        } else {
+            dir_remove(dir, name, dentry.name_len);
+        }
+        dentries += WFS_DENTRY_SIZE(dentry.name_len);
+    }
+}
+
+/**
+ * Packs a directory entry the way the log stores it.
+ *
+ * @param out          Where to write it; WFS_DENTRY_SIZE(len) bytes.
+ * @param inode_number The inode the entry points at.
+ * @param name         The name; need not be null-terminated.
+ * @param len          The length of the name, less than MAX_FILE_NAME_LEN.
+ * @return             The number of bytes written.
+ */
+static size_t pack_dentry(char *out, uint32_t inode_number, const char *name, size_t len) {
+    struct wfs_dentry dentry = { .inode_number = inode_number, .name_len = len };
+    memcpy(out, &dentry, offsetof(struct wfs_dentry, name));
+    memcpy(out + offsetof(struct wfs_dentry, name), name, len);
+    return WFS_DENTRY_SIZE(len);
+}
+
+/**
+ * Collects the log entries needed to rebuild an inode.
+ *
+ * The prev links are followed from the newest entry back to the last entry
+ * that holds the inode in full (WFS_LOG_INODE or WFS_LOG_EXTENTS).
+ *
+ * @param offset The offset of the inode's newest log entry.
+ * @param length Set to the number of entries collected.
+ * @return       The offsets of the entries, newest first. The caller must free it.
+ */
+static uint64_t *read_chain(uint64_t offset, size_t *length) {
+    uint64_t *chain = NULL;
+    size_t capacity = 0;
+    *length = 0;
+    while (1) {
+        if (*length == capacity) {
+            capacity = capacity ? capacity * 2 : WFS_DIR_CHECKPOINT + 1;
+            chain = realloc(chain, capacity * sizeof(uint64_t));
+            if (chain == NULL) {
+                printf("Memory allocation failed");
+                exit(EXIT_FAILURE);
+            }
+        }
+        chain[(*length)++] = offset;
+        struct wfs_log_entry *entry = (struct wfs_log_entry*)((char*)mapped_disk + offset);
+        if (entry->inode.flags == WFS_LOG_INODE || entry->inode.flags == WFS_LOG_EXTENTS) {
+            return chain;
+        }
+        offset = ((struct wfs_delta*)entry->data)->prev;
+    }
+}
+
+/**
+ * Adds the chain bytes of an inode's log entries to the live bytes of the
+ * segments holding them, or takes them away.
+ *
+ * @param offset The offset of the inode's newest log entry.
+ * @param sign   1 to add the bytes, -1 to take them away.
+ */
+static void account_chain(uint64_t offset, int sign) {
+    size_t chain_length;
+    uint64_t *chain = read_chain(offset, &chain_length);
+    for (size_t i = 0; i < chain_length; i++) {
+        struct wfs_log_entry *entry = (struct wfs_log_entry*)((char*)mapped_disk + chain[i]);
+        segment_live[segment_of(chain[i])] += sign * (long)entry_chain_bytes(entry);
+    }
+    free(chain);
+}
+
+/**
+ * Returns the entries of a directory, rebuilding them from the log on first use.
+ *
+ * The directory's chain of delta entries is applied oldest first on top of its
+ * last full entry. The result is kept in the inode map and updated in place by
+ * change_dir().
+ *
+ * @param inode_number The inode number of the directory, which must exist.
+ * @return             The directory's entries.
+ */
+static struct wfs_dir *load_dir(unsigned long inode_number) {
+    struct inode_map_entry *slot = inode_map_slot(inode_number);
+    if (slot->dir != NULL) {
+        return slot->dir;
+    }
+
+    size_t chain_length;
+    uint64_t *chain = read_chain(slot->offset, &chain_length);
+
+    struct wfs_dir *dir = calloc(1, sizeof(struct wfs_dir));
+    if (dir == NULL) {
+        printf("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = chain_length; i-- > 0;) {
+        struct wfs_log_entry *entry = (struct wfs_log_entry*)((char*)mapped_disk + chain[i]);
+        if (entry->inode.flags == WFS_LOG_INODE) {
+            dir_apply(dir, WFS_LOG_DENTRY_ADD, entry->data, entry_data_size(entry));
+        } else {
+            dir_apply(dir, entry->inode.flags, entry->data + sizeof(struct wfs_delta),
+                      entry_data_size(entry) - sizeof(struct wfs_delta));
+        }
+    }
+    dir->deltas = chain_length - 1;
+    free(chain);
+
+    slot->dir = dir;
+    return dir;
+}
+
+/**
+ * Writes a directory in full, so its chain starts over from here and the
+ * entries of the old chain are no longer needed.
+ *
+ * A directory too large for one log entry is written as a full entry
+ * followed by entries that add the rest of its dentries. Each entry is
+ * filled for as long as the next dentry fits, so all but the last lack less
+ * than one dentry of being full.
+ *
+ * @param inode_number The inode number of the directory, which must exist.
+ * @return             0 on success, or an error from reserve_log().
+ */
+static int checkpoint_dir(unsigned long inode_number) {
+    struct wfs_dir *dir = load_dir(inode_number);
+    size_t room = MAX_ENTRY_SIZE - sizeof(struct wfs_inode) - sizeof(struct wfs_delta);
+    size_t entries = dir->bytes / (room - WFS_DENTRY_SIZE(MAX_FILE_NAME_LEN - 1)) + 1;
+    size_t bytes = dir->bytes + entries * (sizeof(struct wfs_record) + sizeof(struct wfs_inode) + sizeof(struct wfs_delta));
+    int ret = reserve_log(bytes, entries > 1 ? SEGMENT_ROOM : bytes);
+    if (ret != 0) {
+        return ret;
+    }
+
+    struct wfs_log_entry *new_entry = malloc(MAX_ENTRY_SIZE);
+    if (new_entry == NULL) {
+        printf("Error: Memory allocation failed\n");
+        return -ENOMEM;
+    }
+    struct wfs_inode inode = find_last_matching_inode(inode_number)->inode;
+    account_chain(inode_map[inode_number].offset, -1);
+
+    size_t done = 0;  // dentries written
+    uint64_t size = 0; // the bytes they take
+    size_t b = 0;
+    size_t i = 0;
+    do {
+        size_t header = done == 0 ? 0 : sizeof(struct wfs_delta);
+        size_t used = header;
+        while (done < dir->count) { // In the directory's order, so loading it appends
+            struct dir_entry *dentry = &dir->blocks[b]->entries[i];
+            size_t len = strlen(dentry->name);
+            if (used + WFS_DENTRY_SIZE(len) > header + room) {
+                break;
+            }
+            used += pack_dentry(new_entry->data + used, dentry->inode_number, dentry->name, len);
+            done++;
+            if (++i == dir->blocks[b]->count) {
+                b++;
+                i = 0;
+            }
+        }
+        size += used - header;
+        new_entry->inode = inode;
+        new_entry->inode.size = size;
+        if (header == 0) {
+            new_entry->inode.flags = WFS_LOG_INODE;
+        } else {
+            struct wfs_delta delta = { .prev = inode_map[inode_number].offset };
+            new_entry->inode.flags = WFS_LOG_DENTRY_ADD;
+            memcpy(new_entry->data, &delta, sizeof(delta));
+        }
+        append_log_entry(new_entry, used); // Cannot fail: the room was reserved above
+    } while (done < dir->count);
+
+    free(new_entry);
+    dir->deltas = 0;
+    return 0;
+}
+
+/**
+ * Adds or removes one entry of a directory by appending a small delta entry.
+ *
+ * Once WFS_DIR_CHECKPOINT deltas have been written since the last full entry
+ * of the directory, the whole directory is written as well, so rebuilding it
+ * never has to follow a long chain.
+ *
+ * @param inode_number The inode number of the directory, which must exist.
+ * @param kind         WFS_LOG_DENTRY_ADD or WFS_LOG_DENTRY_DEL.
+ * @param child        The inode number the entry points at.
+ * @param name         The name of the entry, shorter than MAX_FILE_NAME_LEN.
+ * @return             0 on success, or an error from reserve_log().
+ */
+static int change_dir(unsigned long inode_number, unsigned int kind, uint32_t child, const char *name) {
+    size_t len = strlen(name);
+    size_t data_size = sizeof(struct wfs_delta) + WFS_DENTRY_SIZE(len);
+    size_t entry_size = sizeof(struct wfs_inode) + data_size;
+    int ret = reserve_log(sizeof(struct wfs_record) + entry_size, sizeof(struct wfs_record) + entry_size);
+    if (ret != 0) {
+        return ret;
+    }
+    struct wfs_log_entry *new_entry = malloc(entry_size);
+    if (new_entry == NULL) {
+        printf("Error: Memory allocation failed\n");
+        return -ENOMEM;
+    }
+
+    struct wfs_dir *dir = load_dir(inode_number);
+    if (kind == WFS_LOG_DENTRY_ADD) {
+        dir_insert(dir, child, name, len);
+    } else {
+        dir_remove(dir, name, len);
+    }
+
+    struct wfs_delta delta = { .prev = inode_map[inode_number].offset };
+    new_entry->inode = find_last_matching_inode(inode_number)->inode;
+    new_entry->inode.flags = kind;
+    new_entry->inode.size = dir->bytes;
+    new_entry->inode.mtime = wall_clock();
+    new_entry->inode.ctime = new_entry->inode.mtime;
+    memcpy(new_entry->data, &delta, sizeof(delta));
+    pack_dentry(new_entry->data + sizeof(delta), child, name, len);
+    append_log_entry(new_entry, data_size);
+    free(new_entry);
+
+    if (++dir->deltas >= WFS_DIR_CHECKPOINT) {
+        checkpoint_dir(inode_number); // If there is no room now, the next change tries again
+    }
+    return 0;
+}
+
+/**
+ * Looks a name up in a directory's entries.
+ *
+ * @param dir  The directory to search.
+ * @param name The name to look up; need not be null-terminated.
+ * @param len  The length of the name.
+ * @return     The inode number of the entry, or DCACHE_NEGATIVE if there is none.
+ */
+static uint32_t find_dentry(struct wfs_dir *dir, const char *name, size_t len) {
+    size_t b, i;
+    if (!dir_position(dir, dentry_cookie(name, len), name, len, &b, &i)) {
+        return DCACHE_NEGATIVE;
+    }
+    return dir->blocks[b]->entries[i].inode_number;
+}
+
+/**
+ * Adds the bytes an extent keeps live to the live bytes of its segment, or
+ * takes them away. An extent into a chunk takes a reference to the chunk or
+ * gives one back instead, and the whole chunk is live while it has any.
+ *
+ * @param extent The extent.
+ * @param sign   1 to add the bytes, -1 to take them away.
+ */
+static void account_extent(const struct wfs_extent *extent, int sign) {
+    uint32_t segment = segment_of(extent->location);
+    if (dedup_data) {
+        pthread_mutex_lock(&chunk_lock);
+        struct wfs_chunk *chunk = chunk_at(extent->location);
+        if (chunk != NULL) {
+            chunk->refs += sign;
+            if (chunk->refs == (sign > 0 ? 1 : 0)) {
+                segment_live[segment] += sign * (long)chunk->length;
+            }
+        }
+        pthread_mutex_unlock(&chunk_lock);
+        if (chunk != NULL) {
+            return;
+        }
+    }
+    segment_live[segment] += sign * extent_live(extent, extent->offset, extent->offset + extent->length);
+}
+
+/**
+ * Maps a range of a file to bytes in the log, replacing whatever the range
+ * mapped to before. Extents stay sorted by offset and never overlap.
+ *
+ * @param file     The file to update.
+ * @param offset   The offset of the range within the file.
+ * @param length   The length of the range in bytes.
+ * @param location The offset of the range's first byte from the start of the disk.
+ * @param account  Nonzero to move the range's bytes to the live bytes of its new segment.
+ */
+static void file_map_range(struct wfs_file *file, uint64_t offset, uint32_t length, uint64_t location, int account) {
+    if (length == 0) {
+        return;
+    }
+    uint64_t end = offset + length;
+
+    // Find the run of extents that overlap [offset, end)
+    size_t first = 0;
+    while (first < file->count && file->extents[first].offset + file->extents[first].length <= offset) {
+        first++;
+    }
+    size_t last = first;
+    while (last < file->count && file->extents[last].offset < end) {
+        last++;
+    }
+    struct wfs_extent mapped = { .offset = offset, .length = length, .location = location };
+
+    // Parts of the first and last overlapping extents that stick out survive
+    struct wfs_extent before = { 0 };
+    struct wfs_extent after = { 0 };
+    if (first < last && file->extents[first].offset < offset) {
+        before = file->extents[first];
+        before.length = offset - before.offset;
+    }
+    if (first < last) {
+        struct wfs_extent *tail = &file->extents[last - 1];
+        if (tail->offset + tail->length > end) {
+            after.offset = end;
+            after.length = tail->offset + tail->length - end;
+            // Every part of a packed run keeps the run's location
+            after.location = tail->location + (is_packed_segment(segment_of(tail->location)) ? 0 : end - tail->offset);
+        }
+    }
+    if (account) {
+        // Whole extents are swapped, so the references to chunks come out even
+        account_extent(&mapped, 1);
+        if (before.length != 0) {
+            account_extent(&before, 1);
+        }
+        if (after.length != 0) {
+            account_extent(&after, 1);
+        }
+        for (size_t i = first; i < last; i++) {
+            account_extent(&file->extents[i], -1);
+        }
+    }
+
+    size_t replacement = 1 + (before.length != 0) + (after.length != 0);
+    size_t new_count = file->count - (last - first) + replacement;
+    if (new_count > file->capacity) {
+        size_t new_capacity = file->capacity ? file->capacity * 2 : 8;
+        while (new_capacity < new_count) {
+            new_capacity *= 2;
+        }
+        struct wfs_extent *new_extents = realloc(file->extents, new_capacity * sizeof(struct wfs_extent));
+        if (new_extents == NULL) {
+            printf("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        file->extents = new_extents;
+        file->capacity = new_capacity;
+    }
+    memmove(&file->extents[first + replacement], &file->extents[last],
+            (file->count - last) * sizeof(struct wfs_extent));
+
+    size_t i = first;
+    if (before.length != 0) {
+        file->extents[i++] = before;
+    }
+    file->extents[i++] = mapped;
+    if (after.length != 0) {
+        file->extents[i++] = after;
+    }
+    file->count = new_count;
+}
+
+/**
+ * Returns the extent map of a file, rebuilding it from the log on first use.
+ *
+ * The file's chain of map entries is applied oldest first on top of its last
+ * full entry, which is either the inode as created, mapping nothing, or a
+ * saved extent map. The result is kept in the inode map and updated by write_file().
+ *
+ * @param inode_number The inode number of the file, which must exist.
+ * @return             The file's extent map.
+ */
+static struct wfs_file *load_file(unsigned long inode_number) {
+    struct inode_map_entry *slot = inode_map_slot(inode_number);
+    if (slot->file != NULL) {
+        return slot->file;
+    }
+
+    size_t chain_length;
+    uint64_t *chain = read_chain(slot->offset, &chain_length);
+
+    struct wfs_file *file = calloc(1, sizeof(struct wfs_file));
+    if (file == NULL) {
+        printf("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = chain_length; i-- > 0;) {
+        struct wfs_log_entry *entry = (struct wfs_log_entry*)((char*)mapped_disk + chain[i]);
+        if (entry->inode.flags == WFS_LOG_EXTENTS || entry->inode.flags == WFS_LOG_MAP) {
+            struct wfs_extent *extents = (struct wfs_extent*)(entry->data + sizeof(struct wfs_delta));
+            size_t count = (entry_data_size(entry) - sizeof(struct wfs_delta)) / sizeof(struct wfs_extent);
+            for (size_t j = 0; j < count; j++) {
+                file_map_range(file, extents[j].offset, extents[j].length, extents[j].location, 0);
+            }
+        }
+    }
+    file->deltas = chain_length - 1;
+    free(chain);
+
+    slot->file = file;
+    return file;
+}
+
+/**
+ * Takes a directory's lock for reading, building its entries first if they
+ * are not in memory yet, which takes the lock for writing for a moment.
+ *
+ * @param inode_number The inode number of the directory, which must exist.
+ * @return             The directory's entries, which stay put until the lock is released.
+ */
+static struct wfs_dir *read_lock_dir(unsigned long inode_number) {
+    pthread_rwlock_rdlock(inode_lock(inode_number));
+    while (inode_map[inode_number].dir == NULL) {
+        pthread_rwlock_unlock(inode_lock(inode_number));
+        pthread_rwlock_wrlock(inode_lock(inode_number));
+        load_dir(inode_number);
+        pthread_rwlock_unlock(inode_lock(inode_number));
+        pthread_rwlock_rdlock(inode_lock(inode_number));
+    }
+    return inode_map[inode_number].dir;
+}
+
+/**
+ * Takes a file's lock for reading, building its extent map first if it is
+ * not in memory yet, which takes the lock for writing for a moment.
+ *
+ * @param inode_number The inode number of the file, which must exist.
+ * @return             The file's extent map, which stays put until the lock is released.
+ */
+static struct wfs_file *read_lock_file(unsigned long inode_number) {
+    pthread_rwlock_rdlock(inode_lock(inode_number));
+    while (inode_map[inode_number].file == NULL) {
+        pthread_rwlock_unlock(inode_lock(inode_number));
+        pthread_rwlock_wrlock(inode_lock(inode_number));
+        load_file(inode_number);
+        pthread_rwlock_unlock(inode_lock(inode_number));
+        pthread_rwlock_rdlock(inode_lock(inode_number));
+    }
+    return inode_map[inode_number].file;
+}
+
+/**
+ * Adds the bytes a file's extent map refers to to the live bytes of the
+ * segments holding them, or takes them away.
+ *
+ * @param file The file's extent map.
+ * @param sign 1 to add the bytes, -1 to take them away.
+ */
+static void account_extents(struct wfs_file *file, int sign) {
+    for (size_t i = 0; i < file->count; i++) {
+        account_extent(&file->extents[i], sign);
+    }
+}
+
+/**
+ * Adds or takes away the bytes of an inode's tombstone in the live count of
+ * its segment.
+ *
+ * @param inode_number The inode number, which must have a tombstone.
+ * @param sign         1 to add the bytes, -1 to take them away.
+ */
+static void account_tombstone(unsigned long inode_number, int sign) {
+    uint64_t offset = inode_map[inode_number].tombstone;
+    segment_live[segment_of(offset)] += sign * (long)entry_chain_bytes((struct wfs_log_entry*)((char*)mapped_disk + offset));
+}
+
+/**
+ * Counts the live bytes of every inode, once the inode map has been built.
+ */
+static void account_all_inodes() {
+    for (unsigned long i = 0; i < inode_map_size; i++) {
+        if (inode_map[i].tombstone != 0) {
+            account_tombstone(i, 1);
+        }
+        if (inode_map[i].offset == 0) {
+            continue;
+        }
+        account_chain(inode_map[i].offset, 1);
+        if (!S_ISDIR(find_last_matching_inode(i)->inode.mode)) {
+            account_extents(load_file(i), 1);
+        }
+    }
+}
+
+/**
+ * Forgets an inode and everything it kept live in the log.
+ *
+ * @param inode_number The inode number to drop, which must exist.
+ */
+static void drop_inode(unsigned long inode_number) {
+    if (!S_ISDIR(find_last_matching_inode(inode_number)->inode.mode)) {
+        account_extents(load_file(inode_number), -1);
+    }
+    account_chain(inode_map[inode_number].offset, -1);
+    inode_map_set(inode_number, 0);
+}
+
+/**
+ * Saves the extent map of a file, so its chain starts over from here and the
+ * entries of the old chain are no longer needed. The data they hold stays
+ * where it is for as long as the extent map refers to it.
+ *
+ * @param inode_number The inode number of the file, which must exist.
+ * @return             0 on success, -EFBIG if the extent map does not fit in
+ *                     one log entry, or an error from reserve_log().
+ */
+static int checkpoint_file(unsigned long inode_number) {
+    struct wfs_file *file = load_file(inode_number);
+    size_t entry_size = sizeof(struct wfs_inode) + sizeof(struct wfs_delta) + file->count * sizeof(struct wfs_extent);
+    if (entry_size > MAX_ENTRY_SIZE) {
+        return -EFBIG;
+    }
+    int ret = reserve_log(sizeof(struct wfs_record) + entry_size, sizeof(struct wfs_record) + entry_size);
+    if (ret != 0) {
+        return ret;
+    }
+    struct wfs_log_entry *new_entry = malloc(entry_size);
+    if (new_entry == NULL) {
+        printf("Error: Memory allocation failed\n");
+        return -ENOMEM;
+    }
+
+    struct wfs_delta delta = { .prev = 0 };
+    new_entry->inode = find_last_matching_inode(inode_number)->inode;
+    new_entry->inode.flags = WFS_LOG_EXTENTS;
+    memcpy(new_entry->data, &delta, sizeof(delta));
+    if (file->count > 0) {
+        memcpy(new_entry->data + sizeof(delta), file->extents, file->count * sizeof(struct wfs_extent));
+    }
+
+    account_chain(inode_map[inode_number].offset, -1);
+    append_log_entry(new_entry, entry_size - sizeof(struct wfs_inode)); // Cannot fail: the room was reserved above
+    free(new_entry);
+    file->deltas = 0;
+    return 0;
+}
+
+/**
+ * Maps runs of bytes already in data segments into a file, with a single
+ * WFS_LOG_MAP entry. The caller must have reserved room for the entry.
+ *
+ * @param inode_number The inode number of the file, which must exist.
+ * @param runs         Where in the file each run goes and where in the image it is, in order.
+ * @param count        The number of runs, at most MAP_EXTENTS.
+ * @param touch        Nonzero to update the modification and change times.
+ * @return             0 on success, or -ENOSPC.
+ */
+static int map_file_runs(unsigned long inode_number, const struct wfs_extent *runs, size_t count, int touch) {
+    struct wfs_file *file = load_file(inode_number); // Before the append, which would add the entry to it
+    struct {
+        struct wfs_inode inode;
+        char data[sizeof(struct wfs_delta) + MAP_EXTENTS * sizeof(struct wfs_extent)]; // Packed, as in the log
+    } entry;
+    entry.inode = find_last_matching_inode(inode_number)->inode;
+    for (size_t i = 0; i < count; i++) {
+        if (runs[i].offset + runs[i].length > entry.inode.size) {
+            entry.inode.size = runs[i].offset + runs[i].length;
+        }
+    }
+    struct wfs_delta delta = { .prev = inode_map[inode_number].offset };
+    entry.inode.flags = WFS_LOG_MAP;
+    if (touch) {
+        entry.inode.mtime = wall_clock();
+        entry.inode.ctime = entry.inode.mtime;
+    }
+    memcpy(entry.data, &delta, sizeof(delta));
+    memcpy(entry.data + sizeof(delta), runs, count * sizeof(struct wfs_extent));
+
+    uint32_t data_size = sizeof(struct wfs_delta) + count * sizeof(struct wfs_extent);
+    if (append_log_entry((struct wfs_log_entry*)&entry, data_size) == NULL) {
+        return -ENOSPC;
+    }
+    for (size_t i = 0; i < count; i++) {
+        file_map_range(file, runs[i].offset, runs[i].length, runs[i].location, 1);
+    }
+    file->deltas++;
+    return 0;
+}
+
+/**
+ * Returns the log room it takes to write bytes to a file as data runs and
+ * the WFS_LOG_MAP entries that map them in.
+ *
+ * @param size    The number of bytes.
+ * @param runs    The number of runs they are split into.
+ * @param largest Where to store the size of the largest run or entry.
+ * @return        The total number of bytes.
+ */
+static size_t file_runs_bytes(size_t size, size_t runs, size_t *largest) {
+    size_t maps = (runs + MAP_EXTENTS - 1) / MAP_EXTENTS;
+    size_t header = sizeof(struct wfs_record) + sizeof(struct wfs_inode) + sizeof(struct wfs_delta);
+    size_t map_size = header + (runs < MAP_EXTENTS ? runs : MAP_EXTENTS) * sizeof(struct wfs_extent);
+    size_t run_header = sizeof(struct wfs_record) + (compress_data ? sizeof(struct wfs_packed_run) : sizeof(struct wfs_data_run));
+    size_t run_size = run_header + (size < run_limit() ? size : run_limit());
+    *largest = run_size > map_size ? run_size : map_size;
+    return size + runs * (run_header + sizeof(struct wfs_extent)) + maps * header;
+}
+
+/**
+ * Writes bytes to a file on an image with deduplication on, as write_file()
+ * does otherwise. The bytes are taken from the source into a buffer, cut
+ * into chunks there, and each chunk is mapped to a run that already holds
+ * its bytes or else written to a run of its own. Chunks are cut afresh for
+ * each write, so their boundaries start out at the write's offset and then
+ * follow the content.
+ *
+ * @return As write_file().
+ */
+static int write_chunks(unsigned long inode_number, libwfs_source_t source, void *context, uint32_t size, uint64_t offset) {
+    size_t largest;
+    size_t bytes = file_runs_bytes(size, size / CHUNK_MIN + 1, &largest); // Only the last chunk may be shorter
+    int ret = reserve_log(bytes, largest);
+    if (ret != 0) {
+        return ret;
+    }
+
+    char buffer[2 * CHUNK_MAX];
+    uint32_t start = 0;  // first byte in the buffer not stored yet
+    uint32_t held = 0;   // end of the bytes in the buffer
+    uint32_t taken = 0;  // bytes taken from the source
+    int failed = 0;      // what the source returned once it failed
+    struct wfs_extent runs[MAP_EXTENTS];
+    size_t count = 0;
+    uint32_t done = 0;   // bytes stored
+    uint32_t mapped = 0; // bytes mapped into the file
+    while (ret == 0 && done < size) {
+        if (held - start < CHUNK_MAX && taken < size && failed == 0) {
+            memmove(buffer, buffer + start, held - start);
+            held -= start;
+            start = 0;
+            uint32_t want = size - taken < sizeof(buffer) - held ? size - taken : sizeof(buffer) - held;
+            failed = source(context, buffer + held, want);
+            if (failed == 0) {
+                held += want;
+                taken += want;
+            }
+        }
+        if (held == start) {
+            break; // The source failed, and all that came in before is stored
+        }
+        uint64_t started = op_clock();
+        uint32_t piece = chunk_cut((const unsigned char*)buffer + start, held - start);
+        atomic_fetch_add_explicit(&chunk_nanoseconds, op_clock() - started, memory_order_relaxed);
+        uint64_t location;
+        ret = store_chunk(inode_number, buffer + start, piece, offset + done, &location);
+        if (ret == 0) {
+            runs[count++] = (struct wfs_extent){ .offset = offset + done, .length = piece, .location = location };
+            done += piece;
+            start += piece;
+        }
+        if (count == MAP_EXTENTS) {
+            ret = map_file_runs(inode_number, runs, count, 1);
+            mapped = ret == 0 ? done : mapped;
+            count = 0;
+        }
+    }
+    // Whatever came in before a failing source is still written
+    if (count > 0 && map_file_runs(inode_number, runs, count, 1) == 0) {
+        mapped = done;
+    } else if (count > 0) {
+        ret = -ENOSPC;
+    }
+    ret = ret != 0 ? ret : failed;
+
+    if (load_file(inode_number)->deltas >= WFS_FILE_CHECKPOINT) {
+        checkpoint_file(inode_number); // The data is already written; the checkpoint can wait
+    }
+    return mapped > 0 || ret == 0 ? (int)mapped : ret;
+}
+
+/**
+ * Appends the bytes written to a file to the file data and maps them in.
+ *
+ * The bytes go to data segments in runs of at most run_limit(), and each
+ * MAP_EXTENTS runs are mapped in by one small log entry. Once
+ * WFS_FILE_CHECKPOINT of those have been written since the file's last full
+ * entry, its extent map is saved as well, so rebuilding it never has to
+ * follow a long chain. With deduplication on, write_chunks() writes them.
+ *
+ * @param inode_number The inode number of the file, which must exist.
+ * @param source       Produces the bytes to write, in order.
+ * @param context      Passed on to the source.
+ * @param size         The number of bytes to write.
+ * @param offset       The offset within the file to write at.
+ * @return             The number of bytes written, which is short if the
+ *                     source failed part way, or a negative error code.
+ */
+static int write_file(unsigned long inode_number, libwfs_source_t source, void *context, uint32_t size, uint64_t offset) {
+    if (dedup_data) {
+        return write_chunks(inode_number, source, context, size, offset);
+    }
+    size_t largest;
+    size_t bytes = file_runs_bytes(size, (size + run_limit() - 1) / run_limit(), &largest);
+    int ret = reserve_log(bytes, largest);
+    if (ret != 0) {
+        return ret;
+    }
+
+    struct wfs_extent runs[MAP_EXTENTS];
+    size_t count = 0;
+    uint32_t done = 0;   // bytes in data runs
+    uint32_t mapped = 0; // bytes mapped into the file
+    while (ret == 0 && done < size) {
+        uint32_t piece = size - done < run_limit() ? size - done : run_limit();
+        uint64_t location;
+        ret = append_data_run(inode_number, source, context, piece, offset + done, &location);
+        if (ret == 0) {
+            runs[count++] = (struct wfs_extent){ .offset = offset + done, .length = piece, .location = location };
+            done += piece;
+        }
+        // Whatever came in before a failing source is still written
+        if (count > 0 && (ret != 0 || count == MAP_EXTENTS || done == size)) {
+            if (map_file_runs(inode_number, runs, count, 1) != 0) {
+                ret = -ENOSPC;
+                break;
+            }
+            mapped = done;
+            count = 0;
+        }
+    }
+
+    if (load_file(inode_number)->deltas >= WFS_FILE_CHECKPOINT) {
+        checkpoint_file(inode_number); // The data is already written; the checkpoint can wait
+    }
+    return mapped > 0 || ret == 0 ? (int)mapped : ret;
+}
+
+/**
+ * Finds the bytes of part of an extent: in the image, or for a compressed
+ * packed run, in its decompressed copy, which is first extended past them
+ * if it does not reach them yet.
+ *
+ * @param extent   The extent.
+ * @param from     The file offset of the first byte wanted.
+ * @param to       The file offset just past the last one.
+ * @param unpacked The packed run decompressed last, which is replaced if the extent maps another.
+ * @return         A pointer to the byte at from, or NULL if the run does not decompress.
+ */
+static const char *extent_bytes(const struct wfs_extent *extent, uint64_t from, uint64_t to, struct unpacked_run *unpacked) {
+    if (!is_packed_segment(segment_of(extent->location))) {
+        return (char*)mapped_disk + extent->location + (from - extent->offset);
+    }
+    const struct wfs_packed_run *run = packed_run(extent->location);
+    if (run->codec == WFS_CODEC_NONE) {
+        return (const char*)(run + 1) + (from - run->offset);
+    }
+    if (unpacked->location != extent->location || unpacked->length < to - run->offset) {
+        // The same run read further decompresses the rest of it at once
+        uint32_t wanted = unpacked->location == extent->location ? run->size : to - run->offset;
+        if (lz4_decompress(run + 1, run->length, unpacked->bytes, wanted) != 0) {
+            printf("Error: packed run at %lu of inode %u does not decompress\n", (unsigned long)extent->location, run->inode_number);
+
+            return NULL;
+        }
+        unpacked->location = extent->location;
+        unpacked->length = wanted;
+    }
+    return unpacked->bytes + (from - run->offset);
+}
+
+/**
+ * Copies a range of a file into a buffer, following the extent map to the
+ * newest bytes for each part of the range. Packed runs are decompressed only
+ * as far as the range reaches into them.
+ *
+ * @param inode_number The inode number of the file, which must exist.
+ * @param buf          The buffer to fill.
+ * @param size         The number of bytes to read.
+ * @param offset       The offset within the file to read from.
+ * @return             The number of bytes read, which is short at the end of
+ *                     the file, or -EIO if a packed run does not decompress.
+ */
+static int read_file(unsigned long inode_number, char *buf, size_t size, uint64_t offset) {
+    uint64_t file_size = find_last_matching_inode(inode_number)->inode.size;
+    if (offset >= file_size) {
+        return 0;
+    }
+    if (size > file_size - offset) {
+        size = file_size - offset;
+    }
+    uint64_t end = offset + size;
+
+    struct wfs_file *file = load_file(inode_number);
+    size_t low = 0; // Binary search for the first extent ending after offset
+    size_t high = file->count;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (file->extents[mid].offset + file->extents[mid].length <= offset) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    struct unpacked_run unpacked;
+    unpacked.location = 0;
+    memset(buf, 0, size); // Holes read as zeros
+    for (size_t i = low; i < file->count && file->extents[i].offset < end; i++) {
+        struct wfs_extent *extent = &file->extents[i];
+        uint64_t from = extent->offset > offset ? extent->offset : offset;
+        uint64_t to = extent->offset + extent->length < end ? extent->offset + extent->length : end;
+        const char *bytes = extent_bytes(extent, from, to, &unpacked);
+        if (bytes == NULL) {
+            return -EIO;
+        }
+        memcpy(buf + (from - offset), bytes, to - from);
+    }
+    return size;
+}
+
+/**
+ * Lists where in the image the bytes of a range of a file are, in order, so
+ * they can be handed on without copying. Holes point at zero_block. Bytes of
+ * compressed packed runs are decompressed into a buffer of their own and
+ * point there. The pointers stay good only while the file's lock is held.
+ *
+ * @param inode_number The inode number of the file, which must exist.
+ * @param size         The number of bytes to map.
+ * @param offset       The offset within the file to map from.
+ * @param count        Where to store the number of pieces.
+ * @param length       Where to store the number of bytes mapped, which is short at the end of the file.
+ * @param copies       Where to store the buffer of decompressed bytes, NULL if none were needed;
+ *                     the caller frees it once done with the pieces.
+ * @param error        Where to store -ENOMEM or -EIO on failure.
+ * @return             The pieces, which the caller frees, or NULL on failure.
+ */
+static struct iovec *map_file(unsigned long inode_number, size_t size, uint64_t offset, int *count, size_t *length, char **copies, int *error) {
+    uint64_t file_size = find_last_matching_inode(inode_number)->inode.size;
+    size = offset >= file_size ? 0 : size < file_size - offset ? size : file_size - offset;
+    uint64_t end = offset + size;
+    struct wfs_file *file = load_file(inode_number);
+
+    *copies = NULL;
+    *error = -ENOMEM;
+    size_t capacity = 8;
+    struct iovec *iov = malloc(capacity * sizeof(struct iovec));
+    if (iov == NULL) {
+        printf("Error: Memory allocation failed\n");
+        return NULL;
+    }
+    struct unpacked_run unpacked;
+    unpacked.location = 0;
+    *count = 0;
+    *length = size;
+    size_t i = 0; // Binary search for the first extent ending after offset
+    size_t high = file->count;
+    while (i < high) {
+        size_t mid = (i + high) / 2;
+        if (file->extents[mid].offset + file->extents[mid].length <= offset) {
+            i = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    uint64_t at = offset;
+    while (at < end) {
+        struct wfs_extent *extent = i < file->count && file->extents[i].offset < end ? &file->extents[i] : NULL;
+        const char *base;
+        uint64_t to;
+        if (extent != NULL && extent->offset <= at) {
+            to = extent->offset + extent->length < end ? extent->offset + extent->length : end;
+            base = extent_bytes(extent, at, to, &unpacked);
+            if (base == NULL) {
+                *error = -EIO;
+                free(*copies);
+                free(iov);
+                return NULL;
+            }
+            if (is_packed_segment(segment_of(extent->location)) && packed_run(extent->location)->codec != WFS_CODEC_NONE) {
+                // The decompressed copy is reused for the next run, so the bytes move to the buffer
+                *copies = *copies != NULL ? *copies : malloc(size);
+                if (*copies == NULL) {
+                    printf("Error: Memory allocation failed\n");
+                    free(iov);
+                    return NULL;
+                }
+                memcpy(*copies + (at - offset), base, to - at);
+                base = *copies + (at - offset);
+            }
+            i++;
+        } else {
+            base = (char*)zero_block;
+            to = extent != NULL ? extent->offset : end;
+            if (to - at > sizeof(zero_block)) {
+                to = at + sizeof(zero_block);
+            }
+        }
+        if ((size_t)*count == capacity) {
+            capacity *= 2;
+            struct iovec *grown = realloc(iov, capacity * sizeof(struct iovec));
+            if (grown == NULL) {
+                printf("Error: Memory allocation failed\n");
+                free(*copies);
+                free(iov);
+                return NULL;
+            }
+            iov = grown;
+        }
+        iov[(*count)++] = (struct iovec){ .iov_base = (char*)base, .iov_len = to - at };
+        at = to;
+    }
+    return iov;
+}
+
+/**
+ * Checks whether an inode still needs anything stored in a segment, either
+ * an entry of its chain or, for a file, bytes its extent map refers to.
+ *
+ * @param inode_number The inode number to check.
+ * @param segment      The segment number.
+ * @return             1 if the inode needs the segment, 0 otherwise.
+ */
+static int inode_in_segment(unsigned long inode_number, uint32_t segment) {
+    if (inode_number >= inode_map_size || inode_map[inode_number].offset == 0) {
+        return 0;
+    }
+    size_t chain_length;
+    uint64_t *chain = read_chain(inode_map[inode_number].offset, &chain_length);
+    int found = 0;
+    for (size_t i = 0; i < chain_length && !found; i++) {
+        found = segment_of(chain[i]) == segment;
+    }
+    free(chain);
+    if (found || S_ISDIR(find_last_matching_inode(inode_number)->inode.mode)) {
+        return found;
+    }
+
+    struct wfs_file *file = load_file(inode_number);
+    for (size_t i = 0; i < file->count; i++) {
+        if (segment_of(file->extents[i].location) == segment) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Rewrites whatever an inode still needs from a segment at the head of the
+ * log and of the file data.
+ *
+ * A directory is written in full. A file has the bytes its extent map refers
+ * to in the segment written again as data runs, and its extent map saved if
+ * its chain also runs through the segment.
+ *
+ * @param inode_number The inode number to move, which must exist.
+ * @param segment      The segment being cleaned.
+ * @return             0 on success, or a negative error code.
+ */
+static int relocate_inode(unsigned long inode_number, uint32_t segment) {
+    if (S_ISDIR(find_last_matching_inode(inode_number)->inode.mode)) {
+        return checkpoint_dir(inode_number);
+    }
+
+    struct wfs_file *file = load_file(inode_number);
+    size_t bytes = 0;
+    size_t moving = 0;
+    for (size_t i = 0; i < file->count; i++) {
+        if (segment_of(file->extents[i].location) == segment) {
+            bytes += file->extents[i].length;
+            moving += (file->extents[i].length + run_limit() - 1) / run_limit();
+        }
+    }
+    size_t largest;
+    bytes = file_runs_bytes(bytes, moving, &largest);
+    int ret = reserve_log(bytes, largest);
+    if (ret != 0) {
+        return ret;
+    }
+
+    // Each extent is replaced exactly. Extents only ever get split, so none
+    // is longer than the run it came from and most take one run. Plain ones
+    // moving to packed runs, which are smaller, take several, as would one
+    // from fsck.wfs that does not fit. Packed runs the cleaner moves to are
+    // compressed afresh, so data written before compression was turned on
+    // gets compressed as its segments are cleaned. With deduplication on,
+    // pieces are looked up like new chunks, so files that shared a run
+    // share its new copy.
+    struct wfs_extent runs[MAP_EXTENTS];
+    struct unpacked_run unpacked;
+    unpacked.location = 0;
+    size_t count = 0;
+    for (size_t i = 0; i < file->count; i++) {
+        struct wfs_extent extent = file->extents[i];
+        if (segment_of(extent.location) != segment) {
+            continue;
+        }
+        for (uint32_t done = 0; done < extent.length;) {
+            struct wfs_extent piece = {
+                .offset = extent.offset + done,
+                .length = extent.length - done < run_limit() ? extent.length - done : run_limit(),
+            };
+            const char *next = extent_bytes(&extent, piece.offset, piece.offset + piece.length, &unpacked);
+            if (next == NULL) {
+                return -EIO;
+            }
+            if (dedup_data) {
+                ret = store_chunk(inode_number, next, piece.length, piece.offset, &piece.location);
+            } else {
+                ret = append_data_run(inode_number, copy_from_memory, &next, piece.length, piece.offset, &piece.location);
+            }
+            if (ret != 0) {
+                return ret;
+            }
+            runs[count++] = piece;
+            done += piece.length;
+            moving--;
+            if (count == MAP_EXTENTS || moving == 0) {
+                ret = map_file_runs(inode_number, runs, count, 0);
+                if (ret != 0) {
+                    return ret;
+                }
+                count = 0;
+            }
+        }
+    }
+    if (inode_in_segment(inode_number, segment)) {
+        return checkpoint_file(inode_number);
+    }
+    return 0;
+}
+
+/**
+ * Finds every file that maps in a chunk whose run was written to another
+ * file, and makes the lists of sharers of the segments hold exactly those.
+ * Mounting does not keep track of sharers, so until this has run, the lists
+ * only hold the files that mapped in such chunks since. The caller holds
+ * fs_lock exclusively.
+ */
+static void rebuild_sharers() {
+    for (uint32_t segment = 0; segment < segment_count; segment++) {
+        segment_chunks[segment].sharer_count = 0;
+    }
+    for (unsigned long i = 0; i < inode_map_size; i++) {
+        if (inode_map[i].offset == 0 || S_ISDIR(find_last_matching_inode(i)->inode.mode)) {
+            continue;
+        }
+        struct wfs_file *file = load_file(i);
+        for (size_t j = 0; j < file->count; j++) {
+            const struct wfs_chunk *chunk = chunk_at(file->extents[j].location);
+            if (chunk != NULL && chunk_owner(chunk->location) != i) {
+                add_sharer(segment_of(chunk->location), i);
+            }
+        }
+    }
+}
+
+/**
+ * Moves the chunks of a data segment being cleaned out of it for the files
+ * that map them in but did not write them, once the files that did have
+ * moved theirs. If the list of sharers misses some, it is rebuilt.
+ *
+ * @param segment The segment being cleaned, whose chunks are hidden.
+ * @return        0 on success, -EIO if chunks are still mapped in after
+ *                that, or an error from relocate_inode().
+ */
+static int relocate_sharers(uint32_t segment) {
+    for (int pass = 0; pass < 2 && chunks_mapped(segment); pass++) {
+        if (pass == 1) {
+            rebuild_sharers();
+        }
+        for (uint32_t i = 0; i < segment_chunks[segment].sharer_count; i++) {
+            uint32_t sharer = segment_chunks[segment].sharers[i];
+            if (inode_in_segment(sharer, segment)) {
+                int ret = relocate_inode(sharer, segment);
+                if (ret != 0) {
+                    return ret;
+                }
+            }
+        }
+    }
+    if (chunks_mapped(segment)) {
+        printf("Error: chunks of segment %u are still mapped in after cleaning it\n", segment);
+        return -EIO;
+    }
+    return 0;
+}
+
+/**
+ * Returns the sequence number of the oldest log segment in use other than
+ * the given one, or UINT64_MAX if there is none.
+ */
+static uint64_t oldest_log_sequence(uint32_t except) {
+    uint64_t oldest = UINT64_MAX;
+    for (uint32_t segment = 0; segment < segment_count; segment++) {
+        if (segment != except && is_log_segment(segment) && segment_sequence[segment] < oldest) {
+            oldest = segment_sequence[segment];
+        }
+    }
+    return oldest;
+}
+
+/**
+ * Moves a tombstone out of a segment being cleaned if older entries of its
+ * inode may still be replayed, and otherwise drops it.
+ *
+ * @param offset The tombstone's entry.
+ * @param oldest The sequence number of the oldest log segment that stays in use.
+ * @return       0 on success, or an error from reserve_log().
+ */
+static int relocate_tombstone(uint64_t offset, uint64_t oldest) {
+    struct wfs_log_entry *entry = (struct wfs_log_entry*)((char*)mapped_disk + offset);
+    unsigned long inode_number = entry->inode.inode_number;
+    if (inode_number >= inode_map_size || inode_map[inode_number].tombstone != offset) {
+        return 0; // No longer the inode's
+    }
+    struct {
+        struct wfs_inode inode;
+        struct wfs_tombstone tombstone;
+    } copy;
+    memcpy(&copy, entry, sizeof(copy));
+    if (copy.tombstone.sequence < oldest) {
+        account_tombstone(inode_number, -1);
+        inode_map[inode_number].tombstone = 0;
+        return 0;
+    }
+
+    int ret = reserve_log(sizeof(struct wfs_record) + sizeof(copy), sizeof(struct wfs_record) + sizeof(copy));
+    if (ret != 0) {
+        return ret;
+    }
+    account_tombstone(inode_number, -1);
+    append_log_entry((struct wfs_log_entry*)&copy, sizeof(copy.tombstone)); // Cannot fail: the room was reserved above
+    return 0;
+}
+
+/**
+ * Frees a segment by moving everything still live in it to the head of the log.
+ *
+ * The inodes that may need something from it are those of its log entries,
+ * or for a data segment, the files its runs were written to. Whatever no
+ * inode needs any more is simply dropped, tombstones included once every
+ * log segment they were written after is gone. The segment's header is cleared
+ * last, so if the image is left behind part way, replay still finds either
+ * the old or the new copy of every inode.
+ *
+ * A data segment may hold runs a crash tore, which nothing maps in; they are
+ * told apart by their CRCs and stepped over a byte at a time until the next
+ * run that checks out. With deduplication on, its chunks are hidden first,
+ * so nothing moved maps them again, and files that map in chunks they did
+ * not write are moved after the ones that wrote them.
+ *
+ * @param segment The segment to clean; must be in use and not an active segment.
+ * @return        0 on success, or a negative error code.
+ */
+static int clean_segment(uint32_t segment) {
+    cleaning = 1;
+    int data = is_data_segment(segment);
+    uint32_t run_type = is_packed_segment(segment) ? WFS_RECORD_PACKED_RUN : WFS_RECORD_RUN;
+    uint64_t oldest = data ? 0 : oldest_log_sequence(segment);
+    uint64_t offset = segment_first_entry(segment);
+    uint64_t end = (uint64_t)segment * WFS_SEGMENT_SIZE + segment_header(segment)->used;
+    if (data && dedup_data) {
+        hide_chunks(segment);
+    }
+    while (offset < end) {
+        if (data && !record_valid(offset, end, run_type)) {
+            offset++;
+            continue;
+        }
+        struct wfs_record *record = (struct wfs_record*)((char*)mapped_disk + offset);
+        struct wfs_log_entry *entry = (struct wfs_log_entry*)(record + 1);
+        struct wfs_data_run *run = (struct wfs_data_run*)(record + 1); // A packed run starts the same
+        unsigned long owner = data ? run->inode_number : entry->inode.inode_number;
+        int deleted = !data && entry->inode.deleted;
+        offset += sizeof(struct wfs_record) + record->length;
+        int ret = 0;
+        if (!data && entry->inode.flags == WFS_LOG_TOMBSTONE) {
+            ret = relocate_tombstone((char*)entry - (char*)mapped_disk, oldest);
+        } else if (!deleted && inode_in_segment(owner, segment)) {
+            ret = relocate_inode(owner, segment);
+        }
+        if (ret != 0) {
+            cleaning = 0;
+            return ret;
+        }
+    }
+    if (dedup_data) {
+        int ret = relocate_sharers(segment);
+        if (ret != 0) {
+            cleaning = 0;
+            return ret;
+        }
+        drop_chunks(segment);
+    }
+
+    // The newest checkpoint may still point into the segment, so it can only
+    // be reused once the next checkpoint has been written
+    struct wfs_segment *header = segment_header(segment);
+    header->magic = 0;
+    header->used = 0;
+    header->sequence = 0;
+    segment_live[segment] = 0;
+    segment_sequence[segment] = 0;
+    pending_segments[pending_count++] = segment;
+    cleaning = 0;
+    segments_cleaned++;
+    return 0;
+}
+
+/**
+ * Picks the segment that is most worth cleaning.
+ *
+ * Segments are weighed by cost-benefit: the free space cleaning would gain,
+ * times how long the segment has gone without changing, over the cost of
+ * reading it and writing out what is still live. Old, mostly dead segments
+ * go first; a segment written a moment ago may still die off by itself.
+ *
+ * @return The segment number, or SEGMENT_NONE if no segment would gain anything.
+ */
+static uint32_t pick_victim() {
+    uint32_t victim = SEGMENT_NONE;
+    double best = 0;
+    for (uint32_t segment = 0; segment < segment_count; segment++) {
+        if (segment == log_segment() || segment == data_segment() || segment_sequence[segment] == 0) {
+            continue;
+        }
+        double capacity = WFS_SEGMENT_SIZE - segment_first_entry(segment) % WFS_SEGMENT_SIZE;
+        double utilization = segment_live[segment] / capacity;
+        if (utilization >= 1) {
+            continue;
+        }
+        double age = last_sequence - segment_sequence[segment] + 1;
+        double score = (1 - utilization) * age / (1 + utilization);
+        if (score > best) {
+            best = score;
+            victim = segment;
+        }
+    }
+    return victim;
+}
+
+/**
+ * Body of the background cleaner thread.
+ *
+ * Whenever fewer than options.clean_threshold segments are free, the image
+ * grows if it is mostly live; otherwise, or if it may not grow, segments are
+ * cleaned at no more than options.clean_rate per second, so writers are never
+ * locked out for long. Otherwise the cleaner checks again once a second, and
+ * writes a checkpoint if segments have been cleaned or CHECKPOINT_SEGMENTS
+ * segments written since the last one. Each round holds fs_lock exclusively.
+ *
+ * @param arg Unused.
+ * @return    NULL.
+ */
+static void *cleaner_main(void *arg) {
+    pthread_mutex_lock(&cleaner_lock);
+    while (!cleaner_stop) {
+        pthread_mutex_unlock(&cleaner_lock);
+        struct timespec wait;
+        clock_gettime(CLOCK_REALTIME, &wait);
+        begin_exclusive();
+        uint32_t before = free_count + pending_count; // Cleaned segments are free after the next checkpoint
+        uint32_t threshold = options.clean_threshold > 0 ? options.clean_threshold : CLEANER_RESERVE + segment_count / 8 + 1;
+        uint32_t victim = SEGMENT_NONE;
+        if (before < threshold && mostly_live()) {
+            grow_image(); // Cheaper than cleaning; if it cannot, cleaning is all that is left
+        }
+        if (options.clean_rate > 0 && free_count + pending_count < threshold) {
+            victim = pick_victim();
+        }
+        if (victim != SEGMENT_NONE && clean_segment(victim) == 0 && free_count + pending_count > before) {
+            wait.tv_nsec += 1000000000L / options.clean_rate;
+            wait.tv_sec += wait.tv_nsec / 1000000000L;
+            wait.tv_nsec %= 1000000000L;
+        } else {
+            if (pending_count > 0 || segments_since_checkpoint >= CHECKPOINT_SEGMENTS) {
+                write_checkpoint();
+            }
+            wait.tv_sec += 1; // Nothing to do, or nothing gained
+        }
+        end_exclusive();
+        pthread_mutex_lock(&cleaner_lock);
+        if (!cleaner_stop) {
+            pthread_cond_timedwait(&cleaner_wakeup, &cleaner_lock, &wait);
+        }
+    }
+    pthread_mutex_unlock(&cleaner_lock);
+    return NULL;
+}
+
+/**
+ * Notes that everything appended so far is on disk. The caller holds fs_lock
+ * exclusively, so no append is under way.
+ */
+static void mark_committed() {
+    committed_sequence = last_sequence;
+    committed_log = log_head();
+    committed_data = data_segment() != SEGMENT_NONE ? (uint64_t)data_segment() * WFS_SEGMENT_SIZE + segment_header(data_segment())->used : 0;
+}
+
+/**
+ * Returns the part of a segment a commit has to flush: what was appended to
+ * it after the last commit, up to where it ended when this one started.
+ *
+ * @param segment  The segment.
+ * @param sequence The newest segment opened when the commit started.
+ * @param log_end  The end of the log then.
+ * @param data_end The end of the file data then, or 0.
+ * @param start    Where to store the start of the part.
+ * @return         The end of the part, which is no further than start if
+ *                 there is nothing to flush.
+ */
+static uint64_t commit_range(uint32_t segment, uint64_t sequence, uint64_t log_end, uint64_t data_end, uint64_t *start) {
+    uint64_t base = (uint64_t)segment * WFS_SEGMENT_SIZE;
+    *start = base;
+    if (segment_sequence[segment] == 0 || segment_sequence[segment] > sequence) {
+        return base; // Free, or opened since the commit started
+    }
+    if (segment_sequence[segment] <= committed_sequence) {
+        // Only the segments that were being filled at the last commit have grown since
+        if (committed_log > base && segment_of(committed_log - 1) == segment) {
+            *start = committed_log;
+        } else if (committed_data > base && segment_of(committed_data - 1) == segment) {
+            *start = committed_data;
+        } else {
+            return base;
+        }
+    }
+    if (log_end > base && segment_of(log_end - 1) == segment) {
+        return log_end;
+    }
+    if (data_end > base && segment_of(data_end - 1) == segment) {
+        return data_end;
+    }
+    return base + segment_header(segment)->used;
+}
+
+/**
+ * Flushes part of the image to disk.
+ *
+ * @param start The offset of the first byte, which is rounded down to a page.
+ * @param end   The offset just past the last byte.
+ * @return      The bytes flushed, or a negative error code.
+ */
+static long flush_range(size_t start, size_t end) {
+    start -= start % sysconf(_SC_PAGESIZE);
+    if (end <= start) {
+        return 0;
+    }
+    if (msync((char*)mapped_disk + start, end - start, MS_SYNC) == -1) {
+        return -errno;
+    }
+    return end - start;
+}
+
+/**
+ * Makes everything appended to the log and the file data so far durable.
+ *
+ * Appends under way finish first; then whatever went to each segment since
+ * the last commit is flushed, leaving out the page holding the segment's
+ * header. The headers, which say how much of each segment is filled, follow
+ * once that is on disk, and the superblock comes last. Nothing ever claims
+ * more of the log than has reached the disk before it. Operations go on
+ * while the flush runs; only the cleaner and others that need the exclusive
+ * lock wait for it.
+ *
+ * @return 0 on success, or a negative error code.
+ */
+static int commit_log() {
+    begin_exclusive();
+    uint64_t sequence = last_sequence;
+    uint64_t log_end = log_head();
+    uint64_t data_end = data_segment() != SEGMENT_NONE ? (uint64_t)data_segment() * WFS_SEGMENT_SIZE + segment_header(data_segment())->used : 0;
+    unsigned long seen = checkpoints;
+    int idle = sequence == committed_sequence && log_end == committed_log && data_end == committed_data;
+    end_exclusive();
+    if (idle) {
+        return 0;
+    }
+
+    begin_shared();
+    if (checkpoints != seen) {
+        end_shared(); // A checkpoint flushed everything in between
+        return 0;
+    }
+    // Segments are opened under log_lock, so their table is read under it
+    uint64_t (*ranges)[2] = malloc(segment_count * sizeof(*ranges));
+    if (ranges == NULL) {
+        end_shared();
+        printf("Error: Memory allocation failed\n");
+        return -ENOMEM;
+    }
+    uint32_t count = 0;
+    pthread_mutex_lock(&log_lock);
+    for (uint32_t segment = 0; segment < segment_count; segment++) {
+        ranges[count][1] = commit_range(segment, sequence, log_end, data_end, &ranges[count][0]);
+        count += ranges[count][1] > ranges[count][0];
+    }
+    pthread_mutex_unlock(&log_lock);
+
+    uint32_t page = sysconf(_SC_PAGESIZE) < WFS_SEGMENT_SIZE ? sysconf(_SC_PAGESIZE) : WFS_SEGMENT_SIZE;
+    long flushed = 0;
+    long ret = 0;
+    for (int pass = 0; pass < 2 && ret >= 0; pass++) {
+        for (uint32_t i = 0; i < count && ret >= 0; i++) {
+            uint64_t base = ranges[i][0] - ranges[i][0] % WFS_SEGMENT_SIZE;
+            uint64_t header_end = base + page;
+            if (pass == 0) {
+                ret = flush_range(ranges[i][0] > header_end ? ranges[i][0] : header_end, ranges[i][1]); // All but the header's page
+            } else {
+                ret = flush_range(base, ranges[i][1] < header_end ? ranges[i][1] : header_end);
+            }
+            flushed += ret > 0 ? ret : 0;
+        }
+    }
+    free(ranges);
+    if (ret >= 0) {
+        ((struct wfs_sb*)mapped_disk)->head = log_end;
+        ret = flush_range(0, sizeof(struct wfs_sb));
+    }
+    if (ret < 0) {
+        printf("Error: Failed to flush the log: %s\n", strerror(-ret));
+    } else {
+        committed_sequence = sequence;
+        committed_log = log_end;
+        committed_data = data_end;
+        commits++;
+        commit_bytes += flushed;
+    }
+    end_shared();
+    return ret < 0 ? ret : 0;
+}
+
+/**
+ * Body of the commit thread. Runs a commit whenever an fsync is waiting for
+ * one, and under periodic durability also every options.commit_interval ms.
+ * Tickets taken while a commit runs are served by the next.
+ *
+ * @param arg Unused.
+ * @return    NULL.
+ */
+static void *commit_main(void *arg) {
+    unsigned int interval = options.commit_interval > 0 ? options.commit_interval : DEFAULT_COMMIT_INTERVAL;
+    pthread_mutex_lock(&commit_lock);
+    while (!commit_stop) {
+        if (commit_finished == commit_requested) {
+            if (options.durability != LIBWFS_DURABILITY_PERIODIC) {
+                pthread_cond_wait(&commit_wakeup, &commit_lock);
+                continue;
+            }
+            struct timespec wait;
+            clock_gettime(CLOCK_REALTIME, &wait);
+            wait.tv_sec += interval / 1000;
+            wait.tv_nsec += interval % 1000 * 1000000L;
+            wait.tv_sec += wait.tv_nsec / 1000000000L;
+            wait.tv_nsec %= 1000000000L;
+            if (pthread_cond_timedwait(&commit_wakeup, &commit_lock, &wait) != ETIMEDOUT) {
+                continue;
+            }
+        }
+        uint64_t batch = commit_requested;
+        pthread_mutex_unlock(&commit_lock);
+        int ret = commit_log();
+        pthread_mutex_lock(&commit_lock);
+        commit_finished = batch;
+        commit_error = ret;
+        pthread_cond_broadcast(&commit_done);
+    }
+    pthread_mutex_unlock(&commit_lock);
+    return NULL;
+}
+
+/**
+ * Writes a checkpoint of the inode map, the highest inode number and the
+ * state of every segment, so the next mount only has to replay the log
+ * written after it.
+ *
+ * The checkpoint goes into free segments. Everything is flushed to disk
+ * before the superblock is pointed at it, and only then are the segments of
+ * the previous checkpoint and those cleaned since it free for reuse.
+ *
+ * @return 0 on success, -ENOSPC if too few segments are free, -ENOMEM, or
+ *         the error msync() gave if the checkpoint did not reach the disk.
+ */
+static int write_checkpoint() {
+    uint32_t parts = checkpoint_parts();
+    if (free_count < parts) {
+        return -ENOSPC;
+    }
+    uint32_t inodes = inode_number + 1;
+    size_t bytes = sizeof(struct wfs_checkpoint) + (parts + segment_count + 1) * sizeof(uint32_t) +
+                   inodes * sizeof(uint64_t) + segment_count * sizeof(struct wfs_segment_usage) +
+                   (dedup_data ? sizeof(uint32_t) + chunk_count * sizeof(struct wfs_chunk) : 0);
+    char *stream = malloc(bytes);
+    if (stream == NULL) {
+        printf("Error: Memory allocation failed\n");
+        return -ENOMEM;
+    }
+
+    struct wfs_checkpoint *checkpoint = (struct wfs_checkpoint*)stream;
+    uint32_t *part = (uint32_t*)(checkpoint + 1);
+    for (uint32_t i = 0; i < parts; i++) {
+        part[i] = free_segments[--free_count];
+    }
+    // Nothing is written to these before the superblock points at the new checkpoint
+    for (uint32_t i = 0; i < checkpoint_count; i++) {
+        free_segments[free_count++] = checkpoint_segments[i];
+    }
+    for (uint32_t i = 0; i < pending_count; i++) {
+        free_segments[free_count++] = pending_segments[i];
+    }
+
+    checkpoint->magic = WFS_CHECKPOINT_MAGIC;
+    checkpoint->head = log_head();
+    checkpoint->sequence = last_sequence;
+    checkpoint->inode_number = inode_number;
+    checkpoint->inodes = inodes;
+    checkpoint->segments = segment_count;
+    checkpoint->free = free_count;
+    checkpoint->parts = parts;
+    uint64_t *map = (uint64_t*)(part + parts);
+    for (uint32_t i = 0; i < inodes; i++) {
+        map[i] = i >= inode_map_size ? 0 : inode_map[i].offset ? inode_map[i].offset : inode_map[i].tombstone;
+    }
+    struct wfs_segment_usage *usage = (struct wfs_segment_usage*)(map + inodes);
+    for (uint32_t i = 0; i < segment_count; i++) {
+        usage[i].sequence = segment_sequence[i];
+        usage[i].live = segment_live[i];
+    }
+    uint32_t *free_stack = (uint32_t*)(usage + segment_count);
+    memcpy(free_stack, free_segments, free_count * sizeof(uint32_t));
+    free_stack[free_count] = data_segment();
+    bytes = (char*)(free_stack + free_count + 1) - stream;
+    if (dedup_data) {
+        uint32_t *chunks = free_stack + free_count + 1;
+        struct wfs_chunk *chunk = (struct wfs_chunk*)(chunks + 1);
+        *chunks = chunk_count;
+        for (uint32_t i = 0; i < segment_count; i++) {
+            if (segment_chunks[i].count > 0) {
+                memcpy(chunk, segment_chunks[i].chunks, segment_chunks[i].count * sizeof(struct wfs_chunk));
+                chunk += segment_chunks[i].count;
+            }
+        }
+        bytes = (char*)chunk - stream;
+    }
+
+    size_t done = 0;
+    for (uint32_t i = 0; i < parts; i++) {
+        uint64_t start = segment_first_entry(part[i]);
+        size_t piece = bytes - done < SEGMENT_ROOM ? bytes - done : SEGMENT_ROOM;
+        memcpy((char*)mapped_disk + start, stream + done, piece);
+        struct wfs_segment *header = segment_header(part[i]);
+        header->magic = WFS_CHECKPOINT_MAGIC;
+        header->used = start % WFS_SEGMENT_SIZE + piece;
+        header->sequence = last_sequence;
+        done += piece;
+    }
+
+    // The log and the checkpoint have to be on disk before the superblock
+    // points at them. If they are not, the superblock is left alone and the
+    // free stack is put back as it was.
+    if (msync(mapped_disk, length, MS_SYNC) == -1) {
+        int ret = -errno;
+        printf("Error: Failed to flush the image before a checkpoint: %s\n", strerror(-ret));
+        free_count -= checkpoint_count + pending_count;
+        for (uint32_t i = parts; i-- > 0;) {
+            free_segments[free_count++] = part[i];
+        }
+        free(stream);
+        return ret;
+    }
+    ((struct wfs_sb*)mapped_disk)->checkpoint = part[0];
+    ((struct wfs_sb*)mapped_disk)->head = log_head();
+    if (msync(mapped_disk, sysconf(_SC_PAGESIZE), MS_SYNC) == -1) {
+        // Either checkpoint may be the one on disk, so neither may be
+        // overwritten: the older one stays taken, and the new one's
+        // segments are freed by the next checkpoint along with those
+        // cleaned since
+        int ret = -errno;
+        printf("Error: Failed to flush the superblock: %s\n", strerror(-ret));
+        free_count -= checkpoint_count + pending_count;
+        memcpy(pending_segments + pending_count, part, parts * sizeof(uint32_t));
+        pending_count += parts;
+        free(stream);
+        return ret;
+    }
+
+    mark_committed();
+    memcpy(checkpoint_segments, part, parts * sizeof(uint32_t));
+    checkpoint_count = parts;
+    checkpoints++;
+    checkpoint_bytes += bytes;
+    pending_count = 0;
+    segments_since_checkpoint = 0;
+    free(stream);
+    return 0;
+}
+
+/**
+ * Brings the state loaded from a checkpoint up to date with the log written
+ * after it.
+ *
+ * The segments written since were taken from the top of the checkpoint's free
+ * stack in order, so they are found by following the stack for as long as
+ * the next segment carries the next sequence number. Data segments among
+ * them only move the head of the file data on. They are all taken in before
+ * any log entry is replayed, as entries may map in runs from any of them.
+ * With deduplication on, their runs and those appended to the checkpoint's
+ * data segment since are added to the chunks once the log is replayed,
+ * before any live bytes are counted again.
+ * The log ends at the first record that does not check out, and later log
+ * segments are dropped. Only the inodes the log entries touch have their
+ * live bytes counted again.
+ *
+ * Segments free at the checkpoint have cleared headers, so any left on the
+ * free stack that still look in use were written after a segment whose
+ * header never reached the disk. They are dropped as well, and their
+ * sequence numbers are never handed out again.
+ */
+static void replay_tail() {
+    uint32_t *logs = malloc((free_count + 1) * sizeof(uint32_t));
+    if (logs == NULL) {
+        printf("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t *datas = malloc((free_count + 1) * sizeof(uint32_t));
+    if (datas == NULL) {
+        printf("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    size_t log_count = 0;
+    size_t data_count = 0;
+    logs[log_count++] = log_segment();
+    if (data_segment() != SEGMENT_NONE) {
+        datas[data_count++] = data_segment();
+    }
+    while (free_count > 0) {
+        uint32_t next = free_segments[free_count - 1];
+        struct wfs_segment *header = segment_header(next);
+        if ((!is_log_segment(next) && !is_data_segment(next)) || header->sequence != last_sequence + 1) {
+            break;
+        }
+        free_count--;
+        segment_sequence[next] = ++last_sequence;
+        segments_since_checkpoint++;
+        if (is_data_segment(next)) {
+            set_data_head(next);
+            datas[data_count++] = next;
+        } else {
+            logs[log_count++] = next;
+        }
+    }
+    for (uint32_t i = 0; i < free_count; i++) {
+        struct wfs_segment *header = segment_header(free_segments[i]);
+        if (is_log_segment(free_segments[i]) || is_data_segment(free_segments[i])) {
+            printf("Error: segment %u was written after a break in the log; dropping it\n", free_segments[i]);
+            last_sequence = header->sequence > last_sequence ? header->sequence : last_sequence;
+            header->magic = 0;
+            header->used = 0;
+            header->sequence = 0;
+            log_torn = 1;
+        }
+    }
+
+    uint64_t *tail = NULL;
+    size_t tail_count = 0;
+    size_t capacity = 0;
+    uint32_t active = log_segment();
+    uint64_t offset = log_head();
+    for (size_t i = 0; i < log_count; i++) {
+        uint32_t segment = logs[i];
+        if (log_torn) {
+            drop_log_segment(segment);
+            continue;
+        }
+        active = segment;
+        offset = i == 0 ? log_head() : segment_first_entry(segment);
+        uint64_t end = recover_segment(segment, offset);
+        while (offset < end) {
+            if (tail_count == capacity) {
+                capacity = capacity ? capacity * 2 : 256;
+                tail = realloc(tail, capacity * sizeof(uint64_t));
+                if (tail == NULL) {
+                    printf("Memory allocation failed");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            tail[tail_count++] = offset + sizeof(struct wfs_record);
+            struct wfs_log_entry *entry = (struct wfs_log_entry*)((char*)mapped_disk + offset + sizeof(struct wfs_record));
+            inode_map_slot(entry->inode.inode_number);
+            offset += sizeof(struct wfs_record) + sizeof(struct wfs_inode) + entry_data_size(entry);
+        }
+    }
+    free(logs);
+    set_log_head(active, offset);
+
+    // Replay marked the runs it maps in as used, so none of them is missed
+    for (size_t i = 0; dedup_data && i < data_count; i++) {
+        index_data_segment(datas[i]);
+    }
+    free(datas);
+
+    // An inode changed since the checkpoint, or marked deleted in place by
+    // an older build, no longer keeps what it kept live at the checkpoint
+    char *touched = calloc(inode_map_size, 1);
+    if (touched == NULL) {
+        printf("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < tail_count; i++) {
+        struct wfs_log_entry *entry = (struct wfs_log_entry*)((char*)mapped_disk + tail[i]);
+        touched[entry->inode.inode_number] = 1;
+        if (entry->inode.flags != WFS_LOG_DENTRY_DEL) {
+            continue;
+        }
+        const char *removed = entry->data + sizeof(struct wfs_delta);
+        const char *end = entry->data + entry_data_size(entry);
+        while (removed < end) {
+            struct wfs_dentry dentry;
+            memcpy(&dentry, removed, offsetof(struct wfs_dentry, name)); // Packed, so not aligned
+            removed += WFS_DENTRY_SIZE(dentry.name_len);
+            unsigned long child = dentry.inode_number;
+            if (child < inode_map_size && inode_map[child].offset != 0 &&
+                find_last_matching_inode(child)->inode.deleted) {
+                touched[child] = 1;
+            }
+        }
+    }
+    for (unsigned long i = 0; i < inode_map_size; i++) {
+        if (touched[i] && inode_map[i].offset != 0) {
+            drop_inode(i);
+        }
+        if (touched[i] && inode_map[i].tombstone != 0) {
+            account_tombstone(i, -1);
+            inode_map[i].tombstone = 0;
+        }
+    }
+
+    for (size_t i = 0; i < tail_count; i++) {
+        struct wfs_log_entry *entry = (struct wfs_log_entry*)((char*)mapped_disk + tail[i]);
+        inode_map_set(entry->inode.inode_number, entry->inode.deleted ? 0 : tail[i]);
+        inode_map[entry->inode.inode_number].tombstone = entry->inode.flags == WFS_LOG_TOMBSTONE ? tail[i] : 0;
+        if ((int)entry->inode.inode_number > inode_number) {
+            inode_number = entry->inode.inode_number;
+        }
+    }
+
+    for (unsigned long i = 0; i < inode_map_size; i++) {
+        if (touched[i] && inode_map[i].tombstone != 0) {
+            account_tombstone(i, 1);
+        }
+        if (touched[i] && inode_map[i].offset != 0) {
+            account_chain(inode_map[i].offset, 1);
+            if (!S_ISDIR(find_last_matching_inode(i)->inode.mode)) {
+                account_extents(load_file(i), 1);
+            }
+        }
+    }
+    free(touched);
+    free(tail);
+}
+
+/**
+ * Loads the newest checkpoint and replays the log written after it.
+ *
+ * @return 0 on success, or -1 if the image has no usable checkpoint, in
+ *         which case nothing has been loaded.
+ */
+static int load_checkpoint() {
+    uint32_t first = ((struct wfs_sb*)mapped_disk)->checkpoint;
+    if (first >= segment_count || segment_header(first)->magic != WFS_CHECKPOINT_MAGIC) {
+        return -1;
+    }
+    struct wfs_checkpoint *checkpoint = (struct wfs_checkpoint*)((char*)mapped_disk + segment_first_entry(first));
+    if (checkpoint->magic != WFS_CHECKPOINT_MAGIC || checkpoint->segments != segment_count ||
+        checkpoint->parts == 0 || checkpoint->parts > segment_count || checkpoint->free > segment_count ||
+        checkpoint->inodes != checkpoint->inode_number + 1 ||
+        sizeof(struct wfs_checkpoint) + checkpoint->parts * sizeof(uint32_t) > SEGMENT_ROOM) {
+        return -1;
+    }
+
+    const uint32_t *part = (const uint32_t*)(checkpoint + 1);
+    if (part[0] != first) {
+        return -1;
+    }
+
+    // Each part is filled before the next is started. Whatever the stream
+    // holds past the data segment is the chunk index.
+    size_t bytes = sizeof(struct wfs_checkpoint) + ((size_t)checkpoint->parts + checkpoint->free + 1) * sizeof(uint32_t) +
+                   (size_t)checkpoint->inodes * sizeof(uint64_t) + segment_count * sizeof(struct wfs_segment_usage);
+    size_t stored = 0;
+    for (uint32_t i = 0; i < checkpoint->parts; i++) {
+        if (part[i] >= segment_count || segment_header(part[i])->magic != WFS_CHECKPOINT_MAGIC) {
+            break;
+        }
+        uint32_t start = segment_first_entry(part[i]) % WFS_SEGMENT_SIZE;
+        uint32_t used = segment_header(part[i])->used;
+        if (used < start || used - start > SEGMENT_ROOM || (used > start && stored != i * SEGMENT_ROOM)) {
+            break;
+        }
+        stored += used - start;
+    }
+    if (stored < bytes) {
+        printf("Error: checkpoint is incomplete, replaying the whole log\n");
+        return -1;
+    }
+    char *stream = malloc(stored);
+    if (stream == NULL) {
+        printf("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t done = 0, i = 0; done < stored; done += SEGMENT_ROOM, i++) {
+        size_t piece = stored - done < SEGMENT_ROOM ? stored - done : SEGMENT_ROOM;
+        memcpy(stream + done, (char*)mapped_disk + segment_first_entry(part[i]), piece);
+    }
+
+    checkpoint = (struct wfs_checkpoint*)stream;
+    part = (const uint32_t*)(checkpoint + 1);
+    const uint64_t *map = (const uint64_t*)(part + checkpoint->parts);
+    const struct wfs_segment_usage *usage = (const struct wfs_segment_usage*)(map + checkpoint->inodes);
+    const uint32_t *free_stack = (const uint32_t*)(usage + segment_count);
+    uint32_t data = free_stack[checkpoint->free];
+    if (data != WFS_NO_SEGMENT && (data >= segment_count || !is_data_segment(data))) {
+        free(stream);
+        return -1;
+    }
+
+    // A checkpoint from before deduplication was turned on has no chunk
+    // index; the whole log is replayed to index the runs already written
+    const uint32_t *chunks = free_stack + checkpoint->free + 1;
+    const struct wfs_chunk *chunk = (const struct wfs_chunk*)(chunks + 1);
+    if (stored != bytes && (!dedup_data || stored < bytes + sizeof(uint32_t) ||
+                            (stored - bytes - sizeof(uint32_t)) / sizeof(struct wfs_chunk) != *chunks ||
+                            (stored - bytes - sizeof(uint32_t)) % sizeof(struct wfs_chunk) != 0)) {
+        printf("Error: checkpoint is damaged, replaying the whole log\n");
+        free(stream);
+        return -1;
+    }
+    if (dedup_data && stored == bytes) {
+        free(stream);
+        return -1;
+    }
+    for (uint32_t i = 0; dedup_data && i < *chunks; i++) {
+        uint32_t segment = segment_of(chunk[i].location);
+        uint32_t offset = chunk[i].location % WFS_SEGMENT_SIZE;
+        if (segment >= segment_count || offset < segment_first_entry(segment) % WFS_SEGMENT_SIZE ||
+            chunk[i].length < WFS_MIN_SHARED_RUN || chunk[i].length > WFS_SEGMENT_SIZE - offset) {
+            printf("Error: checkpoint is damaged, replaying the whole log\n");
+            free(stream);
+            return -1;
+        }
+    }
+
+    for (uint32_t i = 0; i < segment_count; i++) {
+        segment_sequence[i] = usage[i].sequence;
+        segment_live[i] = usage[i].live;
+    }
+    for (uint32_t i = 0; i < checkpoint->inodes; i++) {
+        if (map[i] == 0) {
+            continue;
+        }
+        struct wfs_log_entry *entry = (struct wfs_log_entry*)((char*)mapped_disk + map[i]);
+        if (entry->inode.flags != WFS_LOG_TOMBSTONE) {
+            inode_map_set(i, map[i]);
+        } else if (is_log_segment(segment_of(map[i]))) {
+            inode_map_slot(i)->tombstone = map[i];
+        } else {
+            // Cleaned since the checkpoint: the tombstone was dropped, or
+            // moved to the tail of the log, where replay finds it
+            segment_live[segment_of(map[i])] -= entry_chain_bytes(entry);
+        }
+    }
+    memcpy(free_segments, free_stack, checkpoint->free * sizeof(uint32_t));
+    free_count = checkpoint->free;
+    memcpy(checkpoint_segments, part, checkpoint->parts * sizeof(uint32_t));
+    checkpoint_count = checkpoint->parts;
+    inode_number = checkpoint->inode_number;
+    set_log_head(segment_of(checkpoint->head - 1), checkpoint->head); // head may sit right at the end of its segment
+    last_sequence = checkpoint->sequence;
+    set_data_head(data);
+    for (uint32_t i = 0; dedup_data && i < *chunks; i++) {
+        // Chunks of segments cleaned since stay out of the chunk table
+        segment_chunks[segment_of(chunk[i].location)].hidden = !is_data_segment(segment_of(chunk[i].location));
+        add_chunk(&chunk[i]);
+    }
+    free(stream);
+
+    replay_tail();
+    return 0;
+}
+
+/**
+ * Gets the log ready for appends once the image is loaded. If the log was
+ * torn, a checkpoint is written at once: the log segments dropped break the
+ * chain of sequence numbers the next mount would follow from the older
+ * checkpoint.
+ */
+static void settle_log() {
+    if (log_torn && write_checkpoint() != 0) {
+        printf("Error: Failed to write a checkpoint after cutting the log short\n");
+    }
+}
+
+/**
+ * Finds a name in a directory, through the dentry cache if it can. The
+ * directory's lock is only taken on a miss, while its entries are searched.
+ *
+ * @param parent The inode number of the directory, which must exist.
+ * @param name   The name, which need not be null-terminated.
+ * @param len    The length of the name.
+ * @return       The inode number found, or DCACHE_NEGATIVE.
+ */
+static uint32_t lookup_child(uint32_t parent, const char *name, size_t len) {
+    uint32_t child;
+    if (!dcache_lookup(parent, name, len, &child)) {
+        child = find_dentry(read_lock_dir(parent), name, len);
+        dcache_insert(parent, name, len, child);
+        pthread_rwlock_unlock(inode_lock(parent));
+    }
+    return child;
+}
+
+/**
+ * Hands out an inode number for a new inode: the lowest one given back, or
+ * the next one never used.
+ *
+ * @return The inode number.
+ */
+static uint32_t alloc_inode_number() {
+    pthread_mutex_lock(&inode_alloc_lock);
+    uint32_t number = free_inode_count > 0 ? free_inodes[--free_inode_count] : (uint32_t)++inode_number;
+    pthread_mutex_unlock(&inode_alloc_lock);
+    return number;
+}
+
+/**
+ * Gives back an inode number nothing uses any more, so a new inode may
+ * reuse it.
+ *
+ * @param number The inode number.
+ */
+static void free_inode_number(uint32_t number) {
+    pthread_mutex_lock(&inode_alloc_lock);
+    if (free_inode_count == free_inode_capacity) {
+        uint32_t capacity = free_inode_capacity ? free_inode_capacity * 2 : 64;
+        uint32_t *grown = realloc(free_inodes, capacity * sizeof(uint32_t));
+        if (grown == NULL) {
+            printf("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        free_inodes = grown;
+        free_inode_capacity = capacity;
+    }
+    free_inodes[free_inode_count++] = number;
+    pthread_mutex_unlock(&inode_alloc_lock);
+}
+
+/**
+ * Gives back every inode number up to the highest handed out that no inode
+ * uses, once the image is loaded. The inode map of the checkpoint already
+ * says which those are, so this needs nothing from the log. They are given
+ * back highest first, so the lowest are reused first.
+ */
+static void collect_free_inodes() {
+    for (uint32_t number = inode_number; number > 0; number--) {
+        if (number >= inode_map_size || inode_map[number].offset == 0) {
+            free_inode_number(number);
+        }
+    }
+}
+
+/**
+ * Looks up the type and permissions of an inode. The caller holds fs_lock,
+ * which keeps the inode from being removed until it lets go.
+ *
+ * @param inode_number The inode number, which may be anything a caller passed in.
+ * @param mode         Where to store the file mode.
+ * @return             0 on success, or -ENOENT if there is no such inode.
+ */
+static int inode_mode(uint32_t inode_number, mode_t *mode) {
+    if (inode_number >= inode_map_size) {
+        return -ENOENT;
+    }
+    pthread_rwlock_rdlock(inode_lock(inode_number));
+    uint64_t offset = inode_map[inode_number].offset;
+    if (offset != 0) {
+        *mode = ((struct wfs_log_entry*)((char*)mapped_disk + offset))->inode.mode;
+    }
+    pthread_rwlock_unlock(inode_lock(inode_number));
+    return offset != 0 ? 0 : -ENOENT;
+}
+
+/**
+ * Creates a new inode and links it into a directory. The caller holds the
+ * directory's lock for writing. The new inode needs no lock of its own:
+ * no other operation can find it before it is linked in.
+ *
+ * @param parent_number The inode number of the directory.
+ * @param name          The name of the new entry.
+ * @param mode          The file mode, including the file type.
+ * @param child         Where to store the inode number of the new entry.
+ * @return              0 on success, or a negative error code on failure.
+ */
+static int add_node(unsigned long parent_number, const char *name, mode_t mode, uint32_t *child) {
+    if (find_dentry(load_dir(parent_number), name, strlen(name)) != DCACHE_NEGATIVE) {
+        return -EEXIST;
+    }
+    size_t dentry_entry_size = sizeof(struct wfs_record) + sizeof(struct wfs_inode) + sizeof(struct wfs_delta) +
+                               WFS_DENTRY_SIZE(strlen(name));
+    int ret = reserve_log(sizeof(struct wfs_record) + sizeof(struct wfs_inode) + dentry_entry_size, dentry_entry_size);
+    if (ret != 0) {
+        return ret;
+    }
+    uint32_t number = alloc_inode_number();
+    if (number >= inode_map_size) {
+        free_inode_number(number);
+        thread_map_needed = number; // Growing the map moves it, which takes the exclusive lock
+        return -EAGAIN;
+    }
+
+    // Create a new inode for the new node and copy it to the mapped disk
+    struct wfs_inode new_inode = {
+        .inode_number = number,
+        .deleted = 0,
+        .mode = mode,
+        .uid = getuid(),
+        .gid = getgid(),
+        .flags = WFS_LOG_INODE,
+        .size = 0,
+        .atime = wall_clock(),
+        .links = 1,
+    };
+    new_inode.mtime = new_inode.atime;
+    new_inode.ctime = new_inode.atime;
+    append_log_entry((struct wfs_log_entry*)&new_inode, 0);
+
+    // Link it into the parent directory
+    ret = change_dir(parent_number, WFS_LOG_DENTRY_ADD, number, name);
+    if (ret != 0) {
+        drop_inode(number);
+        free_inode_number(number);
+        return ret;
+    }
+    dcache_insert(parent_number, name, strlen(name), number);
+    *child = number;
+    return 0;
+}
+
+/**
+ * Creates a new file or directory node in a directory.
+ *
+ * The new inode is appended first and then linked into its parent with a
+ * single dentry delta, so the cost does not depend on the size of the parent.
+ *
+ * @param parent_number The inode number of the directory.
+ * @param name          The name of the new entry, short enough for a dentry.
+ * @param mode          The file mode, including the file type.
+ * @param child         Where to store the inode number of the new entry.
+ * @return              0 on success, or a negative error code on failure.
+ */
+static int create_node(uint32_t parent_number, const char *name, mode_t mode, uint32_t *child) {
+    mode_t parent_mode;
+    if (inode_mode(parent_number, &parent_mode) != 0) {
+        return -ENOENT;
+    }
+    if (!S_ISDIR(parent_mode)) {
+        return -ENOTDIR;
+    }
+    pthread_rwlock_wrlock(inode_lock(parent_number));
+    int ret = add_node(parent_number, name, mode, child);
+    pthread_rwlock_unlock(inode_lock(parent_number));
+    return ret;
+}
+
+/**
+ * Removes a file from a directory.
+ *
+ * A tombstone is appended for the file, so replay does not bring back its
+ * older entries, and the entry is removed from its parent with a single
+ * dentry delta; neither depends on the size of the log. The file's
+ * in-memory state is freed, which others may be reading, so the caller
+ * holds fs_lock exclusively.
+ *
+ * @param parent_number The inode number of the directory.
+ * @param name          The name of the file within it.
+ * @return 0 on success, or a negative error code on failure.
+ */
+static int remove_node(uint32_t parent_number, const char *name) {
+    mode_t mode;
+    if (inode_mode(parent_number, &mode) != 0) {
+        return -ENOENT;
+    }
+    if (!S_ISDIR(mode)) {
+        return -ENOTDIR;
+    }
+    if (strlen(name) >= MAX_FILE_NAME_LEN) {
+        return -ENOENT; // No such name can be stored
+    }
+    uint32_t inode_num = find_dentry(load_dir(parent_number), name, strlen(name));
+    if (inode_num == DCACHE_NEGATIVE || inode_mode(inode_num, &mode) != 0) {
+        return -ENOENT;
+    }
+    if (S_ISDIR(mode)) {
+        return -EISDIR;
+    }
+    size_t dentry_entry_size = sizeof(struct wfs_record) + sizeof(struct wfs_inode) + sizeof(struct wfs_delta) +
+                               WFS_DENTRY_SIZE(strlen(name));
+    struct {
+        struct wfs_inode inode;
+        struct wfs_tombstone tombstone;
+    } tombstone;
+    if (reserve_log(sizeof(struct wfs_record) + sizeof(tombstone) + dentry_entry_size, dentry_entry_size) != 0) {
+        return -ENOSPC;
+    }
+
+    // Every older entry of the file is in a log segment up to the active one
+    tombstone.inode = find_last_matching_inode(inode_num)->inode;
+    tombstone.inode.flags = WFS_LOG_TOMBSTONE;
+    tombstone.inode.deleted = 1;
+    tombstone.inode.ctime = wall_clock();
+    tombstone.tombstone.sequence = last_sequence;
+    drop_inode(inode_num);
+    append_log_entry((struct wfs_log_entry*)&tombstone, sizeof(tombstone.tombstone)); // Cannot fail: the room was reserved above
+
+    // Remove the entry from the parent directory
+    dcache_insert(parent_number, name, strlen(name), DCACHE_NEGATIVE);
+    int ret = change_dir(parent_number, WFS_LOG_DENTRY_DEL, inode_num, name);
+    inode_map[inode_num].generation++; // Whoever still holds the number can tell it named another file
+    if (inode_map[inode_num].holds == 0) {
+        free_inode_number(inode_num); // Otherwise libwfs_forget() gives it back
+    }
+    return ret;
+}
+
+/**
+ * Returns a timestamp to measure how long an operation takes, in nanoseconds.
+ */
+static uint64_t op_clock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/**
+ * Counts one call of an operation in its statistics.
+ *
+ * @param op    The operation.
+ * @param start When it started, from op_clock().
+ * @param ret   What it returns; negative values count as errors.
+ * @return      ret, so the caller can return through this.
+ */
+static int op_done(enum wfs_op op, uint64_t start, int ret) {
+    uint64_t elapsed = op_clock() - start;
+    int bucket = elapsed > 0 ? 63 - __builtin_clzll(elapsed) : 0;
+    if (bucket >= LATENCY_BUCKETS) {
+        bucket = LATENCY_BUCKETS - 1;
+    }
+    struct op_stats *stats = &op_stats[op];
+    atomic_fetch_add_explicit(&stats->calls, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->nanoseconds, elapsed, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->buckets[bucket], 1, memory_order_relaxed);
+    if (ret < 0) {
+        atomic_fetch_add_explicit(&stats->errors, 1, memory_order_relaxed);
+    }
+    return ret;
+}
+
+/**
+ * Puts every global back the way it was before the image was opened, so
+ * another image can be opened after it.
+ */
+static void reset_state() {
+    for (unsigned long i = 0; i < inode_map_size; i++) {
+        inode_map_set(i, 0);
+    }
+    free(inode_map);
+    inode_map = NULL;
+    inode_map_size = 0;
+    free(free_inodes);
+    free_inodes = NULL;
+    free_inode_count = free_inode_capacity = 0;
+    memset(dcache, 0, sizeof(dcache));
+    free(free_segments);
+    free(pending_segments);
+    free(checkpoint_segments);
+    for (uint32_t segment = 0; segment < segment_count; segment++) {
+        free(segment_chunks[segment].chunks);
+        free(segment_chunks[segment].sharers);
+    }
+    free(segment_chunks);
+    segment_chunks = NULL;
+    free(chunk_table);
+    chunk_table = NULL;
+    chunk_table_size = chunk_table_used = chunk_count = 0;
+    free((void*)segment_live);
+    free(segment_sequence);
+    free_segments = pending_segments = checkpoint_segments = NULL;
+    segment_live = NULL;
+    segment_sequence = NULL;
+    segment_count = free_count = pending_count = checkpoint_count = segments_since_checkpoint = 0;
+    last_sequence = 0;
+    log_tail = 0;
+    set_data_head(SEGMENT_NONE);
+    inode_number = 0;
+    reserved_bytes = 0;
+    cleaner_stop = 0;
+    commit_stop = 0;
+    commit_requested = commit_finished = 0;
+    commit_error = 0;
+    log_torn = 0;
+    compress_data = 0;
+    dedup_data = 0;
+    mapped_disk = NULL;
+    length = 0;
+    memset(op_stats, 0, sizeof(op_stats));
+    log_bytes = data_bytes = cleaner_bytes = checkpoint_bytes = checkpoints = commits = commit_bytes = 0;
+    packed_bytes = packed_stored = 0;
+    chunks_written = chunks_shared = shared_bytes = chunk_nanoseconds = 0;
+    segments_cleaned = images_grown = dcache_hits = dcache_misses = 0;
+}
+
+struct libwfs {
+    char *disk_path;
+};
+static struct libwfs image; // the one image that can be open at a time
+static pthread_once_t locks_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Opens a WFS image and brings its state up to date, from its newest
+ * checkpoint if it has a usable one and by replaying the whole log otherwise.
+ *
+ * Nothing runs in the background until libwfs_start(), so a process that
+ * forks after opening the image, as FUSE does, should start it afterwards.
+ *
+ * @param path    The path of the image file.
+ * @param opts    How to clean and grow the image, or NULL for the defaults.
+ * @param error   Where to store a negative error code on failure; may be NULL.
+ * @return        The open image, or NULL on failure. -EBUSY means another
+ *                image is still open, and -EINVAL that the file is not an
+ *                image this build can open.
+ */
+struct libwfs *libwfs_open(const char *path, const struct wfs_options *opts, int *error) {
+    int ignored;
+    error = error != NULL ? error : &ignored;
+    if (image.disk_path != NULL) {
+        *error = -EBUSY;
+        return NULL;
+    }
+    pthread_once(&locks_once, init_locks);
+
+    int file_descriptor = open(path, O_RDWR); // check that the disk path is valid, opening using 
+    if (file_descriptor == -1) {
+        *error = -errno;
+        fprintf(stderr, "Error: cannot open %s: %s\n", path, strerror(-*error));
+        return NULL;
+    }
+
+    // Create a struct to hold the information from the file
+    struct stat stat_info;
+    if (fstat(file_descriptor, &stat_info) == -1) { //check error condition for error during operation
+        *error = -errno;
+        fprintf(stderr, "Error: cannot stat %s: %s\n", path, strerror(-*error));
+        close(file_descriptor);
+        return NULL;
+    }
+
+    // mmap the starting of the disk
+    void *mapped = mmap(0, stat_info.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, file_descriptor, 0);
+    if (mapped == (void *)-1) {
+        printf("Error mapping file into memory\n");
+        *error = -errno;
+        close(file_descriptor);
+        return NULL;
+    }
+
+    struct wfs_sb *sb = mapped;
+    const char *problem = NULL;
+    if (stat_info.st_size < (off_t)sizeof(struct wfs_sb) ||
+        (sb->magic != WFS_MAGIC && sb->magic != WFS_MAGIC_V1)) {
+        problem = "is not a WFS image";
+    } else if (sb->magic == WFS_MAGIC_V1 || sb->segment_size != WFS_SEGMENT_SIZE) {
+        problem = "uses an older on-disk format; convert it with fsck.wfs or create it again with mkfs.wfs";
+    } else if (sb->version != WFS_VERSION || (sb->features & ~WFS_FEATURES) != 0) {
+        problem = "uses a newer on-disk format than this build of WFS understands";
+    } else if (sb->segments == 0 || (uint64_t)sb->segments * WFS_SEGMENT_SIZE > (uint64_t)stat_info.st_size) {
+        problem = "is shorter than its superblock says";
+    } else if (((sb->features & WFS_FEATURE_COMPRESSION) != 0 || (opts != NULL && opts->compress)) &&
+               ((sb->features & WFS_FEATURE_DEDUP) != 0 || (opts != NULL && opts->dedup))) {
+        problem = "cannot have both compression and deduplication on";
+    }
+    if (problem != NULL) {
+        printf("Error: %s %s\n", path, problem);
+        *error = -EINVAL;
+        munmap(mapped, stat_info.st_size);
+        close(file_descriptor);
+        return NULL;
+    }
+
+    image.disk_path = strdup(path);
+    if (image.disk_path == NULL) {
+        printf("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    disk_path = image.disk_path;
+    mapped_disk = mapped;
+    length = stat_info.st_size;
+    currFd = file_descriptor;
+    options = (struct wfs_options)LIBWFS_DEFAULT_OPTIONS;
+    if (opts != NULL) {
+        options = *opts;
+    }
+
+    // Turning compression on is for good: data segments written from then on
+    // are packed, so the superblock has to say so before any reaches the disk
+    if (options.compress && (sb->features & WFS_FEATURE_COMPRESSION) == 0) {
+        sb->features |= WFS_FEATURE_COMPRESSION;
+        flush_range(0, sizeof(struct wfs_sb));
+    }
+    compress_data = (sb->features & WFS_FEATURE_COMPRESSION) != 0;
+
+    // So is turning deduplication on. Checkpoints from before then have no
+    // chunk index, so the whole log is replayed, which indexes every run
+    if (options.dedup && (sb->features & WFS_FEATURE_DEDUP) == 0) {
+        sb->features |= WFS_FEATURE_DEDUP;
+        flush_range(0, sizeof(struct wfs_sb));
+    }
+    dedup_data = (sb->features & WFS_FEATURE_DEDUP) != 0;
+    if (dedup_data) {
+        init_chunks();
+    }
+
+    segment_count = sb->segments;
+    alloc_segment_tables();
+    if (load_checkpoint() != 0) {
+        if (build_inode_map() != 0) {
+            munmap(mapped_disk, length);
+            close(currFd);
+            reset_state();
+            free(image.disk_path);
+            image.disk_path = NULL;
+            disk_path = NULL;
+            *error = -EINVAL;
+            return NULL;
+        }
+        for (uint32_t segment = 0; dedup_data && segment < segment_count; segment++) {
+            if (is_data_segment(segment)) {
+                index_data_segment(segment);
+            }
+        }
+        account_all_inodes();
+    }
+    collect_free_inodes();
+    settle_log();
+    if (compress_data && data_segment() != SEGMENT_NONE && !is_packed_segment(data_segment())) {
+        set_data_head(SEGMENT_NONE); // Packed runs go to a packed segment of their own
+    }
+    mark_committed();
+    return &image;
+}
+
+/**
+ * Starts the background threads: the one that cleans segments and writes
+ * checkpoints, which runs even when cleaning is turned off, and unless
+ * durability is relaxed, the one that commits. Until then, fsyncs commit on
+ * their own.
+ *
+ * @param fs The open image.
+ * @return   0 on success, or a negative error code if a thread could not start.
+ */
+int libwfs_start(struct libwfs *fs) {
+    if (!cleaner_running) {
+        int err = pthread_create(&cleaner_thread, NULL, cleaner_main, NULL);
+        if (err != 0) {
+            return -err;
+        }
+        cleaner_running = 1;
+    }
+    if (!commit_running && options.durability != LIBWFS_DURABILITY_RELAXED) {
+        int err = pthread_create(&commit_thread, NULL, commit_main, NULL);
+        if (err != 0) {
+            return -err;
+        }
+        commit_running = 1;
+    }
+    return 0;
+}
+
+/**
+ * Closes an image. Stops the background threads and writes a final
+ * checkpoint, so the next open replays nothing. No other call on the image
+ * may be running or made afterwards.
+ *
+ * @param fs The open image.
+ * @return   0 on success, or the error that kept the checkpoint from being
+ *           written, in which case the next open replays the log.
+ */
+int libwfs_close(struct libwfs *fs) {
+    if (cleaner_running) {
+        pthread_mutex_lock(&cleaner_lock);
+        cleaner_stop = 1;
+        pthread_cond_signal(&cleaner_wakeup);
+        pthread_mutex_unlock(&cleaner_lock);
+        pthread_join(cleaner_thread, NULL);
+        cleaner_running = 0;
+    }
+    if (commit_running) {
+        pthread_mutex_lock(&commit_lock);
+        commit_stop = 1;
+        pthread_cond_signal(&commit_wakeup);
+        pthread_mutex_unlock(&commit_lock);
+        pthread_join(commit_thread, NULL);
+        commit_running = 0;
+    }
+    begin_exclusive();
+    int ret = write_checkpoint();
+    if (ret != 0) {
+        printf("Error: Failed to write a checkpoint; the next mount replays the log\n");
+    }
+    end_exclusive();
+
+    // Unmap the memory
+    munmap(mapped_disk, length);
+    close(currFd);
+    reset_state();
+    free(fs->disk_path);
+    fs->disk_path = NULL;
+    disk_path = NULL;
+    return ret;
+}
+
+/**
+ * Makes everything written so far durable, by writing a checkpoint.
+ *
+ * @param fs The open image.
+ * @return   0 on success, or a negative error code.
+ */
+int libwfs_sync(struct libwfs *fs) {
+    uint64_t start = op_clock();
+    begin_exclusive();
+    int ret = write_checkpoint();
+    end_exclusive();
+    return op_done(OP_SYNC, start, ret);
+}
+
+/**
+ * Makes a file or directory durable, as far as the image's durability mode
+ * asks. Under strict durability, returns once a commit has made everything
+ * written before the call durable, which a crash then cannot undo; the log
+ * is replayed in order, so committing one file commits all of it. fsyncs
+ * from many threads at once share commits. Otherwise, returns at once.
+ *
+ * @param fs           The open image.
+ * @param inode_number The inode number of the file or directory.
+ * @return             0 on success, -ENOENT, or the error that kept the commit from finishing.
+ */
+int libwfs_fsync(struct libwfs *fs, uint32_t inode_number) {
+    uint64_t start = op_clock();
+    begin_shared();
+    mode_t mode;
+    int ret = inode_mode(inode_number, &mode);
+    end_shared();
+    if (ret != 0 || options.durability != LIBWFS_DURABILITY_STRICT) {
+        return op_done(OP_FSYNC, start, ret);
+    }
+    pthread_mutex_lock(&commit_lock);
+    if (!commit_running) {
+        ret = commit_log();
+    } else {
+        uint64_t ticket = ++commit_requested;
+        pthread_cond_signal(&commit_wakeup);
+        while (commit_finished < ticket) {
+            pthread_cond_wait(&commit_done, &commit_lock);
+        }
+        ret = commit_error; // That of the commit serving the ticket or of a later one, which covers it too
+    }
+    pthread_mutex_unlock(&commit_lock);
+    return op_done(OP_FSYNC, start, ret);
+}
+
+/**
+ * Finds the inode a path leads to from the root directory.
+ *
+ * @param fs           The open image.
+ * @param path         The path, with components separated by '/'.
+ * @param inode_number Where to store the inode number found.
+ * @return             0 on success, or -ENOENT.
+ */
+int libwfs_resolve(struct libwfs *fs, const char *path, uint32_t *inode_number) {
+    uint64_t start = op_clock();
+    begin_shared();
+    // Walk the path a component at a time from the root, comparing names in
+    // place, through the dentry cache where it can
+    uint32_t current = 0;
+    int ret = 0;
+    for (const char *name = path; *name != '\0' && ret == 0;) {
+        if (*name == '/') {
+            name++;
+            continue;
+        }
+        size_t len = strcspn(name, "/");
+        mode_t mode;
+        ret = inode_mode(current, &mode);
+        if (ret == 0 && (len >= MAX_FILE_NAME_LEN || !S_ISDIR(mode))) {
+            ret = -ENOENT; // No such name can be stored, or this is not a directory
+        } else if (ret == 0 && (current = lookup_child(current, name, len)) == DCACHE_NEGATIVE) {
+            ret = -ENOENT;
+        }
+        name += len;
+    }
+    if (ret == 0) {
+        *inode_number = current;
+    }
+    end_shared();
+    return op_done(OP_RESOLVE, start, ret);
+}
+
+/**
+ * Keeps an inode number from being handed out again, even once its inode is
+ * removed, until libwfs_forget() undoes this. A frontend that lets others
+ * refer to files by inode number, such as a kernel holding lookups, holds
+ * each number it gives out; operations on a removed inode then fail with
+ * -ENOENT rather than reaching a new file that took over its number.
+ *
+ * @param fs           The open image.
+ * @param inode_number The inode number.
+ * @return             0 on success, or -ENOENT if no inode has the number.
+ */
+int libwfs_hold(struct libwfs *fs, uint32_t inode_number) {
+    int ret = -ENOENT;
+    begin_shared();
+    if (inode_number < inode_map_size) {
+        pthread_rwlock_wrlock(inode_lock(inode_number));
+        if (inode_map[inode_number].offset != 0) {
+            inode_map[inode_number].holds++;
+            ret = 0;
+        }
+        pthread_rwlock_unlock(inode_lock(inode_number));
+    }
+    end_shared();
+    return ret;
+}
+
+/**
+ * Undoes one libwfs_hold() of an inode number. Once the last hold of a
+ * removed inode's number is gone, the number may be reused.
+ *
+ * @param fs           The open image.
+ * @param inode_number The inode number, which is held.
+ */
+void libwfs_forget(struct libwfs *fs, uint32_t inode_number) {
+    begin_shared();
+    if (inode_number < inode_map_size) {
+        pthread_rwlock_wrlock(inode_lock(inode_number));
+        struct inode_map_entry *slot = &inode_map[inode_number];
+        if (slot->holds > 0 && --slot->holds == 0 && slot->offset == 0) {
+            free_inode_number(inode_number); // Removed while held, and nothing can have taken the number since
+        }
+        pthread_rwlock_unlock(inode_lock(inode_number));
+    }
+    end_shared();
+}
+
+/**
+ * Finds a name in a directory.
+ *
+ * @param fs     The open image.
+ * @param parent The inode number of the directory.
+ * @param name   The name to look for.
+ * @param child  Where to store the inode number found.
+ * @return       0 on success, -ENOENT, or -ENOTDIR if parent is not a directory.
+ */
+int libwfs_lookup(struct libwfs *fs, uint32_t parent, const char *name, uint32_t *child) {
+    uint64_t start = op_clock();
+    size_t len = strlen(name);
+    begin_shared();
+    mode_t mode;
+    int ret = inode_mode(parent, &mode);
+    if (ret == 0 && !S_ISDIR(mode)) {
+        ret = -ENOTDIR;
+    } else if (ret == 0) {
+        uint32_t found = len < MAX_FILE_NAME_LEN ? lookup_child(parent, name, len) : DCACHE_NEGATIVE;
+        if (found == DCACHE_NEGATIVE) {
+            ret = -ENOENT;
+        } else {
+            *child = found;
+        }
+    }
+    end_shared();
+    return op_done(OP_LOOKUP, start, ret);
+}
+
+/**
+ * Gets the generation of an inode number, which changes whenever the number
+ * is freed. Inode numbers are reused, so a frontend that lets others hold on
+ * to them passes this along to tell the files apart.
+ *
+ * @param fs           The open image.
+ * @param inode_number The inode number.
+ * @param generation   Where to store the generation.
+ * @return             0 on success, or -ENOENT.
+ */
+int libwfs_generation(struct libwfs *fs, uint32_t inode_number, uint64_t *generation) {
+    int ret = -ENOENT;
+    begin_shared();
+    if (inode_number < inode_map_size) {
+        pthread_rwlock_rdlock(inode_lock(inode_number));
+        if (inode_map[inode_number].offset != 0) {
+            *generation = inode_map[inode_number].generation;
+            ret = 0;
+        }
+        pthread_rwlock_unlock(inode_lock(inode_number));
+    }
+    end_shared();
+    return ret;
+}
+
+/**
+ * Get file or directory attributes for an inode.
+ *
+ * @param fs           The open image.
+ * @param inode_number The inode number of the file or directory.
+ * @param stbuf        A pointer to the struct stat to be populated with attribute information.
+ * @return             0 on success, or -ENOENT.
+ */
+int libwfs_getattr(struct libwfs *fs, uint32_t inode_number, struct stat *stbuf) {
+    uint64_t start = op_clock();
+    begin_shared();
+    if (inode_number >= inode_map_size) {
+        end_shared();
+        return op_done(OP_GETATTR, start, -ENOENT);
+    }
+    pthread_rwlock_rdlock(inode_lock(inode_number));
+    if (inode_map[inode_number].offset == 0) {
+        pthread_rwlock_unlock(inode_lock(inode_number));
+        end_shared();
+        return op_done(OP_GETATTR, start, -ENOENT);
+    }
+    struct wfs_log_entry *entry = find_last_matching_inode(inode_number);
+    struct wfs_inode *i = &entry->inode;
+
+    memset(stbuf, 0, sizeof(*stbuf)); // initialize the struct stat (stbuf) to all zeros before populating
+    stbuf->st_ino = inode_number;
+    stbuf->st_uid = i->uid;
+    stbuf->st_gid = i->gid;
+    stbuf->st_atim = (struct timespec){ .tv_sec = i->atime / 1000000000, .tv_nsec = i->atime % 1000000000 };
+    stbuf->st_mtim = (struct timespec){ .tv_sec = i->mtime / 1000000000, .tv_nsec = i->mtime % 1000000000 };
+    stbuf->st_ctim = (struct timespec){ .tv_sec = i->ctime / 1000000000, .tv_nsec = i->ctime % 1000000000 };
+    stbuf->st_mode = i->mode;
+    stbuf->st_nlink = i->links;
+    stbuf->st_size = i->size;
+
+    /*If a field is meaningless or semi-meaningless (e.g., st_ino) then it should be set to 0 or given a "reasonable" value.*/
+    stbuf->st_dev = 0;
+    stbuf->st_blksize = 0;
+    stbuf->st_blocks = 0;
+    stbuf->st_rdev = 0;
+
+    pthread_rwlock_unlock(inode_lock(inode_number));
+    end_shared();
+    return op_done(OP_GETATTR, start, 0);
+}
+
+/**
+ * Returns whether a name is "." or "..", which every directory has without
+ * entries of its own, so no entry may take them.
+ */
+static int dot_name(const char *name) {
+    return strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+}
+
+/**
+ * Creates a file or directory in a directory.
+ *
+ * @param fs     The open image.
+ * @param parent The inode number of the directory.
+ * @param name   The name of the new entry.
+ * @param mode   The file mode, including the file type.
+ * @param child  Where to store the inode number of the new entry.
+ * @return       0 on success, -EEXIST for "." and "..", or another negative error code on failure.
+ */
+int libwfs_create(struct libwfs *fs, uint32_t parent, const char *name, mode_t mode, uint32_t *child) {
+    uint64_t start = op_clock();
+    if (strlen(name) >= MAX_FILE_NAME_LEN) {
+        return op_done(OP_CREATE, start, -ENAMETOOLONG);
+    }
+    if (*name == '\0' || strchr(name, '/') != NULL) {
+        return op_done(OP_CREATE, start, -EINVAL);
+    }
+    if (dot_name(name)) {
+        return op_done(OP_CREATE, start, -EEXIST);
+    }
+    int ret;
+    do {
+        begin_shared();
+        ret = create_node(parent, name, mode, child);
+        end_shared();
+    } while (ret == -EAGAIN && (ret = make_progress()) == 0);
+    return op_done(OP_CREATE, start, ret);
+}
+
+/**
+ * Reads data from a file.
+ *
+ * @param fs           The open image.
+ * @param inode_number The inode number of the file.
+ * @param buf          The buffer to store the read data.
+ * @param size         The size of the buffer.
+ * @param offset       The offset within the file to start reading.
+ * @return             On success, the actual size of data read. On failure, a negative error code.
+ */
+int libwfs_read(struct libwfs *fs, uint32_t inode_number, char *buf, size_t size, off_t offset) {
+    uint64_t start = op_clock();
+    begin_shared();
+    mode_t mode;
+    int ret = inode_mode(inode_number, &mode);
+    if (ret == 0 && S_ISDIR(mode)) {
+        ret = -EISDIR;
+    } else if (ret == 0 && offset < 0) {
+        ret = -EINVAL;
+    } else if (ret == 0) {
+        read_lock_file(inode_number);
+        ret = read_file(inode_number, buf, size, offset);
+        pthread_rwlock_unlock(inode_lock(inode_number));
+    }
+    end_shared();
+    return op_done(OP_READ, start, ret);
+}
+
+/**
+ * Reads data from a file without copying it. The sink is handed pointers to
+ * the bytes where they are in the image, or for compressed data, to a copy
+ * decompressed for this read, while the file is locked against
+ * changes and the image against moving, and must be done with them when it
+ * returns. It must not call back into the engine.
+ *
+ * @param fs           The open image.
+ * @param inode_number The inode number of the file.
+ * @param size         The number of bytes to read.
+ * @param offset       The offset within the file to start reading.
+ * @param sink         Called once with the bytes read, which are short at the end of the file.
+ * @param context      Passed on to the sink.
+ * @return             On success, the number of bytes read. On failure, a negative error code,
+ *                     which may be the sink's, in which case the sink was called.
+ */
+int libwfs_read_to(struct libwfs *fs, uint32_t inode_number, size_t size, off_t offset, libwfs_sink_t sink, void *context) {
+    uint64_t start = op_clock();
+    begin_shared();
+    mode_t mode;
+    int ret = inode_mode(inode_number, &mode);
+    if (ret == 0 && S_ISDIR(mode)) {
+        ret = -EISDIR;
+    } else if (ret == 0 && offset < 0) {
+        ret = -EINVAL;
+    } else if (ret == 0) {
+        read_lock_file(inode_number);
+        int count = 0;
+        size_t length = 0;
+        char *copies;
+        struct iovec *iov = map_file(inode_number, size, offset, &count, &length, &copies, &ret);
+        if (iov != NULL) {
+            ret = sink(context, iov, count);
+            ret = ret != 0 ? ret : (int)length;
+            free(copies);
+        }
+        free(iov);
+        pthread_rwlock_unlock(inode_lock(inode_number));
+    }
+    end_shared();
+    return op_done(OP_READ, start, ret);
+}
+
+/**
+ * Writes data to a file, taking the bytes from a source rather than a buffer.
+ * The source copies them straight into the log, so the data is copied only
+ * once on its way to the image. The source is called under the file's lock,
+ * with pieces of at most one log entry, in order.
+ *
+ * @param fs           The open image.
+ * @param inode_number The inode number of the file.
+ * @param source       Produces the bytes to write.
+ * @param context      Passed on to the source.
+ * @param size         The size of the data to write.
+ * @param offset       The offset in the file where writing should start.
+ * @return             On success, the number of bytes written. On failure, a negative error code.
+ */
+int libwfs_write_from(struct libwfs *fs, uint32_t inode_number, libwfs_source_t source, void *context, size_t size, off_t offset) {
+    uint64_t start = op_clock();
+    if (offset < 0 || size > INT_MAX) {
+        return op_done(OP_WRITE, start, -EINVAL);
+    }
+    int ret;
+    do {
+        begin_shared();
+        mode_t mode;
+        ret = inode_mode(inode_number, &mode);
+        if (ret != 0) {
+            // No such file
+        } else if (S_ISDIR(mode)) {
+            ret = -EISDIR;
+        } else if (size > MAX_FILE_SIZE - offset) {
+            ret = -EFBIG;
+        } else if (size > 0) {
+            pthread_rwlock_wrlock(inode_lock(inode_number));
+            ret = write_file(inode_number, source, context, size, offset);
+            pthread_rwlock_unlock(inode_lock(inode_number));
+        }
+        end_shared();
+    } while (ret == -EAGAIN && (ret = make_progress()) == 0);
+    return op_done(OP_WRITE, start, ret);
+}
+
+/**
+ * Writes data to a file. The bytes are appended to the log as a new data
+ * entry, which also carries the file's updated size and metadata.
+ *
+ * @param fs           The open image.
+ * @param inode_number The inode number of the file.
+ * @param buf          The buffer containing the data to be written.
+ * @param size         The size of the data to write.
+ * @param offset       The offset in the file where writing should start.
+ * @return             On success, the number of bytes written. On failure, a negative error code.
+ */
+int libwfs_write(struct libwfs *fs, uint32_t inode_number, const char *buf, size_t size, off_t offset) {
+    return libwfs_write_from(fs, inode_number, copy_from_memory, &buf, size, offset);
+}
+
+/**
+ * Lists the entries of a directory, not including "." and "..", starting at
+ * a cookie. The directory is locked against changes while the filler runs.
+ *
+ * Entries come in the order of their cookies, which do not change while
+ * they exist, so a listing picked up at the cookie of the next entry goes on
+ * where it stopped even if the directory changed in between.
+ *
+ * @param fs           The open image.
+ * @param inode_number The inode number of the directory.
+ * @param cookie       0 to start at the beginning, or a cookie handed to the filler.
+ * @param filler       Called once for each entry from the cookie on.
+ * @param context      Passed on to the filler.
+ * @return             0 on success, -ENOENT, or -ENOTDIR.
+ */
+int libwfs_readdir(struct libwfs *fs, uint32_t inode_number, uint64_t cookie, libwfs_filler_t filler, void *context) {
+    uint64_t start = op_clock();
+    begin_shared();
+    mode_t mode;
+    int ret = inode_mode(inode_number, &mode);
+    if (ret == 0 && !S_ISDIR(mode)) {
+        ret = -ENOTDIR;
+    } else if (ret == 0) {
+        struct wfs_dir *dir = read_lock_dir(inode_number);
+        size_t b, i;
+        dir_position(dir, cookie, "", 0, &b, &i); // The empty name comes before every other
+        int done = 0;
+        for (; b < dir->block_count && !done; b++, i = 0) {
+            struct dir_block *block = dir->blocks[b];
+            for (; i < block->count && !done; i++) {
+                uint64_t next = i + 1 < block->count ? block->cookies[i + 1] :
+                                b + 1 < dir->block_count ? dir->blocks[b + 1]->cookies[0] : LIBWFS_COOKIE_END;
+                done = filler(context, block->entries[i].name, block->entries[i].inode_number, next) != 0;
+            }
+        }
+        pthread_rwlock_unlock(inode_lock(inode_number));
+    }
+    end_shared();
+    return op_done(OP_READDIR, start, ret);
+}
+
+/**
+ * Removes a file from a directory.
+ *
+ * @param fs     The open image.
+ * @param parent The inode number of the directory.
+ * @param name   The name of the file.
+ * @return       0 on success, -EINVAL for "." and "..", or another negative error code on failure.
+ */
+int libwfs_unlink(struct libwfs *fs, uint32_t parent, const char *name) {
+    uint64_t start = op_clock();
+    if (dot_name(name)) {
+        return op_done(OP_UNLINK, start, -EINVAL);
+    }
+    begin_exclusive();
+    int ret = remove_node(parent, name);
+    end_exclusive();
+    return op_done(OP_UNLINK, start, ret);
+}
+
+/**
+ * Appends to a report being built by libwfs_stats(), like snprintf() would.
+ */
+static void report_add(char *buf, size_t size, size_t *written, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int added = vsnprintf(*written < size ? buf + *written : NULL, *written < size ? size - *written : 0, format, args);
+    va_end(args);
+    *written += added > 0 ? added : 0;
+}
+
+/**
+ * Returns the upper bound, in microseconds, of the latency bucket that holds
+ * the given share of an operation's calls.
+ */
+static double latency_percentile(const struct op_stats *stats, unsigned long calls, double share) {
+    unsigned long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += stats->buckets[i];
+        if (seen > 0 && seen >= share * calls) {
+            return (2ull << i) / 1000.0;
+        }
+    }
+    return (2ull << (LATENCY_BUCKETS - 1)) / 1000.0;
+}
+
+/**
+ * Writes a plain-text report of the statistics kept since the image was
+ * opened: calls, errors and latencies of each operation, bytes written to
+ * the log, dentry cache hit rates and how the image's space is used.
+ *
+ * Works like snprintf(): at most size bytes are written, including the
+ * terminating null byte, and the length of the whole report is returned.
+ *
+ * @param fs   The open image.
+ * @param buf  Where to write the report; may be NULL if size is 0.
+ * @param size The size of buf.
+ * @return     The length of the report, not counting the null byte.
+ */
+int libwfs_stats(struct libwfs *fs, char *buf, size_t size) {
+    size_t written = 0;
+    report_add(buf, size, &written, "%-10s %10s %8s %9s %9s %9s\n", "op", "calls", "errors", "avg us", "p50 us", "p99 us");
+    for (int op = 0; op < OP_COUNT; op++) {
+        const struct op_stats *stats = &op_stats[op];
+        unsigned long calls = stats->calls;
+        report_add(buf, size, &written, "%-10s %10lu %8lu %9.1f %9.1f %9.1f\n", op_names[op], calls, (unsigned long)stats->errors,
+                   calls > 0 ? stats->nanoseconds / 1000.0 / calls : 0.0,
+                   calls > 0 ? latency_percentile(stats, calls, 0.5) : 0.0,
+                   calls > 0 ? latency_percentile(stats, calls, 0.99) : 0.0);
+    }
+    report_add(buf, size, &written, "\nlatency histograms, as calls per bucket by its upper bound in us\n");
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (op_stats[op].calls == 0) {
+            continue;
+        }
+        report_add(buf, size, &written, "%-10s", op_names[op]);
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            unsigned long count = op_stats[op].buckets[i];
+            if (count > 0) {
+                report_add(buf, size, &written, " %g:%lu", (2ull << i) / 1000.0, count);
+            }
+        }
+        report_add(buf, size, &written, "\n");
+    }
+
+    // A consistent view of the segments
+    begin_shared();
+    pthread_mutex_lock(&log_lock);
+    uint32_t segments = segment_count;
+    uint32_t free_segments_now = free_count;
+    uint32_t pending = pending_count;
+    uint32_t in_checkpoint = checkpoint_count;
+    size_t image_bytes = length;
+    pthread_mutex_unlock(&log_lock);
+    pthread_mutex_lock(&inode_alloc_lock);
+    uint32_t inode_numbers = inode_number + 1;
+    uint32_t free_inode_numbers = free_inode_count;
+    pthread_mutex_unlock(&inode_alloc_lock);
+    long live = 0;
+    for (uint32_t segment = 0; segment < segments; segment++) {
+        live += segment_live[segment];
+    }
+    end_shared();
+
+    unsigned long hits = dcache_hits;
+    unsigned long misses = dcache_misses;
+    double capacity = (double)segments * (WFS_SEGMENT_SIZE - sizeof(struct wfs_segment));
+    report_add(buf, size, &written, "\nlog bytes appended     %lu\n", (unsigned long)log_bytes);
+    report_add(buf, size, &written, "  to data segments    %lu\n", (unsigned long)data_bytes);
+    report_add(buf, size, &written, "  moved by the cleaner %lu\n", (unsigned long)cleaner_bytes);
+    if (compress_data) {
+        unsigned long packed = packed_bytes;
+        unsigned long stored = packed_stored;
+        report_add(buf, size, &written, "file bytes compressed  %lu into %lu (%.1f%%)\n", packed, stored,
+                   packed > 0 ? 100.0 * stored / packed : 100.0);
+    }
+    if (dedup_data) {
+        unsigned long shared = chunks_shared;
+        report_add(buf, size, &written, "file chunks written    %lu; %lu more mapped to runs already written (%lu bytes)\n",
+                   (unsigned long)chunks_written, shared, (unsigned long)shared_bytes);
+        report_add(buf, size, &written, "chunk index            %zu chunks; %.1f ms spent cutting and looking up chunks\n",
+                   (size_t)chunk_count, chunk_nanoseconds / 1e6);
+    }
+    report_add(buf, size, &written, "checkpoints written    %lu (%lu bytes)\n", (unsigned long)checkpoints, (unsigned long)checkpoint_bytes);
+    report_add(buf, size, &written, "commits                %lu (%lu bytes) for %lu fsyncs\n", (unsigned long)commits,
+               (unsigned long)commit_bytes, (unsigned long)op_stats[OP_FSYNC].calls);
+    report_add(buf, size, &written, "segments cleaned       %lu\n", (unsigned long)segments_cleaned);
+    report_add(buf, size, &written, "times the image grew   %lu\n", (unsigned long)images_grown);
+    report_add(buf, size, &written, "dcache hits            %lu (%.1f%%)\n", hits, hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0);
+    report_add(buf, size, &written, "dcache misses          %lu\n", misses);
+    report_add(buf, size, &written, "image bytes            %zu\n", image_bytes);
+    report_add(buf, size, &written, "segments               %u: %u free, %u waiting for a checkpoint, %u holding the checkpoint\n",
+               segments, free_segments_now, pending, in_checkpoint);
+    report_add(buf, size, &written, "live bytes             %ld (%.1f%% of the log)\n", live, capacity > 0 ? 100.0 * live / capacity : 0.0);
+    report_add(buf, size, &written, "inode numbers          %u: %u free for reuse\n", inode_numbers, free_inode_numbers);
+    return written;
+}
@@ -0,0 +1,97 @@
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#ifndef LIBWFS_H_
+#define LIBWFS_H_
+
+/*
+ * In-process interface to the WFS engine. Files and directories are named by
+ * inode number; LIBWFS_ROOT is the root directory, and libwfs_resolve() turns
+ * a path into an inode number. Every call may be made from any number of
+ * threads at once. Errors are returned as negative errno values.
+ *
+ * The engine keeps its state in globals, so only one image can be open in a
+ * process at a time.
+ */
+
+#define LIBWFS_ROOT 0
+#define DEFAULT_CLEAN_RATE 32           // segments the cleaner may clean per second
+#define DEFAULT_GROW_SIZE 4             // MiB added to the image each time it grows
+#define LIBWFS_COOKIE_FIRST 16          // readdir cookies start here; those below are free for "." and ".."
+#define LIBWFS_COOKIE_END INT64_MAX     // the cookie after the last entry of a directory
+#define DEFAULT_COMMIT_INTERVAL 1000    // ms between commits in periodic mode
+
+/*
+ * Durability modes, which set what libwfs_fsync() promises. A commit flushes
+ * everything written so far to the disk; checkpoints do as well.
+ */
+#define LIBWFS_DURABILITY_RELAXED 0  // fsync returns at once; data reaches the disk with checkpoints and the kernel's writeback
+#define LIBWFS_DURABILITY_PERIODIC 1 // fsync returns at once; a commit runs every commit_interval ms
+#define LIBWFS_DURABILITY_STRICT 2   // fsync returns once a commit covers everything written before it
+
+/**
+ * Tuning knobs of an open image. Start from LIBWFS_DEFAULT_OPTIONS.
+ */
+struct wfs_options {
+    unsigned int clean_rate;      // segments the cleaner may clean per second; 0 disables cleaning
+    unsigned int clean_threshold; // the cleaner runs while fewer segments than this are free; 0 picks one from the image size
+    unsigned int grow_size;       // MiB added to the image when it runs out of room; 0 keeps its size fixed
+    unsigned int max_size;        // MiB the image may grow to; 0 allows as much as the format can address
+    unsigned int durability;      // one of the LIBWFS_DURABILITY_ modes
+    unsigned int commit_interval; // ms between commits in periodic mode; 0 picks DEFAULT_COMMIT_INTERVAL
+    unsigned int compress;        // nonzero to turn on WFS_FEATURE_COMPRESSION, for good, if the image does not have it
+    unsigned int dedup;           // nonzero to turn on WFS_FEATURE_DEDUP, for good, if the image does not have it
+};
+#define LIBWFS_DEFAULT_OPTIONS { .clean_rate = DEFAULT_CLEAN_RATE, .grow_size = DEFAULT_GROW_SIZE, \
+                                 .durability = LIBWFS_DURABILITY_STRICT, .commit_interval = DEFAULT_COMMIT_INTERVAL }
+
+struct libwfs; // an open image
+
+/**
+ * Called by libwfs_readdir() once for each entry of a directory. next is the
+ * cookie that picks the listing up again after this entry.
+ *
+ * @return 0 to go on, or anything else to stop.
+ */
+typedef int (*libwfs_filler_t)(void *context, const char *name, uint32_t inode_number, uint64_t next);
+
+/**
+ * Called by libwfs_write_from() to copy the next size bytes of the data being
+ * written to dst, which is their place in the image.
+ *
+ * @return 0 on success, or a negative error code to end the write.
+ */
+typedef int (*libwfs_source_t)(void *context, char *dst, size_t size);
+
+/**
+ * Called by libwfs_read_to() with the bytes read, as pieces of the image, of
+ * a block of zeros for holes, and of a buffer of bytes decompressed for the read.
+ *
+ * @return 0 on success, or a negative error code to fail the read.
+ */
+typedef int (*libwfs_sink_t)(void *context, const struct iovec *iov, int count);
+
+struct libwfs *libwfs_open(const char *disk_path, const struct wfs_options *options, int *error);
+int libwfs_start(struct libwfs *fs);
+int libwfs_close(struct libwfs *fs);
+int libwfs_sync(struct libwfs *fs);
+int libwfs_fsync(struct libwfs *fs, uint32_t inode_number);
+
+int libwfs_resolve(struct libwfs *fs, const char *path, uint32_t *inode_number);
+int libwfs_lookup(struct libwfs *fs, uint32_t parent, const char *name, uint32_t *child);
+int libwfs_generation(struct libwfs *fs, uint32_t inode_number, uint64_t *generation);
+int libwfs_hold(struct libwfs *fs, uint32_t inode_number);
+void libwfs_forget(struct libwfs *fs, uint32_t inode_number);
+int libwfs_getattr(struct libwfs *fs, uint32_t inode_number, struct stat *stbuf);
+int libwfs_create(struct libwfs *fs, uint32_t parent, const char *name, mode_t mode, uint32_t *child);
+int libwfs_read(struct libwfs *fs, uint32_t inode_number, char *buf, size_t size, off_t offset);
+int libwfs_read_to(struct libwfs *fs, uint32_t inode_number, size_t size, off_t offset, libwfs_sink_t sink, void *context);
+int libwfs_write(struct libwfs *fs, uint32_t inode_number, const char *buf, size_t size, off_t offset);
+int libwfs_write_from(struct libwfs *fs, uint32_t inode_number, libwfs_source_t source, void *context, size_t size, off_t offset);
+int libwfs_readdir(struct libwfs *fs, uint32_t inode_number, uint64_t cookie, libwfs_filler_t filler, void *context);
+int libwfs_unlink(struct libwfs *fs, uint32_t parent, const char *name);
+int libwfs_stats(struct libwfs *fs, char *buf, size_t size);
+
+#endif
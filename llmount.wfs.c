@@ -0,0 +1,786 @@
+#define FUSE_USE_VERSION 30
+#include <fuse_lowlevel.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "libwfs.h"
+
+#define STATS_NAME ".wfs_stats"         // read-only file at the root with the engine's statistics
+#define STATS_INO ((fuse_ino_t)UINT32_MAX) // above every inode number of the engine, shifted up by one
+#define MAX_WRITE (1 << 20)             // largest write request to ask the kernel for
+#define MAX_IOV 1024                    // the most pieces one reply may have, as for writev()
+
+/**
+ * The -o options of llmount.wfs: those of the engine, and how long the kernel
+ * may cache what it learns.
+ */
+struct llmount_options {
+    struct wfs_options engine;
+    double entry_timeout;    // seconds the kernel may cache names
+    double attr_timeout;     // seconds the kernel may cache attributes
+    double negative_timeout; // seconds the kernel may cache that a name does not exist; 0 to not
+};
+
+/*
+ * The low-level FUSE frontend of the engine in libwfs.c, an alternative to
+ * mount.wfs. The kernel names files by the inode numbers it was handed by
+ * lookup, so no path is ever parsed here: each name is looked up once, in
+ * its parent directory, when the kernel first meets it.
+ *
+ * FUSE numbers the root 1, so inode numbers are shifted up by one on the way
+ * out and back down on the way in.
+ */
+
+struct libwfs *fs; // the mounted image
+struct llmount_options mount_options = {
+    .engine = LIBWFS_DEFAULT_OPTIONS,
+    .entry_timeout = 1.0,
+    .attr_timeout = 1.0,
+};
+time_t mount_time;
+pthread_t stats_thread;  // prints the statistics on SIGUSR1
+int stats_running;
+_Atomic int stats_stop;
+
+uint64_t *lookups;       // how many lookups of each inode the kernel has yet to forget
+size_t lookups_size;
+unsigned long kernel_inodes; // inodes with lookups
+pthread_mutex_t lookups_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Returns the FUSE inode number of an inode of the engine.
+ */
+fuse_ino_t to_fuse(uint32_t inode_number) {
+    return (fuse_ino_t)inode_number + 1;
+}
+
+/**
+ * Returns the inode number of the engine for a FUSE inode number.
+ */
+uint32_t to_wfs(fuse_ino_t ino) {
+    return ino - 1;
+}
+
+/**
+ * Records that the kernel was handed an inode by a lookup, which it holds on
+ * to until it forgets it. While the kernel holds an inode, the engine holds
+ * its number, so a file removed while still open cannot have its reads and
+ * writes go to a new file that reused the number. An open handle keeps the
+ * kernel's lookup, so it keeps the hold too.
+ *
+ * @param inode_number The inode number of the engine.
+ * @return             0 on success, or -ENOENT if the inode was removed meanwhile.
+ */
+int count_lookup(uint32_t inode_number) {
+    pthread_mutex_lock(&lookups_lock);
+    if (inode_number >= lookups_size) {
+        size_t size = lookups_size > 0 ? lookups_size : 64;
+        while (size <= inode_number) {
+            size *= 2;
+        }
+        uint64_t *grown = realloc(lookups, size * sizeof(uint64_t));
+        if (grown == NULL) { // Handle memory allocation failure
+            printf("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        memset(grown + lookups_size, 0, (size - lookups_size) * sizeof(uint64_t));
+        lookups = grown;
+        lookups_size = size;
+    }
+    int ret = 0;
+    if (lookups[inode_number] == 0) {
+        ret = libwfs_hold(fs, inode_number);
+        kernel_inodes += ret == 0;
+    }
+    lookups[inode_number] += ret == 0;
+    pthread_mutex_unlock(&lookups_lock);
+    return ret;
+}
+
+/**
+ * Drops lookups of an inode the kernel has forgotten, and once it has
+ * forgotten them all, the engine's hold of its number.
+ *
+ * @param ino     The FUSE inode number.
+ * @param nlookup The number of lookups forgotten.
+ */
+void forget_lookups(fuse_ino_t ino, uint64_t nlookup) {
+    if (ino == FUSE_ROOT_ID || ino == STATS_INO) {
+        return; // Never counted
+    }
+    uint32_t inode_number = to_wfs(ino);
+    pthread_mutex_lock(&lookups_lock);
+    if (inode_number < lookups_size && lookups[inode_number] > 0) {
+        lookups[inode_number] = lookups[inode_number] > nlookup ? lookups[inode_number] - nlookup : 0;
+        if (lookups[inode_number] == 0) {
+            kernel_inodes--;
+            libwfs_forget(fs, inode_number);
+        }
+    }
+    pthread_mutex_unlock(&lookups_lock);
+}
+
+/**
+ * Helper method that builds the current statistics report, followed by what
+ * this frontend knows.
+ *
+ * @param length Where to store the length of the report.
+ * @return       The report, which the caller frees.
+ */
+char *stats_report(int *length) {
+    char *report = NULL;
+    int size = 0;
+    while ((*length = libwfs_stats(fs, report, size)) + 64 >= size) { // It may have grown since it was measured
+        free(report);
+        size = *length + 256;
+        report = malloc(size);
+        if (report == NULL) {
+            printf("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_mutex_lock(&lookups_lock);
+    *length += snprintf(report + *length, size - *length, "%-23s%lu\n", "inodes held by kernel", kernel_inodes);
+    pthread_mutex_unlock(&lookups_lock);
+    return report;
+}
+
+/**
+ * Body of the thread that prints the statistics to standard output each
+ * time the process gets SIGUSR1. The signal is blocked in every thread, so
+ * it is only ever taken here, by sigwait().
+ *
+ * @param arg Unused.
+ * @return    NULL.
+ */
+void *stats_main(void *arg) {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    int received;
+    while (sigwait(&signals, &received) == 0 && !stats_stop) {
+        int length;
+        char *report = stats_report(&length);
+        printf("--- wfs statistics at %ld ---\n%s", (long)time(NULL), report);
+        fflush(stdout);
+        free(report);
+    }
+    return NULL;
+}
+
+/**
+ * Helper method that fills in the attributes of an inode as FUSE numbers it.
+ *
+ * @param ino   The FUSE inode number.
+ * @param stbuf The struct stat to fill in.
+ * @return      0 on success, or a negative error code.
+ */
+int fill_attr(fuse_ino_t ino, struct stat *stbuf) {
+    if (ino == STATS_INO) {
+        int length;
+        free(stats_report(&length));
+        memset(stbuf, 0, sizeof(*stbuf));
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_uid = getuid();
+        stbuf->st_gid = getgid();
+        stbuf->st_size = length;
+        stbuf->st_atime = stbuf->st_mtime = mount_time;
+    } else {
+        int ret = libwfs_getattr(fs, to_wfs(ino), stbuf);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    stbuf->st_ino = ino;
+    return 0;
+}
+
+/**
+ * Returns how long the kernel may cache the attributes of an inode. Every
+ * change to an inode of the engine comes through the kernel, which updates
+ * or drops what it has cached as it makes it, so they can be kept for the
+ * configured time. The statistics file changes under the kernel's feet, so
+ * its attributes are never cached.
+ *
+ * @param ino The FUSE inode number.
+ * @return    The timeout in seconds.
+ */
+double attr_timeout(fuse_ino_t ino) {
+    return ino == STATS_INO ? 0 : mount_options.attr_timeout;
+}
+
+/**
+ * Helper method that answers a request with the entry for an inode, which
+ * the kernel then holds until it forgets it.
+ *
+ * @param req The request.
+ * @param ino The FUSE inode number.
+ */
+void reply_entry(fuse_req_t req, fuse_ino_t ino) {
+    // Counted first, so the number cannot be reused from here on
+    int ret = ino != STATS_INO ? count_lookup(to_wfs(ino)) : 0;
+    struct fuse_entry_param entry;
+    memset(&entry, 0, sizeof(entry));
+    if (ret == 0 && (ret = fill_attr(ino, &entry.attr)) != 0 && ino != STATS_INO) {
+        forget_lookups(ino, 1);
+    }
+    if (ret != 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    entry.ino = ino;
+    if (ino != STATS_INO) {
+        uint64_t generation = 0;
+        libwfs_generation(fs, to_wfs(ino), &generation); // Inode numbers are reused; this tells the kernel which file it got
+        entry.generation = generation;
+    }
+    entry.attr_timeout = attr_timeout(ino);
+    entry.entry_timeout = mount_options.entry_timeout;
+    if (fuse_reply_entry(req, &entry) != 0 && ino != STATS_INO) {
+        forget_lookups(ino, 1); // The kernel never got it
+    }
+}
+
+/**
+ * Returns whether a name in a directory is the statistics file.
+ */
+int is_stats(fuse_ino_t parent, const char *name) {
+    return parent == FUSE_ROOT_ID && strcmp(name, STATS_NAME) == 0;
+}
+
+/**
+ * FUSE callback for looking up a name in a directory.
+ *
+ * @param req    The request.
+ * @param parent The FUSE inode number of the directory.
+ * @param name   The name to look up.
+ */
+static void wfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    if (is_stats(parent, name)) {
+        reply_entry(req, STATS_INO);
+        return;
+    }
+    uint32_t child;
+    int ret = libwfs_lookup(fs, to_wfs(parent), name, &child);
+    if (ret == -ENOENT && mount_options.negative_timeout > 0) {
+        struct fuse_entry_param entry; // Inode 0 tells the kernel to remember the name is missing
+        memset(&entry, 0, sizeof(entry));
+        entry.entry_timeout = mount_options.negative_timeout;
+        fuse_reply_entry(req, &entry);
+        return;
+    }
+    if (ret != 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    reply_entry(req, to_fuse(child));
+}
+
+/**
+ * FUSE callback for the kernel dropping its lookups of an inode.
+ *
+ * @param req     The request, which gets no reply.
+ * @param ino     The FUSE inode number.
+ * @param nlookup The number of lookups dropped.
+ */
+static void wfs_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    forget_lookups(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+/**
+ * FUSE callback for the kernel dropping its lookups of several inodes.
+ *
+ * @param req     The request, which gets no reply.
+ * @param count   The number of inodes.
+ * @param forgets The inodes and how many lookups of each are dropped.
+ */
+static void wfs_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets) {
+    for (size_t i = 0; i < count; i++) {
+        forget_lookups(forgets[i].ino, forgets[i].nlookup);
+    }
+    fuse_reply_none(req);
+}
+
+/**
+ * FUSE callback for getting the attributes of an inode.
+ *
+ * @param req The request.
+ * @param ino The FUSE inode number.
+ * @param fi  Unused.
+ */
+static void wfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct stat stbuf;
+    int ret = fill_attr(ino, &stbuf);
+    if (ret != 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    fuse_reply_attr(req, &stbuf, attr_timeout(ino));
+}
+
+/**
+ * Creates a new file in a directory.
+ *
+ * @param req    The request.
+ * @param parent The FUSE inode number of the directory.
+ * @param name   The name of the new file.
+ * @param mode   The file mode and type.
+ * @param rdev   Ignored; included for compatibility.
+ */
+static void wfs_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev) {
+    if (is_stats(parent, name)) {
+        fuse_reply_err(req, EEXIST);
+        return;
+    }
+    uint32_t child;
+    int ret = libwfs_create(fs, to_wfs(parent), name, __S_IFREG | mode, &child);
+    if (ret != 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    reply_entry(req, to_fuse(child));
+}
+
+/**
+ * Creates a new directory in a directory.
+ *
+ * @param req    The request.
+ * @param parent The FUSE inode number of the directory.
+ * @param name   The name of the new directory.
+ * @param mode   The permissions of the new directory.
+ */
+static void wfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    if (is_stats(parent, name)) {
+        fuse_reply_err(req, EEXIST);
+        return;
+    }
+    uint32_t child;
+    int ret = libwfs_create(fs, to_wfs(parent), name, __S_IFDIR | mode, &child);
+    if (ret != 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    reply_entry(req, to_fuse(child));
+}
+
+/**
+ * FUSE callback for opening a file. Files keep what the page cache holds of
+ * them from one open to the next, as nothing changes them behind the
+ * kernel's back. The statistics file does change so, and is read straight
+ * from the engine instead; it may only be read.
+ *
+ * @param req The request.
+ * @param ino The FUSE inode number.
+ * @param fi  Information about the opened file.
+ */
+static void wfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    if (ino == STATS_INO) {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+            fuse_reply_err(req, EACCES);
+            return;
+        }
+        fi->direct_io = 1;
+    } else {
+        fi->keep_cache = 1;
+    }
+    fuse_reply_open(req, fi);
+}
+
+/**
+ * Where wfs_read() sends the bytes libwfs_read_to() finds.
+ */
+struct read_context {
+    fuse_req_t req;
+    int replied;     // whether the request has been answered
+};
+
+/**
+ * Answers a read with the bytes where they lie in the image. The engine
+ * holds the file still until this returns, so the kernel copies them straight
+ * from the mapping, and nothing is copied here.
+ *
+ * @param context The struct read_context of the read.
+ * @param iov     The pieces of the image read.
+ * @param count   The number of pieces.
+ * @return        0 on success, or a negative error code.
+ */
+int reply_iov(void *context, const struct iovec *iov, int count) {
+    struct read_context *read = context;
+    read->replied = 1;
+    if (count < MAX_IOV) { // fuse_reply_iov() needs one more for the header
+        return fuse_reply_iov(read->req, iov, count);
+    }
+
+    // Too fragmented to send in one go; gather it instead
+    size_t size = 0;
+    for (int i = 0; i < count; i++) {
+        size += iov[i].iov_len;
+    }
+    char *buf = malloc(size);
+    if (buf == NULL) {
+        return fuse_reply_err(read->req, ENOMEM);
+    }
+    size_t done = 0;
+    for (int i = 0; i < count; i++) {
+        memcpy(buf + done, iov[i].iov_base, iov[i].iov_len);
+        done += iov[i].iov_len;
+    }
+    int ret = fuse_reply_buf(read->req, buf, size);
+    free(buf);
+    return ret;
+}
+
+/**
+ * FUSE callback for reading data from a file.
+ *
+ * @param req    The request.
+ * @param ino    The FUSE inode number.
+ * @param size   The number of bytes to read.
+ * @param offset The offset within the file to start reading.
+ * @param fi     Information about the opened file.
+ */
+static void wfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
+    if (ino == STATS_INO) {
+        int length;
+        char *report = stats_report(&length);
+        size_t copied = offset < length ? (size < (size_t)(length - offset) ? size : (size_t)(length - offset)) : 0;
+        fuse_reply_buf(req, report + (copied > 0 ? offset : 0), copied);
+        free(report);
+        return;
+    }
+    struct read_context context = { .req = req };
+    int ret = libwfs_read_to(fs, to_wfs(ino), size, offset, reply_iov, &context);
+    if (!context.replied) {
+        fuse_reply_err(req, -ret);
+    }
+}
+
+/**
+ * @brief Writes data to a file in the custom file system.
+ *
+ * @param req    The request.
+ * @param ino    The FUSE inode number.
+ * @param buf    The buffer containing the data to be written.
+ * @param size   The size of the data to write.
+ * @param offset The offset in the file where writing should start.
+ * @param fi     Information about the opened file.
+ */
+static void wfs_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    if (ino == STATS_INO) {
+        fuse_reply_err(req, EACCES);
+        return;
+    }
+    int ret = libwfs_write(fs, to_wfs(ino), buf, size, offset);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    fuse_reply_write(req, ret);
+}
+
+/**
+ * @brief Copies the next bytes of a write out of the FUSE buffer.
+ *
+ * A source for libwfs_write_from(). FUSE moves the buffer vector on past the
+ * bytes copied, so each call picks up where the last one stopped.
+ *
+ * @param context The struct fuse_bufvec holding the data to write.
+ * @param dst Where in the image the bytes go.
+ * @param size The number of bytes to copy.
+ * @return 0 on success, or a negative error code.
+ */
+int copy_from_bufvec(void *context, char *dst, size_t size) {
+    struct fuse_bufvec *src = context;
+    while (size > 0) {
+        struct fuse_bufvec to = FUSE_BUFVEC_INIT(size);
+        to.buf[0].mem = dst;
+        ssize_t copied = fuse_buf_copy(&to, src, 0);
+        if (copied < 0) {
+            return copied;
+        }
+        if (copied == 0) {
+            return -EIO; // The request held fewer bytes than it claimed
+        }
+        dst += copied;
+        size -= copied;
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes data to a file straight from the FUSE buffer, which may be
+ * a pipe the request was spliced into.
+ *
+ * @param req    The request.
+ * @param ino    The FUSE inode number.
+ * @param bufv   The buffer vector holding the data to be written.
+ * @param offset The offset in the file where writing should start.
+ * @param fi     Information about the opened file.
+ */
+static void wfs_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t offset, struct fuse_file_info *fi) {
+    if (ino == STATS_INO) {
+        fuse_reply_err(req, EACCES);
+        return;
+    }
+    int ret = libwfs_write_from(fs, to_wfs(ino), copy_from_bufvec, bufv, fuse_buf_size(bufv), offset);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    fuse_reply_write(req, ret);
+}
+
+/**
+ * Where wfs_readdir() gathers the entries libwfs_readdir() finds.
+ */
+struct readdir_context {
+    fuse_req_t req;
+    char *buf;       // the reply being built
+    size_t size;     // the room in buf
+    size_t used;     // the bytes of buf filled
+};
+
+/**
+ * Adds one directory entry to the reply of a readdir. Each entry carries the
+ * cookie of the entry after it, from which the next call picks up.
+ *
+ * @param context      The struct readdir_context of the readdir.
+ * @param name         The name of the entry.
+ * @param inode_number The inode number of the engine it names.
+ * @param next         The cookie of the entry after it.
+ * @return             0 to go on, or 1 once the reply is full.
+ */
+int fill_dir(void *context, const char *name, uint32_t inode_number, uint64_t next) {
+    struct readdir_context *dir = context;
+    struct stat stbuf;
+    memset(&stbuf, 0, sizeof(stbuf));
+    stbuf.st_ino = to_fuse(inode_number);
+    size_t size = fuse_add_direntry(dir->req, NULL, 0, name, NULL, 0);
+    if (dir->used + size > dir->size) {
+        return 1;
+    }
+    fuse_add_direntry(dir->req, dir->buf + dir->used, size, name, &stbuf, next);
+    dir->used += size;
+    return 0;
+}
+
+/**
+ * FUSE callback for listing a directory, a reply's worth at a time. "." and
+ * ".." take the cookies 1 and 2, below any the engine hands out.
+ *
+ * @param req    The request.
+ * @param ino    The FUSE inode number of the directory.
+ * @param size   The most bytes of entries to reply with.
+ * @param offset Where to pick up: 0 for the beginning, or a cookie handed out before.
+ * @param fi     Unused.
+ */
+static void wfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
+    if (ino == STATS_INO) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    struct readdir_context context = { .req = req, .size = size };
+    context.buf = malloc(size);
+    if (context.buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    int ret = 0;
+    if ((offset >= 1 || fill_dir(&context, ".", to_wfs(ino), 1) == 0) &&
+        (offset >= 2 || fill_dir(&context, "..", to_wfs(ino), 2) == 0)) {
+        ret = libwfs_readdir(fs, to_wfs(ino), offset < LIBWFS_COOKIE_FIRST ? 0 : offset, fill_dir, &context);
+    }
+    if (ret != 0) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_buf(req, context.buf, context.used);
+    }
+    free(context.buf);
+}
+
+/**
+ * FUSE callback for removing a file.
+ *
+ * @param req    The request.
+ * @param parent The FUSE inode number of the directory.
+ * @param name   The name of the file to remove.
+ */
+static void wfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    if (is_stats(parent, name)) {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+    fuse_reply_err(req, -libwfs_unlink(fs, to_wfs(parent), name));
+}
+
+/**
+ * FUSE callback for making a file or directory durable. What that takes
+ * depends on the -o durability the image was mounted with; see
+ * libwfs_fsync(). It serves fsyncdir as well.
+ *
+ * @param req      The request.
+ * @param ino      The FUSE inode number.
+ * @param datasync Unused; the log is committed as a whole either way.
+ * @param fi       Unused.
+ */
+static void wfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    fuse_reply_err(req, ino == STATS_INO ? 0 : -libwfs_fsync(fs, to_wfs(ino)));
+}
+
+/**
+ * FUSE callback run once the filesystem is mounted. Asks the kernel for
+ * large writes, spliced write requests and asynchronous reads, and, where
+ * the kernel and libfuse have it, to cache writes and send them back in bulk.
+ *
+ * It also starts the background cleaner, here rather than in main(), since
+ * FUSE may fork into the background after main() hands over and threads do
+ * not survive a fork. So is the thread that prints the statistics on SIGUSR1.
+ *
+ * @param userdata Unused.
+ * @param conn     The connection, whose settings are negotiated here.
+ */
+static void wfs_init(void *userdata, struct fuse_conn_info *conn) {
+    conn->want |= conn->capable & (FUSE_CAP_ASYNC_READ | FUSE_CAP_BIG_WRITES | FUSE_CAP_SPLICE_WRITE);
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+    conn->want |= conn->capable & FUSE_CAP_WRITEBACK_CACHE;
+#endif
+    conn->max_write = MAX_WRITE; // libfuse lowers it to what its buffers hold
+    if (libwfs_start(fs) != 0) {
+        printf("Error: Failed to start the cleaner\n");
+    }
+    if (pthread_create(&stats_thread, NULL, stats_main, NULL) == 0) {
+        stats_running = 1;
+    }
+}
+
+/**
+ * FUSE callback run when the filesystem is unmounted. Closes the image,
+ * which writes a final checkpoint, so the next mount replays nothing.
+ *
+ * @param userdata Unused.
+ */
+static void wfs_destroy(void *userdata) {
+    if (stats_running) {
+        stats_stop = 1;
+        pthread_kill(stats_thread, SIGUSR1);
+        pthread_join(stats_thread, NULL);
+        stats_running = 0;
+    }
+    libwfs_close(fs);
+    fs = NULL;
+}
+
+static struct fuse_lowlevel_ops ops = {
+    .init         = wfs_init,
+    .destroy      = wfs_destroy,
+    .lookup       = wfs_lookup,
+    .forget       = wfs_forget,
+    .forget_multi = wfs_forget_multi,
+    .getattr      = wfs_getattr,
+    .mknod        = wfs_mknod,
+    .mkdir        = wfs_mkdir,
+    .unlink       = wfs_unlink,
+    .open         = wfs_open,
+    .read         = wfs_read,
+    .write        = wfs_write,
+    .write_buf    = wfs_write_buf,
+    .readdir      = wfs_readdir,
+    .fsync        = wfs_fsync,
+    .fsyncdir     = wfs_fsync,
+};
+
+/**
+ * Mounts a WFS image through the low-level FUSE API.
+ *
+ * @param argc      The number of command-line arguments.
+ * @param argv      An array of strings representing the command-line arguments.
+ *                 Expected format: llmount.wfs [FUSE options] disk_path mount_point
+ *                 It takes the same -o options as mount.wfs, and
+ *                 -o entry_timeout=S,attr_timeout=S,negative_timeout=S to
+ *                 set how many seconds the kernel may cache names, attributes
+ *                 and missing names (1, 1 and 0 by default).
+ * @return          0 on success, non-zero on failure.
+ */
+int main(int argc, char *argv[]) {
+    if (argc < 3 || argv[argc - 2][0] == '-' || argv[argc - 1][0] == '-') {
+        printf("Usage: llmount.wfs [FUSE options] [-o clean_rate=N,clean_threshold=N,grow_size=N,max_size=N] "
+               "[-o durability=relaxed|periodic|strict,commit_interval=N] [-o compress|dedup] "
+               "[-o entry_timeout=S,attr_timeout=S,negative_timeout=S] disk_path mount_point\n");
+        exit(EXIT_FAILURE);
+    }
+    const char *disk_path = argv[argc-2];
+    argv[argc-2] = argv[argc-1]; // FUSE only wants the mount point
+    argv[argc-1] = NULL;
+    argc--;
+
+    // Pick out our own -o options; everything else goes to FUSE
+    struct fuse_opt option_spec[] = {
+        { "clean_rate=%u", offsetof(struct llmount_options, engine.clean_rate), 1 },
+        { "clean_threshold=%u", offsetof(struct llmount_options, engine.clean_threshold), 1 },
+        { "grow_size=%u", offsetof(struct llmount_options, engine.grow_size), 1 },
+        { "max_size=%u", offsetof(struct llmount_options, engine.max_size), 1 },
+        { "durability=relaxed", offsetof(struct llmount_options, engine.durability), LIBWFS_DURABILITY_RELAXED },
+        { "durability=periodic", offsetof(struct llmount_options, engine.durability), LIBWFS_DURABILITY_PERIODIC },
+        { "durability=strict", offsetof(struct llmount_options, engine.durability), LIBWFS_DURABILITY_STRICT },
+        { "commit_interval=%u", offsetof(struct llmount_options, engine.commit_interval), 1 },
+        { "compress", offsetof(struct llmount_options, engine.compress), 1 },
+        { "dedup", offsetof(struct llmount_options, engine.dedup), 1 },
+        { "entry_timeout=%lf", offsetof(struct llmount_options, entry_timeout), 1 },
+        { "attr_timeout=%lf", offsetof(struct llmount_options, attr_timeout), 1 },
+        { "negative_timeout=%lf", offsetof(struct llmount_options, negative_timeout), 1 },
+        FUSE_OPT_END
+    };
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    char *mountpoint;
+    int multithreaded, foreground;
+    if (fuse_opt_parse(&args, &mount_options, option_spec, NULL) == -1 ||
+        fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1) {
+        exit(EXIT_FAILURE);
+    }
+
+    fs = libwfs_open(disk_path, &mount_options.engine, NULL);
+    if (fs == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    mount_time = time(NULL);
+
+    // Only the statistics thread takes SIGUSR1; the threads FUSE starts inherit the mask
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    int ret = EXIT_FAILURE;
+    struct fuse_chan *channel = fuse_mount(mountpoint, &args);
+    if (channel != NULL) {
+        struct fuse_session *session = fuse_lowlevel_new(&args, &ops, sizeof(ops), NULL);
+        if (session != NULL) {
+            if (fuse_set_signal_handlers(session) == 0) {
+                fuse_session_add_chan(session, channel);
+                if (fuse_daemonize(foreground) == 0) {
+                    ret = (multithreaded ? fuse_session_loop_mt(session) : fuse_session_loop(session)) == 0 ? 0 : EXIT_FAILURE;
+                }
+                fuse_remove_signal_handlers(session);
+                fuse_session_remove_chan(channel);
+            }
+            fuse_session_destroy(session); // Calls destroy if init ran
+        }
+        fuse_unmount(mountpoint, channel);
+    }
+    free(mountpoint);
+    fuse_opt_free_args(&args);
+    if (fs != NULL) { // FUSE gave up before it was mounted
+        libwfs_close(fs);
+    }
+    return ret;
+}
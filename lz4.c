@@ -0,0 +1,215 @@
+#include <stdint.h>
+#include <string.h>
+#include "lz4.h"
+
+#define MIN_MATCH 4         // shortest match a sequence can hold
+#define LAST_LITERALS 5     // the last bytes of a block are always literals
+#define MATCH_START_LIMIT 12 // no match starts closer than this to the end of a block
+#define MAX_OFFSET 65535    // farthest back a match can reach
+#define HASH_BITS 12        // positions remembered by the compressor, as a power of two
+#define SKIP_SHIFT 6        // misses after which the compressor steps one byte further per probe
+
+static uint32_t read32(const uint8_t *bytes) {
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static uint32_t hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/**
+ * Writes what is left of a length after the 15 its token holds: bytes of
+ * 255 and a last one below that.
+ *
+ * @param op     Where to write.
+ * @param end    The end of the room to write to.
+ * @param length The length, at least 15.
+ * @return       Where the next byte goes, or NULL if there is no room.
+ */
+static uint8_t *put_length(uint8_t *op, const uint8_t *end, size_t length) {
+    for (length -= 15; length >= 255; length -= 255) {
+        if (op == end) {
+            return NULL;
+        }
+        *op++ = 255;
+    }
+    if (op == end) {
+        return NULL;
+    }
+    *op++ = length;
+    return op;
+}
+
+/**
+ * Writes one sequence of a block: a token, literals, and unless it is the
+ * last sequence, the offset and length of a match.
+ *
+ * @param op       Where to write.
+ * @param end      The end of the room to write to.
+ * @param literals The literal bytes.
+ * @param count    The number of literal bytes.
+ * @param offset   How far back the match starts.
+ * @param match    The number of bytes matched, or 0 for the last sequence.
+ * @return         Where the next sequence goes, or NULL if there is no room.
+ */
+static uint8_t *put_sequence(uint8_t *op, const uint8_t *end, const uint8_t *literals, size_t count, size_t offset, size_t match) {
+    if (op == end) {
+        return NULL;
+    }
+    uint8_t *token = op++;
+    *token = (count < 15 ? count : 15) << 4;
+    if (count >= 15 && (op = put_length(op, end, count)) == NULL) {
+        return NULL;
+    }
+    if ((size_t)(end - op) < count) {
+        return NULL;
+    }
+    memcpy(op, literals, count);
+    op += count;
+    if (match == 0) {
+        return op;
+    }
+    if (end - op < 2) {
+        return NULL;
+    }
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    size_t code = match - MIN_MATCH;
+    *token |= code < 15 ? code : 15;
+    return code >= 15 ? put_length(op, end, code) : op;
+}
+
+/**
+ * Compresses bytes into one LZ4 block.
+ *
+ * @param src      The bytes to compress.
+ * @param size     The number of bytes.
+ * @param dst      Where to write the block.
+ * @param capacity The room at dst; the block is given up on once it would not fit.
+ * @return         The size of the block, or 0 if it does not fit in capacity.
+ */
+size_t lz4_compress(const void *src, size_t size, void *dst, size_t capacity) {
+    const uint8_t *in = src;
+    const uint8_t *end = in + size;
+    const uint8_t *anchor = in; // first byte not yet written out
+    uint8_t *op = dst;
+    const uint8_t *op_end = op + capacity;
+
+    if (size > MATCH_START_LIMIT) {
+        uint32_t table[1 << HASH_BITS] = { 0 }; // the last position each hash was seen at
+        const uint8_t *start_limit = end - MATCH_START_LIMIT;
+        const uint8_t *end_limit = end - LAST_LITERALS;
+        const uint8_t *ip = in;
+        unsigned misses = 1 << SKIP_SHIFT;
+        while (ip < start_limit) {
+            uint32_t sequence = read32(ip);
+            uint32_t slot = hash(sequence);
+            const uint8_t *ref = in + table[slot];
+            table[slot] = ip - in;
+            if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != sequence) {
+                ip += misses++ >> SKIP_SHIFT;
+                continue;
+            }
+            misses = 1 << SKIP_SHIFT;
+
+            const uint8_t *match_end = ip + MIN_MATCH;
+            for (const uint8_t *from = ref + MIN_MATCH; match_end < end_limit && *match_end == *from; from++) {
+                match_end++;
+            }
+            while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            op = put_sequence(op, op_end, anchor, ip - anchor, ip - ref, match_end - ip);
+            if (op == NULL) {
+                return 0;
+            }
+            anchor = ip = match_end;
+        }
+    }
+    op = put_sequence(op, op_end, anchor, end - anchor, 0, 0);
+    return op == NULL ? 0 : (size_t)(op - (uint8_t*)dst);
+}
+
+/**
+ * Reads a length whose token held 15 or more: the bytes that follow add to it.
+ *
+ * @param ip     Points at where the bytes start, and is moved past them.
+ * @param end    The end of the block.
+ * @param length The length so far, which the bytes are added to.
+ * @return       0 on success, or -1 if the block ends first.
+ */
+static int get_length(const uint8_t **ip, const uint8_t *end, size_t *length) {
+    uint8_t byte;
+    do {
+        if (*ip == end) {
+            return -1;
+        }
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+/**
+ * Decompresses the start of an LZ4 block, so a reader that wants bytes near
+ * the start need not decode the rest. Nothing is read or written out of
+ * bounds, whatever the block holds.
+ *
+ * @param src    The block.
+ * @param stored The size of the block.
+ * @param dst    Where to write the bytes.
+ * @param size   The number of bytes wanted, at most what the block decompresses to.
+ * @return       0 on success, or -1 if the block is damaged or decompresses to fewer bytes.
+ */
+int lz4_decompress(const void *src, size_t stored, void *dst, size_t size) {
+    const uint8_t *ip = src;
+    const uint8_t *in_end = ip + stored;
+    uint8_t *out = dst;
+    uint8_t *op = out;
+    uint8_t *out_end = out + size;
+    while (op < out_end) {
+        if (ip == in_end) {
+            return -1;
+        }
+        unsigned token = *ip++;
+        size_t count = token >> 4;
+        if (count == 15 && get_length(&ip, in_end, &count) != 0) {
+            return -1;
+        }
+        if ((size_t)(in_end - ip) < count) {
+            return -1;
+        }
+        size_t copy = count < (size_t)(out_end - op) ? count : (size_t)(out_end - op);
+        memcpy(op, ip, copy);
+        op += copy;
+        ip += count;
+        if (op == out_end) {
+            return 0;
+        }
+
+        if (in_end - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        size_t match = token & 15;
+        if (offset == 0 || offset > (size_t)(op - out) || (match == 15 && get_length(&ip, in_end, &match) != 0)) {
+            return -1;
+        }
+        match += MIN_MATCH;
+        copy = match < (size_t)(out_end - op) ? match : (size_t)(out_end - op);
+
+        // A match may overlap the bytes it writes; the bytes behind op repeat
+        // every offset bytes, so each copy can take twice as many as the last
+        for (size_t step = offset; copy > 0; step *= 2) {
+            size_t piece = step < copy ? step : copy;
+            memcpy(op, op - step, piece);
+            op += piece;
+            copy -= piece;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,17 @@
+#include <stddef.h>
+
+#ifndef LZ4_H_
+#define LZ4_H_
+
+/*
+ * A compressor and decompressor for the LZ4 block format, as used for the
+ * packed data runs of a WFS image. Blocks are plain LZ4 blocks, so any LZ4
+ * implementation can read them; this one is built in so the tools need no
+ * library. The compressor trades ratio for speed: one hash probe per
+ * position, and fewer the longer it goes without a match.
+ */
+
+size_t lz4_compress(const void *src, size_t size, void *dst, size_t capacity);
+int lz4_decompress(const void *src, size_t stored, void *dst, size_t size);
+
+#endif
@@ -1,51 +1,169 @@
 #define _POSIX_C_SOURCE 200809L
 #include "wfs.h"
+#include "crc32c.h"
+#include <stddef.h>  // for offsetof
 #include <fcntl.h>   // for open
 #include <unistd.h>  // for close, read, write
 #include <stdio.h>   // for printf
 #include <stdlib.h>  // for exit
+#include <string.h>  // for memcpy
 #include <sys/stat.h> // for S_IFDIR
-#include <time.h>    // for time
+#include <time.h>    // for clock_gettime
+#include <sys/random.h> // for getrandom
 
+#define DEFAULT_DISK_SIZE (1024 * 1024) // size given to new or undersized images, as in create_disk.sh
+#define MIN_SEGMENTS 4                  // segment 0 plus room for the cleaner to work
 
-static int init_fs(const char *path) {
-    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+/**
+ * Picks the sequence number of segment 0. It is random, so the records an
+ * earlier file system left in the image carry other sequence numbers than
+ * those of this one and cannot pass for its records.
+ */
+static uint64_t first_sequence() {
+    uint32_t random = 0;
+    if (getrandom(&random, sizeof(random), 0) != sizeof(random)) {
+        random = time(NULL) ^ getpid();
+    }
+    return (uint64_t)random << 24 | 1; // Leaves room for 2^40 segments to be opened
+}
+
+/**
+ * Builds the root directory's log entry, framed like every other so it is
+ * checked at mount.
+ *
+ * @param out      Where to write the record and the root's inode.
+ * @param sequence The sequence number of segment 0.
+ * @param format   1 or 2.
+ * @return         The number of bytes written.
+ */
+static size_t root_entry(char *out, uint64_t sequence, int format) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    char inode[sizeof(struct wfs_inode) > sizeof(struct wfs_inode_v1) ? sizeof(struct wfs_inode) : sizeof(struct wfs_inode_v1)];
+    size_t inode_size;
+    if (format == 1) {
+        struct wfs_inode_v1 root = {
+            .inode_number = 0,
+            .mode = S_IFDIR,
+            .uid = getuid(),
+            .gid = getgid(),
+            .flags = WFS_LOG_INODE,
+            .size = 0,
+            .atime = now.tv_sec,
+            .mtime = now.tv_sec,
+            .ctime = now.tv_sec,
+            .links = 1,
+        };
+        inode_size = sizeof(root);
+        memcpy(inode, &root, inode_size);
+    } else {
+        struct wfs_inode root = {
+            .inode_number = 0,
+            .flags = WFS_LOG_INODE,
+            .mode = S_IFDIR,
+            .uid = getuid(),
+            .gid = getgid(),
+            .links = 1,
+            .size = 0,
+            .atime = now.tv_sec * 1000000000ll + now.tv_nsec,
+        };
+        root.mtime = root.atime;
+        root.ctime = root.atime;
+        inode_size = sizeof(root);
+        memcpy(inode, &root, inode_size);
+    }
+
+    struct wfs_record record = { .type = WFS_RECORD_ENTRY, .length = inode_size };
+    record.crc = crc32c(0, &sequence, sizeof(sequence));
+    record.crc = crc32c(record.crc, &record, offsetof(struct wfs_record, crc));
+    record.crc = crc32c(record.crc, inode, inode_size);
+    memcpy(out, &record, sizeof(record));
+    memcpy(out + sizeof(record), inode, inode_size);
+    return sizeof(record) + inode_size;
+}
+
+static int init_fs(const char *path, int format, uint32_t features) {
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
     if (fd == -1) {
         perror("Error opening file");
         return -1;
     }
 
-    struct wfs_sb supblock;
-    struct wfs_inode root;
+    struct stat stat_info;
+    if (fstat(fd, &stat_info) == -1) {
+        perror("Error getting file size");
+        close(fd);
+        return -1;
+    }
+    off_t disk_size = stat_info.st_size;
+    if (disk_size < (off_t)MIN_SEGMENTS * WFS_SEGMENT_SIZE) {
+        disk_size = DEFAULT_DISK_SIZE;
+        if (ftruncate(fd, disk_size) == -1) {
+            perror("Error resizing file");
+            close(fd);
+            return -1;
+        }
+    }
+
+    struct wfs_sb supblock = { 0 };
+    struct wfs_sb_v1 supblock_v1;
+    struct wfs_segment segment;
+    char root[sizeof(struct wfs_record) + sizeof(struct wfs_inode) + sizeof(struct wfs_inode_v1)];
+    size_t sb_size = format == 1 ? sizeof(struct wfs_sb_v1) : sizeof(struct wfs_sb);
 
+    segment.magic = WFS_FRAMED_SEGMENT_MAGIC;
+    segment.sequence = first_sequence();
+    size_t root_size = root_entry(root, segment.sequence, format);
+
+    // The log starts in segment 0, right after the superblock and the segment header.
+    // Segments past the most the format can address are left unused.
+    off_t max_segments = format == 1 ? WFS_MAX_SEGMENTS_V1 : WFS_MAX_SEGMENTS;
     supblock.magic = WFS_MAGIC;
-    supblock.head = sizeof(struct wfs_sb) + sizeof(struct wfs_inode);
-    
-    // creating the root
-    root.inode_number = 0;
-    root.deleted = 0;
-    root.mode = S_IFDIR; // | 0755 for perission bits, this is different for file types (ibelieve that files are 0644)
-    root.uid = getuid();
-    root.gid = getgid();
-    root.flags = 0;
-    root.size = 0;
-    root.atime = time(NULL);
-    root.mtime = time(NULL);
-    root.ctime = time(NULL);
-    root.links = 1;
-
-    if (write(fd, &supblock, sizeof(struct wfs_sb)) == -1) {
+    supblock.head = sb_size + sizeof(struct wfs_segment) + root_size;
+    supblock.segment_size = WFS_SEGMENT_SIZE;
+    supblock.segments = disk_size / WFS_SEGMENT_SIZE < max_segments ? disk_size / WFS_SEGMENT_SIZE : max_segments;
+    supblock.checkpoint = WFS_NO_CHECKPOINT;
+    supblock.version = WFS_VERSION;
+    supblock.features = features;
+    segment.used = supblock.head;
+    if (format == 1) {
+        supblock_v1 = (struct wfs_sb_v1){
+            .magic = WFS_MAGIC_V1,
+            .head = supblock.head,
+            .segment_size = WFS_SEGMENT_SIZE,
+            .segments = supblock.segments,
+            .checkpoint = WFS_NO_CHECKPOINT,
+        };
+    }
+
+    if (write(fd, format == 1 ? (void*)&supblock_v1 : (void*)&supblock, sb_size) == -1) {
         perror("Error writing superblock");
         close(fd);
         return -1;
     }
 
-    if (write(fd, &root, sizeof(struct wfs_inode)) == -1) {
+    if (write(fd, &segment, sizeof(struct wfs_segment)) == -1) {
+        perror("Error writing segment header");
+        close(fd);
+        return -1;
+    }
+
+    if (write(fd, root, root_size) == -1) {
         perror("Error writing root inode");
         close(fd);
         return -1;
     }
 
+    // Mark every other segment free, in case the image held an older file system
+    struct wfs_segment free_segment = { 0 };
+    for (uint32_t i = 1; i < supblock.segments; i++) {
+        if (pwrite(fd, &free_segment, sizeof(free_segment), (off_t)i * WFS_SEGMENT_SIZE) == -1) {
+            perror("Error writing segment header");
+            close(fd);
+            return -1;
+        }
+    }
+
     close(fd);
 
     printf("Filesystem init success at %s\n", path);
@@ -53,18 +171,36 @@ static int init_fs(const char *path) {
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: mkfs.wfs disk_path\n");
+    int format = WFS_VERSION;
+    uint32_t features = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "cdf:")) != -1) {
+        if (opt == 'c' || opt == 'd') {
+            features |= opt == 'c' ? WFS_FEATURE_COMPRESSION : WFS_FEATURE_DEDUP;
+            continue;
+        }
+        if (opt != 'f' || (strcmp(optarg, "1") != 0 && strcmp(optarg, "2") != 0)) {
+            optind = argc + 1; // Falls through to the usage message
+            break;
+        }
+        format = atoi(optarg);
+    }
+    if (optind != argc - 1 || (format == 1 && features != 0) ||
+        features == (WFS_FEATURE_COMPRESSION | WFS_FEATURE_DEDUP)) {
+        fprintf(stderr, "Usage: mkfs.wfs [-c | -d] [-f format] disk_path\n"
+                        "  -c         compress file data (format 2 only)\n"
+                        "  -d         deduplicate file data (format 2 only)\n"
+                        "  -f format  on-disk format to write: 2 (the default), or 1 for tools that predate it\n");
         exit(-1);
     }
 
-    const char *disk_path = argv[1];
+    const char *disk_path = argv[optind];
 
     // Initialize the filesystem
-    if (init_fs(disk_path) == -1) {
+    if (init_fs(disk_path, format, features) == -1) {
         fprintf(stderr, "Fail init filesystem.\n");
         exit(-1);
     }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -1,253 +1,415 @@
 #define FUSE_USE_VERSION 30
 #include <fuse.h>
 #include <errno.h>
-#include <sys/mman.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <unistd.h>
-#include <sys/stat.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <time.h>
-#include "wfs.h"
-#include "assert.h"
+#include "libwfs.h"
 
-#define MAX_LENGTH 100
+#define STATS_PATH "/.wfs_stats" // read-only file at the root with the engine's statistics
+#define MAX_WRITE (1 << 20)       // largest write request to ask the kernel for
+#define WRITE_BUFFER_SIZE MAX_WRITE // most bytes an open file holds back from the engine
+#define WRITE_BUFFER_MS 1000      // longest an open file holds bytes back, in ms
+#define OPEN_FILE_LISTS 256       // lists the open files are spread over by inode number
 
-const char *disk_path;
-void *mapped_disk; // starting of the superblock
-int currFd; // file descriptor for the current open file
-uint32_t head;
-int inode_number;
-int length;
+/*
+ * The FUSE frontend of the engine in libwfs.c. Each callback resolves the
+ * paths FUSE hands it to inode numbers and calls into the engine.
+ */
+
+struct libwfs *fs; // the mounted image
+time_t mount_time;
+pthread_t stats_thread;  // prints the statistics on SIGUSR1
+int stats_running;
+_Atomic int stats_stop;
+
+/*
+ * Write-back buffers. Small writes to an open file are held back in memory
+ * and handed to the engine together, so a file written 4 KiB at a time does
+ * not cost a log entry and a data record per call. A write is merged with
+ * what is held if it touches or overlaps it; otherwise, or once
+ * WRITE_BUFFER_SIZE bytes are held, the buffer is sent on first. It is also
+ * sent on flush, fsync and release, before anything reads the file or its
+ * size, and by the flusher thread once it is WRITE_BUFFER_MS old. A send
+ * that fails is reported by the next write, flush or fsync of the file, or
+ * if the file is released first, kept in lost_errors for the next fsync or
+ * getattr of its inode.
+ *
+ * Open files are listed by inode number, so the buffers of a file can be
+ * found from its path. open_files_lock guards the lists. It is held shared
+ * around anything that touches a buffer, and exclusively by unlink, so a
+ * buffer is never sent to an inode number the engine has handed out again.
+ */
+struct open_file {
+    uint32_t inode_number;  // the file, which also picks the list the open file is in
+    int removed;            // set, under open_files_lock, once the file is removed and its number may be reused
+    pthread_mutex_t lock;   // guards the fields below
+    char *buffer;           // bytes written but not yet handed to the engine
+    size_t capacity;        // bytes allocated at buffer
+    size_t length;          // bytes held, 0 if none
+    off_t start;            // where in the file the bytes held go
+    struct timespec since;  // when the buffer last went from empty to holding bytes
+    int error;              // a failed send not yet reported, or 0
+    struct open_file *next; // next open file in the same list
+};
+struct open_file *open_files[OPEN_FILE_LISTS];
+pthread_rwlock_t open_files_lock = PTHREAD_RWLOCK_INITIALIZER;
+_Atomic int buffered_files; // open files holding bytes back
+
+/*
+ * A failed send no open file is left to report, kept until the next fsync or
+ * getattr of the inode, or until the inode is removed.
+ */
+struct lost_error {
+    uint32_t inode_number;
+    int error;
+    struct lost_error *next;
+};
+struct lost_error *lost_errors;
+pthread_mutex_t lost_errors_lock = PTHREAD_MUTEX_INITIALIZER; // guards lost_errors
 
-struct wfs_log_entry *find_last_matching_inode(unsigned long inode_number);
+pthread_t flusher_thread; // sends buffers that have been held too long
+int flusher_running;
+int flusher_stop;
+pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER; // guards flusher_stop
+pthread_cond_t flusher_wakeup = PTHREAD_COND_INITIALIZER;
 
 /**
- * Helper method that counts the number of slashes ('/') in the given file path.
+ * Helper method that splits a path into its parent directory, resolved to an
+ * inode number, and the name of the last component within it.
  *
- * @param filepath  A null-terminated string representing the file path.
- * @return          The count of slashes in the file path.
+ * @param path   The path.
+ * @param parent Where to store the inode number of the parent directory.
+ * @param name   Where to store a pointer to the last component, within path.
+ * @return       0 on success, -ENAMETOOLONG if the parent's path is longer
+ *               than PATH_MAX, or -ENOENT if the parent directory does not exist.
  */
-int count_slashes(const char *filepath) {
-    int count = 0;
-    while (*filepath) {
-        if (*filepath == '/') {
-            count++;
-        }
-        filepath++;
-    }
-    return count;
+int resolve_parent(const char *path, uint32_t *parent, const char **name) {
+    const char *last = strrchr(path, '/');
+    *name = last + 1; // Name of the entry within its parent
+    size_t length = last - path;
+    if (length >= PATH_MAX) {
+        return -ENAMETOOLONG;
+    }
+    char parent_path[PATH_MAX];
+    memcpy(parent_path, path, length);
+    parent_path[length] = '\0';
+    return libwfs_resolve(fs, length > 0 ? parent_path : "/", parent);
 }
 
 /**
- * Helper method that tokenizes a string based on the '/' delimiter.
- *
- * @param str       The input string to be tokenized.
- * @return          An array of strings containing the tokens.
- *                  The array is null-terminated.
- *                  Memory is dynamically allocated, and the caller is responsible for freeing it.
+ * Returns whether a path names the statistics file.
  */
-char** tokenize(char str[]) {
-    char **array = malloc(MAX_LENGTH * sizeof(char*));
-    if (array == NULL) { // Handle memory allocation failure
-        printf("Memory allocation failed");
-        exit(EXIT_FAILURE);
-    }
+int is_stats(const char *path) {
+    return strcmp(path, STATS_PATH) == 0;
+}
 
-    char *token = strtok(str, "/");
-    int i = 0;
-    while (token != NULL && i < MAX_LENGTH) {
-        array[i++] = strdup(token); // Duplicate the token and store its pointer
-        if (array[i - 1] == NULL) { // Handle memory allocation failure
+/**
+ * Helper method that builds the current statistics report.
+ *
+ * @param length Where to store the length of the report.
+ * @return       The report, which the caller frees.
+ */
+char *stats_report(int *length) {
+    char *report = NULL;
+    int size = 0;
+    while ((*length = libwfs_stats(fs, report, size)) >= size) { // It may have grown since it was measured
+        free(report);
+        size = *length + 256;
+        report = malloc(size);
+        if (report == NULL) {
             printf("Memory allocation failed");
             exit(EXIT_FAILURE);
         }
-        token = strtok(NULL, "/");
     }
-
-    array[i] = NULL; // Null-terminate the array
-    return array;
+    return report;
 }
 
 /**
- * Helper method that removes the last token from the input string and returns the modified string.
+ * Body of the thread that prints the statistics to standard output each
+ * time the process gets SIGUSR1. The signal is blocked in every thread, so
+ * it is only ever taken here, by sigwait().
  *
- * @param str   The input string to be processed.
- * @return      A newly allocated string without the last token.
- *              The caller is responsible for freeing the returned string.
+ * @param arg Unused.
+ * @return    NULL.
  */
-char* remove_last_token(char str[]) {
-    char** tokens = tokenize(str);
-    if (tokens[0] == NULL) { // return empty string on an empty path
-        printf("Error: The string is empty after tokenization\n");
-        return strdup("");
-    }
-
-    int lastTokenIndex = 0;
-    while (tokens[lastTokenIndex + 1] != NULL) {
-        lastTokenIndex++;
-    }
-
-    int lengthWithoutLastToken = 0;
-    for (int i = 0; i < lastTokenIndex; i++) {
-        lengthWithoutLastToken += strlen(tokens[i]) + 1; // Add 1 for the '/'
-    }
+void *stats_main(void *arg) {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    int received;
+    while (sigwait(&signals, &received) == 0 && !stats_stop) {
+        int length;
+        char *report = stats_report(&length);
+        printf("--- wfs statistics at %ld ---\n%s", (long)time(NULL), report);
+        fflush(stdout);
+        free(report);
+    }
+    return NULL;
+}
 
-    char* result = malloc(lengthWithoutLastToken + 1); // Add 1 for the null terminator
-    if (result == NULL) {
-        printf("Memory allocation failed");
-        exit(EXIT_FAILURE);
-    }
-    result[0] = '\0';
-    for (int i = 0; i < lastTokenIndex; i++) {
-        strcat(result, tokens[i]);
-        strcat(result, "/");
-    }
+/**
+ * Returns the open file of a FUSE file handle, or NULL if it has none.
+ */
+struct open_file *open_file_of(struct fuse_file_info *fi) {
+    return fi != NULL ? (struct open_file*)(uintptr_t)fi->fh : NULL;
+}
 
-    if (lengthWithoutLastToken > 0) {
-        result[lengthWithoutLastToken - 1] = '\0';
+/**
+ * Hands the bytes an open file holds back to the engine. A failure is kept
+ * in file->error. The caller holds open_files_lock and file->lock.
+ *
+ * @param file The open file.
+ */
+void send_buffer(struct open_file *file) {
+    if (file->length == 0) {
+        return;
     }
-
-    for (int i = 0; tokens[i] != NULL; i++) {
-        free(tokens[i]);
+    int ret = file->removed ? 0 : libwfs_write(fs, file->inode_number, file->buffer, file->length, file->start);
+    if (ret < 0 && file->error == 0) {
+        file->error = ret;
     }
-    free(tokens);
-
-    return result;
+    file->length = 0;
+    buffered_files--;
 }
 
 /**
- * Helper method that frees the memory allocated for an array of strings.
+ * Sends the buffer of an open file and takes the failure to report, if any.
+ * The caller holds open_files_lock and file->lock.
  *
- * This function takes an array of strings and iteratively frees each string 
- * along with the memory allocated for the array itself. The array is expected 
- * to be null-terminated.
+ * @param file The open file.
+ * @return     0, or the first failed send not yet reported.
+ */
+int send_and_report(struct open_file *file) {
+    send_buffer(file);
+    int ret = file->error;
+    file->error = 0;
+    return ret;
+}
+
+/**
+ * Keeps a failed send of a file being released for the next fsync or getattr
+ * of its inode. An inode keeps only the first one.
  *
- * @param tokens An array of strings to be freed.
+ * @param inode_number The inode number.
+ * @param error        The failure, a negative error code.
  */
-void free_tokens(char** tokens) {
-    for (int i = 0; tokens[i] != NULL; i++) {
-        free(tokens[i]);
+void keep_lost_error(uint32_t inode_number, int error) {
+    pthread_mutex_lock(&lost_errors_lock);
+    struct lost_error *lost = lost_errors;
+    while (lost != NULL && lost->inode_number != inode_number) {
+        lost = lost->next;
+    }
+    if (lost == NULL) {
+        lost = malloc(sizeof(struct lost_error));
+        if (lost == NULL) {
+            printf("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        lost->inode_number = inode_number;
+        lost->error = error;
+        lost->next = lost_errors;
+        lost_errors = lost;
     }
-    free(tokens);
+    pthread_mutex_unlock(&lost_errors_lock);
 }
 
 /**
- * Helper method that retrieves the inode number associated with the given file path.
- *
- * This function tokenizes the provided file path, traverses the directory structure
- * starting from the root node, and iteratively checks each component in the tokenized path.
- * If a file is encountered, the function directly uses the data; if a directory is encountered,
- * it parses through the directory to check the existence of the next component in the path.
+ * Takes the failed send kept for an inode, if any.
  *
- * @param filepath The file path for which to retrieve the inode number.
- * @return A pointer to the wfs_inode structure corresponding to the provided file path,
- *         or NULL if the file path does not exist or an error occurs.
+ * @param inode_number The inode number.
+ * @return             The failure kept, or 0.
  */
-struct wfs_inode *get_inode_number_path(const char *filepath){
-    int found_flag = 0;
-    // Make a copy of the input filepath to avoid modifying the original string
-    char input[MAX_LENGTH];
-    strncpy(input, filepath, MAX_LENGTH - 1);
-    input[MAX_LENGTH - 1] = '\0';  // Null-termination for strings
-
-    char**tokens=tokenize(input);
-    if (tokens == NULL) {
-        printf("Error: Tokenization failed in get_inode_number_path()\n");
-        return NULL; // Return -ENOMEM on memory allocation failure
+int take_lost_error(uint32_t inode_number) {
+    int error = 0;
+    pthread_mutex_lock(&lost_errors_lock);
+    for (struct lost_error **link = &lost_errors; *link != NULL; link = &(*link)->next) {
+        if ((*link)->inode_number == inode_number) {
+            struct lost_error *lost = *link;
+            error = lost->error;
+            *link = lost->next;
+            free(lost);
+            break;
+        }
     }
+    pthread_mutex_unlock(&lost_errors_lock);
+    return error;
+}
 
-    struct wfs_log_entry *curr = find_last_matching_inode(0);
-    if (curr == NULL) {
-        printf("Error: Failed to find last matching inode\n");
-        free_tokens(tokens);
-        return NULL; // Return -ENOENT when the last matching inode is not found
+/**
+ * Sends the buffers of every open file of an inode, so the engine sees all
+ * that was written to it. The caller holds open_files_lock.
+ *
+ * @param inode_number The inode number.
+ */
+void send_buffers_locked(uint32_t inode_number) {
+    for (struct open_file *file = open_files[inode_number % OPEN_FILE_LISTS]; file != NULL; file = file->next) {
+        if (file->inode_number == inode_number && !file->removed) {
+            pthread_mutex_lock(&file->lock);
+            send_buffer(file);
+            pthread_mutex_unlock(&file->lock);
+        }
     }
+}
 
-    int i = 0;
-    if (tokens[i] == NULL) {
-        free_tokens(tokens);
-        return (struct wfs_inode*)curr;
+/**
+ * Sends the buffers of every open file of an inode, if any file holds bytes back.
+ *
+ * @param inode_number The inode number.
+ */
+void send_buffers(uint32_t inode_number) {
+    if (buffered_files == 0) {
+        return;
     }
+    pthread_rwlock_rdlock(&open_files_lock);
+    send_buffers_locked(inode_number);
+    pthread_rwlock_unlock(&open_files_lock);
+}
 
-    while(tokens[i] != NULL) {
-        found_flag=0;
-        struct wfs_dentry* entry = (struct wfs_dentry*)curr->data;
-
-        for(int j = 0; j < (curr->inode.size/sizeof(struct wfs_dentry)); j++) {
-            if(strcmp(tokens[i],entry->name) == 0) {
-                curr = find_last_matching_inode(entry->inode_number);
-                if (curr == NULL) {
-                    printf("Error: Failed to find last matching inode\n");
-                    free_tokens(tokens);
-                    return NULL; //ERR_PTR(-ENOENT)
-                }
-                found_flag = 1;
-            }
-            entry++;
+/**
+ * Adds a write to the bytes an open file holds back. The caller holds
+ * open_files_lock and file->lock, and has checked that the write touches or
+ * overlaps what is held and that both fit in WRITE_BUFFER_SIZE bytes.
+ *
+ * @param file    The open file.
+ * @param source  Produces the bytes written.
+ * @param context Passed on to the source.
+ * @param size    The number of bytes written.
+ * @param offset  Where in the file they go.
+ * @return        size, or the source's error, in which case the buffer holds what it did before.
+ */
+int hold_write(struct open_file *file, libwfs_source_t source, void *context, size_t size, off_t offset) {
+    off_t old_start = file->start;
+    size_t old_length = file->length;
+    off_t start = old_length > 0 && old_start < offset ? old_start : offset;
+    off_t end = old_length > 0 && old_start + (off_t)old_length > offset + (off_t)size ? old_start + (off_t)old_length
+                                                                                         : offset + (off_t)size;
+    if ((size_t)(end - start) > file->capacity) {
+        size_t capacity = file->capacity > 0 ? file->capacity : 64 * 1024;
+        while (capacity < (size_t)(end - start)) {
+            capacity *= 2;
         }
-        i++;
-    }
-    free_tokens(tokens);
-    if(found_flag == 0){
-        return NULL; // Return -ENOENT when the file/directory does not exist
-    }else{
-        return (struct wfs_inode*)curr; 
+        char *grown = realloc(file->buffer, capacity);
+        if (grown == NULL) {
+            return -ENOMEM;
+        }
+        file->buffer = grown;
+        file->capacity = capacity;
+    }
+    if (old_length == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &file->since);
+        buffered_files++;
+    } else if (start < old_start) {
+        memmove(file->buffer + (old_start - start), file->buffer, old_length);
+    }
+    file->start = start;
+    file->length = end - start;
+
+    int ret = source(context, file->buffer + (offset - start), size);
+    if (ret != 0) { // Keep only what was held before
+        if (old_length == 0) {
+            file->length = 0;
+            buffered_files--;
+        } else {
+            memmove(file->buffer, file->buffer + (old_start - start), old_length);
+            file->start = old_start;
+            file->length = old_length;
+        }
+        return ret;
     }
+    return size;
 }
 
 /**
- * Finds the last log entry with the specified inode number.
+ * Writes to an open file through its buffer. Writes too large to be worth
+ * holding back go straight to the engine, once the buffer has been sent.
  *
- * This function iterates through all log entries, checking the inode portion of each entry
- * to find the last log entry with a matching inode number. It returns the corresponding log entry.
- *
- * @param inode_number The inode number to search for.
- * @return A pointer to the last log entry with the specified inode number,
- *         or NULL if no matching inode is found.
+ * @param file    The open file.
+ * @param source  Produces the bytes written.
+ * @param context Passed on to the source.
+ * @param size    The number of bytes written.
+ * @param offset  Where in the file they go.
+ * @return        The number of bytes written, or a negative error code.
  */
-struct wfs_log_entry *find_last_matching_inode(unsigned long inode_number){
-    struct wfs_log_entry* last_matching_entry = NULL; // temp var for log entry, set it to null
-    char *current =(char*)mapped_disk + sizeof(struct wfs_sb);
-
-    // iterate through the superblock whilst maintaining current entry
-    while (current < ((char*)mapped_disk + head)){
-        struct wfs_log_entry *curr_log_entry = (struct wfs_log_entry*)(current); // temp struct for current, set it to start of disk + size of a SB struct
-        // we want the time of the new to be more than the time of the old
-        if (curr_log_entry->inode.inode_number == inode_number){
-            last_matching_entry = (struct wfs_log_entry *)curr_log_entry;
+int buffered_write(struct open_file *file, libwfs_source_t source, void *context, size_t size, off_t offset) {
+    pthread_rwlock_rdlock(&open_files_lock);
+    pthread_mutex_lock(&file->lock);
+    off_t start = file->length > 0 && file->start < offset ? file->start : offset;
+    off_t held_end = file->start + (off_t)file->length;
+    off_t end = file->length > 0 && held_end > offset + (off_t)size ? held_end : offset + (off_t)size;
+    if (file->length > 0 && (offset > held_end || offset + (off_t)size < file->start || end - start > WRITE_BUFFER_SIZE)) {
+        send_buffer(file);
+    }
+    int ret = file->error;
+    file->error = 0;
+    if (ret == 0 && file->removed) {
+        ret = -ENOENT;
+    } else if (ret == 0 && size >= WRITE_BUFFER_SIZE) {
+        send_buffer(file); // Held bytes it overlaps must not be sent after it
+        ret = file->error;
+        file->error = 0;
+        if (ret == 0) {
+            ret = libwfs_write_from(fs, file->inode_number, source, context, size, offset);
+        }
+    } else if (ret == 0) {
+        ret = hold_write(file, source, context, size, offset);
+        if (ret >= 0 && file->length >= WRITE_BUFFER_SIZE) {
+            send_buffer(file); // Full; a failure is reported by the next call
         }
-        current += curr_log_entry->inode.size + sizeof(struct wfs_inode);
-        curr_log_entry = (struct wfs_log_entry *)current;
-    }
-
-    if (last_matching_entry == NULL){
-        printf("inode not found, still equal to NULL"); // ENOENT
     }
-    return last_matching_entry;
+    pthread_mutex_unlock(&file->lock);
+    pthread_rwlock_unlock(&open_files_lock);
+    return ret;
 }
 
 /**
- * Finds the highest inode number currently in use.
- *
- * This function starts at inode number 0 for the root node and iterates
- * through log entries until it finds the last matching inode number.
+ * Body of the flusher thread. Every WRITE_BUFFER_MS it sends the buffers
+ * that have held bytes back for that long, so written data reaches the
+ * engine, and the disk with its next commit, even while a file stays open.
  *
- * @return The highest inode number currently in use.
+ * @param arg Unused.
+ * @return    NULL.
  */
-unsigned int find_current_highest_inode_number(){
-    unsigned int current_inode_number = 0;
-    struct wfs_log_entry *temp_log_entry;
-    while(1){
-        temp_log_entry = find_last_matching_inode((unsigned long)current_inode_number);
-        // if (temp_log_entry.inode.inode_number == NULL || temp_log_entry.inode.inode_number != current_inode_number){
-        if (temp_log_entry->inode.inode_number != current_inode_number){
-            break;
+void *flusher_main(void *arg) {
+    pthread_mutex_lock(&flusher_lock);
+    while (!flusher_stop) {
+        struct timespec wait;
+        clock_gettime(CLOCK_REALTIME, &wait);
+        wait.tv_nsec += WRITE_BUFFER_MS % 1000 * 1000000L;
+        wait.tv_sec += WRITE_BUFFER_MS / 1000 + wait.tv_nsec / 1000000000L;
+        wait.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&flusher_wakeup, &flusher_lock, &wait);
+        if (flusher_stop || buffered_files == 0) {
+            continue;
         }
-        current_inode_number++;
+        pthread_mutex_unlock(&flusher_lock);
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        pthread_rwlock_rdlock(&open_files_lock);
+        for (int list = 0; list < OPEN_FILE_LISTS; list++) {
+            for (struct open_file *file = open_files[list]; file != NULL; file = file->next) {
+                pthread_mutex_lock(&file->lock);
+                long age = (now.tv_sec - file->since.tv_sec) * 1000 + (now.tv_nsec - file->since.tv_nsec) / 1000000;
+                if (file->length > 0 && age >= WRITE_BUFFER_MS) {
+                    send_buffer(file);
+                }
+                pthread_mutex_unlock(&file->lock);
+            }
+        }
+        pthread_rwlock_unlock(&open_files_lock);
+        pthread_mutex_lock(&flusher_lock);
     }
-    return temp_log_entry->inode.inode_number;
+    pthread_mutex_unlock(&flusher_lock);
+    return NULL;
 }
 
 /**
@@ -261,36 +423,30 @@ unsigned int find_current_highest_inode_number(){
  * @return 0 on success, or a negative error code on failure (e.g., -ENOENT for "No such file or directory").
  */
 static int wfs_getattr(const char *path, struct stat *stbuf) {
-    struct wfs_log_entry *entry  = (struct wfs_log_entry*)get_inode_number_path(path);
-    if (!entry || entry == NULL) {
-        // Handle the case where the specified path does not exist
-        return -ENOENT;
-    }
-    struct wfs_inode *i = &entry->inode;
-    if (!i || i == NULL) {
-        return -ENOENT;
-    }
-        
-    memset(stbuf, 0, sizeof(*stbuf)); // initialize the struct stat (stbuf) to all zeros before populating
-    stbuf->st_uid = i->uid;
-    stbuf->st_gid = i->gid;
-    stbuf->st_atime = i->atime;
-    stbuf->st_mtime = i->mtime;
-    stbuf->st_mode = i->mode;
-    stbuf->st_nlink = i->links;
-    stbuf->st_size = i->size;
-
-    /*If a field is meaningless or semi-meaningless (e.g., st_ino) then it should be set to 0 or given a "reasonable" value.*/
-    stbuf->st_dev = 0;
-    stbuf->st_blksize = 0;
-    stbuf->st_blocks = 0;
-    stbuf->st_rdev = 0;
-
-    return 0;
+    if (is_stats(path)) {
+        int length;
+        free(stats_report(&length));
+        memset(stbuf, 0, sizeof(*stbuf));
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_uid = getuid();
+        stbuf->st_gid = getgid();
+        stbuf->st_size = length;
+        stbuf->st_atime = stbuf->st_mtime = mount_time;
+        return 0;
+    }
+    uint32_t number;
+    int ret = libwfs_resolve(fs, path, &number);
+    if (ret != 0) {
+        return ret;
+    }
+    send_buffers(number); // The size may still be held back
+    ret = take_lost_error(number);
+    return ret != 0 ? ret : libwfs_getattr(fs, number, stbuf);
 }
 
 /**
- * Creates a new file or directory node at the specified path.
+ * Creates a new file node at the specified path.
  * If the parent directory does not exist, returns -ENOENT.
  *
  * @param path The path for the new file or directory.
@@ -299,81 +455,16 @@ static int wfs_getattr(const char *path, struct stat *stbuf) {
  * @return 0 on success, or an error code on failure.
  */
 static int wfs_mknod(const char *path, mode_t mode, dev_t dev) {
-    char input_path[MAX_LENGTH];
-    strcpy(input_path,path);
-
-    char parent_path[MAX_LENGTH];
-    strcpy(parent_path, remove_last_token(input_path));
-    if(strlen(parent_path) == 0){
-        strcpy(parent_path,"/");
-    }
-
-    struct wfs_inode *parent_inode = get_inode_number_path(parent_path);
-    if (parent_inode == NULL) { // Handle the case where the parent directory does not exist
-        printf("Error: Parent directory does not exist\n");
-        return -ENOENT;
+    uint32_t parent, child;
+    const char *name;
+    if (is_stats(path)) {
+        return -EEXIST;
     }
-    struct wfs_log_entry *parent_log_entry = (void*)parent_inode;
-
-    size_t new_entry_size = sizeof(struct wfs_log_entry) + sizeof(struct wfs_dentry) + parent_inode->size;
-    struct wfs_log_entry *new_entry = malloc(new_entry_size);
-    if (new_entry == NULL) { // Handle memory allocation failure
-        printf("Error: Memory allocation failed\n");
-        return -ENOMEM;
+    int ret = resolve_parent(path, &parent, &name);
+    if (ret != 0) {
+        return ret;
     }
-
-    // Copy data from the parent entry to the new entry
-    memcpy(new_entry, parent_inode, sizeof(*parent_inode));
-    memcpy(new_entry->data, parent_log_entry->data, parent_inode->size);
-    new_entry->inode.size += sizeof(struct wfs_dentry);
-
-    struct wfs_dentry *new_dentry = (void *)(new_entry->data + parent_inode->size);
-
-    char input[25];
-    for(int i = 0; i < MAX_LENGTH; i++) {
-        input[i] = path[i];
-    }
-
-    char**tokens=tokenize(input);
-    int token_index = 0;
-    char current_token[25];
-    while(tokens[token_index] != NULL){
-        strcpy(current_token,tokens[token_index]);
-        token_index++;
-    }
-    strcpy(new_dentry->name, current_token);
-
-    // Update inode number and copy the new entry to the mapped disk
-    inode_number++;
-    new_dentry->inode_number=inode_number;
-
-    memcpy((char*)mapped_disk+head,new_entry,new_entry_size);
-
-    head += new_entry_size;
-    
-    free(new_entry);
-
-    // Create a new inode for the newly created file
-    struct wfs_inode new_inode = {
-        .inode_number = inode_number,
-        .deleted = 0,
-        .mode = __S_IFREG | mode,
-        .uid = getuid(),
-        .gid = getgid(),
-        .size = 0,
-        .atime = time(NULL),
-        .mtime = time(NULL),
-        .ctime = time(NULL),
-        .links = 1,
-    };
-
-    // Copy the new inode to the mapped disk and update the superblock
-    memcpy((char*)mapped_disk+head, &new_inode,sizeof(new_inode));
-    struct wfs_sb *sb=(void*)mapped_disk;
-    head+=sizeof(new_inode);
-    sb->head = head;
-
-    return 0;
+    return libwfs_create(fs, parent, name, __S_IFREG | mode, &child);
 }
 
 /**
@@ -386,79 +477,108 @@ static int wfs_mknod(const char *path, mode_t mode, dev_t dev) {
  * @return 0 on success, or a negative error code on failure.
  */
 static int wfs_mkdir(const char *path, mode_t mode) {
-    char input_path[MAX_LENGTH];
-    strcpy(input_path, path);
-
-    char parent_path[MAX_LENGTH];
-    strcpy(parent_path, remove_last_token(input_path));
-    if(strlen(parent_path) == 0){
-        strcpy(parent_path,"/");
+    uint32_t parent, child;
+    const char *name;
+    if (is_stats(path)) {
+        return -EEXIST;
     }
-
-    // Get the parent inode
-    struct wfs_inode *parent_inode = get_inode_number_path(parent_path);
-    if (parent_inode == NULL) {
-        // Handle the case where the parent directory does not exist
-        printf("Error: Parent directory does not exist\n");
-        return -ENOENT;
+    int ret = resolve_parent(path, &parent, &name);
+    if (ret != 0) {
+        return ret;
     }
-    struct wfs_log_entry *parent_log_entry=(void*)parent_inode;
+    return libwfs_create(fs, parent, name, __S_IFDIR | mode, &child);
+}
 
-    size_t new_entry_size = sizeof(struct wfs_log_entry) + sizeof(struct wfs_dentry) + parent_inode->size;
-    struct wfs_log_entry *new_entry = malloc(new_entry_size);
-    if (new_entry == NULL) { // Handle memory allocation failure
-        printf("Error: Memory allocation failed\n");
-        return -ENOMEM;
+/**
+ * FUSE callback for opening a file. Files keep what the page cache holds of
+ * them from one open to the next, as nothing changes them behind the
+ * kernel's back. The statistics file does change so, and is read straight
+ * from the engine instead; it may only be read. Any other file gets an open
+ * file, with a buffer for its writes, as its file handle.
+ *
+ * @param path The path to the file.
+ * @param fi   Information about the opened file.
+ * @return     0 on success, or a negative error code.
+ */
+static int wfs_open(const char *path, struct fuse_file_info *fi) {
+    if (is_stats(path)) {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+            return -EACCES;
+        }
+        fi->direct_io = 1;
+        fi->fh = 0;
+        return 0;
     }
-
-    // Copy data from the parent entry to the new entry
-    memcpy(new_entry, parent_inode, sizeof(*parent_inode));
-    memcpy(new_entry->data, parent_log_entry->data, parent_inode->size);
-    new_entry->inode.size += sizeof(struct wfs_dentry);
-
-    struct wfs_dentry *new_dentry = (void*)(new_entry->data + parent_inode->size);
-
-    // Extract the name of the new directory from the path
-    char input[25];
-    for(int i = 0; i < MAX_LENGTH; i++) {
-        input[i] = path[i];
+    uint32_t number;
+    int ret = libwfs_resolve(fs, path, &number);
+    if (ret != 0) {
+        return ret;
     }
-
-    char **tokens = tokenize(input);
-    int token_index = 0;
-    char current_token[25];
-    while(tokens[token_index]!=NULL){
-        strcpy(current_token, tokens[token_index]);
-        token_index++;
+    struct open_file *file = calloc(1, sizeof(struct open_file));
+    if (file == NULL) {
+        return -ENOMEM;
     }
-    strcpy(new_dentry->name, current_token);
-
-    inode_number++;
-    new_dentry->inode_number=inode_number;
-
-    memcpy((char*)mapped_disk+head,new_entry,new_entry_size);
-
-    head += new_entry_size;
-    free(new_entry);
-
-    struct wfs_inode new_inode={
-        .inode_number=inode_number,
-        .deleted=0,
-        .mode= __S_IFDIR | mode,
-        .uid=getuid(),
-        .gid=getgid(),
-        .size=0,
-        .atime=time(NULL),
-        .mtime=time(NULL),
-        .ctime=time(NULL),
-        .links=1,
-    };
+    file->inode_number = number;
+    pthread_mutex_init(&file->lock, NULL);
+    pthread_rwlock_wrlock(&open_files_lock);
+    file->next = open_files[number % OPEN_FILE_LISTS];
+    open_files[number % OPEN_FILE_LISTS] = file;
+    pthread_rwlock_unlock(&open_files_lock);
+    fi->fh = (uintptr_t)file;
+    fi->keep_cache = 1;
+    return 0;
+}
 
-    memcpy((char*)mapped_disk + head, &new_inode, sizeof(new_inode));
-    struct wfs_sb *sb = (void*)mapped_disk;
-    head += sizeof(new_inode);
-    sb->head = head;
+/**
+ * FUSE callback for closing a file descriptor. Sends what the open file
+ * holds back, so close() reports a failure to write it.
+ *
+ * @param path The path to the file.
+ * @param fi   Information about the opened file.
+ * @return     0 on success, or a negative error code.
+ */
+static int wfs_flush(const char *path, struct fuse_file_info *fi) {
+    struct open_file *file = open_file_of(fi);
+    if (file == NULL) {
+        return 0;
+    }
+    pthread_rwlock_rdlock(&open_files_lock);
+    pthread_mutex_lock(&file->lock);
+    int ret = send_and_report(file);
+    pthread_mutex_unlock(&file->lock);
+    pthread_rwlock_unlock(&open_files_lock);
+    return ret;
+}
 
+/**
+ * FUSE callback for the last close of an open file. Sends what it holds
+ * back and frees it. A failed send not yet reported is printed and kept for
+ * the next fsync or getattr of the file.
+ *
+ * @param path The path to the file.
+ * @param fi   Information about the opened file.
+ * @return     0; FUSE ignores it.
+ */
+static int wfs_release(const char *path, struct fuse_file_info *fi) {
+    struct open_file *file = open_file_of(fi);
+    if (file == NULL) {
+        return 0;
+    }
+    pthread_rwlock_wrlock(&open_files_lock);
+    struct open_file **link = &open_files[file->inode_number % OPEN_FILE_LISTS];
+    send_buffer(file); // No one else has the file now
+    if (file->error != 0 && !file->removed) {
+        fprintf(stderr, "Error: Failed to write back inode %u: %s\n", file->inode_number, strerror(-file->error));
+        keep_lost_error(file->inode_number, file->error);
+    }
+    while (*link != file) {
+        link = &(*link)->next;
+    }
+    *link = file->next;
+    pthread_rwlock_unlock(&open_files_lock);
+    pthread_mutex_destroy(&file->lock);
+    free(file->buffer);
+    free(file);
     return 0;
 }
 
@@ -473,64 +593,146 @@ static int wfs_mkdir(const char *path, mode_t mode) {
  * @return On success, the actual size of data read. On failure, a negative error code.
  */
 static int wfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    struct wfs_inode *file_inode = get_inode_number_path(path);
-    if (file_inode == NULL) {
-        return -ENOENT; // Handle the case where the specified path does not exist
-    }
-    struct wfs_log_entry *file_log_entry = (void *)file_inode;
-
-    size_t read_size; // don't read more data than is available in the file
-    if (file_inode->size > size) {
-        read_size = size;
-    } else {
-        read_size = file_inode->size;
-    }
-    memcpy(buf, file_log_entry->data + offset, read_size);
+    if (is_stats(path)) {
+        int length;
+        char *report = stats_report(&length);
+        size_t copied = offset < length ? (size < (size_t)(length - offset) ? size : (size_t)(length - offset)) : 0;
+        memcpy(buf, report + offset, copied);
+        free(report);
+        return copied;
+    }
+    uint32_t number;
+    int ret = libwfs_resolve(fs, path, &number);
+    if (ret != 0) {
+        return ret;
+    }
+    send_buffers(number);
+    return libwfs_read(fs, number, buf, size, offset);
+}
 
-    return read_size;
+/**
+ * @brief Copies the next bytes of a write out of memory.
+ *
+ * A source for buffered_write(); each call picks up where the last one stopped.
+ *
+ * @param context Points at the pointer to the next bytes to copy.
+ * @param dst Where the bytes go.
+ * @param size The number of bytes to copy.
+ * @return 0.
+ */
+static int copy_from_memory(void *context, char *dst, size_t size) {
+    const char **src = context;
+    memcpy(dst, *src, size);
+    *src += size;
+    return 0;
 }
 
 /**
  * @brief Writes data to a file in the custom file system.
  *
  * This function is called to write data to a file specified by the path.
- * It updates the file's content, size, and metadata (access time, modification time, and change time).
  *
  * @param path The path of the file to write.
  * @param buf The buffer containing the data to be written.
  * @param size The size of the data to write.
  * @param offset The offset in the file where writing should start.
- * @param fi File information (not used in this implementation).
+ * @param fi File information, whose open file buffers the write.
  * @return On success, returns the number of bytes written. On failure, returns an appropriate error code.
  *         Possible error codes include -ENOENT (file does not exist).
  */
 static int wfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    char *fullpath;
-    
-    fullpath = strdup(path);
-
-    struct wfs_log_entry *log_entr = (struct wfs_log_entry*)get_inode_number_path(fullpath);
-
-    size_t updated_size;
-
-    if(log_entr->inode.size > size){
-        
-        updated_size = log_entr->inode.size;
+    if (is_stats(path)) {
+        return -EACCES;
+    }
+    struct open_file *file = open_file_of(fi);
+    if (file != NULL) {
+        return buffered_write(file, copy_from_memory, &buf, size, offset);
     }
-    else{
+    uint32_t number;
+    int ret = libwfs_resolve(fs, path, &number);
+    if (ret != 0) {
+        return ret;
+    }
+    return libwfs_write(fs, number, buf, size, offset);
+}
 
-        updated_size = size;
-    
+/**
+ * @brief Copies the next bytes of a write out of the FUSE buffer.
+ *
+ * A source for libwfs_write_from(). FUSE moves the buffer vector on past the
+ * bytes copied, so each call picks up where the last one stopped.
+ *
+ * @param context The struct fuse_bufvec holding the data to write.
+ * @param dst Where in the image the bytes go.
+ * @param size The number of bytes to copy.
+ * @return 0 on success, or a negative error code.
+ */
+static int copy_from_bufvec(void *context, char *dst, size_t size) {
+    struct fuse_bufvec *src = context;
+    while (size > 0) {
+        struct fuse_bufvec to = FUSE_BUFVEC_INIT(size);
+        to.buf[0].mem = dst;
+        ssize_t copied = fuse_buf_copy(&to, src, 0);
+        if (copied < 0) {
+            return copied;
+        }
+        if (copied == 0) {
+            return -EIO; // The request held fewer bytes than it claimed
+        }
+        dst += copied;
+        size -= copied;
     }
+    return 0;
+}
 
-    memcpy(log_entr->data + offset, buf, updated_size);
+/**
+ * @brief Writes data to a file straight from the FUSE buffer.
+ *
+ * Unlike wfs_write(), the data is not first gathered into a buffer of its
+ * own: when FUSE splices the request from the kernel, the bytes are copied
+ * from the pipe straight into the open file's buffer, or for a large write,
+ * into their place in the image.
+ *
+ * @param path The path of the file to write.
+ * @param buf The buffer vector holding the data to be written.
+ * @param offset The offset in the file where writing should start.
+ * @param fi File information, whose open file buffers the write.
+ * @return On success, returns the number of bytes written. On failure, returns an appropriate error code.
+ */
+static int wfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+    if (is_stats(path)) {
+        return -EACCES;
+    }
+    struct open_file *file = open_file_of(fi);
+    if (file != NULL) {
+        return buffered_write(file, copy_from_bufvec, buf, fuse_buf_size(buf), offset);
+    }
+    uint32_t number;
+    int ret = libwfs_resolve(fs, path, &number);
+    if (ret != 0) {
+        return ret;
+    }
+    return libwfs_write_from(fs, number, copy_from_bufvec, buf, fuse_buf_size(buf), offset);
+}
 
-    log_entr->inode.size = updated_size;
-    log_entr->inode.mtime = time(NULL);
-    log_entr->inode.atime = time(NULL);
+/**
+ * Where wfs_readdir() sends the entries libwfs_readdir() finds.
+ */
+struct readdir_context {
+    void *buf;
+    fuse_fill_dir_t filler;
+};
 
-    free(fullpath);
-    return updated_size;}
+/**
+ * Passes one directory entry on to FUSE, along with the cookie from which a
+ * later call goes on after it.
+ *
+ * @return 0 to go on, or 1 once FUSE's buffer is full.
+ */
+int fill_dir(void *context, const char *name, uint32_t inode_number, uint64_t next) {
+    struct readdir_context *readdir_context = context;
+    return readdir_context->filler(readdir_context->buf, name, NULL, next);
+}
 
 /**
  * @brief Reads the contents of a directory and fills the buffer with directory entries.
@@ -540,118 +742,190 @@ static int wfs_write(const char *path, const char *buf, size_t size, off_t offse
  * @param path The path of the directory to read.
  * @param buf The buffer to be filled with directory entries.
  * @param filler The filler function to add entries to the buffer.
- * @param offset The offset within the directory (unused in this implementation).
+ * Entries are handed over a buffer at a time. Each carries the cookie of the
+ * entry after it, which comes back as the offset of the next call; "." and
+ * ".." take the cookies 1 and 2, below any the engine hands out.
+ *
+ * @param offset Where to pick up: 0 for the beginning, or a cookie handed to FUSE.
  * @param fi Information about the opened file (unused in this implementation).
  *
  * @return 0 on success, or a negative error code on failure.
  *         -ENOENT is returned if the specified path does not exist.
  */
 static int wfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) { // walk through the directory entries
-    filler(buf, ".", NULL, 0);  // Add entry for current Directory
-    filler(buf, "..", NULL, 0); // Add entry for parent Directory
-    struct wfs_log_entry *current_log_entry = (struct wfs_log_entry*)get_inode_number_path(path);
-    if (current_log_entry == NULL) {
-        return -ENOENT; // Handle the case where the specified path does not exist
-    }
-    struct wfs_dentry *current_directory_entry = (void*) current_log_entry->data;
-    size_t entries = current_log_entry->inode.size / sizeof(struct wfs_dentry); // Calculate the number of directory entries
-    assert(current_log_entry->inode.size % sizeof(struct wfs_dentry) == 0); // Verify that the size is a multiple of the entry size
-    // Iterate through each directory entry and add its name to the buffer
-    for(size_t i = 0; i < entries; i++){
-        filler(buf, (current_directory_entry + i)->name, NULL, 0);
+    uint32_t number;
+    int ret = libwfs_resolve(fs, path, &number);
+    if (ret != 0) {
+        return ret;
     }
-    return 0;
+    if (offset < 1 && filler(buf, ".", NULL, 1) != 0) {   // Add entry for current Directory
+        return 0;
+    }
+    if (offset < 2 && filler(buf, "..", NULL, 2) != 0) {  // Add entry for parent Directory
+        return 0;
+    }
+    struct readdir_context context = { .buf = buf, .filler = filler };
+    return libwfs_readdir(fs, number, offset < LIBWFS_COOKIE_FIRST ? 0 : offset, fill_dir, &context);
 }
 
-
-static int wfs_unlink(const char *path) { // same as deleting, set the inode delete,
-
-    char *fullpath;
-
-    fullpath = strdup(path);
-
-    char *beforeLastSlash;
-    beforeLastSlash = malloc(sizeof(char) * 256);
-    const char *lastSlash = strrchr(fullpath, '/');
-    
-    if (lastSlash != NULL) {
-
-        if(lastSlash == fullpath) {
-            strcpy(beforeLastSlash, "/");
-        }
-        else {
-            ptrdiff_t length = lastSlash - fullpath;
-            strncpy(beforeLastSlash, fullpath, length);
-            beforeLastSlash[length] = '\0';
-        }
-
+/**
+ * FUSE callback for removing a file.
+ *
+ * @param path The path of the file to remove.
+ * @return 0 on success, or a negative error code on failure.
+ */
+static int wfs_unlink(const char *path) {
+    uint32_t parent;
+    const char *name;
+    if (is_stats(path)) {
+        return -EPERM;
     }
-
-    struct wfs_log_entry *subDirOfDelete  = (struct wfs_log_entry*)get_inode_number_path(beforeLastSlash);
-    struct wfs_log_entry *toDelete = (struct wfs_log_entry*)get_inode_number_path(fullpath);
-    if(subDirOfDelete == (struct wfs_log_entry *) NULL || toDelete == (struct wfs_log_entry *) NULL) {
-
-        return -ENOENT;
-
+    int ret = resolve_parent(path, &parent, &name);
+    if (ret != 0) {
+        return ret;
     }
 
-    unsigned long inode_num = toDelete->inode.inode_number;
-    struct wfs_log_entry *curr = (struct wfs_log_entry*)( (char*) mapped_disk + sizeof(struct wfs_sb));
-
-    while(curr < (struct wfs_log_entry *) ((char*)mapped_disk + ((struct wfs_sb *)mapped_disk)->head)) {
-
-        if(curr->inode.deleted == 0 && curr->inode.inode_number == inode_num) {
-
-            curr->inode.deleted = 1;
-        
-        }
-
-        curr = (struct wfs_log_entry*) ((char *)curr + sizeof(struct wfs_inode) + curr->inode.size);
+    // Held back bytes are sent first, and none after, as the number may be handed out again
+    uint32_t number;
+    int found = libwfs_resolve(fs, path, &number) == 0;
+    pthread_rwlock_wrlock(&open_files_lock);
+    if (found) {
+        send_buffers_locked(number);
     }
+    ret = libwfs_unlink(fs, parent, name);
+    for (struct open_file *file = found && ret == 0 ? open_files[number % OPEN_FILE_LISTS] : NULL; file != NULL; file = file->next) {
+        file->removed = file->removed || file->inode_number == number;
+    }
+    if (found && ret == 0) {
+        take_lost_error(number); // Not to be reported to whatever gets the number next
+    }
+    pthread_rwlock_unlock(&open_files_lock);
+    return ret;
+}
 
+/**
+ * FUSE callback for making a file durable. What that takes depends on the
+ * -o durability the image was mounted with; see libwfs_fsync().
+ *
+ * Whatever open files of it hold back is sent first.
+ *
+ * @param path     The path of the file.
+ * @param datasync Unused; the log is committed as a whole either way.
+ * @param fi       The open file, whose failed sends are reported here.
+ * @return 0 on success, or a negative error code on failure.
+ */
+static int wfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    if (is_stats(path)) {
+        return 0;
+    }
+    uint32_t number;
+    int ret = libwfs_resolve(fs, path, &number);
+    if (ret != 0) {
+        return ret;
+    }
+    send_buffers(number);
+    struct open_file *file = open_file_of(fi);
+    if (file != NULL) {
+        pthread_rwlock_rdlock(&open_files_lock);
+        pthread_mutex_lock(&file->lock);
+        ret = send_and_report(file);
+        pthread_mutex_unlock(&file->lock);
+        pthread_rwlock_unlock(&open_files_lock);
+    }
+    int lost = take_lost_error(number);
+    ret = ret != 0 ? ret : lost;
+    return ret != 0 ? ret : libwfs_fsync(fs, number);
+}
 
-    struct wfs_log_entry* subDir = subDirOfDelete;
-    unsigned long inodeToDel = toDelete->inode.inode_number;
-    struct wfs_log_entry *newLogEntry = (struct wfs_log_entry *) ((char *) mapped_disk + ((struct wfs_sb *)mapped_disk)->head);
-
-    memcpy(newLogEntry, &subDir->inode, sizeof(struct wfs_inode));
-
-    int inDirectory = subDir->inode.size / sizeof(struct wfs_dentry);
-
-    struct wfs_dentry *currDEntry = (struct wfs_dentry *) (subDir->data);
-    struct wfs_dentry *currData = (struct wfs_dentry *) ((char *)newLogEntry + sizeof(struct wfs_inode));
-
-
-
-    for(int i = 0; i < inDirectory; i++) {
-
-        if(currDEntry->inode_number != inodeToDel) {
+/**
+ * FUSE callback for making a directory durable, like wfs_fsync().
+ */
+static int wfs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
+    return wfs_fsync(path, datasync, NULL);
+}
 
-            currData->inode_number = currDEntry->inode_number;
-            strcpy(currData->name, currDEntry->name);
-            currData++;
+/**
+ * FUSE callback run once the filesystem is mounted. Asks the kernel for
+ * large writes, spliced write requests and asynchronous reads, and, where
+ * the kernel and libfuse have it, to cache writes and send them back in bulk.
+ *
+ * It also starts the background cleaner, here rather than in main(), since
+ * FUSE may fork into the background after main() hands over and threads do
+ * not survive a fork. So are the thread that prints the statistics on
+ * SIGUSR1 and the one that sends write-back buffers held too long.
+ *
+ * @param conn The connection, whose settings are negotiated here.
+ * @return     NULL, which FUSE passes to destroy.
+ */
+static void *wfs_init(struct fuse_conn_info *conn) {
+    conn->want |= conn->capable & (FUSE_CAP_ASYNC_READ | FUSE_CAP_BIG_WRITES | FUSE_CAP_SPLICE_WRITE);
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+    conn->want |= conn->capable & FUSE_CAP_WRITEBACK_CACHE;
+#endif
+    conn->max_write = MAX_WRITE; // libfuse lowers it to what its buffers hold
+    if (libwfs_start(fs) != 0) {
+        printf("Error: Failed to start the cleaner\n");
+    }
+    if (pthread_create(&stats_thread, NULL, stats_main, NULL) == 0) {
+        stats_running = 1;
+    }
+    if (pthread_create(&flusher_thread, NULL, flusher_main, NULL) == 0) {
+        flusher_running = 1;
+    }
+    return NULL;
+}
 
+/**
+ * FUSE callback run when the filesystem is unmounted. Closes the image,
+ * which writes a final checkpoint, so the next mount replays nothing.
+ *
+ * @param private_data Unused.
+ */
+static void wfs_destroy(void *private_data) {
+    if (stats_running) {
+        stats_stop = 1;
+        pthread_kill(stats_thread, SIGUSR1);
+        pthread_join(stats_thread, NULL);
+        stats_running = 0;
+    }
+    if (flusher_running) {
+        pthread_mutex_lock(&flusher_lock);
+        flusher_stop = 1;
+        pthread_cond_signal(&flusher_wakeup);
+        pthread_mutex_unlock(&flusher_lock);
+        pthread_join(flusher_thread, NULL);
+        flusher_running = 0;
+    }
+    for (int list = 0; list < OPEN_FILE_LISTS; list++) { // Files FUSE never released
+        for (struct open_file *file = open_files[list]; file != NULL; file = file->next) {
+            send_buffer(file);
         }
-
-        currDEntry++;
-
     }
-
-    newLogEntry->inode.size -= sizeof(struct wfs_dentry);
-
-
-
-    return 0;
+    while (lost_errors != NULL) {
+        struct lost_error *lost = lost_errors;
+        lost_errors = lost->next;
+        free(lost);
+    }
+    libwfs_close(fs);
+    fs = NULL;
 }
 
 static struct fuse_operations ops = {
     .getattr    = wfs_getattr,
     .mknod      = wfs_mknod,
     .mkdir      = wfs_mkdir,
+    .open       = wfs_open,
+    .flush      = wfs_flush,
+    .release    = wfs_release,
     .read       = wfs_read,
     .write      = wfs_write,
+    .write_buf  = wfs_write_buf,
     .readdir    = wfs_readdir,
     .unlink     = wfs_unlink,
+    .fsync      = wfs_fsync,
+    .fsyncdir   = wfs_fsyncdir,
+    .init       = wfs_init,
+    .destroy    = wfs_destroy,
 };
 
 /**
@@ -660,6 +934,23 @@ static struct fuse_operations ops = {
  * @param argc      The number of command-line arguments.
  * @param argv      An array of strings representing the command-line arguments.
  *                 Expected format: mount.wfs [FUSE options] disk_path mount_point
+ *                 Besides the FUSE options, -o clean_rate=N limits the background
+ *                 cleaner to N segments per second (0 turns cleaning off) and
+ *                 -o clean_threshold=N sets how few free segments start it.
+ *                 The image grows by -o grow_size=N MiB (0 keeps it fixed) when
+ *                 it runs out of room, up to -o max_size=N MiB.
+ *                 -o durability=strict (the default) makes fsync wait for
+ *                 a commit, shared by the fsyncs that arrive together;
+ *                 durability=periodic commits every -o commit_interval=N ms
+ *                 instead, and durability=relaxed leaves it to checkpoints.
+ *                 -o compress turns on LZ4 compression of file data; the
+ *                 image keeps it on from then on. -o dedup likewise turns
+ *                 on deduplication of file data, which cannot be combined
+ *                 with compression.
+ *                 Statistics can be read from /.wfs_stats, and are printed
+ *                 each time the process gets SIGUSR1. How long the kernel
+ *                 caches names and attributes is set by FUSE's own
+ *                 -o entry_timeout, attr_timeout and negative_timeout.
  * @return          The exit status of the FUSE filesystem operation.
  *                 Returns 0 on success, non-zero on failure.
  *                 Refer to FUSE documentation for specific error codes.
@@ -667,38 +958,11 @@ static struct fuse_operations ops = {
 int main(int argc, char *argv[]) {
     // if (argc < 3 || strcmp(argv[0], "./mount.wfs") != 0 || argv[argc - 2][0] == '-' || argv[argc - 1][0] == '-') {
     if (argc < 3 || argv[argc - 2][0] == '-' || argv[argc - 1][0] == '-') { // checks from fuse website
-        printf("Usage: mount.wfs [FUSE options] disk_path mount_point\n");
-        exit(EXIT_FAILURE);
-    }
-    disk_path = argv[argc-2]; // get disk path from the second last parameter of the string
-    int file_descriptor = open(disk_path, O_RDWR); // check that the disk path is valid, opening using 
-    if (file_descriptor == -1) {
-        printf("Error opening file");
-        exit(EXIT_FAILURE);
-    }
-
-    // Create a struct to hold the information from the file
-    struct stat stat_info;
-    if (fstat(file_descriptor, &stat_info) == -1) { //check error condition for error during operation
-        printf("Error getting file size");
-        close(file_descriptor);
+        printf("Usage: mount.wfs [FUSE options] [-o clean_rate=N,clean_threshold=N,grow_size=N,max_size=N]\n"
+               "       [-o durability=relaxed|periodic|strict,commit_interval=N] [-o compress|dedup] disk_path mount_point\n");
         exit(EXIT_FAILURE);
     }
-    stat(disk_path,&stat_info); // gets info from the disk path and stores into stat info
-
-    // mmap the starting of the disk
-    length = stat_info.st_size;
-    mapped_disk = mmap(0, length, PROT_READ|PROT_WRITE, MAP_SHARED, file_descriptor, 0);
-    if (mapped_disk == (void *)-1) {
-        printf("Error mapping file into memory\n");
-        close(file_descriptor);
-        exit(EXIT_FAILURE);
-    }
-    close(file_descriptor);
-
-    // Set the global variable for head
-    struct wfs_sb *sb=(void*)mapped_disk;
-    head = sb->head;
+    const char *disk_path = argv[argc-2]; // get disk path from the second last parameter of the string
 
     // code from https://www.cs.nmsu.edu/~pfeiffer/fuse-tutorial/html/init.html
     // building new argument vector from argc and argv, without the disk
@@ -706,10 +970,41 @@ int main(int argc, char *argv[]) {
     argv[argc-1] = NULL;
     argc--;
 
-    int fuse_ret = fuse_main(argc, argv, &ops, NULL); // start fuse
-    // sb->head = head;
+    // Pick out our own -o options; everything else goes to FUSE
+    struct fuse_opt option_spec[] = {
+        { "clean_rate=%u", offsetof(struct wfs_options, clean_rate), 1 },
+        { "clean_threshold=%u", offsetof(struct wfs_options, clean_threshold), 1 },
+        { "grow_size=%u", offsetof(struct wfs_options, grow_size), 1 },
+        { "max_size=%u", offsetof(struct wfs_options, max_size), 1 },
+        { "durability=relaxed", offsetof(struct wfs_options, durability), LIBWFS_DURABILITY_RELAXED },
+        { "durability=periodic", offsetof(struct wfs_options, durability), LIBWFS_DURABILITY_PERIODIC },
+        { "durability=strict", offsetof(struct wfs_options, durability), LIBWFS_DURABILITY_STRICT },
+        { "commit_interval=%u", offsetof(struct wfs_options, commit_interval), 1 },
+        { "compress", offsetof(struct wfs_options, compress), 1 },
+        { "dedup", offsetof(struct wfs_options, dedup), 1 },
+        FUSE_OPT_END
+    };
+    struct wfs_options options = LIBWFS_DEFAULT_OPTIONS;
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, &options, option_spec, NULL) == -1) {
+        exit(EXIT_FAILURE);
+    }
 
-    // Unmap the memory
-    munmap(mapped_disk, length);
+    fs = libwfs_open(disk_path, &options, NULL);
+    if (fs == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    mount_time = time(NULL);
+
+    // Only the statistics thread takes SIGUSR1; the threads FUSE starts inherit the mask
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    int fuse_ret = fuse_main(args.argc, args.argv, &ops, NULL); // start fuse
+    fuse_opt_free_args(&args);
+    if (fs != NULL) { // FUSE gave up before it was mounted
+        libwfs_close(fs);
+    }
     return fuse_ret;
 }
@@ -0,0 +1,540 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>    // for EEXIST, EINVAL, ENOSPC
+#include <fcntl.h>    // for open, S_IFREG
+#include <signal.h>   // for signal, SIGALRM
+#include <stdio.h>    // for printf
+#include <stdlib.h>   // for exit, system
+#include <string.h>   // for memset, strerror
+#include <sys/wait.h> // for waitpid
+#include <unistd.h>   // for alarm, close, fork, ftruncate, pread
+#include "libwfs.h"
+#include "wfs.h"
+
+#define TIME_LIMIT 60           // seconds a test may take before it counts as hung
+#define FILL_SIZE (16 * 1024)   // bytes of each file that fills an image
+#define LARGE_WRITE (152 * 1024) // bytes of the write that has to make room
+#define LARGE_IMAGE ((off_t)5 << 30) // bytes of an image past format 1's 4 GiB limit
+#define MODEL_SIZE (64 * 1024)  // bytes of each file whose contents a test keeps a copy of
+#define MAX_PATH 256
+
+static const char *mkfs = "./mkfs.wfs"; // formats the scratch image
+static const char *fsck = "./fsck.wfs"; // compacts it
+static const char *image;               // the scratch image
+static const char *current;             // name of the test running
+static int failures;
+
+/**
+ * Ends the run when a test takes so long it has to be stuck.
+ */
+static void timed_out(int signal) {
+    static const char message[] = "FAIL: timed out\n";
+    write(STDOUT_FILENO, message, sizeof(message) - 1);
+    _exit(-1);
+}
+
+/**
+ * Records a check of the current test that did not hold.
+ */
+static void expect(int holds, const char *what) {
+    if (!holds) {
+        printf("FAIL %s: %s\n", current, what);
+        failures++;
+    }
+}
+
+/**
+ * Formats the scratch image afresh at the given size.
+ *
+ * @param size The size of the image, in bytes; the run ends if it cannot be made.
+ */
+static void format_image(off_t size) {
+    char command[MAX_PATH * 2 + 32];
+    snprintf(command, sizeof(command), "%s %s > /dev/null", mkfs, image);
+    int fd = open(image, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (fd == -1 || ftruncate(fd, size) != 0 || close(fd) != 0 || system(command) != 0) {
+        printf("Cannot format %s\n", image);
+        exit(-1);
+    }
+}
+
+/**
+ * Opens the scratch image.
+ *
+ * @param options The options to open it with.
+ * @return        The open image; the run ends if it cannot be opened.
+ */
+static struct libwfs *open_image(const struct wfs_options *options) {
+    int error = 0;
+    struct libwfs *fs = libwfs_open(image, options, &error);
+    if (fs == NULL || (error = libwfs_start(fs)) != 0) {
+        printf("Cannot open %s: %s\n", image, strerror(-error));
+        exit(-1);
+    }
+    return fs;
+}
+
+/**
+ * Formats a fresh scratch image of the given size and opens it.
+ *
+ * @param size      The size of the image, in bytes.
+ * @param grow_size MiB the image may grow by when full, or 0.
+ * @return          The open image; the run ends if it cannot be made.
+ */
+static struct libwfs *fresh_image(off_t size, unsigned int grow_size) {
+    format_image(size);
+    struct wfs_options options = LIBWFS_DEFAULT_OPTIONS;
+    options.grow_size = grow_size;
+    return open_image(&options);
+}
+
+/**
+ * Fills an image with files of live data until it is full, or until the
+ * given number of bytes have been written.
+ *
+ * @param most The most bytes to write.
+ * @return     The bytes written.
+ */
+static long fill(struct libwfs *fs, long most) {
+    static char data[FILL_SIZE];
+    memset(data, 'f', sizeof(data));
+    long written = 0;
+    for (int i = 0; written < most; i++) {
+        char name[32];
+        uint32_t inode;
+        snprintf(name, sizeof(name), "fill%d", i);
+        if (libwfs_create(fs, LIBWFS_ROOT, name, S_IFREG | 0644, &inode) != 0 ||
+            libwfs_write(fs, inode, data, sizeof(data), 0) != sizeof(data)) {
+            break;
+        }
+        written += sizeof(data);
+    }
+    return written;
+}
+
+/**
+ * Writes LARGE_WRITE bytes to a new file in one call.
+ *
+ * @return What libwfs_write() returned, or what creating the file did if that failed.
+ */
+static int large_write(struct libwfs *fs) {
+    static char data[LARGE_WRITE];
+    memset(data, 'l', sizeof(data));
+    uint32_t inode;
+    int ret = libwfs_create(fs, LIBWFS_ROOT, "large", S_IFREG | 0644, &inode);
+    return ret != 0 ? ret : libwfs_write(fs, inode, data, sizeof(data), 0);
+}
+
+/**
+ * A large write to an image that is nearly full of live data, and may not
+ * grow, fails with -ENOSPC rather than cleaning forever.
+ */
+static void test_full_image_fails() {
+    struct libwfs *fs = fresh_image(1024 * 1024, 0);
+    expect(fill(fs, 1024 * 1024) > 0, "filling the image");
+    expect(large_write(fs) == -ENOSPC, "large write to a full image gives -ENOSPC");
+    expect(libwfs_close(fs) == 0, "closing the image");
+}
+
+/**
+ * A large write to an image that is mostly live, and may grow, grows it.
+ */
+static void test_full_image_grows() {
+    struct libwfs *fs = fresh_image(1024 * 1024, 4);
+    expect(fill(fs, 600 * 1024) >= 600 * 1024, "filling the image to 60%");
+    expect(large_write(fs) == LARGE_WRITE, "large write grows the image");
+    expect(libwfs_close(fs) == 0, "closing the image");
+}
+
+/**
+ * Counts the entries of a directory listed by libwfs_readdir(), and those
+ * named "." or "..".
+ */
+static int count_entry(void *context, const char *name, uint32_t inode, uint64_t next) {
+    long *counts = context;
+    counts[0]++;
+    counts[1] += strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+    return 0;
+}
+
+/**
+ * "." and ".." cannot be created, as files or directories, at the root or
+ * below it, nor unlinked, and no listing shows an entry of that name.
+ */
+static void test_dot_names() {
+    struct libwfs *fs = fresh_image(1024 * 1024, 0);
+    uint32_t dir;
+    uint32_t child;
+    expect(libwfs_create(fs, LIBWFS_ROOT, "dir", S_IFDIR | 0755, &dir) == 0, "creating a directory");
+    const uint32_t parents[] = { LIBWFS_ROOT, dir };
+    const char *names[] = { ".", ".." };
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < 2; j++) {
+            expect(libwfs_create(fs, parents[i], names[j], S_IFREG | 0644, &child) == -EEXIST, "creating a file named . or .. gives -EEXIST");
+            expect(libwfs_create(fs, parents[i], names[j], S_IFDIR | 0755, &child) == -EEXIST, "creating a directory named . or .. gives -EEXIST");
+            expect(libwfs_unlink(fs, parents[i], names[j]) == -EINVAL, "unlinking . or .. gives -EINVAL");
+        }
+        long counts[2] = { 0 };
+        expect(libwfs_readdir(fs, parents[i], 0, count_entry, counts) == 0, "listing the directory");
+        expect(counts[0] == (i == 0) && counts[1] == 0, "no entry named . or .. is listed");
+    }
+    expect(libwfs_create(fs, dir, "...", S_IFREG | 0644, &child) == 0, "creating a file named ...");
+    expect(libwfs_close(fs) == 0, "closing the image");
+}
+
+/**
+ * The number of a file removed while held is not handed out again, so
+ * writes through it fail with -ENOENT rather than reach a new file, until
+ * its last hold is undone.
+ */
+static void test_held_number() {
+    struct libwfs *fs = fresh_image(1024 * 1024, 0);
+    uint32_t held;
+    uint32_t other;
+    expect(libwfs_create(fs, LIBWFS_ROOT, "held", S_IFREG | 0644, &held) == 0, "creating a file");
+    expect(libwfs_hold(fs, held) == 0 && libwfs_hold(fs, held) == 0, "holding its number twice");
+    expect(libwfs_unlink(fs, LIBWFS_ROOT, "held") == 0, "removing it");
+    expect(libwfs_hold(fs, held) == -ENOENT, "holding the number of a removed file gives -ENOENT");
+    for (int i = 0; i < 4; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "new%d", i);
+        expect(libwfs_create(fs, LIBWFS_ROOT, name, S_IFREG | 0644, &other) == 0 && other != held, "new files do not get a held number");
+    }
+    expect(libwfs_write(fs, held, "stale", 5, 0) == -ENOENT, "writing through a held number gives -ENOENT");
+    libwfs_forget(fs, held);
+    expect(libwfs_create(fs, LIBWFS_ROOT, "still", S_IFREG | 0644, &other) == 0 && other != held, "one hold still keeps the number");
+    libwfs_forget(fs, held);
+    expect(libwfs_create(fs, LIBWFS_ROOT, "reused", S_IFREG | 0644, &other) == 0 && other == held, "the number is reused once forgotten");
+    expect(libwfs_close(fs) == 0, "closing the image");
+}
+
+/**
+ * Overwrites a file again and again, each time with FILL_SIZE bytes.
+ *
+ * @return 1 if every write went through, 0 otherwise.
+ */
+static int overwrite(struct libwfs *fs, uint32_t inode, int times) {
+    static char data[FILL_SIZE];
+    for (int i = 0; i < times; i++) {
+        memset(data, 'a' + i % 26, sizeof(data));
+        if (libwfs_write(fs, inode, data, sizeof(data), 0) != sizeof(data)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Overwriting a file again and again in an image that may not grow keeps
+ * making room by cleaning, even on the first round after the image was
+ * formatted, whose checkpoint has no older one to free.
+ */
+static void test_overwrite_cleans() {
+    struct libwfs *fs = fresh_image(1024 * 1024, 0);
+    uint32_t inode;
+    expect(libwfs_create(fs, LIBWFS_ROOT, "file", S_IFREG | 0644, &inode) == 0, "creating a file");
+    expect(overwrite(fs, inode, 200), "overwriting it many times the size of the image");
+    expect(libwfs_close(fs) == 0, "closing the image");
+}
+
+/**
+ * An image larger than format 1's 4 GiB limit opens, and what is written to
+ * it is there once it is opened again.
+ */
+static void test_large_image() {
+    struct libwfs *fs = fresh_image(LARGE_IMAGE, 0);
+    uint32_t inode;
+    char data[16] = { 0 };
+    expect(libwfs_create(fs, LIBWFS_ROOT, "file", S_IFREG | 0644, &inode) == 0, "creating a file");
+    expect(libwfs_write(fs, inode, "large", 5, 0) == 5, "writing to it");
+    expect(libwfs_close(fs) == 0, "closing the image");
+    int error;
+    fs = libwfs_open(image, NULL, &error);
+    expect(fs != NULL && libwfs_start(fs) == 0, "opening the image again");
+    if (fs != NULL) {
+        expect(libwfs_read(fs, inode, data, sizeof(data), 0) == 5 && strcmp(data, "large") == 0, "reading the file back");
+        expect(libwfs_close(fs) == 0, "closing the image again");
+    }
+}
+
+/**
+ * Creates a file holding its own name and, under strict durability, makes
+ * it durable.
+ *
+ * @return 1 on success, 0 otherwise.
+ */
+static int durable_file(struct libwfs *fs, const char *name) {
+    uint32_t inode;
+    int length = strlen(name);
+    return libwfs_create(fs, LIBWFS_ROOT, name, S_IFREG | 0644, &inode) == 0 &&
+           libwfs_write(fs, inode, name, length, 0) == length && libwfs_fsync(fs, inode) == 0;
+}
+
+/**
+ * Returns whether a file holds its own name and nothing else.
+ */
+static int holds_name(struct libwfs *fs, const char *name) {
+    uint32_t inode;
+    char data[32] = { 0 };
+    return libwfs_lookup(fs, LIBWFS_ROOT, name, &inode) == 0 &&
+           libwfs_read(fs, inode, data, sizeof(data), 0) == (int)strlen(name) && strcmp(data, name) == 0;
+}
+
+/**
+ * A process that ends without closing the image, whose last log record is
+ * then torn, leaves an image that opens with everything before that record
+ * and without the record. The log goes on from there.
+ */
+static void test_torn_tail() {
+    format_image(1024 * 1024);
+    struct wfs_options options = LIBWFS_DEFAULT_OPTIONS;
+    options.grow_size = 0;
+    pid_t child = fork();
+    if (child == 0) { // Threads do not survive fork(), so the child opens the image itself
+        struct libwfs *fs = open_image(&options);
+        _exit(durable_file(fs, "kept") && durable_file(fs, "torn") ? 0 : 1);
+    }
+    int status;
+    expect(child > 0 && waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0,
+           "writing files and ending without closing the image");
+
+    // Flip the last byte of the last record the commit made durable
+    struct wfs_sb sb;
+    char byte;
+    int fd = open(image, O_RDWR);
+    expect(fd != -1 && pread(fd, &sb, sizeof(sb), 0) == sizeof(sb) && pread(fd, &byte, 1, sb.head - 1) == 1, "reading the head of the log");
+    byte ^= 0xff;
+    expect(pwrite(fd, &byte, 1, sb.head - 1) == 1 && close(fd) == 0, "tearing the last record");
+
+    struct libwfs *fs = open_image(&options);
+    expect(holds_name(fs, "kept"), "a file from before the torn record reads back");
+    expect(!holds_name(fs, "torn"), "the torn record is dropped");
+    expect(durable_file(fs, "after"), "writing after the torn record");
+    expect(libwfs_close(fs) == 0, "closing the image");
+    fs = open_image(&options);
+    expect(holds_name(fs, "kept") && holds_name(fs, "after"), "both files read back once opened again");
+    expect(libwfs_close(fs) == 0, "closing the image again");
+}
+
+/**
+ * An image whose log is gone fails to open with -EINVAL rather than ending
+ * the process, and leaves nothing behind that keeps the next image from
+ * opening.
+ */
+static void test_no_log() {
+    format_image(1024 * 1024);
+    struct wfs_sb sb;
+    int fd = open(image, O_RDWR);
+    expect(fd != -1 && pread(fd, &sb, sizeof(sb), 0) == sizeof(sb), "reading the superblock");
+    for (uint32_t segment = 0; fd != -1 && segment < sb.segments; segment++) {
+        off_t offset = (off_t)segment * WFS_SEGMENT_SIZE + (segment == 0 ? sizeof(struct wfs_sb) : 0);
+        struct wfs_segment header;
+        if (pread(fd, &header, sizeof(header), offset) == sizeof(header) && header.magic == WFS_FRAMED_SEGMENT_MAGIC) {
+            header.magic = 0;
+            expect(pwrite(fd, &header, sizeof(header), offset) == sizeof(header), "freeing a log segment");
+        }
+    }
+    expect(fd != -1 && close(fd) == 0, "closing the scratch image");
+
+    int error = 0;
+    struct wfs_options options = LIBWFS_DEFAULT_OPTIONS;
+    expect(libwfs_open(image, &options, &error) == NULL && error == -EINVAL, "opening fails with -EINVAL");
+    struct libwfs *fs = fresh_image(1024 * 1024, 0);
+    expect(durable_file(fs, "after"), "writing to the next image opened");
+    expect(libwfs_close(fs) == 0, "closing the image");
+}
+
+/*
+ * A file a test writes, and what it should hold.
+ */
+struct model {
+    const char *name;
+    uint32_t inode;
+    char bytes[MODEL_SIZE];
+    size_t size;
+};
+
+/**
+ * Writes bytes to a file and to its model.
+ *
+ * @return 1 if the write went through, 0 otherwise.
+ */
+static int model_write(struct libwfs *fs, struct model *file, const char *bytes, size_t length, size_t offset) {
+    memcpy(file->bytes + offset, bytes, length);
+    file->size = offset + length > file->size ? offset + length : file->size;
+    return libwfs_write(fs, file->inode, bytes, length, offset) == (int)length;
+}
+
+/**
+ * Returns whether a file, looked up by name, holds exactly what its model does.
+ */
+static int model_matches(struct libwfs *fs, const struct model *file) {
+    static char data[MODEL_SIZE + 1];
+    uint32_t inode;
+    return libwfs_lookup(fs, LIBWFS_ROOT, file->name, &inode) == 0 &&
+           libwfs_read(fs, inode, data, sizeof(data), 0) == (int)file->size && memcmp(data, file->bytes, file->size) == 0;
+}
+
+/**
+ * Fills a buffer with bytes no compressor can shrink.
+ */
+static void noise(char *bytes, size_t length, uint32_t seed) {
+    for (size_t i = 0; i < length; i++) {
+        seed = seed * 1103515245 + 12345;
+        bytes[i] = seed >> 16;
+    }
+}
+
+/**
+ * Compacts the scratch image in place with fsck.wfs.
+ *
+ * @return 1 on success, 0 otherwise.
+ */
+static int compact_image() {
+    char command[MAX_PATH * 2 + 32];
+    snprintf(command, sizeof(command), "%s %s > /dev/null", fsck, image);
+    return system(command) == 0;
+}
+
+/**
+ * File data written to packed runs, compressible or not, and overwritten in
+ * the middle of a run and across runs, reads back byte for byte once the
+ * image is opened again, and once fsck.wfs has compacted it.
+ */
+static void test_compressed_data() {
+    static struct model files[] = { { .name = "text" }, { .name = "noise" } };
+    static char bytes[MODEL_SIZE];
+    format_image(2 * 1024 * 1024);
+    struct wfs_options options = LIBWFS_DEFAULT_OPTIONS;
+    options.grow_size = 0;
+    options.compress = 1;
+    struct libwfs *fs = open_image(&options);
+    for (int i = 0; i < 2; i++) {
+        files[i].size = 0;
+        expect(libwfs_create(fs, LIBWFS_ROOT, files[i].name, S_IFREG | 0644, &files[i].inode) == 0, "creating a file");
+    }
+    for (size_t i = 0; i < MODEL_SIZE; i++) {
+        bytes[i] = "compressible text "[i % 18];
+    }
+    expect(model_write(fs, &files[0], bytes, MODEL_SIZE, 0), "writing compressible data");
+    noise(bytes, MODEL_SIZE, 1);
+    expect(model_write(fs, &files[1], bytes, 48 * 1024, 0), "writing incompressible data");
+    expect(model_write(fs, &files[0], bytes, 100, 5000), "overwriting the middle of a packed run");
+    expect(model_write(fs, &files[0], bytes + 100, 3000, 15000), "overwriting across two packed runs");
+    memset(bytes, 'z', 500);
+    expect(model_write(fs, &files[1], bytes, 500, 20000), "overwriting incompressible data with compressible");
+    expect(model_write(fs, &files[1], bytes, 500, 60000), "writing past the end of a file");
+    for (int i = 0; i < 2; i++) {
+        expect(model_matches(fs, &files[i]), "files read back as written");
+    }
+    expect(libwfs_close(fs) == 0, "closing the image");
+
+    fs = open_image(&options);
+    for (int i = 0; i < 2; i++) {
+        expect(model_matches(fs, &files[i]), "files read back once the image is opened again");
+    }
+    expect(libwfs_close(fs) == 0, "closing the image again");
+    expect(compact_image(), "compacting the image with fsck.wfs");
+    fs = open_image(&options);
+    for (int i = 0; i < 2; i++) {
+        expect(model_matches(fs, &files[i]), "files read back once the image is compacted");
+    }
+    expect(libwfs_close(fs) == 0, "closing the compacted image");
+}
+
+/**
+ * Files that share their data through deduplication keep it when some of
+ * them are removed and the cleaner moves the shared runs, over and over
+ * as other writes wrap around the image, and once it is opened again.
+ */
+static void test_shared_data() {
+    static struct model files[] = { { .name = "copy0" }, { .name = "copy1" }, { .name = "copy2" }, { .name = "copy3" } };
+    static char bytes[MODEL_SIZE];
+    format_image(1024 * 1024);
+    struct wfs_options options = LIBWFS_DEFAULT_OPTIONS;
+    options.grow_size = 0;
+    options.dedup = 1;
+    struct libwfs *fs = open_image(&options);
+    noise(bytes, MODEL_SIZE, 2);
+    for (int i = 0; i < 4; i++) {
+        files[i].size = 0;
+        expect(libwfs_create(fs, LIBWFS_ROOT, files[i].name, S_IFREG | 0644, &files[i].inode) == 0 &&
+               model_write(fs, &files[i], bytes, MODEL_SIZE, 0), "writing the same data to several files");
+    }
+    expect(libwfs_unlink(fs, LIBWFS_ROOT, "copy0") == 0 && libwfs_unlink(fs, LIBWFS_ROOT, "copy2") == 0,
+           "removing some of the files");
+
+    // Write unique data over and over, several times the size of the image
+    uint32_t inode;
+    expect(libwfs_create(fs, LIBWFS_ROOT, "churn", S_IFREG | 0644, &inode) == 0, "creating a file to overwrite");
+    int written = 1;
+    for (uint32_t i = 0; i < 200 && written; i++) {
+        noise(bytes, FILL_SIZE, 100 + i);
+        written = libwfs_write(fs, inode, bytes, FILL_SIZE, 0) == FILL_SIZE;
+    }
+    expect(written, "overwriting a file until the image has wrapped");
+    expect(model_matches(fs, &files[1]) && model_matches(fs, &files[3]), "the remaining files read back");
+    expect(libwfs_close(fs) == 0, "closing the image");
+
+    fs = open_image(&options);
+    expect(model_matches(fs, &files[1]) && model_matches(fs, &files[3]), "the remaining files read back once opened again");
+    expect(libwfs_close(fs) == 0, "closing the image again");
+}
+
+static const struct {
+    const char *name;
+    void (*run)();
+} tests[] = {
+    { "full_image_fails", test_full_image_fails },
+    { "full_image_grows", test_full_image_grows },
+    { "dot_names", test_dot_names },
+    { "held_number", test_held_number },
+    { "large_image", test_large_image },
+    { "overwrite_cleans", test_overwrite_cleans },
+    { "torn_tail", test_torn_tail },
+    { "no_log", test_no_log },
+    { "compressed_data", test_compressed_data },
+    { "shared_data", test_shared_data },
+};
+
+/**
+ * Runs the regression tests of the engine in-process, each on a freshly
+ * formatted scratch image, which is overwritten. A test that takes longer
+ * than TIME_LIMIT seconds ends the run.
+ *
+ * Usage: test.wfs [-m mkfs_path] [-f fsck_path] image
+ */
+int main(int argc, char *argv[]) {
+    int bad_usage = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "m:f:")) != -1) {
+        if (opt == 'm') {
+            mkfs = optarg;
+        } else if (opt == 'f') {
+            fsck = optarg;
+        } else {
+            bad_usage = 1;
+        }
+    }
+    if (bad_usage || optind != argc - 1 || strlen(argv[optind]) >= MAX_PATH || strlen(mkfs) >= MAX_PATH ||
+        strlen(fsck) >= MAX_PATH) {
+        fprintf(stderr, "Usage: test.wfs [-m mkfs_path] [-f fsck_path] image\n");
+        exit(-1);
+    }
+    image = argv[optind];
+    signal(SIGALRM, timed_out);
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+    int count = sizeof(tests) / sizeof(tests[0]);
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        int before = failures;
+        current = tests[i].name;
+        alarm(TIME_LIMIT);
+        tests[i].run();
+        alarm(0);
+        failed += failures != before;
+        printf("%-24s %s\n", current, failures == before ? "ok" : "FAILED");
+    }
+    printf("%d of %d tests failed\n", failed, count);
+    return failed ? -1 : 0;
+}
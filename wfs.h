@@ -4,32 +4,254 @@
 #ifndef MOUNT_WFS_H_
 #define MOUNT_WFS_H_
 
-#define MAX_FILE_NAME_LEN 32
-#define WFS_MAGIC 0xdeadbeef
+#define MAX_FILE_NAME_LEN 256 // longest name plus a terminating null
+#define WFS_MAGIC 0xdeadbef2    // images of format 2 and later; WFS_VERSION says which
+#define WFS_MAGIC_V1 0xdeadbeef // images of format 1, which has no version field
+#define WFS_VERSION 2           // the format this build reads and writes
+#define WFS_FEATURES (WFS_FEATURE_COMPRESSION | WFS_FEATURE_DEDUP) // the feature bits this build understands
+#define WFS_SEGMENT_MAGIC 0x5e65e65e
+#define WFS_CHECKPOINT_MAGIC 0xc4ec4ec4
+#define WFS_DATA_MAGIC 0xda7ada7a
+#define WFS_FRAMED_SEGMENT_MAGIC 0x5e65e65f // like WFS_SEGMENT_MAGIC, but every entry has a wfs_record in front
+#define WFS_FRAMED_DATA_MAGIC 0xda7ada7b    // like WFS_DATA_MAGIC, but every run has a wfs_record in front
+#define WFS_PACKED_DATA_MAGIC 0xda7ada7c    // like WFS_FRAMED_DATA_MAGIC, but its runs are wfs_packed_runs
+#define WFS_NO_CHECKPOINT 0xffffffff    // sb.checkpoint of an image that has never been checkpointed
+#define WFS_NO_SEGMENT 0xffffffff       // data_segment of a checkpoint taken before any file data was written
+#define WFS_SEGMENT_SIZE (64 * 1024)    // the log is written and cleaned in units of this many bytes
+#define WFS_MAX_SEGMENTS (WFS_NO_SEGMENT - 1) // most segments in an image, so every segment number is below WFS_NO_SEGMENT
+#define WFS_MAX_SEGMENTS_V1 (UINT32_MAX / WFS_SEGMENT_SIZE) // the same in format 1, whose offsets are 32 bits
 
+// Optional additions to format 2, set in the superblock's features field
+#define WFS_FEATURE_COMPRESSION 0x1 // file data is written to packed data segments, compressed
+#define WFS_FEATURE_DEDUP       0x2 // a data run may be mapped into more than one file; never set with compression
+
+// Kinds of log entries, stored in the flags field of each entry's inode
+#define WFS_LOG_INODE       0   // data holds the full contents of the inode
+#define WFS_LOG_DENTRY_ADD  1   // data holds a wfs_delta followed by the dentries added
+#define WFS_LOG_DENTRY_DEL  2   // data holds a wfs_delta followed by the dentries removed
+#define WFS_LOG_DATA        3   // format 1 only: data holds a wfs_delta_v1 followed by the bytes written at its offset
+#define WFS_LOG_EXTENTS     4   // data holds a wfs_delta followed by the file's wfs_extents
+#define WFS_LOG_MAP         5   // data holds a wfs_delta followed by wfs_extents of bytes just written to data segments
+#define WFS_LOG_TOMBSTONE   6   // the inode was deleted; data holds a wfs_tombstone
+
+// Kinds of records, stored in the type field of each wfs_record
+#define WFS_RECORD_ENTRY    0x4c6f6745  // a log entry: wfs_inode and its data
+#define WFS_RECORD_RUN      0x52756e44  // a wfs_data_run and its bytes
+#define WFS_RECORD_PACKED_RUN 0x52756e5a // a wfs_packed_run and its bytes
+
+// Codecs of packed runs, stored in the codec field of each wfs_packed_run
+#define WFS_CODEC_NONE      0   // the bytes are stored as they are, as compressing them did not make them smaller
+#define WFS_CODEC_LZ4       1   // the bytes are one LZ4 block
+#define WFS_PACKED_RUN_SIZE (16 * 1024) // most file bytes in one packed run, before compression
+#define WFS_MIN_SHARED_RUN 512 // runs shorter than this are only ever mapped into the file they were written to
+
+#define WFS_DIR_CHECKPOINT  64  // delta entries after which a directory is written in full
+#define WFS_FILE_CHECKPOINT 64  // data entries after which a file's extents are written in full
+
+/*
+ * The superblock. Format 2 changed the magic as well as the layout, so tools
+ * from before the version field turn its images away rather than misread
+ * them. From then on a new layout raises version, and an optional addition
+ * to one sets a bit in features; a build mounts only images whose version
+ * and features it knows.
+ *
+ * Offsets into the image, here and in the log, are 64 bits from format 2 on,
+ * so an image may have as many segments as a uint32_t counts; format 1 kept
+ * them to 32 bits, which capped its images at 4 GiB.
+ */
 struct wfs_sb {
-    uint32_t magic;
-    uint32_t head;
+    uint32_t magic;         // WFS_MAGIC
+    uint32_t segment_size;  // WFS_SEGMENT_SIZE
+    uint32_t segments;      // number of segments in the image
+    uint32_t checkpoint;    // first segment of the newest checkpoint, or WFS_NO_CHECKPOINT
+    uint32_t version;       // WFS_VERSION
+    uint32_t features;      // feature bits the image uses
+    uint64_t head;          // end of the log as of the newest commit or checkpoint
+};
+
+/*
+ * Header at the start of every segment; in segment 0 it follows the
+ * superblock. Log entries never cross a segment boundary, and the log is the
+ * concatenation of the segments in use, in sequence order.
+ *
+ * File contents are kept apart from the log, in data segments, so replaying
+ * and cleaning metadata never has to step over them. A data segment holds
+ * wfs_data_runs back to back, and WFS_LOG_MAP entries in the log say where
+ * in a file their bytes belong. Data and log segments come from the same
+ * free segments and share one sequence.
+ */
+struct wfs_segment {
+    uint32_t magic;     // WFS_FRAMED_SEGMENT_MAGIC while the segment holds log entries,
+                        // WFS_FRAMED_DATA_MAGIC or WFS_PACKED_DATA_MAGIC while it holds file data,
+                        // WFS_SEGMENT_MAGIC or WFS_DATA_MAGIC in format 1 if written before records,
+                        // WFS_CHECKPOINT_MAGIC while it holds part of a checkpoint, 0 when it is free
+    uint32_t used;      // end of the last log entry, relative to the start of the segment
+    uint64_t sequence;  // position of the segment in the log
+};
+
+/*
+ * A snapshot of the state mount.wfs would otherwise rebuild by replaying the
+ * whole log. It is written as one stream of bytes over the segments listed
+ * after it, which are taken from the free segments; the first of them holds
+ * this header. The stream goes on with:
+ *
+ *   uint32_t                  part[parts];       segments holding the stream, in order
+ *   uint64_t                  inode_map[inodes]; newest log entry of each inode number, its tombstone
+ *                                                if it was deleted and still has one, 0 if none
+ *   struct wfs_segment_usage  usage[segments];
+ *   uint32_t                  free[free];        free segments, in the order they will be used
+ *   uint32_t                  data_segment;      the data segment being filled, or WFS_NO_SEGMENT
+ *
+ * On an image with WFS_FEATURE_DEDUP, a checkpoint goes on with the chunk
+ * index, which mounting tells apart from a checkpoint without it by the
+ * length of the stream:
+ *
+ *   uint32_t                  chunks;
+ *   struct wfs_chunk          chunk[chunks];     data runs new file data may be mapped to
+ *
+ * Mounting loads the snapshot and replays only the segments written after
+ * it. Segments freed by the cleaner are not reused until a checkpoint that
+ * no longer needs them has been written.
+ */
+struct wfs_checkpoint {
+    uint32_t magic;         // WFS_CHECKPOINT_MAGIC
+    uint32_t inode_number;  // highest inode number handed out; those below it with no inode are free for reuse
+    uint64_t head;          // head of the log when the checkpoint was taken
+    uint64_t sequence;      // sequence number of the segment head points into
+    uint32_t inodes;        // entries in inode_map
+    uint32_t segments;      // entries in usage; always the number of segments in the image
+    uint32_t free;          // entries in free
+    uint32_t parts;         // entries in part
+};
+
+/*
+ * A data run of an image with WFS_FEATURE_DEDUP, as its chunk index knows
+ * it. Bytes written to a file are cut into chunks where their content says
+ * to, so the same bytes are cut the same way wherever they are written, and
+ * a chunk whose bytes are already in a run is mapped to that run rather than
+ * written again. Runs shorter than a few hundred bytes are left out. A run
+ * stays live for as long as any extent maps part of it, whichever file the
+ * extent is in.
+ */
+struct wfs_chunk {
+    uint64_t location;  // offset of the run's first byte from the start of the disk
+    uint32_t length;    // bytes in the run
+    uint32_t crc;       // CRC-32C of the bytes, which finds the run; the bytes are compared before it is used
+    uint32_t refs;      // extents that map some part of the run, in any file
+};
+
+struct wfs_segment_usage {
+    uint64_t sequence;  // sequence number of a segment holding log entries, 0 otherwise
+    uint64_t live;      // bytes in the segment still needed by some inode; for part of a packed
+                        // run, its share of the bytes stored; a chunk counts once, however many map it
 };
 
+/*
+ * Header of every log entry. size is always the size of the inode after the
+ * entry; how many bytes of data follow is in the entry's wfs_record.
+ */
 struct wfs_inode {
-    unsigned int inode_number;
-    unsigned int deleted;       // 1 if deleted, 0 otherwise
-    // check mode to see if it's a file or directory
-    unsigned int mode;          // type. S_IFDIR if the inode represents a directory or S_IFREG if it's for a file
-    unsigned int uid;           // user id
-    unsigned int gid;           // group id
-    unsigned int flags;         // flags
-    unsigned int size;          // size in bytes
-    unsigned int atime;         // last access time
-    unsigned int mtime;         // last modify time
-    unsigned int ctime;         // inode change time (the last time any field of inode is modified)
-    unsigned int links;         // number of hard links to this file (this can always be set to 1)
-};
-
-struct wfs_dentry { 
-    char name[MAX_FILE_NAME_LEN];
-    unsigned long inode_number;
+    uint32_t inode_number;
+    uint16_t flags;         // kind of log entry, one of WFS_LOG_*
+    uint16_t deleted;       // 1 in a WFS_LOG_TOMBSTONE entry, 0 otherwise
+    uint32_t mode;          // file type and permissions: S_IFDIR for a directory, S_IFREG for a file
+    uint32_t uid;           // user id
+    uint32_t gid;           // group id
+    uint32_t links;         // number of hard links to this file (this can always be set to 1)
+    uint64_t size;          // size in bytes; for a directory, that of its packed dentries
+    int64_t atime;          // last access time, in nanoseconds since the epoch
+    int64_t mtime;          // last modify time, likewise
+    int64_t ctime;          // inode change time (the last time any field of inode is modified), likewise
+};
+
+/*
+ * A directory entry, packed: entries follow one another with nothing in
+ * between, each WFS_DENTRY_SIZE(name_len) bytes long.
+ */
+struct wfs_dentry {
+    uint32_t inode_number;
+    uint8_t name_len;       // 1 to MAX_FILE_NAME_LEN - 1
+    char name[];            // name_len bytes, not null-terminated
+};
+#define WFS_DENTRY_SIZE(name_len) (offsetof(struct wfs_dentry, name) + (name_len))
+
+/*
+ * Start of the data of every log entry that is not WFS_LOG_INODE. Following
+ * prev from the newest entry of an inode leads back to its last
+ * WFS_LOG_INODE or WFS_LOG_EXTENTS entry; applying the entries in between
+ * rebuilds it.
+ */
+struct wfs_delta {
+    uint64_t prev;  // offset of the previous log entry of the same inode
+};
+
+/*
+ * Data of a WFS_LOG_TOMBSTONE entry, whose inode has deleted set. Unlinking
+ * appends one rather than touching the older entries of the inode, which
+ * replay then overrides like any other. Once no log segment up to sequence
+ * is in use, none of those entries are left and the cleaner drops it.
+ */
+struct wfs_tombstone {
+    uint64_t sequence;  // newest log segment that may hold an older entry of the inode
+};
+
+/*
+ * A run of file bytes stored contiguously in the log. A file's extents are
+ * sorted by offset and never overlap; bytes not covered by any extent read
+ * as zeros.
+ */
+struct wfs_extent {
+    uint64_t offset;    // offset of the run within the file
+    uint64_t location;  // offset of the run's first byte from the start of the disk
+    uint32_t length;    // length of the run in bytes
+};
+
+/*
+ * Header of a run of file bytes in a data segment; length bytes follow it.
+ * It only tells the cleaner whose bytes these may be: they are live for as
+ * long as the file's extent map refers to them. With WFS_FEATURE_DEDUP, the
+ * extent maps of other files may refer to them as well.
+ */
+struct wfs_data_run {
+    uint32_t inode_number;  // the file the bytes were written to
+    uint32_t length;        // bytes that follow
+};
+
+/*
+ * Header of a run of file bytes in a packed data segment; length bytes
+ * follow it, which decompress to the size bytes written to the file at
+ * offset. Every extent that maps part of a packed run has the location of
+ * the bytes after the header, and which part it maps follows from where the
+ * extent lies in the file. Reading any of the run decompresses it up to the
+ * bytes read, which is why runs are kept to WFS_PACKED_RUN_SIZE. Images with
+ * WFS_FEATURE_COMPRESSION write all their new file data this way; data
+ * segments from before the feature was turned on keep their plain runs.
+ */
+struct wfs_packed_run {
+    uint32_t inode_number;  // the file the bytes were written to
+    uint32_t length;        // bytes that follow, as stored
+    uint64_t offset;        // where in the file the first byte was written
+    uint32_t size;          // bytes once decompressed, 1 to WFS_PACKED_RUN_SIZE
+    uint32_t codec;         // one of WFS_CODEC_*
+};
+
+/*
+ * Frame in front of every log entry and data run in a segment with a framed
+ * magic. crc is the CRC-32C of the segment's sequence number (8 bytes), the
+ * type and length fields, then the length bytes of the record. Seeding it
+ * with the sequence keeps records left over from an earlier use of the
+ * segment from passing for new ones; mkfs.wfs starts the sequence at a
+ * random number, so the same goes for an earlier file system in the image.
+ *
+ * Mounting stops replaying the log at the first record that does not check
+ * out, which is where a crash tore the tail, and drops the rest. The deleted
+ * field of a log entry's inode counts as 0 for the CRC, as unlink used to set
+ * it in place on every entry of the inode. Format 1 frames its records the same way, around its own inodes.
+ */
+struct wfs_record {
+    uint32_t type;      // WFS_RECORD_ENTRY, WFS_RECORD_RUN or WFS_RECORD_PACKED_RUN
+    uint32_t length;    // bytes of the record after this frame
+    uint32_t crc;
 };
 
 struct wfs_log_entry {
@@ -37,4 +259,56 @@ struct wfs_log_entry {
     char data[]; // the actual data
 };
 
+/*
+ * Format 1, which fsck.wfs upgrades in place and mkfs.wfs -f 1 still writes.
+ * Its superblock is shorter, so segment 0's header sits further up. Every
+ * log entry holds a whole wfs_inode_v1, whose size field is the length of
+ * the entry's data; entries other than WFS_LOG_INODE keep the size of the
+ * inode in their wfs_delta_v1. Sizes, file offsets and offsets into the
+ * image are 32 bits, times are in seconds, and names are at most
+ * MAX_FILE_NAME_LEN_V1 - 1 bytes in fixed-size dentries. The framed segment
+ * magics and data runs are the same as in format 2. Its checkpoints are
+ * not, but fsck.wfs replays the whole log and never reads them.
+ */
+#define MAX_FILE_NAME_LEN_V1 32
+
+struct wfs_sb_v1 {
+    uint32_t magic;         // WFS_MAGIC_V1
+    uint32_t head;
+    uint32_t segment_size;  // WFS_SEGMENT_SIZE; 0 in images from before segments
+    uint32_t segments;
+    uint32_t checkpoint;
+};
+
+struct wfs_inode_v1 {
+    unsigned int inode_number;
+    unsigned int deleted;
+    unsigned int mode;
+    unsigned int uid;
+    unsigned int gid;
+    unsigned int flags;
+    unsigned int size;
+    unsigned int atime;
+    unsigned int mtime;
+    unsigned int ctime;
+    unsigned int links;
+};
+
+struct wfs_dentry_v1 {
+    char name[MAX_FILE_NAME_LEN_V1];
+    unsigned long inode_number;
+};
+
+struct wfs_delta_v1 {
+    uint32_t prev;
+    uint32_t size;
+    uint32_t offset;
+};
+
+struct wfs_extent_v1 {
+    uint32_t offset;
+    uint32_t length;
+    uint32_t location;
+};
+
 #endif